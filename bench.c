@@ -0,0 +1,430 @@
+// Microbenchmarks for lierc hot paths. Build and run with `make bench`.
+//
+// lierc.c is compiled into this file so internal helpers can be measured
+// directly. Allocation counts cover the malloc/calloc/realloc/strdup calls
+// made by lierc.c itself, not those made inside libraries such as json-c.
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <curl/curl.h>
+#include <json-c/json.h>
+#include <locale.h>
+#include <math.h>
+#include <ncurses.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define BENCH_MIN_NS 200000000ULL // Run each benchmark for at least 0.2 s
+
+static unsigned long bench_allocations = 0;
+
+static void *bench_malloc(size_t size) {
+  bench_allocations++;
+  return malloc(size);
+}
+
+static void *bench_calloc(size_t count, size_t size) {
+  bench_allocations++;
+  return calloc(count, size);
+}
+
+static void *bench_realloc(void *ptr, size_t size) {
+  bench_allocations++;
+  return realloc(ptr, size);
+}
+
+static char *bench_strdup(const char *s) {
+  bench_allocations++;
+  return strdup(s);
+}
+
+#define LIERC_NO_MAIN
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+#define strdup(s) bench_strdup(s)
+#include "lierc.c"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+// Sink for results so the compiler can't drop the work being measured
+static volatile size_t bench_sink;
+
+typedef void (*bench_fn)(void *ctx);
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Run fn enough times to fill BENCH_MIN_NS and report ns/op, throughput
+// (when bytes_per_op is nonzero) and allocations per op
+static void run_benchmark(const char *name, bench_fn fn, void *ctx,
+                          size_t bytes_per_op) {
+  unsigned long iterations = 1;
+  while (1) {
+    unsigned long allocations_before = bench_allocations;
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < iterations; i++) {
+      fn(ctx);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (elapsed >= BENCH_MIN_NS || iterations >= (1UL << 31)) {
+      double ns_per_op = (double)elapsed / iterations;
+      double allocs_per_op =
+          (double)(bench_allocations - allocations_before) / iterations;
+      printf("%-34s %10lu %12.1f ns/op", name, iterations, ns_per_op);
+      if (bytes_per_op > 0) {
+        printf(" %9.1f MB/s", bytes_per_op / ns_per_op * 1000.0);
+      } else {
+        printf(" %14s", "");
+      }
+      printf(" %7.2f allocs/op\n", allocs_per_op);
+      return;
+    }
+
+    // Aim straight for the target with some headroom
+    unsigned long next =
+        elapsed > 0 ? (unsigned long)(iterations * 1.2 * BENCH_MIN_NS / elapsed)
+                    : iterations * 100;
+    iterations = next > iterations ? next : iterations * 2;
+  }
+}
+
+// Fill buf with size-1 bytes of chat-like text. Every `special` bytes a
+// character needing JSON escaping is inserted (0 for none).
+static void fill_text(char *buf, size_t size, int special) {
+  const char *words[] = {"lol",   "the",    "bot",  "said", "what",
+                         "meme",  "really", "okay", "irc",  "honestly",
+                         "based", "cringe", "yes",  "no",   "pizza"};
+  size_t pos = 0;
+  unsigned int seed = 42;
+  while (pos + 1 < size) {
+    const char *word = words[rand_r(&seed) % 15];
+    for (const char *p = word; *p && pos + 1 < size; p++) {
+      buf[pos++] = *p;
+    }
+    if (pos + 1 < size) {
+      buf[pos++] = ' ';
+    }
+    if (special > 0 && pos + 1 < size && (pos / special) % 2 == 1) {
+      buf[pos] = (pos & 1) ? '"' : '\n';
+      pos++;
+    }
+  }
+  buf[pos] = '\0';
+}
+
+// Benchmark contexts
+
+typedef struct {
+  const char *input;
+  char *output;
+  size_t output_size;
+} TextCtx;
+
+static void bench_json_escape(void *arg) {
+  TextCtx *ctx = (TextCtx *)arg;
+  json_escape_string(ctx->input, ctx->output, ctx->output_size);
+  bench_sink += ctx->output[0];
+}
+
+static void bench_utf8_validate(void *arg) {
+  TextCtx *ctx = (TextCtx *)arg;
+  bench_sink += utf8_validate(ctx->input, strlen(ctx->input));
+}
+
+static void bench_word_wrap(void *arg) {
+  TextCtx *ctx = (TextCtx *)arg;
+  word_wrap((char *)ctx->input, ctx->output, 80);
+  bench_sink += ctx->output[0];
+}
+
+static void count_line(int line, const char *text, int length, void *ctx) {
+  (void)line;
+  (void)text;
+  *(size_t *)ctx += length;
+}
+
+static void bench_render_chat(void *arg) {
+  (void)arg;
+  size_t chars = 0;
+  bench_sink += render_chat_lines(50, 120, count_line, &chars);
+  bench_sink += chars;
+}
+
+typedef struct {
+  const char *message;
+  char names[50][50];
+} MentionCtx;
+
+static void bench_is_mentioned(void *arg) {
+  MentionCtx *ctx = (MentionCtx *)arg;
+  int mentioned = 0;
+  for (int i = 0; i < 50; i++) {
+    mentioned += is_mentioned(ctx->message, ctx->names[i]);
+  }
+  bench_sink += mentioned;
+}
+
+static void bench_find_mentions(void *arg) {
+  BotHandle mentioned[MAX_MENTIONS];
+  bench_sink += find_mentions((const char *)arg, mentioned, MAX_MENTIONS);
+}
+
+typedef struct {
+  Bot *bot;
+  const char *query;
+  char json_data[MAX_QUERY_SIZE * 20];
+} RequestCtx;
+
+static void bench_build_request(void *arg) {
+  RequestCtx *ctx = (RequestCtx *)arg;
+  bench_sink += build_bot_request(ctx->bot, 0.8f, 0, ctx->query, "user",
+                                  ctx->json_data, sizeof(ctx->json_data));
+}
+
+typedef struct {
+  const char *api_type;
+  const char *body;
+} ParseCtx;
+
+static void bench_parse_response(void *arg) {
+  ParseCtx *ctx = (ParseCtx *)arg;
+  TokenUsage usage;
+  char *text = parse_bot_response(ctx->api_type, ctx->body, &usage);
+  bench_sink += text != NULL ? strlen(text) : 0;
+  free(text);
+}
+
+static void bench_embed(void *arg) {
+  int8_t embedding[EMBEDDING_DIM];
+  embed_text((const char *)arg, embedding);
+  bench_sink += embedding[0];
+}
+
+typedef struct {
+  MemoryStore store;
+  const char *query;
+} RecallCtx;
+
+static void bench_recall(void *arg) {
+  RecallCtx *ctx = (RecallCtx *)arg;
+  MemoryMatch matches[LONG_TERM_RECALL];
+  bench_sink += memory_store_search(&ctx->store, ctx->query,
+                                    MAX_MEMORY_ENTRIES, matches,
+                                    LONG_TERM_RECALL);
+}
+
+typedef struct {
+  char lines[64][160]; // Messages indexed in turn
+  unsigned long added;
+} IndexCtx;
+
+static void bench_index_add(void *arg) {
+  IndexCtx *ctx = (IndexCtx *)arg;
+  search_index_add(0, ctx->added, -1, "bob", ctx->lines[ctx->added % 64]);
+  ctx->added++;
+}
+
+static void bench_search(void *arg) {
+  SearchHit hits[SEARCH_RESULTS];
+  int hit_count;
+  bench_sink += search_index_query((const char *)arg, hits, SEARCH_RESULTS,
+                                   &hit_count);
+}
+
+static void bench_queue(void *arg) {
+  queue_t *q = (queue_t *)arg;
+  queue_push(q, q);
+  bench_sink += (size_t)queue_pop(q);
+}
+
+int main() {
+  headless = 1; // Keep log_error and friends away from ncurses
+  channels_init();
+
+  printf("%-34s %10s %15s %14s %17s\n", "benchmark", "iterations", "time",
+         "throughput", "allocations");
+
+  // JSON escaping of a typical chat line and of a long message
+  static char short_text[201], long_text[4097], escaped[16384];
+  fill_text(short_text, sizeof(short_text), 0);
+  fill_text(long_text, sizeof(long_text), 64);
+  TextCtx escape_short = {short_text, escaped, sizeof(escaped)};
+  TextCtx escape_long = {long_text, escaped, sizeof(escaped)};
+  run_benchmark("json_escape_string/200B", bench_json_escape, &escape_short,
+                strlen(short_text));
+  run_benchmark("json_escape_string/4KB", bench_json_escape, &escape_long,
+                strlen(long_text));
+
+  // Word wrapping a long message at 80 columns
+  static char plain_long[4097];
+  fill_text(plain_long, sizeof(plain_long), 0);
+  TextCtx wrap = {plain_long, escaped, sizeof(escaped)};
+  run_benchmark("word_wrap/4KB", bench_word_wrap, &wrap, strlen(plain_long));
+
+  // The same text kernels on a message with some non-ASCII words, and
+  // everything again with the scalar fallbacks for comparison
+  static char utf8_long[4097];
+  size_t utf8_length = 0;
+  const char *utf8_words[] = {"naïve ", "日本語 ", "emoji 😀 ", "plain ",
+                              "words ", "here "};
+  for (int i = 0; utf8_length + 16 < sizeof(utf8_long); i++) {
+    const char *word = utf8_words[i % 6 < 3 && i % 5 ? 3 + i % 3 : i % 6];
+    strcpy(utf8_long + utf8_length, word);
+    utf8_length += strlen(word);
+  }
+  TextCtx utf8_escape = {utf8_long, escaped, sizeof(escaped)};
+  run_benchmark("json_escape_string/4KB UTF-8", bench_json_escape,
+                &utf8_escape, utf8_length);
+  run_benchmark("utf8_validate/4KB UTF-8", bench_utf8_validate, &utf8_escape,
+                utf8_length);
+  run_benchmark("word_wrap/4KB UTF-8", bench_word_wrap, &utf8_escape,
+                utf8_length);
+  text_kernel_level = TEXT_SCALAR;
+  run_benchmark("json_escape_string/4KB scalar", bench_json_escape,
+                &escape_long, strlen(long_text));
+  run_benchmark("word_wrap/4KB scalar", bench_word_wrap, &wrap,
+                strlen(plain_long));
+  run_benchmark("utf8_validate/4KB UTF-8 scalar", bench_utf8_validate,
+                &utf8_escape, utf8_length);
+  text_kernel_level = -1;
+
+  // Chat window layout over a full history of mixed-length messages
+  Channel *channel = channels[0];
+  for (int i = 0; i < CHAT_HISTORY_LIMIT; i++) {
+    ChatMessage *message = &channel->history[i];
+    strcpy(message->timestamp, "[12:34]");
+    strcpy(message->role, i % 3 ? "assistant" : "user");
+    snprintf(message->display_name, sizeof(message->display_name), "bot%d",
+             i % 7);
+    fill_text(message->content, 40 + (i * 37) % 600, 0);
+  }
+  channel->total = CHAT_HISTORY_LIMIT;
+  channel->scroll_position = 0;
+  run_benchmark("render_chat_lines/100msg", bench_render_chat, NULL, 0);
+
+  // Mention detection for one message against 50 bot names
+  MentionCtx mention;
+  mention.message = "hey @bot42 and @bot7, what do you think about the meme "
+                    "that everyone keeps posting in here?";
+  for (int i = 0; i < 50; i++) {
+    snprintf(mention.names[i], sizeof(mention.names[i]), "bot%d", i);
+  }
+  run_benchmark("is_mentioned/50bots", bench_is_mentioned, &mention, 0);
+
+  // The same message against the automaton over all registered bots' names
+  for (int i = 0; i < 500; i++) {
+    Bot *registered = calloc(1, sizeof(Bot));
+    snprintf(registered->name, sizeof(registered->name), "bot%d", i);
+    bot_register(registered, 0.7f);
+    if (i == 49 || i == 499) {
+      run_benchmark(i == 49 ? "find_mentions/50bots" : "find_mentions/500bots",
+                    bench_find_mentions, (void *)mention.message, 0);
+    }
+  }
+
+  // Request building with a full memory, a summary and five messages of
+  // context
+  static Bot bot;
+  memory_store_init(&bot.long_term);
+  strcpy(bot.name, "bob");
+  strcpy(bot.api_type, "openai");
+  strcpy(bot.model, "gpt-4");
+  fill_text(bot.personality, sizeof(bot.personality), 0);
+  for (int i = 0; i < MAX_MEMORY_ENTRIES; i++) {
+    fill_text(bot.memory[i], MAX_MEMORY_ENTRY_LENGTH, 0);
+  }
+  bot.memory_count = MAX_MEMORY_ENTRIES;
+  fill_text(bot.summary, sizeof(bot.summary), 0);
+  channel->total = 50;
+  static RequestCtx request;
+  request.bot = &bot;
+  request.query = "@bob what do you think about \"pineapple\" on pizza?";
+  run_benchmark("build_bot_request", bench_build_request, &request, 0);
+
+  // Embedding a chat line, and recalling from 20000 long-term memories
+  run_benchmark("embed_text/200B", bench_embed, short_text, strlen(short_text));
+  static RecallCtx recall;
+  memory_store_init(&recall.store);
+  for (int i = 0; i < 20000; i++) {
+    char exchange[LONG_TERM_ENTRY_LENGTH];
+    fill_text(exchange, 60 + i % 150, 0);
+    size_t length = strlen(exchange);
+    snprintf(exchange + length, sizeof(exchange) - length, " %d", i);
+    memory_store_add(&recall.store, exchange);
+  }
+  recall.query = request.query;
+  run_benchmark("memory_store_search/20k", bench_recall, &recall, 0);
+  memory_store_free(&recall.store);
+
+  // Scrollback indexing, then queries over a million indexed messages: a
+  // topic word said in one message in a thousand plus a common word, and
+  // two common words
+  static IndexCtx index_ctx;
+  for (int i = 0; i < 64; i++) {
+    fill_text(index_ctx.lines[i], 60 + i, 0);
+    size_t length = strlen(index_ctx.lines[i]);
+    snprintf(index_ctx.lines[i] + length, sizeof(index_ctx.lines[i]) - length,
+             " topic%d", i * 17);
+  }
+  run_benchmark("search_index_add/80B", bench_index_add, &index_ctx, 0);
+  while (index_ctx.added < 1000000) {
+    char line[200];
+    snprintf(line, sizeof(line), "%s topic%lu",
+             index_ctx.lines[index_ctx.added % 64], index_ctx.added % 1000);
+    search_index_add(0, index_ctx.added++, -1, "bob", line);
+  }
+  run_benchmark("search/1M lines, rare+common", bench_search, "pizza topic42",
+                0);
+  run_benchmark("search/1M lines, common+common", bench_search,
+                "meme cringe", 0);
+
+  // Response parsing for both providers
+  static char openai_body[2048], anthropic_body[2048];
+  snprintf(openai_body, sizeof(openai_body),
+           "{\"id\": \"chatcmpl-1\", \"object\": \"chat.completion\", "
+           "\"created\": 1700000000, \"model\": \"gpt-4\", \"choices\": "
+           "[{\"index\": 0, \"message\": {\"role\": \"assistant\", "
+           "\"content\": \"%.400s\"}, \"finish_reason\": \"stop\"}], "
+           "\"usage\": {\"prompt_tokens\": 512, \"completion_tokens\": 100, "
+           "\"total_tokens\": 612}}",
+           short_text);
+  snprintf(anthropic_body, sizeof(anthropic_body),
+           "{\"id\": \"msg_1\", \"type\": \"message\", \"role\": "
+           "\"assistant\", \"model\": \"claude-3-5-haiku-latest\", "
+           "\"content\": [{\"type\": \"text\", \"text\": \"%.400s\"}], "
+           "\"stop_reason\": \"end_turn\", \"usage\": {\"input_tokens\": "
+           "512, \"output_tokens\": 100}}",
+           short_text);
+  ParseCtx parse_openai = {"openai", openai_body};
+  ParseCtx parse_anthropic = {"anthropic", anthropic_body};
+  run_benchmark("parse_bot_response/openai", bench_parse_response,
+                &parse_openai, strlen(openai_body));
+  run_benchmark("parse_bot_response/anthropic", bench_parse_response,
+                &parse_anthropic, strlen(anthropic_body));
+
+  // Queue enqueue + dequeue pair
+  queue_t *q = queue_create();
+  run_benchmark("queue_push+queue_pop", bench_queue, q, 0);
+  queue_destroy(q);
+
+  return 0;
+}
@@ -1,19 +1,37 @@
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <json-c/json.h>
+#include <locale.h>
+#include <math.h>
 #include <ncurses.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #define MAX_THREADS 10
-
-pthread_t thread_pool[MAX_THREADS];
-int thread_pool_size = 0;
-pthread_mutex_t thread_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t thread_pool_cond = PTHREAD_COND_INITIALIZER;
+#define MAX_PENDING_REQUESTS 64
 
 // Simple queue implementation
 typedef struct QueueNode {
@@ -24,14 +42,50 @@ typedef struct QueueNode {
 typedef struct {
   QueueNode *front;
   QueueNode *rear;
+  size_t length;
 } queue_t;
 
 queue_t *queue_create() {
   queue_t *q = malloc(sizeof(queue_t));
   q->front = q->rear = NULL;
+  q->length = 0;
   return q;
 }
 
+// Append an item to the rear of the queue. Returns 0 on success.
+int queue_push(queue_t *q, void *data) {
+  QueueNode *node = malloc(sizeof(QueueNode));
+  if (node == NULL) {
+    return -1;
+  }
+  node->data = data;
+  node->next = NULL;
+  if (q->rear == NULL) {
+    q->front = q->rear = node;
+  } else {
+    q->rear->next = node;
+    q->rear = node;
+  }
+  q->length++;
+  return 0;
+}
+
+// Remove and return the item at the front of the queue, or NULL if empty
+void *queue_pop(queue_t *q) {
+  QueueNode *node = q->front;
+  if (node == NULL) {
+    return NULL;
+  }
+  void *data = node->data;
+  q->front = node->next;
+  if (q->front == NULL) {
+    q->rear = NULL;
+  }
+  q->length--;
+  free(node);
+  return data;
+}
+
 void queue_destroy(queue_t *q) {
   while (q->front != NULL) {
     QueueNode *temp = q->front;
@@ -41,1275 +95,9718 @@ void queue_destroy(queue_t *q) {
   free(q);
 }
 
-FILE *log_file = NULL;
-pthread_mutex_t chat_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t bot_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
-
-queue_t *response_queue;
-
-// Helper function to escape special characters in JSON strings
-void json_escape_string(const char *input, char *output, size_t output_size) {
-  size_t i, j;
-  for (i = 0, j = 0; input[i] != '\0' && j < output_size - 1; i++) {
-    switch (input[i]) {
-    case '\"':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = '\"';
-      }
-      break;
-    case '\\':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = '\\';
-      }
-      break;
-    case '\b':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = 'b';
-      }
-      break;
-    case '\f':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = 'f';
-      }
-      break;
-    case '\n':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = 'n';
-      }
-      break;
-    case '\r':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = 'r';
-      }
-      break;
-    case '\t':
-      if (j + 2 < output_size - 1) {
-        output[j++] = '\\';
-        output[j++] = 't';
-      }
-      break;
-    default:
-      output[j++] = input[i];
-      break;
-    }
+// With --reactor, one thread runs the whole app from an epoll loop instead
+// of the input, response, timer and worker threads. Other threads wake it by
+// writing to an eventfd.
+#define REACTOR_MAX_REQUESTS 256 // Requests in flight at once
+int reactor_mode = 0;
+int reactor_wake_fd = -1;
+
+void reactor_wake() {
+  int fd = __atomic_load_n(&reactor_wake_fd, __ATOMIC_ACQUIRE);
+  if (fd >= 0) {
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written; // Fails only when the counter is already huge
   }
-  output[j] = '\0';
 }
 
-#define MAX_RESPONSE_SIZE 4096
-#define MAX_QUERY_SIZE 256
-#define CHAT_HISTORY_LIMIT 100
-#define DEFAULT_MODEL "gpt-4"
-#define MAX_BOTS 10
-
-// Color pair indices
-#define COLOR_TIME 1
-#define COLOR_USERNAME_USER 2
-#define COLOR_USERNAME_ASSISTANT 3
-#define COLOR_BRACKETS 4
-#define COLOR_STATUS_BAR 5
-#define COLOR_TEXT 6
-#define COLOR_SIDEBAR 7
-#define COLOR_SYSTEM_MESSAGE 8
-#define COLOR_LLM_MESSAGE 9
-#define COLOR_TYPING 10
-
-// Chat message structure
-typedef struct {
-  char timestamp[20];    // Timestamp in [HH:mm] format
-  char role[16];         // "user" or "assistant"
-  char display_name[50]; // Display name like "gpt-4" for the assistant
-  char content[MAX_RESPONSE_SIZE]; // The message content
-} ChatMessage;
-
-// Bot structure
-#define MAX_MEMORY_ENTRIES 10
-#define MAX_MEMORY_ENTRY_LENGTH 200
+// Hierarchical timer wheel. A single thread drives all timed events (such as
+// autonomous bot chatter); each level covers 64 times the range of the level
+// below it, so scheduling and cancelling are O(1) regardless of timer count.
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+// Timer callbacks run on the timer thread with timer_mutex held and must not
+// block. They return the delay in milliseconds until they should fire again,
+// or 0 to leave the timer disarmed. Objects owning an event are freed
+// through timer_release, which is safe from inside a callback.
+typedef unsigned (*timer_callback)(void *arg);
+
+typedef struct TimerEvent {
+  uint64_t expires; // Tick at which the event fires
+  timer_callback callback;
+  void *arg;
+  int armed; // Set while the event is linked into the wheel
+  LIST_ENTRY(TimerEvent) entries;
+  void (*destroy)(void *owner); // Set by timer_release from a callback
+  void *owner;
+  struct TimerEvent *next_released;
+} TimerEvent;
+
+LIST_HEAD(TimerList, TimerEvent);
+
+struct TimerList timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+uint64_t timer_now_tick = 0; // Last tick processed by the timer thread
+uint64_t timer_base_ms = 0;  // Monotonic time corresponding to tick 0
+int timer_running = 0;
+pthread_t timer_thread_id;
+pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+__thread int timer_in_callback = 0; // This thread holds timer_mutex for one
+TimerEvent *timer_released = NULL;  // Destroyed once the callback returns
+
+// Simulated time (--virtual-time). The clock the app reads stands still
+// while the reactor has transfers in flight and jumps straight to the next
+// deadline when it would otherwise sleep, so reply delays, chatter timers
+// and script pauses take no real time. Only the reactor advances it.
+int virtual_time = 0;
+uint64_t virtual_now_us = 0;
+uint64_t virtual_start_us = 0;
+time_t virtual_wall_start = 0;
+
+// Microseconds from the real monotonic clock
+uint64_t real_monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-typedef struct {
-  char api_type[20];     // "openai" or "anthropic"
-  char name[50];         // Display name of the bot
-  char personality[256]; // Personality description
-  float temperature;     // Temperature for API calls
-  char memory[MAX_MEMORY_ENTRIES]
-             [MAX_MEMORY_ENTRY_LENGTH]; // Circular buffer for recent
-                                        // interactions
-  int memory_index;                     // Current index in the circular buffer
-  int memory_count;                     // Number of entries in the memory
-  int total_messages;  // Total number of messages processed by the bot
-  pthread_t thread_id; // Thread ID for the bot's autonomous behavior
-  int is_active;       // Flag to indicate if the bot is active
-  int is_typing;       // Flag to indicate if the bot is currently "typing"
-} Bot;
+// Microseconds and milliseconds from the app's monotonic clock
+uint64_t monotonic_us() {
+  if (virtual_time) {
+    return __atomic_load_n(&virtual_now_us, __ATOMIC_RELAXED);
+  }
+  return real_monotonic_us();
+}
 
-// Global variables
-char *openai_api_key;
-char *anthropic_api_key;
-char model[50];
-char user_name[50] = "user"; // Default user name
+uint64_t monotonic_ms() { return monotonic_us() / 1000; }
 
-// Chat history buffer
-ChatMessage chat_history[CHAT_HISTORY_LIMIT];
-int chat_index = 0;      // Tracks the number of chat messages in history
-int scroll_position = 0; // Tracks the scroll position
+// Switch to simulated time, starting from the real clocks
+void virtual_time_start() {
+  virtual_now_us = virtual_start_us = real_monotonic_us();
+  virtual_wall_start = time(NULL);
+  virtual_time = 1;
+}
 
-// Bot list
-Bot bots[MAX_BOTS];
-int bot_count = 0;
+// Move simulated time forward to us
+void virtual_time_advance(uint64_t us) {
+  if (us > virtual_now_us) {
+    __atomic_store_n(&virtual_now_us, us, __ATOMIC_RELAXED);
+  }
+}
 
-// Stats
-int messages_sent = 0;
-int messages_received = 0;
-time_t start_time;
+// Wall clock time in seconds, following simulated time when it is on
+time_t wall_time() {
+  if (virtual_time) {
+    return virtual_wall_start +
+           (time_t)((monotonic_us() - virtual_start_us) / 1000000);
+  }
+  return time(NULL);
+}
 
-// ncurses windows
-WINDOW *chat_win, *input_win, *status_win, *sidebar_win;
+// Random numbers. Each thread draws from its own xorshift64* generator, so
+// there is no shared state to lock or contend on. Generators are seeded
+// from random_seed (--seed, or the clock) in the order threads first draw:
+// with one thread making every decision, as under --virtual-time, a seed
+// reproduces a run.
+uint64_t random_seed = 0;
+unsigned random_streams = 0; // Generators seeded so far
+__thread uint64_t random_state = 0;
+
+// splitmix64, to spread a seed over the generator's state
+static uint64_t random_mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
 
-// Structure to hold response from the OpenAI API
-struct memory {
-  char *response;
-  size_t size;
-};
+uint32_t random_next() {
+  if (random_state == 0) {
+    unsigned stream = __atomic_fetch_add(&random_streams, 1, __ATOMIC_RELAXED);
+    random_state = random_mix(random_seed ^ random_mix(stream)) | 1;
+  }
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return (uint32_t)((random_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
 
-// Function to handle memory reallocation for the CURL response
-static size_t write_callback(void *data, size_t size, size_t nmemb,
-                             void *userp) {
-  size_t realsize = size * nmemb;
-  struct memory *mem = (struct memory *)userp;
+// Uniform in [0, n)
+unsigned random_below(unsigned n) {
+  return (unsigned)(((uint64_t)random_next() * n) >> 32);
+}
 
-  char *ptr = realloc(mem->response, mem->size + realsize + 1);
-  if (ptr == NULL) {
-    return 0;
+// Uniform in [0, 1)
+float random_unit() { return random_next() / 4294967296.0f; }
+
+// Link an event into the wheel level that covers its remaining delay
+static void timer_insert_locked(TimerEvent *event) {
+  uint64_t delta =
+      event->expires > timer_now_tick ? event->expires - timer_now_tick : 0;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+    level++;
   }
+  int slot = (event->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  LIST_INSERT_HEAD(&timer_wheel[level][slot], event, entries);
+  event->armed = 1;
+}
 
-  mem->response = ptr;
-  memcpy(&(mem->response[mem->size]), data, realsize);
-  mem->size += realsize;
-  mem->response[mem->size] = 0;
+// Unlink an armed event from the wheel
+static void timer_cancel_locked(TimerEvent *event) {
+  if (event->armed) {
+    LIST_REMOVE(event, entries);
+    event->armed = 0;
+  }
+}
 
-  return realsize;
+// Schedule (or reschedule) an event to fire after delay_ms milliseconds
+static void timer_schedule_locked(TimerEvent *event, unsigned delay_ms) {
+  timer_cancel_locked(event);
+  uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  event->expires = timer_now_tick + (ticks > 0 ? ticks : 1);
+  timer_insert_locked(event);
 }
 
-// Get timestamp in [HH:mm] format
-void get_timestamp(char *buffer, size_t buffer_size) {
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  snprintf(buffer, buffer_size, "[%02d:%02d]", tm.tm_hour, tm.tm_min);
+void timer_schedule(TimerEvent *event, unsigned delay_ms) {
+  pthread_mutex_lock(&timer_mutex);
+  timer_schedule_locked(event, delay_ms);
+  pthread_mutex_unlock(&timer_mutex);
+  reactor_wake(); // The reactor may have to wake up sooner
 }
 
-// Update the status bar with connection time and message stats
-void update_status_bar() {
-  werase(status_win);
-  int max_x;
-  getmaxyx(status_win, (int){0}, max_x);
+void timer_cancel(TimerEvent *event) {
+  pthread_mutex_lock(&timer_mutex);
+  timer_cancel_locked(event);
+  pthread_mutex_unlock(&timer_mutex);
+}
 
-  // Set blue background for the status bar and extend across the entire width
-  wattron(status_win, COLOR_PAIR(COLOR_STATUS_BAR));
-  for (int i = 0; i < max_x; i++) {
-    mvwprintw(status_win, 0, i, " ");
+// Cancel an event and destroy the object owning it (and the event). A
+// callback can drop the last reference to such an object, e.g. a bot kicked
+// meanwhile; timer_mutex is already held then, and the event may be the one
+// firing, so both wait until the callback returns.
+void timer_release(TimerEvent *event, void (*destroy)(void *owner),
+                   void *owner) {
+  if (!timer_in_callback) {
+    timer_cancel(event);
+    destroy(owner);
+    return;
   }
+  timer_cancel_locked(event);
+  event->destroy = destroy;
+  event->owner = owner;
+  event->next_released = timer_released;
+  timer_released = event;
+}
 
-  // Time connected
-  time_t now = time(NULL);
-  int seconds_connected = (int)difftime(now, start_time);
-  int minutes = seconds_connected / 60;
-  int seconds = seconds_connected % 60;
-
-  mvwprintw(status_win, 0, 0,
-            " Time Connected: %02d:%02d  |  Sent: %d  |  Received: %d ",
-            minutes, seconds, messages_sent, messages_received);
+// Advance the wheel by one tick, cascading higher levels and firing events
+static void timer_advance_locked() {
+  uint64_t tick = ++timer_now_tick;
 
-  wattroff(status_win, COLOR_PAIR(COLOR_STATUS_BAR));
-  wrefresh(status_win);
-}
+  // When a level wraps, redistribute the next slot of the level above it
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    if ((tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+      break;
+    }
+    int slot = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    TimerEvent *event;
+    while ((event = LIST_FIRST(&timer_wheel[level][slot])) != NULL) {
+      LIST_REMOVE(event, entries);
+      timer_insert_locked(event);
+    }
+  }
 
-// Word-wrap function to ensure clean text breaks on spaces
-void word_wrap(char *input, char *output, int max_width) {
-  int len = strlen(input);
-  int space_left = max_width;
-  int out_pos = 0;
-  for (int i = 0; i < len; i++) {
-    if (input[i] == ' ' && i > 0) {
-      output[out_pos++] = input[i];
-      space_left = max_width;
-    } else if (space_left == 0) {
-      output[out_pos++] = '\n';
-      output[out_pos++] = input[i];
-      space_left = max_width - 1;
-    } else {
-      output[out_pos++] = input[i];
-      space_left--;
+  struct TimerList *due = &timer_wheel[0][tick & TIMER_WHEEL_MASK];
+  TimerEvent *event;
+  while ((event = LIST_FIRST(due)) != NULL) {
+    LIST_REMOVE(event, entries);
+    event->armed = 0;
+    timer_in_callback = 1;
+    unsigned next_ms = event->callback(event->arg);
+    timer_in_callback = 0;
+    if (next_ms > 0 && event->destroy == NULL) {
+      timer_schedule_locked(event, next_ms);
+    }
+    while (timer_released != NULL) {
+      TimerEvent *released = timer_released;
+      timer_released = released->next_released;
+      released->destroy(released->owner);
     }
   }
-  output[out_pos] = '\0'; // Null terminate the output
 }
 
-// Function to update and render the chat window with messages
-void update_chat_window() {
-  werase(chat_win); // Clear the chat window first
-  int max_y, max_x;
-  getmaxyx(chat_win, max_y, max_x); // Get the dimensions of the chat window
-
-  int line = 0; // Track the current line number in the chat window
+// Timer thread: advances the wheel in step with the monotonic clock
+void trace_thread_name(const char *name);
 
-  // Iterate through the chat history and render messages, taking scrolling into
-  // account
-  for (int i = 0; i < CHAT_HISTORY_LIMIT; i++) {
-    int idx =
-        (scroll_position + i) % CHAT_HISTORY_LIMIT; // Circular buffer handling
-    if (strlen(chat_history[idx].content) == 0) {
-      continue; // Skip empty chat history slots
+void *timer_thread(void *arg) {
+  (void)arg;
+  trace_thread_name("timer");
+  pthread_mutex_lock(&timer_mutex);
+  while (timer_running) {
+    uint64_t target = (monotonic_ms() - timer_base_ms) / TIMER_TICK_MS;
+    while (timer_now_tick < target) {
+      timer_advance_locked();
     }
 
-    char formatted_message[MAX_RESPONSE_SIZE +
-                           100]; // Buffer for formatted message
-
-    // Prepare the message format: [timestamp] <username>: message
-    snprintf(formatted_message, sizeof(formatted_message), "[%s] <%s>: %s",
-             chat_history[idx].timestamp, chat_history[idx].display_name,
-             chat_history[idx].content);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TIMER_TICK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&timer_cond, &timer_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  return NULL;
+}
 
-    // Now handle word wrapping to ensure text doesn't overflow the window width
-    int message_length = strlen(formatted_message);
-    int start_pos = 0;
+// Fire the events that are due by now. The reactor calls this instead of
+// running the timer thread.
+void timer_run_due() {
+  pthread_mutex_lock(&timer_mutex);
+  uint64_t target = (monotonic_ms() - timer_base_ms) / TIMER_TICK_MS;
+  while (timer_running && timer_now_tick < target) {
+    timer_advance_locked();
+  }
+  pthread_mutex_unlock(&timer_mutex);
+}
 
-    while (message_length > 0 && line < max_y) {
-      int chars_to_print =
-          (message_length < max_x) ? message_length : max_x - 1;
-      mvwprintw(chat_win, line++, 0, "%.*s", chars_to_print,
-                formatted_message + start_pos);
-      message_length -= chars_to_print;
-      start_pos += chars_to_print;
+// The monotonic time in ms by which timer_run_due() next has work to do:
+// the next event due in the lowest level, or the next cascade if a higher
+// level has events. 0 if nothing is armed.
+uint64_t timer_next_ms() {
+  pthread_mutex_lock(&timer_mutex);
+  uint64_t next = 0;
+  int higher = 0; // Events waiting in a higher level
+  for (int i = 1; i < TIMER_WHEEL_SLOTS && next == 0; i++) {
+    if (!LIST_EMPTY(&timer_wheel[0][(timer_now_tick + i) & TIMER_WHEEL_MASK])) {
+      next = timer_now_tick + i;
     }
-
-    // Stop rendering if we've run out of space in the chat window
-    if (line >= max_y) {
-      break;
+  }
+  for (int level = 1; level < TIMER_WHEEL_LEVELS && !higher; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS && !higher; slot++) {
+      higher = !LIST_EMPTY(&timer_wheel[level][slot]);
     }
   }
-
-  // Refresh the chat window to apply changes
-  wrefresh(chat_win);
+  if (higher) {
+    uint64_t cascade = ((timer_now_tick >> TIMER_WHEEL_BITS) + 1)
+                       << TIMER_WHEEL_BITS;
+    if (next == 0 || cascade < next) {
+      next = cascade;
+    }
+  }
+  if (!timer_running) {
+    next = 0;
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  return next ? timer_base_ms + next * TIMER_TICK_MS : 0;
 }
 
-// Scroll the chat window up
-void scroll_up() {
-  if (scroll_position > 0) {
-    scroll_position--;
-    update_chat_window();
+// Returns -1 if the timer thread can't be started; the wheel then stays idle.
+int timer_start() {
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      LIST_INIT(&timer_wheel[level][slot]);
+    }
   }
+  timer_base_ms = monotonic_ms();
+  timer_now_tick = 0;
+  timer_running = 1;
+  if (!reactor_mode &&
+      pthread_create(&timer_thread_id, NULL, timer_thread, NULL) != 0) {
+    timer_running = 0;
+    return -1;
+  }
+  return 0;
 }
 
-// Scroll the chat window down
-void scroll_down() {
-  int max_y;
-  getmaxyx(chat_win, max_y, (int){0});
-  if (scroll_position < chat_index - max_y) {
-    scroll_position++;
-    update_chat_window();
+void timer_stop() {
+  pthread_mutex_lock(&timer_mutex);
+  if (!timer_running) {
+    pthread_mutex_unlock(&timer_mutex);
+    return;
+  }
+  timer_running = 0;
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_mutex);
+  if (!reactor_mode) {
+    pthread_join(timer_thread_id, NULL);
   }
 }
 
-// Function to add chat messages to the chat window and ensure they're displayed
-// properly
-void add_chat_message(const char *role, const char *display_name,
-                      const char *message) {
-  pthread_mutex_lock(&chat_mutex);
+// End-to-end reply latency, split into the stages a reply passes through
+// between the message being sent and the bot's line appearing. Each stage is
+// recorded into an HDR-style histogram per provider/model: values below 64 us
+// are exact, above that each power of two is split into 32 linear
+// sub-buckets, giving ~3% relative precision up to ~38 hours.
+typedef enum {
+  STAGE_QUEUE,      // Waiting in the scheduler for a worker
+  STAGE_CLASSIFY,   // Deciding whether the bot answers at all
+  STAGE_DELAY,      // Artificial "typing" delay
+  STAGE_CONNECT,    // DNS lookup and TCP connect
+  STAGE_TLS,        // TLS handshake
+  STAGE_FIRST_BYTE, // Request sent until the first response byte
+  STAGE_LAST_BYTE,  // First until last response byte
+  STAGE_PARSE,      // Extracting the reply from the response JSON
+  STAGE_RENDER,     // Waiting in the response queue and drawing the line
+  STAGE_TOTAL,      // Message sent until the reply is on screen
+  LATENCY_STAGES
+} LatencyStage;
+
+const char *latency_stage_names[LATENCY_STAGES] = {
+    "queue", "classify",  "delay", "connect", "tls",
+    "ttfb",  "last byte", "parse", "render",  "total"};
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 31 // Values are clamped below 2^37 us
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_SUB_BUCKETS)
 
-  get_timestamp(chat_history[chat_index].timestamp,
-                sizeof(chat_history[chat_index].timestamp));
-  strncpy(chat_history[chat_index].role, role,
-          sizeof(chat_history[chat_index].role));
-  strncpy(chat_history[chat_index].display_name, display_name,
-          sizeof(chat_history[chat_index].display_name));
-  strncpy(chat_history[chat_index].content, message, MAX_RESPONSE_SIZE);
+typedef struct {
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+} LatencyHistogram;
 
-  chat_index++;
-  if (chat_index >= CHAT_HISTORY_LIMIT) {
-    chat_index = 0; // Scroll the buffer
+// Histograms for one provider/model pair
+typedef struct {
+  char api_type[20];
+  char model[50];
+  LatencyHistogram stages[LATENCY_STAGES];
+} LatencyStats;
+
+LatencyStats *latency_stats = NULL;
+int latency_stats_count = 0;
+LatencyHistogram latency_total; // STAGE_TOTAL across all models
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int histogram_bucket(uint64_t value_us) {
+  uint64_t limit = (uint64_t)HISTOGRAM_SUB_BUCKETS << (HISTOGRAM_MAX_SHIFT + 1);
+  if (value_us >= limit) {
+    value_us = limit - 1;
   }
+  int msb = 63 - __builtin_clzll(value_us | 1);
+  int shift = msb > HISTOGRAM_SUB_BITS ? msb - HISTOGRAM_SUB_BITS : 0;
+  return shift * HISTOGRAM_SUB_BUCKETS + (int)(value_us >> shift);
+}
 
-  scroll_position = chat_index; // Automatically scroll to the latest message
-  update_chat_window();         // Refresh chat window to show new messages
+// Highest value that lands in a bucket
+static uint64_t histogram_bucket_limit(int bucket) {
+  int shift = bucket >= 2 * HISTOGRAM_SUB_BUCKETS
+                  ? bucket / HISTOGRAM_SUB_BUCKETS - 1
+                  : 0;
+  uint64_t sub = bucket - shift * HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
 
-  // Log the message to file if logging is enabled
-  if (log_file != NULL) {
-    fprintf(log_file, "[%s] <%s> %s\n", chat_history[chat_index - 1].timestamp,
-            display_name, message);
-    fflush(log_file);
+static void histogram_record(LatencyHistogram *hist, uint64_t value_us) {
+  hist->counts[histogram_bucket(value_us)]++;
+  hist->count++;
+  hist->sum_us += value_us;
+  if (value_us > hist->max_us) {
+    hist->max_us = value_us;
   }
-
-  pthread_mutex_unlock(&chat_mutex);
 }
 
-// Function to log errors and display them in the chat window
-void log_error(const char *error_message) {
-  add_chat_message("system", "system", error_message);
+// Value at or below which percentile percent of the samples fall
+uint64_t histogram_percentile(const LatencyHistogram *hist, double percentile) {
+  if (hist->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    seen += hist->counts[b];
+    if (seen >= rank) {
+      uint64_t limit = histogram_bucket_limit(b);
+      return limit < hist->max_us ? limit : hist->max_us;
+    }
+  }
+  return hist->max_us;
 }
 
-// Function to generate a unique bot personality using OpenAI
-char *
-generate_unique_bot_personality(float *temperature,
-                                char existing_personalities[MAX_BOTS][256],
-                                int bot_count) {
-  CURL *curl;
-  CURLcode res;
-  struct memory chunk = {0};
-  chunk.response = malloc(1);
-  chunk.size = 0;
-
-  curl = curl_easy_init();
-  if (!curl) {
-    log_error("CURL initialization failed.");
-    return NULL;
+// Record the stage timings of one completed reply
+void latency_record(const char *api_type, const char *model,
+                    const uint64_t stage_us[LATENCY_STAGES]) {
+  pthread_mutex_lock(&latency_mutex);
+  LatencyStats *stats = NULL;
+  for (int i = 0; i < latency_stats_count; i++) {
+    if (strcmp(latency_stats[i].api_type, api_type) == 0 &&
+        strcmp(latency_stats[i].model, model) == 0) {
+      stats = &latency_stats[i];
+      break;
+    }
   }
-
-  // Set up the request to OpenAI
-  const char *url = "https://api.openai.com/v1/chat/completions";
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  char auth_header[256];
-  snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-           openai_api_key);
-  headers = curl_slist_append(headers, auth_header);
-
-  // Create a string of existing personalities
-  char existing_personalities_str[MAX_BOTS * 256] = "";
-  for (int i = 0; i < bot_count; i++) {
-    strcat(existing_personalities_str, existing_personalities[i]);
-    strcat(existing_personalities_str, " ");
+  if (stats == NULL) {
+    LatencyStats *grown =
+        realloc(latency_stats, (latency_stats_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&latency_mutex);
+      return;
+    }
+    latency_stats = grown;
+    stats = &latency_stats[latency_stats_count++];
+    memset(stats, 0, sizeof(*stats));
+    snprintf(stats->api_type, sizeof(stats->api_type), "%s", api_type);
+    snprintf(stats->model, sizeof(stats->model), "%s", model);
+  }
+  for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+    histogram_record(&stats->stages[stage], stage_us[stage]);
   }
+  histogram_record(&latency_total, stage_us[STAGE_TOTAL]);
+  pthread_mutex_unlock(&latency_mutex);
+}
 
-  // Create the JSON request body
-  char json_data[4096];
-  int json_data_size = sizeof(json_data);
-  int written = snprintf(
-      json_data, json_data_size,
-      "{\"model\": \"gpt-3.5-turbo\", \"messages\": [{\"role\": \"system\", "
-      "\"content\": \"Generate a short, one-sentence personality description "
-      "for a chatbot inspired by various online communities. Include a mix of "
-      "traits such as helpful, sarcastic, meme-loving, intellectual, "
-      "optimistic, cynical, or quirky. Aim for diversity in personalities. "
-      "Ensure the personality is unique and different from these existing "
-      "personalities: %.1000s\"}], "
-      "\"max_tokens\": 50}",
-      existing_personalities_str);
-
-  if (written >= json_data_size) {
-    log_error("JSON data truncated in generate_unique_bot_personality");
-  }
-
-  // Set up CURL options
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+FILE *log_file = NULL;
+pthread_mutex_t chat_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t bot_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
 
-  // Perform the request
-  res = curl_easy_perform(curl);
-  if (res != CURLE_OK) {
-    log_error(curl_easy_strerror(res));
-    free(chunk.response);
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    return NULL;
+queue_t *response_queue;
+int outstanding_responses = 0; // Responses queued or being posted
+int status_bar_stale = 0;      // Load level changed since the bar was drawn
+
+// Text kernels. Escaping, UTF-8 validation and line breaking spend nearly
+// all their time in runs of plain ASCII, so each kernel skips such runs a
+// block at a time with SSE2 or AVX2, picked by what the CPU supports, and
+// handles the bytes in between one at a time. The scalar versions serve
+// other CPUs.
+typedef enum { TEXT_SCALAR, TEXT_SSE2, TEXT_AVX2 } TextKernelLevel;
+
+int text_kernel_level = -1; // Detected on first use; benchmarks override it
+
+static int text_kernels() {
+  int level = __atomic_load_n(&text_kernel_level, __ATOMIC_RELAXED);
+  if (level < 0) {
+    level = TEXT_SCALAR;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? TEXT_AVX2 : TEXT_SSE2;
+#endif
+    __atomic_store_n(&text_kernel_level, level, __ATOMIC_RELAXED);
   }
+  return level;
+}
 
-  // Parse the JSON response
-  struct json_object *parsed_json;
-  struct json_object *choices_array;
-  struct json_object *message_object;
-  struct json_object *message_content;
-
-  parsed_json = json_tokener_parse(chunk.response);
-  char *personality = NULL;
-
-  if (json_object_object_get_ex(parsed_json, "choices", &choices_array)) {
-    if (json_object_get_type(choices_array) == json_type_array) {
-      message_object = json_object_array_get_idx(choices_array, 0);
-      if (json_object_object_get_ex(message_object, "message",
-                                    &message_object)) {
-        if (json_object_object_get_ex(message_object, "content",
-                                      &message_content)) {
-          const char *response_text = json_object_get_string(message_content);
-          personality = strdup(response_text);
-        }
-      }
-    }
+// Length of the leading run of bytes JSON can carry as they are: printable
+// ASCII other than '"' and '\\'
+static size_t json_plain_run_scalar(const char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] < 0x80 &&
+         s[i] != '"' && s[i] != '\\') {
+    i++;
   }
+  return i;
+}
 
-  // Generate a random temperature between 0.5 and 1.0 for more varied responses
-  *temperature = ((float)rand() / RAND_MAX) * 0.5 + 0.5;
-
-  // Clean up
-  json_object_put(parsed_json);
-  free(chunk.response);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
-
-  return personality;
+// Length of the leading run of ASCII bytes
+static size_t ascii_run_scalar(const char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && (unsigned char)s[i] < 0x80) {
+    i++;
+  }
+  return i;
 }
 
-// Function to handle /whois command
-void handle_whois(const char *bot_name) {
-  for (int i = 0; i < bot_count; i++) {
-    if (strcmp(bots[i].name, bot_name) == 0) {
-      char info[1024];
-      snprintf(info, sizeof(info),
-               "Bot Information:\n"
-               "Name: %s\n"
-               "API Type: %s\n"
-               "Temperature: %.2f\n"
-               "Personality: %s\n"
-               "Total Messages: %d\n"
-               "Memory Size: %d/%d\n",
-               bots[i].name, bots[i].api_type, bots[i].temperature,
-               bots[i].personality, bots[i].total_messages,
-               bots[i].memory_count, MAX_MEMORY_ENTRIES);
-      add_chat_message("system", "system", info);
-      return;
+#if defined(__x86_64__)
+// A signed compare against 0x20 catches both control characters and bytes
+// of 0x80 and above, which are negative as signed chars
+__attribute__((target("sse2"))) static size_t
+json_plain_run_sse2(const char *s, size_t n) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i special = _mm_or_si128(
+        _mm_cmplt_epi8(x, space),
+        _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)));
+    unsigned mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
     }
   }
-  log_error("Bot not found.");
+  return i + json_plain_run_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+json_plain_run_avx2(const char *s, size_t n) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i special = _mm256_or_si256(
+        _mm256_cmpgt_epi8(space, x),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, quote),
+                        _mm256_cmpeq_epi8(x, backslash)));
+    unsigned mask = _mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  // Finish with a 16-byte step in this function rather than calling the SSE2
+  // version: mixing its legacy encoding with dirty AVX state stalls
+  if (i + 16 <= n) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i special = _mm_or_si128(
+        _mm_cmplt_epi8(x, _mm256_castsi256_si128(space)),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm256_castsi256_si128(quote)),
+                     _mm_cmpeq_epi8(x, _mm256_castsi256_si128(backslash))));
+    unsigned mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+  return i + json_plain_run_scalar(s + i, n - i);
+}
+
+__attribute__((target("sse2"))) static size_t ascii_run_sse2(const char *s,
+                                                             size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    unsigned mask =
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + ascii_run_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t ascii_run_avx2(const char *s,
+                                                             size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned mask =
+        _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  if (i + 16 <= n) {
+    unsigned mask =
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+  return i + ascii_run_scalar(s + i, n - i);
+}
+#endif
+
+static size_t json_plain_run(const char *s, size_t n) {
+#if defined(__x86_64__)
+  switch (text_kernels()) {
+  case TEXT_AVX2:
+    return json_plain_run_avx2(s, n);
+  case TEXT_SSE2:
+    return json_plain_run_sse2(s, n);
+  }
+#endif
+  return json_plain_run_scalar(s, n);
+}
+
+static size_t ascii_run(const char *s, size_t n) {
+#if defined(__x86_64__)
+  switch (text_kernels()) {
+  case TEXT_AVX2:
+    return ascii_run_avx2(s, n);
+  case TEXT_SSE2:
+    return ascii_run_sse2(s, n);
+  }
+#endif
+  return ascii_run_scalar(s, n);
+}
+
+// Decode the UTF-8 sequence at the start of s into *codepoint. Returns its
+// length, or 0 if it is malformed, truncated, overlong, a surrogate or
+// beyond U+10FFFF.
+int utf8_decode(const char *s, size_t n, uint32_t *codepoint) {
+  const unsigned char *u = (const unsigned char *)s;
+  if (n == 0) {
+    return 0;
+  }
+  if (u[0] < 0x80) {
+    *codepoint = u[0];
+    return 1;
+  }
+  int length;
+  unsigned char low = 0x80, high = 0xBF; // Range of the second byte
+  if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+    length = 2;
+  } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+    length = 3;
+    low = u[0] == 0xE0 ? 0xA0 : 0x80;
+    high = u[0] == 0xED ? 0x9F : 0xBF;
+  } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+    length = 4;
+    low = u[0] == 0xF0 ? 0x90 : 0x80;
+    high = u[0] == 0xF4 ? 0x8F : 0xBF;
+  } else {
+    return 0;
+  }
+  if (n < (size_t)length || u[1] < low || u[1] > high) {
+    return 0;
+  }
+  uint32_t value = u[0] & (0x7F >> length);
+  for (int i = 1; i < length; i++) {
+    if ((u[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+    value = (value << 6) | (u[i] & 0x3F);
+  }
+  *codepoint = value;
+  return length;
+}
+
+// Length of the longest valid UTF-8 prefix of s
+size_t utf8_validate(const char *s, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    i += ascii_run(s + i, n - i);
+    uint32_t codepoint;
+    int length = i < n ? utf8_decode(s + i, n - i, &codepoint) : 0;
+    if (length == 0) {
+      break;
+    }
+    i += length;
+  }
+  return i < n ? i : n;
+}
+
+// Copy input into output (output_size bytes, NUL terminated) as valid
+// UTF-8, replacing malformed bytes with U+FFFD (as json_escape_string does)
+// and never cutting a sequence
+void utf8_sanitize(char *output, const char *input, size_t output_size) {
+  size_t length = strlen(input), i = 0, j = 0;
+  while (i < length && j < output_size - 1) {
+    size_t valid = utf8_validate(input + i, length - i);
+    if (valid > output_size - 1 - j) {
+      // Truncate, backing off to the start of a sequence
+      valid = output_size - 1 - j;
+      while (valid > 0 && (input[i + valid] & 0xC0) == 0x80) {
+        valid--;
+      }
+      memcpy(output + j, input + i, valid);
+      j += valid;
+      break;
+    }
+    memcpy(output + j, input + i, valid);
+    i += valid;
+    j += valid;
+    if (i < length) {
+      if (output_size - 1 - j < 3) {
+        break; // No room for the replacement character
+      }
+      memcpy(output + j, "\xEF\xBF\xBD", 3); // U+FFFD
+      j += 3;
+      i++;
+    }
+  }
+  output[j] = '\0';
+}
+
+// Display width of a code point in a terminal: 0 for combining marks and
+// other zero-width characters, 2 for East Asian wide characters and emoji
+int codepoint_width(uint32_t cp) {
+  if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x200B && cp <= 0x200F) ||
+      (cp >= 0xFE00 && cp <= 0xFE0F) || (cp >= 0x20D0 && cp <= 0x20FF)) {
+    return 0;
+  }
+  if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF &&
+                                         cp != 0x303F) ||
+      (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+      (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+      (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+      (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD)) {
+    return 2;
+  }
+  return 1;
+}
+
+// Display width of the first length bytes of text; malformed bytes take a
+// column each, as in text_break
+int text_width(const char *text, size_t length) {
+  int width = 0;
+  size_t i = 0;
+  while (i < length) {
+    size_t run = ascii_run(text + i, length - i);
+    width += run;
+    i += run;
+    if (i < length) {
+      uint32_t codepoint;
+      int sequence = utf8_decode(text + i, length - i, &codepoint);
+      width += sequence > 0 ? codepoint_width(codepoint) : 1;
+      i += sequence > 0 ? sequence : 1;
+    }
+  }
+  return width;
+}
+
+// Find where to end a line of text at most columns display columns wide:
+// at a newline, else after the last word that fits, else (for a word too
+// long for a line) at the column limit, never inside a UTF-8 sequence.
+// Returns the number of bytes for the line, all of them if the text fits.
+// The caller skips the space or newline the line ends at, if any.
+size_t text_break(const char *text, size_t length, int columns) {
+  size_t i = 0, last_space = 0;
+  int column = 0;
+  if (columns < 1) {
+    columns = 1;
+  }
+  while (i < length) {
+    // Plain ASCII, one column per byte, looking one byte past the limit
+    // for a space to break at
+    size_t room = columns - column;
+    size_t scan = length - i < room + 1 ? length - i : room + 1;
+    size_t run = ascii_run(text + i, scan);
+    const char *newline = memchr(text + i, '\n', run);
+    if (newline != NULL) {
+      return newline - text;
+    }
+    if (run > room) {
+      for (size_t k = run; k > 0; k--) {
+        if (text[i + k - 1] == ' ' && i + k - 1 > 0) {
+          return i + k - 1;
+        }
+      }
+      return last_space > 0 ? last_space : i + room;
+    }
+    for (size_t k = run; k > 0; k--) {
+      if (text[i + k - 1] == ' ') {
+        last_space = i + k - 1 > 0 ? i + k - 1 : last_space;
+        break;
+      }
+    }
+    i += run;
+    column += run;
+    if (i == length) {
+      break;
+    }
+
+    // One non-ASCII character; malformed bytes take a column each
+    uint32_t codepoint = 0;
+    int sequence = utf8_decode(text + i, length - i, &codepoint);
+    int width = sequence > 0 ? codepoint_width(codepoint) : 1;
+    if (column + width > columns) {
+      if (last_space > 0 || i > 0) {
+        return last_space > 0 ? last_space : i;
+      }
+      return sequence > 0 ? sequence : 1; // Wider than the whole line
+    }
+    i += sequence > 0 ? sequence : 1;
+    column += width;
+  }
+  return length;
+}
+
+// Helper function to escape special characters in JSON strings. The output
+// is always valid UTF-8: malformed input bytes become U+FFFD, and when
+// output_size runs out it stops before the escape or character that
+// doesn't fit.
+void json_escape_string(const char *input, char *output, size_t output_size) {
+  size_t length = strlen(input), i = 0, j = 0;
+  while (i < length) {
+    size_t run = json_plain_run(input + i, length - i);
+    if (run > output_size - 1 - j) {
+      run = output_size - 1 - j;
+      memcpy(output + j, input + i, run);
+      j += run;
+      break;
+    }
+    memcpy(output + j, input + i, run);
+    i += run;
+    j += run;
+    if (i == length) {
+      break;
+    }
+
+    char escape[8];
+    const char *piece = escape;
+    size_t piece_length = 2, consumed = 1;
+    unsigned char c = input[i];
+    uint32_t codepoint;
+    if (c >= 0x80) {
+      int sequence = utf8_decode(input + i, length - i, &codepoint);
+      if (sequence > 0) {
+        piece = input + i;
+        piece_length = consumed = sequence;
+      } else {
+        piece = "\xEF\xBF\xBD"; // U+FFFD replacement character
+        piece_length = 3;
+      }
+    } else {
+      escape[0] = '\\';
+      switch (c) {
+      case '"':
+      case '\\':
+        escape[1] = c;
+        break;
+      case '\b':
+        escape[1] = 'b';
+        break;
+      case '\f':
+        escape[1] = 'f';
+        break;
+      case '\n':
+        escape[1] = 'n';
+        break;
+      case '\r':
+        escape[1] = 'r';
+        break;
+      case '\t':
+        escape[1] = 't';
+        break;
+      default:
+        piece_length = snprintf(escape, sizeof(escape), "\\u%04x", c);
+        break;
+      }
+    }
+    if (piece_length > output_size - 1 - j) {
+      break;
+    }
+    memcpy(output + j, piece, piece_length);
+    i += consumed;
+    j += piece_length;
+  }
+  output[j] = '\0';
+}
+
+// Chrome/Perfetto trace-event output (--trace). Each thread appends spans to
+// its own buffer, so recording an event is an uncontended lock and a copy;
+// the buffer is formatted into the trace file only when it fills up or when
+// tracing stops. Open the file in chrome://tracing or ui.perfetto.dev.
+#define TRACE_BUFFER_EVENTS 1024
+
+typedef struct {
+  const char *name; // Must be a string literal
+  char phase;       // 'X' complete span, 'b'/'e' async begin/end
+  uint64_t ts_us;
+  uint64_t dur_us;
+  uintptr_t id;    // Async span id
+  char detail[32]; // Optional argument, such as the bot name
+} TraceEvent;
+
+typedef struct TraceBuffer {
+  int tid;
+  const char *thread_name;
+  int named; // Set once the thread name metadata was written
+  int count;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+  pthread_mutex_t mutex;
+  struct TraceBuffer *next;
+} TraceBuffer;
+
+volatile int tracing = 0;
+FILE *trace_file = NULL;
+uint64_t trace_base_us = 0;
+int trace_first_event = 1;
+int trace_thread_count = 0;
+TraceBuffer *trace_buffers = NULL;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceBuffer *trace_buffer = NULL;
+
+// Write a buffer's events to the trace file. Must hold buffer->mutex.
+static void trace_flush_locked(TraceBuffer *buffer) {
+  // Don't let a thread be cancelled while it holds the buffer
+  int cancel_state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_file != NULL) {
+    if (!buffer->named && buffer->thread_name != NULL) {
+      fprintf(trace_file,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              trace_first_event ? "" : ",", buffer->tid, buffer->thread_name);
+      trace_first_event = 0;
+      buffer->named = 1;
+    }
+    for (int i = 0; i < buffer->count; i++) {
+      TraceEvent *event = &buffer->events[i];
+      char detail[sizeof(event->detail) * 2];
+      json_escape_string(event->detail, detail, sizeof(detail));
+      fprintf(trace_file,
+              "%s\n{\"name\":\"%s\",\"cat\":\"lierc\",\"ph\":\"%c\","
+              "\"ts\":%lu,\"pid\":1,\"tid\":%d",
+              trace_first_event ? "" : ",", event->name, event->phase,
+              (unsigned long)event->ts_us, buffer->tid);
+      trace_first_event = 0;
+      if (event->phase == 'X') {
+        fprintf(trace_file, ",\"dur\":%lu", (unsigned long)event->dur_us);
+      } else {
+        fprintf(trace_file, ",\"id\":\"0x%lx\"", (unsigned long)event->id);
+      }
+      if (detail[0] != '\0') {
+        fprintf(trace_file, ",\"args\":{\"detail\":\"%s\"}", detail);
+      }
+      fputc('}', trace_file);
+    }
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  buffer->count = 0;
+  pthread_setcancelstate(cancel_state, NULL);
+}
+
+// The calling thread's buffer, created on first use
+static TraceBuffer *trace_thread_buffer() {
+  if (trace_buffer == NULL) {
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) {
+      return NULL;
+    }
+    pthread_mutex_init(&buffer->mutex, NULL);
+    pthread_mutex_lock(&trace_mutex);
+    buffer->tid = ++trace_thread_count;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_mutex);
+    trace_buffer = buffer;
+  }
+  return trace_buffer;
+}
+
+static void trace_append(const char *name, char phase, uint64_t ts_us,
+                         uint64_t dur_us, uintptr_t id, const char *detail) {
+  TraceBuffer *buffer = trace_thread_buffer();
+  if (buffer == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&buffer->mutex);
+  TraceEvent *event = &buffer->events[buffer->count++];
+  event->name = name;
+  event->phase = phase;
+  event->ts_us = ts_us > trace_base_us ? ts_us - trace_base_us : 0;
+  event->dur_us = dur_us;
+  event->id = id;
+  snprintf(event->detail, sizeof(event->detail), "%s",
+           detail != NULL ? detail : "");
+  if (buffer->count == TRACE_BUFFER_EVENTS) {
+    trace_flush_locked(buffer);
+  }
+  pthread_mutex_unlock(&buffer->mutex);
+}
+
+// Name the calling thread in the trace
+void trace_thread_name(const char *name) {
+  if (!tracing) {
+    return;
+  }
+  TraceBuffer *buffer = trace_thread_buffer();
+  if (buffer != NULL) {
+    buffer->thread_name = name;
+  }
+}
+
+// Start time for a span, or 0 when tracing is off
+uint64_t trace_begin() { return tracing ? monotonic_us() : 0; }
+
+// Record a span from start_us (as returned by trace_begin) until now
+void trace_end(const char *name, uint64_t start_us, const char *detail) {
+  if (start_us == 0 || !tracing) {
+    return;
+  }
+  trace_append(name, 'X', start_us, monotonic_us() - start_us, 0, detail);
+}
+
+// Record a span that didn't run on one thread, such as time spent queued
+void trace_async(const char *name, uintptr_t id, uint64_t start_us,
+                 uint64_t end_us, const char *detail) {
+  if (!tracing) {
+    return;
+  }
+  trace_append(name, 'b', start_us, 0, id, detail);
+  trace_append(name, 'e', end_us, 0, id, NULL);
+}
+
+// Lock a mutex, recording a span for the time spent waiting if it was
+// contended
+void trace_mutex_lock(pthread_mutex_t *mutex, const char *wait_name) {
+  if (!tracing) {
+    pthread_mutex_lock(mutex);
+    return;
+  }
+  if (pthread_mutex_trylock(mutex) == 0) {
+    return;
+  }
+  uint64_t start = monotonic_us();
+  pthread_mutex_lock(mutex);
+  trace_end(wait_name, start, NULL);
+}
+
+void trace_stop();
+
+// Open the trace file and start recording. Returns -1 if it can't be opened.
+int trace_start(const char *filename) {
+  trace_file = fopen(filename, "w");
+  if (trace_file == NULL) {
+    return -1;
+  }
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", trace_file);
+  trace_base_us = monotonic_us();
+  tracing = 1;
+  atexit(trace_stop); // /quit exits from the input thread
+  return 0;
+}
+
+// Flush every thread's buffer and close the trace file
+void trace_stop() {
+  if (!tracing) {
+    return;
+  }
+  tracing = 0;
+  pthread_mutex_lock(&trace_mutex);
+  TraceBuffer *buffers = trace_buffers;
+  pthread_mutex_unlock(&trace_mutex);
+  for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next) {
+    pthread_mutex_lock(&buffer->mutex);
+    trace_flush_locked(buffer);
+    pthread_mutex_unlock(&buffer->mutex);
+  }
+  pthread_mutex_lock(&trace_mutex);
+  fputs("\n]}\n", trace_file);
+  fclose(trace_file);
+  trace_file = NULL;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+#define MAX_RESPONSE_SIZE 4096
+#define MAX_QUERY_SIZE 256
+#define CHAT_HISTORY_LIMIT 100
+#define DEFAULT_MODEL "gpt-4"
+#define DEFAULT_OPENAI_BASE_URL "https://api.openai.com"
+#define DEFAULT_ANTHROPIC_BASE_URL "https://api.anthropic.com"
+#define DEFAULT_LOCAL_BASE_URL "http://127.0.0.1:8080"
+#define DEFAULT_ANTHROPIC_MODEL "claude-3-5-haiku-latest"
+#define DEFAULT_LOCAL_MODEL "local"
+#define DEFAULT_CLASSIFIER_PROVIDER "openai"
+#define DEFAULT_CLASSIFIER_MODEL "gpt-3.5-turbo"
+#define DEFAULT_ROSTER_FILE "roster.json"
+#define DEFAULT_SNAPSHOT_FILE "lierc.snapshot"
+#define BOT_REGISTRY_INITIAL_CAPACITY 16
+
+// Color pair indices
+#define COLOR_TIME 1
+#define COLOR_USERNAME_USER 2
+#define COLOR_USERNAME_ASSISTANT 3
+#define COLOR_BRACKETS 4
+#define COLOR_STATUS_BAR 5
+#define COLOR_TEXT 6
+#define COLOR_SIDEBAR 7
+#define COLOR_SYSTEM_MESSAGE 8
+#define COLOR_LLM_MESSAGE 9
+#define COLOR_TYPING 10
+
+// Chat message structure
+typedef struct {
+  char timestamp[20];    // Timestamp in [HH:mm] format
+  char role[16];         // "user" or "assistant"
+  char display_name[50]; // Display name like "gpt-4" for the assistant
+  char content[MAX_RESPONSE_SIZE]; // The message content
+} ChatMessage;
+
+// FNV-1a hash of length bytes of text, varied by seed
+static uint32_t text_hash(const char *text, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Read the next word of *text into word and advance past it. Words are
+// lowercased runs of letters and digits, truncated to word_size - 1 bytes.
+// Returns the word's length, 0 once the text is used up.
+size_t next_word(const char **text, char *word, size_t word_size) {
+  const char *p = *text;
+  while (*p && !isalnum((unsigned char)*p)) {
+    p++;
+  }
+  size_t length = 0;
+  while (isalnum((unsigned char)*p)) {
+    if (length < word_size - 1) {
+      word[length++] = tolower((unsigned char)*p);
+    }
+    p++;
+  }
+  word[length] = '\0';
+  *text = p;
+  return length;
+}
+
+// Long-term memory. Every exchange a bot takes part in is kept in a per-bot
+// store alongside a local embedding: hashed word and character trigram
+// features projected onto EMBEDDING_DIM signed buckets, normalized and
+// quantized to int8. Recall is a brute-force scan of int8 dot products,
+// written as plain loops the compiler turns into SIMD, so there is no index
+// to maintain and no network call on the request path.
+#define EMBEDDING_DIM 128
+#define LONG_TERM_MEMORY_LIMIT 32768 // Oldest exchanges are overwritten
+#define LONG_TERM_ENTRY_LENGTH 256
+#define LONG_TERM_RECALL 3         // Exchanges recalled per prompt
+#define LONG_TERM_MIN_SIMILARITY 0.2f // Cosine below which nothing is recalled
+
+typedef struct {
+  pthread_rwlock_t lock;
+  int8_t (*vectors)[EMBEDDING_DIM]; // Quantized unit-length embeddings
+  char (*texts)[LONG_TERM_ENTRY_LENGTH];
+  int count;           // Entries stored
+  int capacity;        // Entries allocated, grown by doubling
+  int next;            // Slot written next once the store is full
+  unsigned long total; // Entries ever added
+} MemoryStore;
+
+typedef struct {
+  int similarity; // Dot product of the quantized embeddings
+  char text[LONG_TERM_ENTRY_LENGTH];
+} MemoryMatch;
+
+void memory_store_init(MemoryStore *store) {
+  memset(store, 0, sizeof(*store));
+  pthread_rwlock_init(&store->lock, NULL);
+}
+
+void memory_store_free(MemoryStore *store) {
+  free(store->vectors);
+  free(store->texts);
+  pthread_rwlock_destroy(&store->lock);
+}
+
+// Add a feature to the embedding: the hash picks the bucket and the sign
+static void embedding_add(float vector[], uint32_t hash, float weight) {
+  vector[hash % EMBEDDING_DIM] += (hash & 0x80000000u) ? -weight : weight;
+}
+
+// Compute the embedding of text. Each word adds itself and the trigrams of
+// " word ", so inflections and typos still land close together.
+void embed_text(const char *text, int8_t embedding[EMBEDDING_DIM]) {
+  float vector[EMBEDDING_DIM] = {0};
+  char word[34] = " ";
+  size_t length;
+  while ((length = next_word(&text, word + 1, sizeof(word) - 2)) > 0) {
+    word[length + 1] = ' ';
+    if (length >= 3) { // Shorter words only add their trigrams
+      embedding_add(vector, text_hash(word + 1, length, 0), 2.0f);
+    }
+    for (size_t i = 0; i + 3 <= length + 2; i++) {
+      embedding_add(vector, text_hash(word + i, 3, 1), 1.0f);
+    }
+  }
+
+  float norm = 0;
+  for (int i = 0; i < EMBEDDING_DIM; i++) {
+    norm += vector[i] * vector[i];
+  }
+  float scale = norm > 0 ? 127.0f / sqrtf(norm) : 0;
+  for (int i = 0; i < EMBEDDING_DIM; i++) {
+    embedding[i] = (int8_t)lrintf(vector[i] * scale);
+  }
+}
+
+// Score count stored embeddings against a query: the dot products of the
+// quantized vectors, 127 * 127 for identical texts. Built for AVX2 as well
+// as the baseline ISA, picked when the program is loaded.
+__attribute__((target_clones("avx2", "default"))) static void
+embedding_scan(const int8_t *query, const int8_t (*vectors)[EMBEDDING_DIM],
+               int count, int scores[]) {
+  for (int n = 0; n < count; n++) {
+    int sum = 0;
+    for (int i = 0; i < EMBEDDING_DIM; i++) {
+      sum += query[i] * vectors[n][i];
+    }
+    scores[n] = sum;
+  }
+}
+
+// Add an entry to a store, overwriting the oldest one once it holds
+// LONG_TERM_MEMORY_LIMIT entries. Returns -1 if out of memory.
+int memory_store_add(MemoryStore *store, const char *text) {
+  int8_t embedding[EMBEDDING_DIM];
+  embed_text(text, embedding);
+
+  pthread_rwlock_wrlock(&store->lock);
+  if (store->count == store->capacity &&
+      store->capacity < LONG_TERM_MEMORY_LIMIT) {
+    int capacity = store->capacity ? store->capacity * 2 : 64;
+    void *vectors =
+        realloc(store->vectors, capacity * sizeof(*store->vectors));
+    if (vectors != NULL) {
+      store->vectors = vectors;
+    }
+    void *texts = realloc(store->texts, capacity * sizeof(*store->texts));
+    if (texts != NULL) {
+      store->texts = texts;
+    }
+    if (vectors == NULL || texts == NULL) {
+      pthread_rwlock_unlock(&store->lock);
+      return -1;
+    }
+    store->capacity = capacity;
+  }
+
+  int slot = store->count < store->capacity ? store->count++ : store->next;
+  store->next = (slot + 1) % LONG_TERM_MEMORY_LIMIT;
+  memcpy(store->vectors[slot], embedding, sizeof(embedding));
+  snprintf(store->texts[slot], LONG_TERM_ENTRY_LENGTH, "%s", text);
+  store->total++;
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+int memory_store_count(MemoryStore *store) {
+  pthread_rwlock_rdlock(&store->lock);
+  int count = store->count;
+  pthread_rwlock_unlock(&store->lock);
+  return count;
+}
+
+// Find up to max_matches entries most similar to query, best first, leaving
+// out the skip_recent newest ones (already in the prompt verbatim) and any
+// below LONG_TERM_MIN_SIMILARITY. Returns the number of matches.
+int memory_store_search(MemoryStore *store, const char *query,
+                        int skip_recent, MemoryMatch matches[],
+                        int max_matches) {
+  int8_t embedding[EMBEDDING_DIM];
+  embed_text(query, embedding);
+  int threshold = (int)(LONG_TERM_MIN_SIMILARITY * 127 * 127);
+
+  pthread_rwlock_rdlock(&store->lock);
+  int searchable = store->count - skip_recent;
+  // Entries are stored oldest first, wrapping around at next once full
+  int first = store->count == LONG_TERM_MEMORY_LIMIT ? store->next : 0;
+  int best[LONG_TERM_RECALL * 4];
+  int best_score[LONG_TERM_RECALL * 4];
+  if (max_matches > (int)(sizeof(best) / sizeof(best[0]))) {
+    max_matches = sizeof(best) / sizeof(best[0]);
+  }
+  int found = 0;
+  int scores[256];
+  for (int n = 0; n < searchable;) {
+    // Score a batch of contiguous slots, then keep the best
+    int slot = (first + n) % store->count;
+    int batch = searchable - n;
+    if (batch > (int)(sizeof(scores) / sizeof(scores[0]))) {
+      batch = sizeof(scores) / sizeof(scores[0]);
+    }
+    if (batch > store->count - slot) {
+      batch = store->count - slot;
+    }
+    embedding_scan(embedding, store->vectors + slot, batch, scores);
+    n += batch;
+
+    for (int b = 0; b < batch; b++) {
+      int score = scores[b];
+      if (score < threshold ||
+          (found == max_matches && score <= best_score[found - 1])) {
+        continue;
+      }
+      // Insert into the sorted list of best matches
+      int position = found < max_matches ? found++ : found - 1;
+      while (position > 0 && best_score[position - 1] < score) {
+        best[position] = best[position - 1];
+        best_score[position] = best_score[position - 1];
+        position--;
+      }
+      best[position] = slot + b;
+      best_score[position] = score;
+    }
+  }
+  for (int i = 0; i < found; i++) {
+    matches[i].similarity = best_score[i];
+    memcpy(matches[i].text, store->texts[best[i]], LONG_TERM_ENTRY_LENGTH);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return found;
+}
+
+// Bot structure
+#define MAX_MEMORY_ENTRIES 10
+#define MAX_MEMORY_ENTRY_LENGTH 200
+#define MAX_SUMMARY_LENGTH 400
+#define MEMORY_PROMPT_SIZE 800         // Memory as rendered into a prompt
+#define RECALL_PROMPT_SIZE 800         // Recalled exchanges in a prompt
+#define SUMMARY_REFRESH_INTERACTIONS 5 // New interactions per summary refresh
+
+// Handle to a bot in the registry. A slot's generation is bumped whenever
+// the bot in it is removed, so handles held by in-flight requests for a
+// kicked bot stop resolving instead of pointing at whoever reuses the slot.
+typedef struct {
+  uint32_t index;      // Slot in the registry
+  uint32_t generation; // Generation of the slot when the handle was issued
+} BotHandle;
+
+// Tokens used by API requests
+typedef struct {
+  unsigned long prompt;     // Prompt tokens, including cached ones
+  unsigned long completion; // Generated tokens
+  unsigned long cached;     // Prompt tokens served from the provider's cache
+} TokenUsage;
+
+typedef struct {
+  BotHandle handle;      // This bot's own handle
+  int refcount;          // References held by the registry and threads
+  char api_type[20];     // Provider name: "openai", "anthropic" or "local"
+  char name[50];         // Display name of the bot
+  char personality[256]; // Personality description
+  char memory[MAX_MEMORY_ENTRIES]
+             [MAX_MEMORY_ENTRY_LENGTH]; // Circular buffer for recent
+                                        // interactions
+  int memory_index;                     // Current index in the circular buffer
+  int memory_count;                     // Number of entries in the memory
+  char summary[MAX_SUMMARY_LENGTH]; // Compact summary of older interactions
+  int unsummarized; // Interactions added since the summary was refreshed
+  int total_messages;  // Total number of messages processed by the bot
+  char model[50];      // Model used for this bot's API calls
+  TimerEvent *timer;   // Autonomous behavior timer, armed lazily
+  TokenUsage tokens;   // Tokens used on this bot's behalf (usage_mutex)
+  double cost;         // Spend in USD on this bot's behalf (usage_mutex)
+  MemoryStore long_term; // Every exchange, searchable by similarity
+} Bot;
+
+// Room events relayed to IRC clients in the given channels (a bitmask of
+// channel indices; see the IRC server section)
+typedef enum {
+  IRC_EVENT_MESSAGE, // nick said text
+  IRC_EVENT_JOIN,    // A bot or the local user joined
+  IRC_EVENT_PART,    // A bot or the local user left
+  IRC_EVENT_QUIT,    // A bot was removed, text is the reason
+  IRC_EVENT_NICK     // The local user renamed from nick to text
+} IrcEventType;
+
+void irc_post_event(IrcEventType type, uint32_t channels, const char *nick,
+                    const char *text);
+
+// Room events streamed to --tail subscribers as JSON lines (see the tail
+// API section). channel is -1 for bot events not tied to one.
+void tail_post_message(int channel, unsigned long number, const char *role,
+                       const char *nick, const char *text);
+void tail_post_bot(const char *type, const char *bot, int channel);
+
+// Bot registry. Cold bot data is allocated per bot so pointers stay valid
+// while referenced; fields read on every message are kept in parallel
+// arrays indexed by slot. Protected by bot_mutex.
+typedef struct {
+  int capacity;           // Number of slots allocated
+  int count;              // Number of live bots
+  Bot **slots;            // Bot data per slot, NULL when free
+  uint32_t *generations;  // Generation counter per slot
+  unsigned char *active;  // Hot: slot holds a live bot
+  unsigned char *typing;  // Hot: bot is currently "typing"
+  float *temperature;     // Hot: temperature for API calls
+  uint32_t *channels;     // Hot: bitmask of the channels the bot is in
+  int *order;             // Live slots in join order (dense, count entries)
+  int *free_slots;        // Stack of free slot indices
+  int free_count;         // Entries in free_slots
+  int *name_buckets;      // Name hash index: first slot per bucket, or -1
+  int *name_next;         // Next slot in the same bucket, or -1
+  int bucket_count;       // Power of two
+} BotRegistry;
+
+// API dialects. Each knows how to address, authenticate, build and parse
+// requests in one wire format. Request bodies are built from text that is
+// already JSON-escaped.
+typedef struct {
+  const char *path; // Endpoint, appended to the provider's base URL
+  // Append the authentication headers for api_key, which may be NULL
+  struct curl_slist *(*auth)(struct curl_slist *headers, const char *api_key);
+  // Build a request body. max_tokens 0 leaves the length to the provider
+  // where it allows that. Returns the length, or -1 if it didn't fit.
+  int (*build)(const char *model, const char *system, const char *user,
+               int max_tokens, float temperature, int stream, char *json,
+               size_t size);
+  // The reply text in a parsed response, or NULL
+  const char *(*reply)(struct json_object *response);
+  // The text added by one parsed streaming event, or NULL; any token counts
+  // it carries are merged into usage
+  const char *(*stream_event)(struct json_object *event, TokenUsage *usage);
+} ProviderApi;
+
+// Providers that bots and the classifier can use, each named by a bot's
+// api_type. Any OpenAI-compatible server (llama.cpp, vLLM, ...) is reached
+// as "local", or by pointing "openai" at it.
+typedef struct {
+  const char *name;
+  const ProviderApi *api;
+  char base_url[256];
+  const char *api_key;        // NULL if none is set
+  const char *key_variable;   // Environment variable holding the key
+  const char *public_url;     // Base URL that requires a key, or NULL
+  char default_model[50];     // For bots added without a model
+} Provider;
+
+Provider *provider_find(const char *name);
+const char *provider_missing_key(const Provider *provider);
+char *provider_complete(const Provider *provider, const char *model,
+                        const char *system, const char *user, int max_tokens,
+                        float temperature, const char *kind,
+                        TokenUsage *usage, int *estimated);
+
+// Global variables
+Provider *classifier_provider; // Classifier, summary and personality traffic
+char classifier_model[50] = DEFAULT_CLASSIFIER_MODEL;
+int stream_replies = 0; // Stream bot replies as server-sent events
+int headless = 0; // Run without ncurses, printing chat to stdout
+char model[50];
+char user_name[50] = "user"; // Default user name
+
+// Channels. Each has its own history, its own bot members and its own
+// request budget, and a message is only heard by the bots in its channel.
+// Channels are never removed, so an index stays valid for the session; bot
+// membership is a bitmask of indices in the registry. Protected by
+// chat_mutex, except that channel_count only grows and names never change.
+#define MAX_CHANNELS 32
+#define DEFAULT_CHANNEL "#lierc"
+
+typedef struct {
+  char name[50];
+  ChatMessage history[CHAT_HISTORY_LIMIT]; // Circular, by message number
+  unsigned long total;   // Messages ever added, including system ones
+  unsigned long seq;     // User and bot messages posted so far
+  int scroll_position;   // First history slot shown in the chat window
+  int joined;            // The local user is in the channel
+  int unread;            // Messages posted while another channel was shown
+  int request_budget;    // Bot requests per minute, 0 for no limit
+  double request_tokens; // Requests left in the budget's token bucket
+  uint64_t refill_us;    // When request_tokens was last topped up
+  unsigned long requests_limited; // Requests skipped for the budget
+} Channel;
+
+Channel *channels[MAX_CHANNELS];
+int channel_count = 0;
+int current_channel = 0;        // Shown in the chat window
+int channel_request_budget = 0; // For new channels (--channel-budget)
+
+// Find a channel by name, ignoring case. Returns its index or -1.
+int channel_find(const char *name) {
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    if (strcasecmp(channels[i]->name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Channel names start with '#' and have no spaces, commas or control
+// characters
+int channel_name_valid(const char *name) {
+  size_t length = strlen(name);
+  if (name[0] != '#' || length < 2 || length >= sizeof(channels[0]->name)) {
+    return 0;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if ((unsigned char)name[i] <= ' ' || name[i] == ',') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Find a channel, creating it if needed. Returns its index, or -1 if the
+// name is invalid or MAX_CHANNELS are in use.
+int channel_open(const char *name) {
+  if (!channel_name_valid(name)) {
+    return -1;
+  }
+  pthread_mutex_lock(&chat_mutex);
+  int index = channel_find(name);
+  if (index < 0 && channel_count < MAX_CHANNELS) {
+    Channel *channel = calloc(1, sizeof(Channel));
+    if (channel != NULL) {
+      snprintf(channel->name, sizeof(channel->name), "%s", name);
+      channel->request_budget = channel_request_budget;
+      channel->request_tokens = channel_request_budget;
+      channel->refill_us = monotonic_us();
+      index = channel_count;
+      channels[index] = channel;
+      __atomic_store_n(&channel_count, channel_count + 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&chat_mutex);
+  return index;
+}
+
+// Create the default channel, where the local user starts out
+void channels_init() {
+  current_channel = channel_open(DEFAULT_CHANNEL);
+  channels[current_channel]->joined = 1;
+}
+
+// Bitmask of the channels the local user is in
+uint32_t user_channels() {
+  uint32_t mask = 0;
+  pthread_mutex_lock(&chat_mutex);
+  for (int i = 0; i < channel_count; i++) {
+    if (channels[i]->joined) {
+      mask |= 1u << i;
+    }
+  }
+  pthread_mutex_unlock(&chat_mutex);
+  return mask;
+}
+
+// Take a request from a channel's budget. Essential requests (replies to a
+// human) always go ahead but still use up the budget. Returns 1 if the
+// request may be made.
+int channel_admit(int index, int essential) {
+  pthread_mutex_lock(&chat_mutex);
+  Channel *channel = channels[index];
+  int admitted = 1;
+  if (channel->request_budget > 0) {
+    uint64_t now = monotonic_us();
+    channel->request_tokens +=
+        (now - channel->refill_us) * channel->request_budget / 60e6;
+    if (channel->request_tokens > channel->request_budget) {
+      channel->request_tokens = channel->request_budget;
+    }
+    channel->refill_us = now;
+    if (channel->request_tokens >= 1) {
+      channel->request_tokens--;
+    } else if (essential) {
+      channel->request_tokens = 0;
+    } else {
+      channel->requests_limited++;
+      admitted = 0;
+    }
+  }
+  pthread_mutex_unlock(&chat_mutex);
+  return admitted;
+}
+
+// A channel's posted-message count, for tagging and aging requests without
+// taking chat_mutex (add_chat_message bumps it atomically)
+unsigned long channel_seq(int index) {
+  return __atomic_load_n(&channels[index]->seq, __ATOMIC_ACQUIRE);
+}
+
+// Bot list
+BotRegistry bot_registry;
+int nick_index_dirty = 1; // Set under bot_mutex when the roster changes
+
+// FNV-1a hash of a bot name for the name index
+static uint32_t bot_name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Rebuild the name index with the given number of buckets (a power of two)
+static int bot_registry_rehash(int bucket_count) {
+  int *buckets = malloc(bucket_count * sizeof(int));
+  if (buckets == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < bucket_count; i++) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < bot_registry.count; i++) {
+    int slot = bot_registry.order[i];
+    int bucket =
+        bot_name_hash(bot_registry.slots[slot]->name) & (bucket_count - 1);
+    bot_registry.name_next[slot] = buckets[bucket];
+    buckets[bucket] = slot;
+  }
+  free(bot_registry.name_buckets);
+  bot_registry.name_buckets = buckets;
+  bot_registry.bucket_count = bucket_count;
+  return 0;
+}
+
+// Grow every per-slot array to twice its capacity. Must hold bot_mutex.
+static int bot_registry_grow() {
+  BotRegistry *r = &bot_registry;
+  int capacity =
+      r->capacity > 0 ? r->capacity * 2 : BOT_REGISTRY_INITIAL_CAPACITY;
+
+#define GROW_ARRAY(field)                                                      \
+  do {                                                                         \
+    void *grown = realloc(r->field, capacity * sizeof(*r->field));             \
+    if (grown == NULL) {                                                       \
+      return -1;                                                               \
+    }                                                                          \
+    r->field = grown;                                                          \
+  } while (0)
+  GROW_ARRAY(slots);
+  GROW_ARRAY(generations);
+  GROW_ARRAY(active);
+  GROW_ARRAY(typing);
+  GROW_ARRAY(temperature);
+  GROW_ARRAY(channels);
+  GROW_ARRAY(order);
+  GROW_ARRAY(free_slots);
+  GROW_ARRAY(name_next);
+#undef GROW_ARRAY
+
+  // New slots go on the free stack so the lowest index is handed out first
+  for (int slot = capacity - 1; slot >= r->capacity; slot--) {
+    r->slots[slot] = NULL;
+    r->generations[slot] = 1;
+    r->active[slot] = 0;
+    r->typing[slot] = 0;
+    r->temperature[slot] = 0;
+    r->channels[slot] = 0;
+    r->name_next[slot] = -1;
+    r->free_slots[r->free_count++] = slot;
+  }
+  r->capacity = capacity;
+  return bot_registry_rehash(capacity);
+}
+
+// Find the slot of a live bot by name, or -1. Must hold bot_mutex.
+static int bot_registry_find_locked(const char *name) {
+  if (bot_registry.bucket_count == 0) {
+    return -1;
+  }
+  int slot = bot_registry.name_buckets[bot_name_hash(name) &
+                                       (bot_registry.bucket_count - 1)];
+  while (slot >= 0 && strcmp(bot_registry.slots[slot]->name, name) != 0) {
+    slot = bot_registry.name_next[slot];
+  }
+  return slot;
+}
+
+// Add a heap-allocated bot to the registry, which takes ownership of it.
+// Returns 0 on success, -1 if the name is taken or memory ran out.
+int bot_register(Bot *bot, float temperature) {
+  pthread_mutex_lock(&bot_mutex);
+  BotRegistry *r = &bot_registry;
+  if (bot_registry_find_locked(bot->name) >= 0 ||
+      (r->free_count == 0 && bot_registry_grow() != 0)) {
+    pthread_mutex_unlock(&bot_mutex);
+    return -1;
+  }
+
+  int slot = r->free_slots[--r->free_count];
+  memory_store_init(&bot->long_term);
+  r->slots[slot] = bot;
+  r->active[slot] = 1;
+  r->typing[slot] = 0;
+  r->temperature[slot] = temperature;
+  r->channels[slot] = 0; // Joins channels with bot_join_channel
+  r->order[r->count++] = slot;
+  bot->handle.index = slot;
+  bot->handle.generation = r->generations[slot];
+  bot->refcount = 1; // The registry's own reference
+
+  int bucket = bot_name_hash(bot->name) & (r->bucket_count - 1);
+  r->name_next[slot] = r->name_buckets[bucket];
+  r->name_buckets[bucket] = slot;
+  __atomic_store_n(&nick_index_dirty, 1, __ATOMIC_RELEASE);
+  tail_post_bot("bot_added", bot->name, -1);
+  pthread_mutex_unlock(&bot_mutex);
+  return 0;
+}
+
+// Check a handle against its slot's generation. Must hold bot_mutex.
+static int bot_handle_valid_locked(BotHandle handle) {
+  return handle.index < (uint32_t)bot_registry.capacity &&
+         bot_registry.active[handle.index] &&
+         bot_registry.generations[handle.index] == handle.generation;
+}
+
+int bot_handle_valid(BotHandle handle) {
+  pthread_mutex_lock(&bot_mutex);
+  int valid = bot_handle_valid_locked(handle);
+  pthread_mutex_unlock(&bot_mutex);
+  return valid;
+}
+
+// Resolve a handle to its bot and take a reference, or NULL if stale
+Bot *bot_acquire(BotHandle handle) {
+  Bot *bot = NULL;
+  trace_mutex_lock(&bot_mutex, "bot_mutex wait");
+  if (bot_handle_valid_locked(handle)) {
+    bot = bot_registry.slots[handle.index];
+    bot->refcount++;
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return bot;
+}
+
+// Look up a bot by name and take a reference, or NULL if not found
+Bot *bot_acquire_by_name(const char *name) {
+  Bot *bot = NULL;
+  pthread_mutex_lock(&bot_mutex);
+  int slot = bot_registry_find_locked(name);
+  if (slot >= 0) {
+    bot = bot_registry.slots[slot];
+    bot->refcount++;
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return bot;
+}
+
+// Free a bot's data, its timer included
+static void bot_destroy(void *owner) {
+  Bot *bot = owner;
+  free(bot->timer);
+  memory_store_free(&bot->long_term);
+  free(bot);
+}
+
+// Drop a reference taken by bot_acquire; frees the bot once it is removed
+// from the registry and no thread uses it any more. Callbacks on the timer
+// wheel (autonomous chatter) can drop the last reference too.
+void bot_release(Bot *bot) {
+  pthread_mutex_lock(&bot_mutex);
+  int remaining = --bot->refcount;
+  pthread_mutex_unlock(&bot_mutex);
+  if (remaining == 0) {
+    if (bot->timer != NULL) {
+      timer_release(bot->timer, bot_destroy, bot);
+    } else {
+      bot_destroy(bot);
+    }
+  }
+}
+
+// Remove a bot from the registry. Its slot's generation is bumped so
+// outstanding handles go stale; the data lives until the last release.
+void bot_unregister(BotHandle handle) {
+  Bot *bot = NULL;
+  pthread_mutex_lock(&bot_mutex);
+  BotRegistry *r = &bot_registry;
+  if (bot_handle_valid_locked(handle)) {
+    int slot = handle.index;
+    bot = r->slots[slot];
+
+    // Unlink from the name index
+    int *link = &r->name_buckets[bot_name_hash(bot->name) &
+                                 (r->bucket_count - 1)];
+    while (*link != slot) {
+      link = &r->name_next[*link];
+    }
+    *link = r->name_next[slot];
+
+    // Remove from the join order, keeping the others in place
+    for (int i = 0; i < r->count; i++) {
+      if (r->order[i] == slot) {
+        memmove(&r->order[i], &r->order[i + 1],
+                (r->count - i - 1) * sizeof(int));
+        break;
+      }
+    }
+    r->count--;
+
+    irc_post_event(IRC_EVENT_QUIT, r->channels[slot], bot->name, "Kicked");
+    tail_post_bot("bot_removed", bot->name, -1);
+    r->slots[slot] = NULL;
+    r->active[slot] = 0;
+    r->typing[slot] = 0;
+    r->channels[slot] = 0;
+    r->generations[slot]++;
+    r->free_slots[r->free_count++] = slot;
+    __atomic_store_n(&nick_index_dirty, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  if (bot != NULL) {
+    bot_release(bot); // Drop the registry's reference
+  }
+}
+
+// Copy the handles of all live bots, in join order. Returns the count and
+// stores a malloc'd array (to be freed by the caller) in *handles.
+int bot_snapshot(BotHandle **handles) {
+  pthread_mutex_lock(&bot_mutex);
+  int count = bot_registry.count;
+  *handles = malloc((count > 0 ? count : 1) * sizeof(BotHandle));
+  if (*handles == NULL) {
+    count = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    (*handles)[i] = bot_registry.slots[bot_registry.order[i]]->handle;
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return count;
+}
+
+// Like bot_snapshot, but only the bots in a channel
+int channel_members(int channel, BotHandle **handles) {
+  pthread_mutex_lock(&bot_mutex);
+  int count = 0;
+  *handles = malloc((bot_registry.count > 0 ? bot_registry.count : 1) *
+                    sizeof(BotHandle));
+  for (int i = 0; *handles != NULL && i < bot_registry.count; i++) {
+    int slot = bot_registry.order[i];
+    if (bot_registry.channels[slot] & (1u << channel)) {
+      (*handles)[count++] = bot_registry.slots[slot]->handle;
+    }
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return count;
+}
+
+// Channels a bot is in as a bitmask, or 0 if the handle is stale
+uint32_t bot_channels(BotHandle handle) {
+  uint32_t mask = 0;
+  pthread_mutex_lock(&bot_mutex);
+  if (bot_handle_valid_locked(handle)) {
+    mask = bot_registry.channels[handle.index];
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return mask;
+}
+
+// Add a bot to a channel or take it out. Returns 0 if that changed its
+// membership, -1 if it didn't (already in or out, or a stale handle).
+static int bot_set_channel(BotHandle handle, int channel, int member) {
+  int changed = 0;
+  pthread_mutex_lock(&bot_mutex);
+  if (bot_handle_valid_locked(handle)) {
+    uint32_t *mask = &bot_registry.channels[handle.index];
+    uint32_t bit = 1u << channel;
+    if (((*mask & bit) != 0) != member) {
+      *mask ^= bit;
+      changed = 1;
+      irc_post_event(member ? IRC_EVENT_JOIN : IRC_EVENT_PART, bit,
+                     bot_registry.slots[handle.index]->name, NULL);
+      tail_post_bot(member ? "join" : "part",
+                    bot_registry.slots[handle.index]->name, channel);
+    }
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return changed ? 0 : -1;
+}
+
+int bot_join_channel(BotHandle handle, int channel) {
+  return bot_set_channel(handle, channel, 1);
+}
+
+int bot_part_channel(BotHandle handle, int channel) {
+  return bot_set_channel(handle, channel, 0);
+}
+
+int bot_count() {
+  pthread_mutex_lock(&bot_mutex);
+  int count = bot_registry.count;
+  pthread_mutex_unlock(&bot_mutex);
+  return count;
+}
+
+void bot_set_typing(BotHandle handle, int typing) {
+  pthread_mutex_lock(&bot_mutex);
+  if (bot_handle_valid_locked(handle) &&
+      bot_registry.typing[handle.index] != typing) {
+    bot_registry.typing[handle.index] = typing;
+    tail_post_bot(typing ? "typing" : "idle",
+                  bot_registry.slots[handle.index]->name, -1);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+}
+
+// Temperature of a bot, or 0 if the handle is stale
+float bot_temperature(BotHandle handle) {
+  float temperature = 0;
+  pthread_mutex_lock(&bot_mutex);
+  if (bot_handle_valid_locked(handle)) {
+    temperature = bot_registry.temperature[handle.index];
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  return temperature;
+}
+
+// Nick index. The bot names form a trie under an '@' edge from the root,
+// which serves both tab completion (the subtree below '@', walked in
+// order) and mention matching: an Aho-Corasick automaton over "@name" for
+// every bot, compiled into a DFA over the bytes that occur in names, finds
+// all the bots a message mentions in one pass however many bots there are.
+// It is rebuilt on first use after the roster changes.
+#define NICK_ROOT 0 // Root state of the trie and automaton
+#define NICK_AT 1   // State after '@'; bot names hang below it
+#define MAX_MENTIONS 32    // Bots promoted for mentions in one message
+#define MAX_COMPLETIONS 32 // Names cycled through by tab completion
+
+typedef struct {
+  unsigned char ch;  // Byte on the edge from the parent
+  int first_child;   // Children are kept sorted by ch, -1 if none
+  int next_sibling;  // -1 if none
+  int name;          // Name ending here, or -1
+  int fail;          // Longest proper suffix that is also a trie state
+  int output;        // Nearest state on the fail chain ending a name, or -1
+} NickNode;
+
+typedef struct {
+  NickNode *nodes;
+  int node_count;
+  int node_capacity;
+  char (*names)[sizeof(((Bot *)0)->name)];
+  BotHandle *handles; // Bot for each name
+  int name_count;
+  unsigned char classes[256]; // Byte to character class, 0 for other bytes
+  int class_count;
+  int *next; // DFA transitions, node_count * class_count
+} NickIndex;
+
+NickIndex nick_index;
+pthread_rwlock_t nick_index_lock = PTHREAD_RWLOCK_INITIALIZER; // After bot
+
+// Characters that can continue a nick; a mention must not be followed by
+// one, so "@bob" doesn't match in "@bobby"
+int is_nick_char(unsigned char c) { return isalnum(c) || c == '_' || c == '-'; }
+
+static int nick_node_add(NickIndex *index, unsigned char ch) {
+  if (index->node_count == index->node_capacity) {
+    int capacity = index->node_capacity ? index->node_capacity * 2 : 256;
+    NickNode *nodes = realloc(index->nodes, capacity * sizeof(NickNode));
+    if (nodes == NULL) {
+      return -1;
+    }
+    index->nodes = nodes;
+    index->node_capacity = capacity;
+  }
+  NickNode *node = &index->nodes[index->node_count];
+  node->ch = ch;
+  node->first_child = node->next_sibling = node->name = node->output = -1;
+  node->fail = NICK_ROOT;
+  return index->node_count++;
+}
+
+// Child of parent along ch, created in sorted position if missing
+static int nick_node_child(NickIndex *index, int parent, unsigned char ch) {
+  int *link = &index->nodes[parent].first_child;
+  while (*link >= 0 && index->nodes[*link].ch < ch) {
+    link = &index->nodes[*link].next_sibling;
+  }
+  if (*link >= 0 && index->nodes[*link].ch == ch) {
+    return *link;
+  }
+  int child = nick_node_add(index, ch);
+  if (child < 0) {
+    return -1;
+  }
+  // nodes may have moved; find the link again
+  link = &index->nodes[parent].first_child;
+  while (*link >= 0 && index->nodes[*link].ch < ch) {
+    link = &index->nodes[*link].next_sibling;
+  }
+  index->nodes[child].next_sibling = *link;
+  *link = child;
+  return child;
+}
+
+static void nick_index_free(NickIndex *index) {
+  free(index->nodes);
+  free(index->names);
+  free(index->handles);
+  free(index->next);
+  memset(index, 0, sizeof(*index));
+}
+
+// Build the trie and automaton from the live bots into an empty index.
+// Must hold bot_mutex. Returns -1 if memory ran out; the index is to be
+// freed either way.
+static int nick_index_build_locked(NickIndex *index) {
+  if (nick_node_add(index, 0) != NICK_ROOT ||
+      nick_node_add(index, '@') != NICK_AT) {
+    return -1;
+  }
+  index->nodes[NICK_ROOT].first_child = NICK_AT;
+
+  int count = bot_registry.count;
+  index->names = malloc((count ? count : 1) * sizeof(*index->names));
+  index->handles = malloc((count ? count : 1) * sizeof(BotHandle));
+  if (index->names == NULL || index->handles == NULL) {
+    return -1;
+  }
+
+  index->class_count = 1;
+  index->classes['@'] = index->class_count++;
+  for (int i = 0; i < count; i++) {
+    Bot *bot = bot_registry.slots[bot_registry.order[i]];
+    int node = NICK_AT;
+    for (const unsigned char *p = (const unsigned char *)bot->name;
+         *p && node >= 0; p++) {
+      if (index->classes[*p] == 0) {
+        index->classes[*p] = index->class_count++;
+      }
+      node = nick_node_child(index, node, *p);
+    }
+    if (node < 0) {
+      return -1;
+    }
+    strcpy(index->names[index->name_count], bot->name);
+    index->handles[index->name_count] = bot->handle;
+    index->nodes[node].name = index->name_count++;
+  }
+
+  // Breadth-first, so a node's fail state is complete before its children
+  // need it. Missing transitions are copied from the fail state.
+  int class_count = index->class_count;
+  index->next = malloc(index->node_count * class_count * sizeof(int));
+  int *queue = malloc(index->node_count * sizeof(int));
+  if (index->next == NULL || queue == NULL) {
+    free(queue);
+    return -1;
+  }
+  int head = 0, tail = 0;
+  queue[tail++] = NICK_ROOT;
+  while (head < tail) {
+    int state = queue[head++];
+    NickNode *node = &index->nodes[state];
+    int *next = &index->next[state * class_count];
+    if (state == NICK_ROOT) {
+      memset(next, 0, class_count * sizeof(int)); // NICK_ROOT is 0
+    } else {
+      memcpy(next, &index->next[node->fail * class_count],
+             class_count * sizeof(int));
+    }
+    for (int child = node->first_child; child >= 0;
+         child = index->nodes[child].next_sibling) {
+      NickNode *c = &index->nodes[child];
+      int cls = index->classes[c->ch];
+      c->fail = state == NICK_ROOT
+                    ? NICK_ROOT
+                    : index->next[node->fail * class_count + cls];
+      c->output = index->nodes[c->fail].name >= 0
+                      ? c->fail
+                      : index->nodes[c->fail].output;
+      next[cls] = child;
+      queue[tail++] = child;
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+// Rebuild the index if the roster changed since it was last built. The new
+// index is built aside and swapped in, so lookups only wait for the swap
+// and a failed rebuild keeps the previous one.
+static void nick_index_refresh() {
+  if (!__atomic_load_n(&nick_index_dirty, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&bot_mutex);
+  if (nick_index_dirty) {
+    NickIndex built = {0};
+    if (nick_index_build_locked(&built) == 0) {
+      pthread_rwlock_wrlock(&nick_index_lock);
+      NickIndex previous = nick_index;
+      nick_index = built;
+      pthread_rwlock_unlock(&nick_index_lock);
+      nick_index_free(&previous);
+      __atomic_store_n(&nick_index_dirty, 0, __ATOMIC_RELEASE);
+    } else {
+      nick_index_free(&built);
+    }
+  }
+  pthread_mutex_unlock(&bot_mutex);
+}
+
+// Find the bots mentioned in message as "@name". Stores up to max handles,
+// each bot once, and returns how many were stored.
+int find_mentions(const char *message, BotHandle mentioned[], int max) {
+  nick_index_refresh();
+  pthread_rwlock_rdlock(&nick_index_lock);
+  NickIndex *index = &nick_index;
+  int found = 0;
+  if (index->next != NULL) {
+    const unsigned char *text = (const unsigned char *)message;
+    int state = NICK_ROOT;
+    for (size_t i = 0; text[i] && found < max; i++) {
+      state = index->next[state * index->class_count +
+                          index->classes[text[i]]];
+      int match = index->nodes[state].name >= 0 ? state
+                                                : index->nodes[state].output;
+      for (; match >= 0 && found < max; match = index->nodes[match].output) {
+        int name = index->nodes[match].name;
+        size_t start = i - strlen(index->names[name]); // The '@'
+        if ((start > 0 && is_nick_char(text[start - 1])) ||
+            is_nick_char(text[i + 1])) {
+          continue; // Part of a longer word, like an email address
+        }
+        int duplicate = 0;
+        for (int m = 0; m < found && !duplicate; m++) {
+          duplicate = mentioned[m].index == index->handles[name].index;
+        }
+        if (!duplicate) {
+          mentioned[found++] = index->handles[name];
+        }
+      }
+    }
+  }
+  pthread_rwlock_unlock(&nick_index_lock);
+  return found;
+}
+
+static void nick_collect(int state, char matches[][sizeof(user_name)],
+                         int *count, int max) {
+  for (int child = nick_index.nodes[state].first_child;
+       child >= 0 && *count < max;
+       child = nick_index.nodes[child].next_sibling) {
+    int name = nick_index.nodes[child].name;
+    if (name >= 0 && *count < max) {
+      snprintf(matches[(*count)++], sizeof(user_name), "%s",
+               nick_index.names[name]);
+    }
+    nick_collect(child, matches, count, max);
+  }
+}
+
+// Find the user and bot names starting with prefix: the user's own name
+// first, then the bots in alphabetical order. Stores up to max names and
+// returns how many were stored.
+int complete_nick(const char *prefix, char matches[][sizeof(user_name)],
+                  int max) {
+  int count = 0;
+  if (max > 0 && strncmp(prefix, user_name, strlen(prefix)) == 0) {
+    snprintf(matches[count++], sizeof(user_name), "%s", user_name);
+  }
+  nick_index_refresh();
+  pthread_rwlock_rdlock(&nick_index_lock);
+  int state = nick_index.nodes != NULL ? NICK_AT : -1;
+  for (const unsigned char *p = (const unsigned char *)prefix;
+       *p && state >= 0; p++) {
+    int child = nick_index.nodes[state].first_child;
+    while (child >= 0 && nick_index.nodes[child].ch != *p) {
+      child = nick_index.nodes[child].next_sibling;
+    }
+    state = child;
+  }
+  if (state >= 0) {
+    int name = nick_index.nodes[state].name;
+    if (name >= 0 && count < max) {
+      snprintf(matches[count++], sizeof(user_name), "%s",
+               nick_index.names[name]);
+    }
+    nick_collect(state, matches, &count, max);
+  }
+  pthread_rwlock_unlock(&nick_index_lock);
+  return count;
+}
+
+// Stats
+// Counters exported through the metrics listener
+typedef enum {
+  WINDOW_CHAT,
+  WINDOW_STATUS,
+  WINDOW_SIDEBAR,
+  WINDOW_COUNT
+} WindowId;
+
+const char *window_names[WINDOW_COUNT] = {"chat", "status", "sidebar"};
+unsigned long render_frames[WINDOW_COUNT];
+unsigned long log_bytes_written = 0;
+
+int messages_sent = 0;
+int messages_received = 0;
+time_t start_time;
+
+// ncurses windows
+WINDOW *chat_win, *input_win, *status_win, *sidebar_win;
+
+// Function prototypes for the request scheduler
+int scheduler_queue_depth();
+void schedule_memory_summary(BotHandle bot);
+void handle_stats();
+void send_chat_query(int channel, const char *query, const char *sender,
+                     int priority);
+
+// Function prototypes for cost accounting
+void record_usage(Bot *bot, const char *api_type, const char *model,
+                  const TokenUsage *usage, int estimated);
+void bot_usage_summary(const Bot *bot, char *buffer, size_t size);
+void handle_budget(const char *args);
+
+// Function prototype for session snapshots
+void handle_snapshot(const char *filename);
+
+// Structure to hold response from the OpenAI API
+struct memory {
+  char *response;
+  size_t size;
+};
+
+// Function to handle memory reallocation for the CURL response
+static size_t write_callback(void *data, size_t size, size_t nmemb,
+                             void *userp) {
+  size_t realsize = size * nmemb;
+  struct memory *mem = (struct memory *)userp;
+
+  char *ptr = realloc(mem->response, mem->size + realsize + 1);
+  if (ptr == NULL) {
+    return 0;
+  }
+
+  mem->response = ptr;
+  memcpy(&(mem->response[mem->size]), data, realsize);
+  mem->size += realsize;
+  mem->response[mem->size] = 0;
+
+  return realsize;
+}
+
+// Get timestamp in [HH:mm] format
+void get_timestamp(char *buffer, size_t buffer_size) {
+  time_t t = wall_time();
+  struct tm tm = *localtime(&t);
+  snprintf(buffer, buffer_size, "[%02d:%02d]", tm.tm_hour, tm.tm_min);
+}
+
+// Name of the admission controller's current load level
+const char *load_level_name();
+
+// Update the status bar with connection time and message stats
+void update_status_bar() {
+  if (headless) {
+    return;
+  }
+  werase(status_win);
+  __atomic_fetch_add(&render_frames[WINDOW_STATUS], 1, __ATOMIC_RELAXED);
+  int max_x;
+  getmaxyx(status_win, (int){0}, max_x);
+
+  // Set blue background for the status bar and extend across the entire width
+  wattron(status_win, COLOR_PAIR(COLOR_STATUS_BAR));
+  for (int i = 0; i < max_x; i++) {
+    mvwprintw(status_win, 0, i, " ");
+  }
+
+  // Time connected
+  time_t now = wall_time();
+  int seconds_connected = (int)difftime(now, start_time);
+  int minutes = seconds_connected / 60;
+  int seconds = seconds_connected % 60;
+
+  pthread_mutex_lock(&latency_mutex);
+  double p50 = histogram_percentile(&latency_total, 50) / 1e6;
+  double p95 = histogram_percentile(&latency_total, 95) / 1e6;
+  double p99 = histogram_percentile(&latency_total, 99) / 1e6;
+  pthread_mutex_unlock(&latency_mutex);
+
+  // The channel shown, then the others with unread messages
+  char channel_list[256];
+  int length = snprintf(channel_list, sizeof(channel_list), "%s",
+                        channels[current_channel]->name);
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count && length < (int)sizeof(channel_list); i++) {
+    if (i != current_channel && channels[i]->unread > 0) {
+      length += snprintf(channel_list + length, sizeof(channel_list) - length,
+                         " [%s:%d]", channels[i]->name, channels[i]->unread);
+    }
+  }
+
+  mvwprintw(status_win, 0, 0,
+            " %s  |  Time Connected: %02d:%02d  |  Sent: %d  |  Received: %d  "
+            "|  Queued: %d  |  Load: %s  |  Reply p50/p95/p99: "
+            "%.1f/%.1f/%.1fs ",
+            channel_list, minutes, seconds, messages_sent, messages_received,
+            scheduler_queue_depth(), load_level_name(), p50, p95, p99);
+
+  wattroff(status_win, COLOR_PAIR(COLOR_STATUS_BAR));
+  wrefresh(status_win);
+}
+
+// Word-wrap input at max_width display columns, breaking lines at spaces
+// where possible and never inside a UTF-8 character. output needs room for
+// the input plus a newline per max_width columns.
+void word_wrap(char *input, char *output, int max_width) {
+  size_t length = strlen(input), out_pos = 0;
+  while (length > 0) {
+    size_t line = text_break(input, length, max_width);
+    memcpy(output + out_pos, input, line);
+    out_pos += line;
+    input += line;
+    length -= line;
+    if (length > 0) {
+      output[out_pos++] = '\n';
+      if (*input == ' ' || *input == '\n') {
+        input++; // The break replaces the space
+        length--;
+      }
+    }
+  }
+  output[out_pos] = '\0'; // Null terminate the output
+}
+
+// Callback drawing one laid-out line of the chat window
+typedef void (*chat_line_fn)(int line, const char *text, int length,
+                             void *ctx);
+
+// Lay out the current channel's history for a max_y by max_x window,
+// calling draw for each line. Returns the number of lines laid out.
+int render_chat_lines(int max_y, int max_x, chat_line_fn draw, void *ctx) {
+  int line = 0; // Track the current line number in the chat window
+  const Channel *channel = channels[current_channel];
+
+  // Iterate through the chat history and render messages, taking scrolling into
+  // account
+  for (int i = 0; i < CHAT_HISTORY_LIMIT; i++) {
+    int idx = (channel->scroll_position + i) %
+              CHAT_HISTORY_LIMIT; // Circular buffer handling
+    const ChatMessage *entry = &channel->history[idx];
+    if (strlen(entry->content) == 0) {
+      continue; // Skip empty chat history slots
+    }
+
+    char formatted_message[MAX_RESPONSE_SIZE +
+                           100]; // Buffer for formatted message
+
+    // Prepare the message format: [timestamp] <username>: message
+    snprintf(formatted_message, sizeof(formatted_message), "[%s] <%s>: %s",
+             entry->timestamp, entry->display_name, entry->content);
+
+    // Now handle word wrapping to ensure text doesn't overflow the window
+    // width, breaking at spaces and newlines by display columns
+    const char *text = formatted_message;
+    size_t message_length = strlen(formatted_message);
+
+    while (message_length > 0 && line < max_y) {
+      size_t line_length = text_break(text, message_length, max_x - 1);
+      draw(line++, text, (int)line_length, ctx);
+      text += line_length;
+      message_length -= line_length;
+      if (message_length > 0 && (*text == ' ' || *text == '\n')) {
+        text++; // Don't start the next line with the break
+        message_length--;
+      }
+    }
+
+    // Stop rendering if we've run out of space in the chat window
+    if (line >= max_y) {
+      break;
+    }
+  }
+  return line;
+}
+
+static void draw_chat_line(int line, const char *text, int length,
+                           void *ctx) {
+  (void)ctx;
+  mvwprintw(chat_win, line, 0, "%.*s", length, text);
+}
+
+// Function to update and render the chat window with messages
+void update_chat_window() {
+  if (headless) {
+    return;
+  }
+  __atomic_fetch_add(&render_frames[WINDOW_CHAT], 1, __ATOMIC_RELAXED);
+  werase(chat_win); // Clear the chat window first
+  int max_y, max_x;
+  getmaxyx(chat_win, max_y, max_x); // Get the dimensions of the chat window
+
+  render_chat_lines(max_y, max_x, draw_chat_line, NULL);
+
+  // Refresh the chat window to apply changes
+  wrefresh(chat_win);
+}
+
+// Scroll the chat window up
+void scroll_up() {
+  Channel *channel = channels[current_channel];
+  if (channel->scroll_position > 0) {
+    channel->scroll_position--;
+    update_chat_window();
+  }
+}
+
+// Scroll the chat window down
+void scroll_down() {
+  int max_y;
+  getmaxyx(chat_win, max_y, (int){0});
+  Channel *channel = channels[current_channel];
+  if (channel->scroll_position <
+      (int)(channel->total % CHAT_HISTORY_LIMIT) - max_y) {
+    channel->scroll_position++;
+    update_chat_window();
+  }
+}
+
+// Function prototype for update_sidebar
+void update_sidebar();
+
+// Show another channel in the chat window, marking it read
+void switch_channel(int index) {
+  pthread_mutex_lock(&chat_mutex);
+  current_channel = index;
+  Channel *channel = channels[index];
+  channel->unread = 0;
+  channel->scroll_position = channel->total % CHAT_HISTORY_LIMIT;
+  update_chat_window();
+  pthread_mutex_unlock(&chat_mutex);
+  update_sidebar();
+  update_status_bar();
+}
+
+// Full-text search over the scrollback. Every user and bot message is added
+// to an inverted index as it is posted: a hash table from each word to the
+// ascending list of messages containing it. Only the last CHAT_HISTORY_LIMIT
+// messages of a channel stay in its history; older ones are read back from
+// the log file, which every message is spilled to.
+#define SEARCH_RESULTS 10   // Results shown per query
+#define SEARCH_MAX_TERMS 8  // Words used from a query
+#define SEARCH_WORD_SIZE 32 // Longer words are truncated
+#define SEARCH_NORM_CACHE 256 // Message lengths with precomputed norms
+
+typedef struct {
+  unsigned long message; // Number of the message in its channel
+  long log_offset;       // Start of its line in the log file, or -1
+  uint32_t words;        // Words in the message, for length normalization
+  int channel;
+} SearchDocument;
+
+typedef struct {
+  char *word;        // NULL for an empty slot
+  uint32_t *docs;    // Documents containing the word, ascending
+  uint8_t *counts;   // Occurrences in each document, saturating
+  uint32_t count;    // Entries in docs and counts
+  uint32_t capacity; // Entries allocated
+} SearchTerm;
+
+typedef struct {
+  SearchDocument *docs;
+  uint32_t doc_count;
+  uint32_t doc_capacity;
+  SearchTerm *terms;      // Open addressing table, linear probing
+  uint32_t term_count;
+  uint32_t term_capacity; // Power of two
+  unsigned long total_words;
+} SearchIndex;
+
+typedef struct {
+  unsigned long message;
+  long log_offset;
+  int channel;
+  double score;
+} SearchHit;
+
+SearchIndex search_index;
+pthread_mutex_t search_mutex = PTHREAD_MUTEX_INITIALIZER; // After chat_mutex
+SearchHit search_last_hits[SEARCH_RESULTS]; // Results of the last /search
+int search_last_count = 0;
+
+// Find a word's slot in the term table: its entry, or the empty slot it
+// would go in. Must hold search_mutex with a nonempty table.
+static SearchTerm *search_term_slot(const char *word, size_t length) {
+  uint32_t mask = search_index.term_capacity - 1;
+  uint32_t i = text_hash(word, length, 0) & mask;
+  while (search_index.terms[i].word != NULL &&
+         strcmp(search_index.terms[i].word, word) != 0) {
+    i = (i + 1) & mask;
+  }
+  return &search_index.terms[i];
+}
+
+// Double the term table, or allocate it. Must hold search_mutex.
+static int search_grow_terms() {
+  SearchIndex *index = &search_index;
+  uint32_t old_capacity = index->term_capacity;
+  SearchTerm *old_terms = index->terms;
+  uint32_t capacity = old_capacity ? old_capacity * 2 : 1024;
+  SearchTerm *terms = calloc(capacity, sizeof(SearchTerm));
+  if (terms == NULL) {
+    return -1;
+  }
+  index->terms = terms;
+  index->term_capacity = capacity;
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old_terms[i].word != NULL) {
+      *search_term_slot(old_terms[i].word, strlen(old_terms[i].word)) =
+          old_terms[i];
+    }
+  }
+  free(old_terms);
+  return 0;
+}
+
+// Count one occurrence of word in document doc. Must hold search_mutex.
+static int search_add_word(const char *word, size_t length, uint32_t doc) {
+  SearchIndex *index = &search_index;
+  if ((index->term_count + 1) * 2 > index->term_capacity &&
+      search_grow_terms() != 0) {
+    return -1;
+  }
+  SearchTerm *term = search_term_slot(word, length);
+  if (term->word == NULL) {
+    term->word = strdup(word);
+    if (term->word == NULL) {
+      return -1;
+    }
+    index->term_count++;
+  }
+  if (term->count > 0 && term->docs[term->count - 1] == doc) {
+    if (term->counts[term->count - 1] < UINT8_MAX) {
+      term->counts[term->count - 1]++;
+    }
+    return 0;
+  }
+  if (term->count == term->capacity) {
+    uint32_t capacity = term->capacity ? term->capacity * 2 : 4;
+    uint32_t *docs = realloc(term->docs, capacity * sizeof(*docs));
+    if (docs != NULL) {
+      term->docs = docs;
+    }
+    uint8_t *counts = realloc(term->counts, capacity * sizeof(*counts));
+    if (counts != NULL) {
+      term->counts = counts;
+    }
+    if (docs == NULL || counts == NULL) {
+      return -1;
+    }
+    term->capacity = capacity;
+  }
+  term->docs[term->count] = doc;
+  term->counts[term->count] = 1;
+  term->count++;
+  return 0;
+}
+
+// Index a posted message under its words and its sender's name. message is
+// its number in its channel and log_offset where its line starts in the log
+// (-1 if it isn't logged).
+void search_index_add(int channel, unsigned long message, long log_offset,
+                      const char *display_name, const char *content) {
+  pthread_mutex_lock(&search_mutex);
+  SearchIndex *index = &search_index;
+  if (index->doc_count == index->doc_capacity) {
+    uint32_t capacity = index->doc_capacity ? index->doc_capacity * 2 : 1024;
+    SearchDocument *docs = realloc(index->docs, capacity * sizeof(*docs));
+    if (docs == NULL) {
+      pthread_mutex_unlock(&search_mutex);
+      return;
+    }
+    index->docs = docs;
+    index->doc_capacity = capacity;
+  }
+  uint32_t doc = index->doc_count++;
+  SearchDocument *entry = &index->docs[doc];
+  entry->message = message;
+  entry->log_offset = log_offset;
+  entry->words = 0;
+  entry->channel = channel;
+
+  char word[SEARCH_WORD_SIZE];
+  size_t length;
+  const char *texts[] = {display_name, content};
+  for (int t = 0; t < 2; t++) {
+    const char *p = texts[t];
+    while ((length = next_word(&p, word, sizeof(word))) > 0) {
+      search_add_word(word, length, doc);
+      entry->words++;
+    }
+  }
+  index->total_words += entry->words;
+  pthread_mutex_unlock(&search_mutex);
+}
+
+// First position at or after from in term's documents holding a document
+// >= doc, by galloping then binary search
+static uint32_t search_seek(const SearchTerm *term, uint32_t from,
+                            uint32_t doc) {
+  uint32_t step = 1;
+  uint32_t high = from;
+  while (high < term->count && term->docs[high] < doc) {
+    from = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > term->count) {
+    high = term->count;
+  }
+  while (from < high) {
+    uint32_t middle = from + (high - from) / 2;
+    if (term->docs[middle] < doc) {
+      from = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return from;
+}
+
+// Find the messages containing every word of query, ranked by BM25 with
+// newer messages first on ties. Fills up to max_hits hits, best first, and
+// returns the total number of matching messages.
+unsigned long search_index_query(const char *query, SearchHit hits[],
+                                 int max_hits, int *hit_count) {
+  char words[SEARCH_MAX_TERMS][SEARCH_WORD_SIZE];
+  int word_count = 0;
+  size_t length;
+  while (word_count < SEARCH_MAX_TERMS &&
+         (length = next_word(&query, words[word_count], SEARCH_WORD_SIZE)) >
+             0) {
+    int duplicate = 0;
+    for (int i = 0; i < word_count; i++) {
+      duplicate |= strcmp(words[i], words[word_count]) == 0;
+    }
+    word_count += !duplicate;
+  }
+  *hit_count = 0;
+  if (word_count == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&search_mutex);
+  SearchIndex *index = &search_index;
+  const SearchTerm *terms[SEARCH_MAX_TERMS];
+  for (int i = 0; i < word_count; i++) {
+    terms[i] = index->term_capacity
+                   ? search_term_slot(words[i], strlen(words[i]))
+                   : NULL;
+    if (terms[i] == NULL || terms[i]->word == NULL) {
+      pthread_mutex_unlock(&search_mutex);
+      return 0; // A word that was never said matches nothing
+    }
+  }
+  // Walk the rarest word's documents, seeking through the others
+  for (int i = 1; i < word_count; i++) {
+    for (int j = i; j > 0 && terms[j]->count < terms[j - 1]->count; j--) {
+      const SearchTerm *swap = terms[j];
+      terms[j] = terms[j - 1];
+      terms[j - 1] = swap;
+    }
+  }
+  double idf[SEARCH_MAX_TERMS];
+  for (int i = 0; i < word_count; i++) {
+    idf[i] = log(1.0 + (index->doc_count - terms[i]->count + 0.5) /
+                           (terms[i]->count + 0.5));
+  }
+  double average_words =
+      (double)index->total_words / (index->doc_count ? index->doc_count : 1);
+  const double k1 = 1.2, b = 0.75;
+  double norms[SEARCH_NORM_CACHE]; // Length normalization of short messages
+  for (int words = 0; words < SEARCH_NORM_CACHE; words++) {
+    norms[words] = k1 * (1 - b + b * words / average_words);
+  }
+
+  uint32_t positions[SEARCH_MAX_TERMS] = {0};
+  unsigned long matches = 0;
+  for (uint32_t p = 0; p < terms[0]->count; p++) {
+    uint32_t doc = terms[0]->docs[p];
+    int all = 1;
+    for (int i = 1; i < word_count && all; i++) {
+      positions[i] = search_seek(terms[i], positions[i], doc);
+      all = positions[i] < terms[i]->count &&
+            terms[i]->docs[positions[i]] == doc;
+    }
+    if (!all) {
+      continue;
+    }
+    matches++;
+
+    uint32_t words = index->docs[doc].words;
+    double norm = words < SEARCH_NORM_CACHE
+                      ? norms[words]
+                      : k1 * (1 - b + b * words / average_words);
+    double score = 0;
+    for (int i = 0; i < word_count; i++) {
+      double count = i == 0 ? terms[0]->counts[p]
+                            : terms[i]->counts[positions[i]];
+      score += idf[i] * count * (k1 + 1) / (count + norm);
+    }
+    // Documents come in ascending order, so ties keep the newest first
+    if (*hit_count == max_hits && score < hits[max_hits - 1].score) {
+      continue;
+    }
+    int position = *hit_count < max_hits ? (*hit_count)++ : max_hits - 1;
+    while (position > 0 && hits[position - 1].score <= score) {
+      hits[position] = hits[position - 1];
+      position--;
+    }
+    hits[position].message = index->docs[doc].message;
+    hits[position].channel = index->docs[doc].channel;
+    hits[position].log_offset = index->docs[doc].log_offset;
+    hits[position].score = score;
+  }
+  pthread_mutex_unlock(&search_mutex);
+  return matches;
+}
+
+// Function to add chat messages to a channel and ensure they're displayed
+// properly if it is the one shown
+void add_channel_message(int channel_index, const char *role,
+                         const char *display_name, const char *message) {
+  trace_mutex_lock(&chat_mutex, "chat_mutex wait");
+  uint64_t held_start = trace_begin();
+
+  Channel *channel = channels[channel_index];
+  unsigned long number = channel->total++;
+  ChatMessage *entry = &channel->history[number % CHAT_HISTORY_LIMIT];
+  get_timestamp(entry->timestamp, sizeof(entry->timestamp));
+  strncpy(entry->role, role, sizeof(entry->role) - 1);
+  strncpy(entry->display_name, display_name, sizeof(entry->display_name) - 1);
+  // Kept as valid UTF-8 so the window never shows a cut or bad character
+  utf8_sanitize(entry->content, message, sizeof(entry->content));
+
+  if (strcmp(role, "system") != 0) {
+    __atomic_add_fetch(&channel->seq, 1, __ATOMIC_RELEASE);
+  }
+
+  // Automatically scroll to the latest message
+  channel->scroll_position = channel->total % CHAT_HISTORY_LIMIT;
+  if (channel_index == current_channel) {
+    update_chat_window(); // Refresh chat window to show new messages
+  } else if (strcmp(role, "system") != 0) {
+    channel->unread++;
+  }
+
+  // In headless mode the chat goes to stdout instead of the chat window
+  if (headless) {
+    printf("%s %s <%s> %s\n", entry->timestamp, channel->name, display_name,
+           message);
+    fflush(stdout);
+  }
+
+  // Log the message to file if logging is enabled
+  long log_offset = -1;
+  if (log_file != NULL) {
+    log_offset = log_bytes_written;
+    int written = fprintf(log_file, "[%s] %s <%s> %s\n", entry->timestamp,
+                          channel->name, display_name, message);
+    if (written > 0) {
+      log_bytes_written += written; // Under chat_mutex
+    }
+    fflush(log_file);
+  }
+
+  if (strcmp(role, "system") != 0) {
+    search_index_add(channel_index, number, log_offset, display_name,
+                     message);
+    irc_post_event(IRC_EVENT_MESSAGE, 1u << channel_index, display_name,
+                   entry->content);
+  }
+  tail_post_message(channel_index, number, entry->role, display_name,
+                    entry->content);
+
+  trace_end("chat_mutex held", held_start, display_name);
+  pthread_mutex_unlock(&chat_mutex);
+}
+
+// Add a message to the channel shown in the chat window
+void add_chat_message(const char *role, const char *display_name,
+                      const char *message) {
+  add_channel_message(current_channel, role, display_name, message);
+}
+
+// Function to log errors and display them in the chat window
+void log_error(const char *error_message) {
+  add_chat_message("system", "system", error_message);
+}
+
+// Get the text of a search hit as it appears in the log. Returns the hit's
+// slot in its channel's history if it is still there, -1 if it was read
+// back from the log file, -2 if it is no longer available.
+static int search_hit_text(const SearchHit *hit, char *text, size_t size) {
+  pthread_mutex_lock(&chat_mutex);
+  const Channel *channel = channels[hit->channel];
+  if (channel->total - hit->message <= CHAT_HISTORY_LIMIT) {
+    int slot = hit->message % CHAT_HISTORY_LIMIT;
+    const ChatMessage *entry = &channel->history[slot];
+    snprintf(text, size, "[%s] %s <%s> %s", entry->timestamp, channel->name,
+             entry->display_name, entry->content);
+    pthread_mutex_unlock(&chat_mutex);
+    return slot;
+  }
+  int fd = log_file != NULL ? fileno(log_file) : -1;
+  pthread_mutex_unlock(&chat_mutex);
+
+  ssize_t length = -1;
+  if (fd >= 0 && hit->log_offset >= 0) {
+    length = pread(fd, text, size - 1, hit->log_offset);
+  }
+  if (length <= 0) {
+    snprintf(text, size, "(message no longer available)");
+    return -2;
+  }
+  text[length] = '\0';
+  text[strcspn(text, "\n")] = '\0';
+  return -1;
+}
+
+// Function to handle /search command
+void handle_search(const char *terms) {
+  uint64_t start = monotonic_us();
+  unsigned long matches = search_index_query(
+      terms, search_last_hits, SEARCH_RESULTS, &search_last_count);
+  double elapsed_ms = (monotonic_us() - start) / 1000.0;
+
+  char results[SEARCH_RESULTS * 200 + 256];
+  int length = snprintf(results, sizeof(results),
+                        "Search \"%.100s\": %lu match%s in %.2f ms", terms,
+                        matches, matches == 1 ? "" : "es", elapsed_ms);
+  for (int i = 0; i < search_last_count; i++) {
+    char text[MAX_RESPONSE_SIZE + 100];
+    search_hit_text(&search_last_hits[i], text, sizeof(text));
+    length += snprintf(results + length, sizeof(results) - length,
+                       "\n%2d. %.180s", i + 1, text);
+  }
+  if (search_last_count > 0) {
+    snprintf(results + length, sizeof(results) - length,
+             "\nUse /jump <n> to show a result in the chat window.");
+  }
+  add_chat_message("system", "system", results);
+}
+
+// Function to handle /jump command: switch to the channel of a result of
+// the last search and scroll to it, or show it if it has scrolled out of
+// the history
+void handle_jump(int result) {
+  if (result < 1 || result > search_last_count) {
+    log_error("No such search result. Usage: /jump <n> after /search");
+    return;
+  }
+  char text[MAX_RESPONSE_SIZE + 100];
+  const SearchHit *hit = &search_last_hits[result - 1];
+  int slot = search_hit_text(hit, text, sizeof(text));
+  if (slot >= 0 && !headless) {
+    switch_channel(hit->channel);
+    pthread_mutex_lock(&chat_mutex);
+    channels[hit->channel]->scroll_position = slot;
+    update_chat_window();
+    pthread_mutex_unlock(&chat_mutex);
+    return;
+  }
+  char message[MAX_RESPONSE_SIZE + 160];
+  snprintf(message, sizeof(message), "Result %d%s: %s", result,
+           slot == -1 ? " (from the log)" : "", text);
+  add_chat_message("system", "system", message);
+}
+
+// Function to generate a unique bot personality with the classifier provider
+char *generate_unique_bot_personality(float *temperature,
+                                      const char *existing_personalities) {
+  char system[1536];
+  snprintf(system, sizeof(system),
+           "Generate a short, one-sentence personality description for a "
+           "chatbot inspired by various online communities. Include a mix of "
+           "traits such as helpful, sarcastic, meme-loving, intellectual, "
+           "optimistic, cynical, or quirky. Aim for diversity in "
+           "personalities. Ensure the personality is unique and different "
+           "from these existing personalities: %.1000s",
+           existing_personalities);
+  TokenUsage usage;
+  int estimated;
+  char *personality = provider_complete(
+      classifier_provider, classifier_model, system,
+      "Describe the personality.", 50, 1.0f, "personality", &usage,
+      &estimated);
+  record_usage(NULL, classifier_provider->name, classifier_model, &usage,
+               estimated);
+
+  // Generate a random temperature between 0.5 and 1.0 for more varied responses
+  *temperature = random_unit() * 0.5 + 0.5;
+
+  return personality;
+}
+
+// Function to handle /whois command
+void handle_whois(const char *bot_name) {
+  Bot *bot = bot_acquire_by_name(bot_name);
+  if (bot == NULL) {
+    log_error("Bot not found.");
+    return;
+  }
+  char info[2048];
+  snprintf(info, sizeof(info),
+           "Bot Information:\n"
+           "Name: %s\n"
+           "API Type: %s\n"
+           "Model: %s\n"
+           "Temperature: %.2f\n"
+           "Personality: %s\n"
+           "Total Messages: %d\n"
+           "Memory Size: %d/%d\n"
+           "Long-term Memory: %d exchanges\n",
+           bot->name, bot->api_type, bot->model, bot_temperature(bot->handle),
+           bot->personality, bot->total_messages, bot->memory_count,
+           MAX_MEMORY_ENTRIES, memory_store_count(&bot->long_term));
+  size_t length = strlen(info);
+  pthread_mutex_lock(&bot_mutex);
+  snprintf(info + length, sizeof(info) - length, "Summary: %s\n",
+           bot->summary[0] ? bot->summary : "(none yet)");
+  pthread_mutex_unlock(&bot_mutex);
+  length = strlen(info);
+  uint32_t member_of = bot_channels(bot->handle);
+  length += snprintf(info + length, sizeof(info) - length, "Channels:");
+  for (int c = 0; c < channel_count && length < sizeof(info); c++) {
+    if (member_of & (1u << c)) {
+      length += snprintf(info + length, sizeof(info) - length, " %s",
+                         channels[c]->name);
+    }
+  }
+  if (length < sizeof(info)) {
+    length += snprintf(info + length, sizeof(info) - length, "\n");
+  }
+  if (length < sizeof(info)) {
+    bot_usage_summary(bot, info + length, sizeof(info) - length);
+  }
+  bot_release(bot);
+  add_chat_message("system", "system", info);
 }
 
 // Function prototype for process_bot_responses
 void *process_bot_responses(void *arg);
 
-// Function to generate a bot personality using OpenAI
-char *generate_bot_personality(float *temperature) {
-  CURL *curl;
-  CURLcode res;
-  struct memory chunk = {0};
-  chunk.response = malloc(1);
-  chunk.size = 0;
-
-  curl = curl_easy_init();
-  if (!curl) {
-    log_error("CURL initialization failed.");
-    return NULL;
+// Function to generate a bot personality with the classifier provider
+char *generate_bot_personality(float *temperature) {
+  TokenUsage usage;
+  int estimated;
+  char *personality = provider_complete(
+      classifier_provider, classifier_model,
+      "Generate a short, one-sentence personality description for a chatbot "
+      "inspired by various online communities. Include a mix of traits such "
+      "as helpful, sarcastic, meme-loving, intellectual, optimistic, "
+      "cynical, or quirky. Aim for diversity in personalities.",
+      "Describe the personality.", 50, 1.0f, "personality", &usage,
+      &estimated);
+  record_usage(NULL, classifier_provider->name, classifier_model, &usage,
+               estimated);
+
+  // Generate a random temperature between 0.5 and 1.0 for more varied responses
+  *temperature = random_unit() * 0.5 + 0.5;
+
+  return personality;
+}
+
+// Function prototype for bot_autonomous_behavior
+unsigned bot_autonomous_behavior(void *arg);
+
+int chatter_stopped = 0; // Set once a headless script is over
+
+// Random delay between autonomous behavior checks (5 to 30 seconds)
+unsigned autonomous_delay_ms() { return (5 + random_below(26)) * 1000; }
+
+// Function to display the sidebar with connected bots
+void update_sidebar() {
+  if (headless) {
+    return;
+  }
+  __atomic_fetch_add(&render_frames[WINDOW_SIDEBAR], 1, __ATOMIC_RELAXED);
+  werase(sidebar_win);
+  int channel = current_channel;
+  mvwprintw(sidebar_win, 1, 2, "Users in %s:", channels[channel]->name);
+  mvwprintw(sidebar_win, 2, 2, "@%s", user_name);
+  int row = 3;
+  pthread_mutex_lock(&bot_mutex);
+  for (int i = 0; i < bot_registry.count; i++) {
+    int slot = bot_registry.order[i];
+    if (!(bot_registry.channels[slot] & (1u << channel))) {
+      continue;
+    }
+    Bot *bot = bot_registry.slots[slot];
+    int color = bot_registry.typing[slot] ? COLOR_TYPING : COLOR_SIDEBAR;
+    wattron(sidebar_win, COLOR_PAIR(color));
+    mvwprintw(sidebar_win, row++, 2, "+%s [%s]", bot->name, bot->api_type);
+    wattroff(sidebar_win, COLOR_PAIR(color));
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  wrefresh(sidebar_win);
+}
+
+// Arm the autonomous behavior timer for a bot if it isn't armed yet
+void schedule_bot_timer(Bot *bot) {
+  if (bot->timer != NULL || !bot_handle_valid(bot->handle)) {
+    return;
+  }
+  TimerEvent *timer = calloc(1, sizeof(TimerEvent));
+  if (timer == NULL) {
+    log_error("Failed to allocate autonomous timer for bot");
+    return;
+  }
+  timer->callback = bot_autonomous_behavior;
+  timer->arg = bot;
+  bot->timer = timer;
+  timer_schedule(timer, autonomous_delay_ms());
+}
+
+// Arm timers for bots loaded without one (e.g. from a roster)
+void schedule_bot_timers() {
+  BotHandle *handles;
+  int count = bot_snapshot(&handles);
+  for (int i = 0; i < count; i++) {
+    Bot *bot = bot_acquire(handles[i]);
+    if (bot != NULL) {
+      schedule_bot_timer(bot);
+      bot_release(bot);
+    }
+  }
+  free(handles);
+}
+
+// Disarm a bot's timer and remove it from the registry. Timer callbacks run
+// under timer_mutex, so once this returns none can be running for the bot.
+void remove_bot(Bot *bot) {
+  pthread_mutex_lock(&timer_mutex);
+  if (bot->timer != NULL) {
+    timer_cancel_locked(bot->timer);
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  bot_unregister(bot->handle);
+}
+
+// Copy a string field from a roster entry, leaving the default if absent
+static void roster_get_string(struct json_object *entry, const char *key,
+                              char *dest, size_t dest_size) {
+  struct json_object *value;
+  if (json_object_object_get_ex(entry, key, &value) &&
+      json_object_get_type(value) == json_type_string) {
+    strncpy(dest, json_object_get_string(value), dest_size - 1);
+    dest[dest_size - 1] = '\0';
+  }
+}
+
+// Load bots from a JSON roster file without any API calls. Autonomous
+// threads are not started here; they are created lazily on first activity.
+// Returns the number of bots loaded or -1 on error.
+int load_roster(const char *filename) {
+  struct json_object *root = json_object_from_file(filename);
+  if (root == NULL) {
+    return -1;
+  }
+
+  struct json_object *entries = root;
+  if (json_object_get_type(root) == json_type_object &&
+      !json_object_object_get_ex(root, "bots", &entries)) {
+    json_object_put(root);
+    return -1;
+  }
+  if (json_object_get_type(entries) != json_type_array) {
+    json_object_put(root);
+    return -1;
+  }
+
+  int loaded = 0;
+  size_t n = json_object_array_length(entries);
+  for (size_t i = 0; i < n; i++) {
+    struct json_object *entry = json_object_array_get_idx(entries, i);
+    struct json_object *value;
+    Bot *new_bot = calloc(1, sizeof(Bot));
+    if (new_bot == NULL) {
+      break;
+    }
+
+    roster_get_string(entry, "name", new_bot->name, sizeof(new_bot->name));
+    if (new_bot->name[0] == '\0') {
+      free(new_bot); // A bot without a name can't be addressed
+      continue;
+    }
+    strcpy(new_bot->api_type, "openai");
+    roster_get_string(entry, "api_type", new_bot->api_type,
+                      sizeof(new_bot->api_type));
+    const Provider *provider = provider_find(new_bot->api_type);
+    snprintf(new_bot->model, sizeof(new_bot->model), "%s",
+             provider != NULL ? provider->default_model : model);
+    roster_get_string(entry, "model", new_bot->model, sizeof(new_bot->model));
+    strcpy(new_bot->personality, "Default personality");
+    roster_get_string(entry, "personality", new_bot->personality,
+                      sizeof(new_bot->personality));
+
+    float temperature = 0.7;
+    if (json_object_object_get_ex(entry, "temperature", &value)) {
+      temperature = (float)json_object_get_double(value);
+    }
+
+    // Seed the memory buffer from the roster
+    if (json_object_object_get_ex(entry, "memory", &value) &&
+        json_object_get_type(value) == json_type_array) {
+      size_t memory_len = json_object_array_length(value);
+      for (size_t m = 0; m < memory_len && m < MAX_MEMORY_ENTRIES; m++) {
+        const char *text =
+            json_object_get_string(json_object_array_get_idx(value, m));
+        if (text == NULL) {
+          continue;
+        }
+        strncpy(new_bot->memory[new_bot->memory_count], text,
+                MAX_MEMORY_ENTRY_LENGTH - 1);
+        new_bot->memory_count++;
+      }
+      new_bot->memory_index = new_bot->memory_count % MAX_MEMORY_ENTRIES;
+    }
+    if (json_object_object_get_ex(entry, "summary", &value)) {
+      snprintf(new_bot->summary, sizeof(new_bot->summary), "%s",
+               json_object_get_string(value));
+    }
+
+    if (bot_register(new_bot, temperature) != 0) {
+      free(new_bot); // Duplicate name
+      continue;
+    }
+
+    // Bots without a channel list start in the default channel
+    if (json_object_object_get_ex(entry, "channels", &value) &&
+        json_object_get_type(value) == json_type_array) {
+      size_t channel_len = json_object_array_length(value);
+      for (size_t c = 0; c < channel_len; c++) {
+        const char *name =
+            json_object_get_string(json_object_array_get_idx(value, c));
+        int index = name != NULL ? channel_open(name) : -1;
+        if (index >= 0) {
+          bot_join_channel(new_bot->handle, index);
+        }
+      }
+    } else {
+      bot_join_channel(new_bot->handle, 0);
+    }
+    loaded++;
+  }
+
+  json_object_put(root);
+  return loaded;
+}
+
+// Save the current bots to a JSON roster file. Returns 0 on success.
+int save_roster(const char *filename) {
+  struct json_object *root = json_object_new_object();
+  struct json_object *entries = json_object_new_array();
+
+  pthread_mutex_lock(&bot_mutex);
+  for (int i = 0; i < bot_registry.count; i++) {
+    int slot = bot_registry.order[i];
+    Bot *bot = bot_registry.slots[slot];
+    struct json_object *entry = json_object_new_object();
+    json_object_object_add(entry, "name", json_object_new_string(bot->name));
+    json_object_object_add(entry, "api_type",
+                           json_object_new_string(bot->api_type));
+    json_object_object_add(entry, "model", json_object_new_string(bot->model));
+    json_object_object_add(entry, "personality",
+                           json_object_new_string(bot->personality));
+    json_object_object_add(
+        entry, "temperature",
+        json_object_new_double(bot_registry.temperature[slot]));
+
+    // Oldest interaction first, as load_roster expects
+    struct json_object *memory = json_object_new_array();
+    for (int m = 0; m < bot->memory_count; m++) {
+      int index = (bot->memory_index - bot->memory_count + m +
+                   MAX_MEMORY_ENTRIES) %
+                  MAX_MEMORY_ENTRIES;
+      json_object_array_add(memory,
+                            json_object_new_string(bot->memory[index]));
+    }
+    json_object_object_add(entry, "memory", memory);
+    json_object_object_add(entry, "summary",
+                           json_object_new_string(bot->summary));
+    struct json_object *bot_channel_list = json_object_new_array();
+    for (int c = 0; c < channel_count; c++) {
+      if (bot_registry.channels[slot] & (1u << c)) {
+        json_object_array_add(bot_channel_list,
+                              json_object_new_string(channels[c]->name));
+      }
+    }
+    json_object_object_add(entry, "channels", bot_channel_list);
+    json_object_array_add(entries, entry);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+
+  json_object_object_add(root, "bots", entries);
+  int result = json_object_to_file_ext(filename, root, JSON_C_TO_STRING_PRETTY);
+  json_object_put(root);
+
+  if (result != 0) {
+    log_error("Failed to write roster file.");
+    return -1;
+  }
+  return 0;
+}
+
+// Function to handle /join: join a channel, creating it if needed, and
+// show it
+void handle_join(const char *name) {
+  int index = channel_open(name);
+  if (index < 0) {
+    log_error(channel_name_valid(name)
+                  ? "Too many channels."
+                  : "Channel names start with '#' and have no spaces.");
+    return;
+  }
+  pthread_mutex_lock(&chat_mutex);
+  int was_joined = channels[index]->joined;
+  channels[index]->joined = 1;
+  pthread_mutex_unlock(&chat_mutex);
+  switch_channel(index);
+  if (!was_joined) {
+    irc_post_event(IRC_EVENT_JOIN, 1u << index, user_name, NULL);
+    char message[128];
+    snprintf(message, sizeof(message),
+             "Now talking in %s. /invite <bot> brings a bot in.",
+             channels[index]->name);
+    add_chat_message("system", "system", message);
+  }
+}
+
+// Function to handle /part: leave a channel (by default the one shown), or
+// with a bot's name, take that bot out of the channel shown
+void handle_part(const char *name) {
+  if (name[0] != '\0' && name[0] != '#') {
+    Bot *bot = bot_acquire_by_name(name);
+    if (bot == NULL) {
+      log_error("Bot not found.");
+      return;
+    }
+    int left = bot_part_channel(bot->handle, current_channel) == 0;
+    bot_release(bot);
+    update_sidebar();
+    if (left) {
+      add_chat_message("system", "system", "Bot left the channel.");
+    } else {
+      log_error("That bot isn't in here.");
+    }
+    return;
+  }
+
+  int index = name[0] != '\0' ? channel_find(name) : current_channel;
+  int next = -1;
+  pthread_mutex_lock(&chat_mutex);
+  int count = channel_count;
+  for (int i = 1; index >= 0 && i < count && next < 0; i++) {
+    if (channels[(index + i) % count]->joined) {
+      next = (index + i) % count;
+    }
+  }
+  int joined = index >= 0 && channels[index]->joined;
+  if (joined && next >= 0) {
+    channels[index]->joined = 0;
+  }
+  pthread_mutex_unlock(&chat_mutex);
+  if (!joined) {
+    log_error("You're not in that channel.");
+  } else if (next < 0) {
+    log_error("You can't leave your last channel.");
+  } else {
+    irc_post_event(IRC_EVENT_PART, 1u << index, user_name, NULL);
+    if (index == current_channel) {
+      switch_channel(next);
+    }
+  }
+}
+
+// Show the next (step 1) or previous (step -1) channel the user is in
+void cycle_channel(int step) {
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 1; i < count; i++) {
+    int index = (current_channel + i * step + count) % count;
+    if (channels[index]->joined) {
+      switch_channel(index);
+      return;
+    }
+  }
+}
+
+// Function to handle /invite: bring a bot into a channel (by default the
+// one shown)
+void handle_invite(const char *bot_name, const char *channel_name) {
+  int index = channel_name[0] != '\0' ? channel_find(channel_name)
+                                      : current_channel;
+  if (index < 0) {
+    log_error("No such channel; /join it first.");
+    return;
+  }
+  Bot *bot = bot_acquire_by_name(bot_name);
+  if (bot == NULL) {
+    log_error("Bot not found.");
+    return;
+  }
+  int joined = bot_join_channel(bot->handle, index) == 0;
+  char message[160];
+  snprintf(message, sizeof(message), "%s %s %s.", bot->name,
+           joined ? "joined" : "is already in", channels[index]->name);
+  schedule_bot_timer(bot);
+  bot_release(bot);
+  update_sidebar();
+  add_chat_message("system", "system", message);
+}
+
+// Function to handle /channels: list the channels with their members,
+// unread messages and request budgets
+void handle_channels() {
+  char info[MAX_CHANNELS * 160 + 64] = "Channels:";
+  size_t length = strlen(info);
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    BotHandle *handles;
+    int bots = channel_members(i, &handles);
+    free(handles);
+    pthread_mutex_lock(&chat_mutex);
+    const Channel *channel = channels[i];
+    char budget[64] = "no request budget";
+    if (channel->request_budget > 0) {
+      snprintf(budget, sizeof(budget), "%d requests/min, %lu skipped",
+               channel->request_budget, channel->requests_limited);
+    }
+    length += snprintf(info + length, sizeof(info) - length,
+                       "\n%c %s: %d bot%s, %lu messages, %d unread, %s",
+                       i == current_channel ? '*'
+                       : channel->joined    ? '+'
+                                            : ' ',
+                       channel->name, bots, bots == 1 ? "" : "s",
+                       channel->seq, channel->unread, budget);
+    pthread_mutex_unlock(&chat_mutex);
+    if (length >= sizeof(info)) {
+      break;
+    }
+  }
+  add_chat_message("system", "system", info);
+}
+
+// Parse and handle slash commands like adding or removing a bot
+void handle_command(char *input) {
+  char command[MAX_QUERY_SIZE];
+  sscanf(input, "%s", command);
+
+  if (strcmp(command, "/addbot") == 0) {
+    char api_type[20], name[50], bot_model[50] = "";
+    if (sscanf(input, "/addbot %19s %49s %49s", api_type, name, bot_model) >=
+        2) {
+      const Provider *provider = provider_find(api_type);
+      if (provider == NULL) {
+        log_error("Unknown provider. Use openai, anthropic or local.");
+        return;
+      }
+      const char *missing = provider_missing_key(provider);
+      if (missing != NULL) {
+        char message[128];
+        snprintf(message, sizeof(message), "No API key for %s: set %s",
+                 provider->name, missing);
+        log_error(message);
+        return;
+      }
+      Bot *existing = bot_acquire_by_name(name);
+      if (existing != NULL) {
+        bot_release(existing);
+        log_error("A bot with that name already exists.");
+        return;
+      }
+      Bot *new_bot = calloc(1, sizeof(Bot));
+      if (new_bot != NULL) {
+        strncpy(new_bot->api_type, api_type, sizeof(new_bot->api_type));
+        strncpy(new_bot->name, name, sizeof(new_bot->name));
+
+        // Collect existing personalities (the prompt only uses ~1000 chars)
+        char existing_personalities[1024] = "";
+        size_t existing_len = 0;
+        pthread_mutex_lock(&bot_mutex);
+        for (int i = 0; i < bot_registry.count; i++) {
+          Bot *bot = bot_registry.slots[bot_registry.order[i]];
+          int written = snprintf(existing_personalities + existing_len,
+                                 sizeof(existing_personalities) - existing_len,
+                                 "%s ", bot->personality);
+          if (written < 0 ||
+              existing_len + written >= sizeof(existing_personalities)) {
+            break;
+          }
+          existing_len += written;
+        }
+        pthread_mutex_unlock(&bot_mutex);
+
+        // Generate unique personality and temperature
+        float temperature;
+        char *personality =
+            generate_unique_bot_personality(&temperature, existing_personalities);
+        if (personality) {
+          snprintf(new_bot->personality, sizeof(new_bot->personality), "%s",
+                   personality);
+          free(personality);
+        } else {
+          strcpy(new_bot->personality, "Default personality");
+        }
+        snprintf(new_bot->model, sizeof(new_bot->model), "%s",
+                 bot_model[0] ? bot_model : provider->default_model);
+
+        if (bot_register(new_bot, temperature) != 0) {
+          free(new_bot);
+          log_error("Failed to add bot.");
+          return;
+        }
+        bot_join_channel(new_bot->handle, current_channel);
+        schedule_bot_timer(new_bot);
+        update_sidebar();
+        char success_message[256];
+        snprintf(success_message, sizeof(success_message),
+                 "Added %s bot '%s' (%s)", api_type, name, new_bot->model);
+        add_chat_message("system", "system", success_message);
+      } else {
+        log_error("Out of memory while adding bot.");
+      }
+    } else {
+      log_error("Invalid command format. Usage: /addbot "
+                "<openai|anthropic|local> <name> [model]");
+    }
+  } else if (strcmp(command, "/kick") == 0) {
+    char botname[50];
+    if (sscanf(input, "/kick %s", botname) == 1) {
+      if (strcmp(botname, "all") == 0) {
+        BotHandle *handles;
+        int count = bot_snapshot(&handles);
+        for (int i = 0; i < count; i++) {
+          Bot *bot = bot_acquire(handles[i]);
+          if (bot != NULL) {
+            remove_bot(bot);
+            bot_release(bot);
+          }
+        }
+        free(handles);
+        update_sidebar();
+        add_chat_message("system", "system", "All bots kicked.");
+      } else {
+        Bot *bot = bot_acquire_by_name(botname);
+        if (bot != NULL) {
+          remove_bot(bot);
+          bot_release(bot);
+          update_sidebar();
+          add_chat_message("system", "system", "Bot kicked.");
+        } else {
+          log_error("Bot not found.");
+        }
+      }
+    } else {
+      log_error("Invalid command format. Usage: /kick <botname|all>");
+    }
+  } else if (strcmp(command, "/nick") == 0) {
+    char new_nick[50];
+    if (sscanf(input, "/nick %49s", new_nick) == 1) {
+      irc_post_event(IRC_EVENT_NICK, user_channels(), user_name, new_nick);
+      strncpy(user_name, new_nick, sizeof(user_name));
+      update_sidebar();
+      add_chat_message("system", "system", "User name changed.");
+    } else {
+      log_error("Invalid command format. Usage: /nick <newname>");
+    }
+  } else if (strcmp(command, "/save") == 0) {
+    char filename[MAX_QUERY_SIZE];
+    if (sscanf(input, "/save %255s", filename) != 1) {
+      strcpy(filename, DEFAULT_ROSTER_FILE);
+    }
+    if (save_roster(filename) == 0) {
+      char message[MAX_QUERY_SIZE + 64];
+      snprintf(message, sizeof(message), "Saved %d bot(s) to %s", bot_count(),
+               filename);
+      add_chat_message("system", "system", message);
+    }
+  } else if (strcmp(command, "/join") == 0) {
+    char name[64];
+    if (sscanf(input, "/join %63s", name) == 1) {
+      handle_join(name);
+    } else {
+      log_error("Invalid command format. Usage: /join <#channel>");
+    }
+  } else if (strcmp(command, "/part") == 0) {
+    char name[64] = "";
+    sscanf(input, "/part %63s", name);
+    handle_part(name);
+  } else if (strcmp(command, "/invite") == 0) {
+    char botname[50], name[64] = "";
+    if (sscanf(input, "/invite %49s %63s", botname, name) >= 1) {
+      handle_invite(botname, name);
+    } else {
+      log_error("Invalid command format. Usage: /invite <botname> [#channel]");
+    }
+  } else if (strcmp(command, "/channels") == 0) {
+    handle_channels();
+  } else if (strcmp(command, "/stats") == 0) {
+    handle_stats();
+  } else if (strcmp(command, "/search") == 0) {
+    const char *terms = input + strlen("/search");
+    while (*terms == ' ') {
+      terms++;
+    }
+    if (*terms != '\0') {
+      handle_search(terms);
+    } else {
+      log_error("Invalid command format. Usage: /search <terms>");
+    }
+  } else if (strcmp(command, "/jump") == 0) {
+    int result;
+    if (sscanf(input, "/jump %d", &result) == 1) {
+      handle_jump(result);
+    } else {
+      log_error("Invalid command format. Usage: /jump <n>");
+    }
+  } else if (strcmp(command, "/budget") == 0) {
+    handle_budget(input + strlen("/budget"));
+  } else if (strcmp(command, "/snapshot") == 0) {
+    char filename[MAX_QUERY_SIZE];
+    if (sscanf(input, "/snapshot %255s", filename) != 1) {
+      strcpy(filename, DEFAULT_SNAPSHOT_FILE);
+    }
+    handle_snapshot(filename);
+  } else if (strcmp(command, "/quit") == 0) {
+    if (!headless) {
+      endwin();
+    }
+    exit(0);
+  } else if (strcmp(command, "/whois") == 0) {
+    char botname[50];
+    if (sscanf(input, "/whois %s", botname) == 1) {
+      handle_whois(botname);
+    } else {
+      log_error("Invalid command format. Usage: /whois <botname>");
+    }
+  } else {
+    log_error("Unknown command.");
+  }
+}
+
+// Token and cost accounting. Every request's token usage is taken from the
+// response's usage block (or estimated at four bytes per token when there
+// is none) and priced per model. Spend is tracked per bot and per
+// provider/model, and budgets throttle and then pause the bots.
+#define BUDGET_THROTTLE_FRACTION 0.8 // Past this, only replies to the human
+
+// Prices in USD per million tokens
+typedef struct {
+  char model[50]; // Model name, or a prefix of model names
+  double input;
+  double output;
+  double cached_input;
+} ModelPrice;
+
+// List prices at the time of writing; override them with --prices
+const ModelPrice default_prices[] = {
+    {"gpt-4o-mini", 0.15, 0.60, 0.075},
+    {"gpt-4o", 2.50, 10.00, 1.25},
+    {"gpt-4-turbo", 10.00, 30.00, 10.00},
+    {"gpt-4", 30.00, 60.00, 30.00},
+    {"gpt-3.5-turbo", 0.50, 1.50, 0.50},
+    {"claude-3-5-sonnet", 3.00, 15.00, 0.30},
+    {"claude-3-5-haiku", 0.80, 4.00, 0.08},
+    {"claude-3-opus", 15.00, 75.00, 1.50},
+    {"claude-3-haiku", 0.25, 1.25, 0.03},
+    {"claude-2", 8.00, 24.00, 8.00},
+    {"claude-instant", 0.80, 2.40, 0.80},
+};
+
+// Usage for one provider/model pair
+typedef struct {
+  char api_type[20];
+  char model[50];
+  unsigned long requests;
+  unsigned long estimated; // Requests whose usage had to be estimated
+  TokenUsage tokens;
+  double cost;
+} UsageStats;
+
+ModelPrice *model_prices = NULL; // Loaded with --prices, checked first
+int model_price_count = 0;
+UsageStats *usage_stats = NULL;
+int usage_stats_count = 0;
+double session_cost = 0;   // Total spend in USD
+double session_budget = 0; // USD, 0 for no limit
+double bot_budget = 0;     // USD per bot, 0 for no limit
+pthread_mutex_t usage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the price for a model: the longest matching name or prefix, from the
+// loaded table first. Returns NULL for unpriced models.
+static const ModelPrice *find_model_price(const char *model) {
+  const ModelPrice *best = NULL;
+  size_t best_length = 0;
+  for (int i = 0; i < model_price_count; i++) {
+    size_t length = strlen(model_prices[i].model);
+    if (length > best_length &&
+        strncmp(model, model_prices[i].model, length) == 0) {
+      best = &model_prices[i];
+      best_length = length;
+    }
+  }
+  if (best != NULL) {
+    return best;
+  }
+  for (size_t i = 0; i < sizeof(default_prices) / sizeof(default_prices[0]);
+       i++) {
+    size_t length = strlen(default_prices[i].model);
+    if (length > best_length &&
+        strncmp(model, default_prices[i].model, length) == 0) {
+      best = &default_prices[i];
+      best_length = length;
+    }
+  }
+  return best;
+}
+
+// Load a price table of the form
+//   {"gpt-4": {"input": 30, "output": 60, "cached_input": 15}, ...}
+// in USD per million tokens. Returns the number of models, or -1 on error.
+int load_prices(const char *filename) {
+  struct json_object *root = json_object_from_file(filename);
+  if (root == NULL || !json_object_is_type(root, json_type_object)) {
+    json_object_put(root);
+    return -1;
+  }
+
+  int loaded = 0;
+  json_object_object_foreach(root, name, entry) {
+    struct json_object *value;
+    ModelPrice price = {0};
+    snprintf(price.model, sizeof(price.model), "%s", name);
+    if (json_object_object_get_ex(entry, "input", &value)) {
+      price.input = json_object_get_double(value);
+    }
+    if (json_object_object_get_ex(entry, "output", &value)) {
+      price.output = json_object_get_double(value);
+    }
+    price.cached_input = price.input;
+    if (json_object_object_get_ex(entry, "cached_input", &value)) {
+      price.cached_input = json_object_get_double(value);
+    }
+
+    ModelPrice *grown =
+        realloc(model_prices, (model_price_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+      break;
+    }
+    model_prices = grown;
+    model_prices[model_price_count++] = price;
+    loaded++;
+  }
+  json_object_put(root);
+  return loaded;
+}
+
+// Read the usage block of a parsed response, in either the OpenAI
+// (prompt/completion tokens) or Anthropic (input/output tokens) form.
+// Returns 1 if one was found.
+int parse_usage(struct json_object *response, TokenUsage *usage) {
+  struct json_object *block, *value, *details;
+  memset(usage, 0, sizeof(*usage));
+  if (!json_object_object_get_ex(response, "usage", &block)) {
+    return 0;
+  }
+  if (json_object_object_get_ex(block, "prompt_tokens", &value)) {
+    usage->prompt = json_object_get_int64(value);
+  }
+  if (json_object_object_get_ex(block, "completion_tokens", &value)) {
+    usage->completion = json_object_get_int64(value);
+  }
+  if (json_object_object_get_ex(block, "prompt_tokens_details", &details) &&
+      json_object_object_get_ex(details, "cached_tokens", &value)) {
+    usage->cached = json_object_get_int64(value);
+  }
+
+  // Anthropic counts cache reads separately from the other input tokens
+  if (json_object_object_get_ex(block, "input_tokens", &value)) {
+    usage->prompt = json_object_get_int64(value);
+  }
+  if (json_object_object_get_ex(block, "output_tokens", &value)) {
+    usage->completion = json_object_get_int64(value);
+  }
+  if (json_object_object_get_ex(block, "cache_read_input_tokens", &value)) {
+    usage->cached = json_object_get_int64(value);
+    usage->prompt += usage->cached;
+  }
+  return 1;
+}
+
+// Account for one request made on a bot's behalf. bot may be NULL. Usage
+// without any tokens (no request was made) is ignored.
+void record_usage(Bot *bot, const char *api_type, const char *model,
+                  const TokenUsage *usage, int estimated) {
+  if (usage->prompt == 0 && usage->completion == 0) {
+    return;
+  }
+
+  double cost = 0;
+  const ModelPrice *price = find_model_price(model);
+  if (price != NULL) {
+    unsigned long cached =
+        usage->cached < usage->prompt ? usage->cached : usage->prompt;
+    cost = ((usage->prompt - cached) * price->input +
+            cached * price->cached_input +
+            usage->completion * price->output) /
+           1e6;
+  }
+
+  char notice[256] = "";
+  pthread_mutex_lock(&usage_mutex);
+  UsageStats *stats = NULL;
+  for (int i = 0; i < usage_stats_count; i++) {
+    if (strcmp(usage_stats[i].api_type, api_type) == 0 &&
+        strcmp(usage_stats[i].model, model) == 0) {
+      stats = &usage_stats[i];
+      break;
+    }
+  }
+  if (stats == NULL) {
+    UsageStats *grown =
+        realloc(usage_stats, (usage_stats_count + 1) * sizeof(*grown));
+    if (grown != NULL) {
+      usage_stats = grown;
+      stats = &usage_stats[usage_stats_count++];
+      memset(stats, 0, sizeof(*stats));
+      snprintf(stats->api_type, sizeof(stats->api_type), "%s", api_type);
+      snprintf(stats->model, sizeof(stats->model), "%s", model);
+    }
+  }
+  if (stats != NULL) {
+    stats->requests++;
+    stats->estimated += estimated;
+    stats->tokens.prompt += usage->prompt;
+    stats->tokens.completion += usage->completion;
+    stats->tokens.cached += usage->cached;
+    stats->cost += cost;
+  }
+
+  // Announce when a budget starts throttling or pausing the bots
+  double before = session_cost;
+  session_cost += cost;
+  if (session_budget > 0) {
+    if (before < session_budget && session_cost >= session_budget) {
+      snprintf(notice, sizeof(notice),
+               "Session budget of $%.2f reached: bots are paused (raise it "
+               "with /budget)",
+               session_budget);
+    } else if (before < session_budget * BUDGET_THROTTLE_FRACTION &&
+               session_cost >= session_budget * BUDGET_THROTTLE_FRACTION) {
+      snprintf(notice, sizeof(notice),
+               "%.0f%% of the $%.2f session budget used: bots only reply to "
+               "you now",
+               BUDGET_THROTTLE_FRACTION * 100, session_budget);
+    }
+  }
+  if (bot != NULL) {
+    before = bot->cost;
+    bot->tokens.prompt += usage->prompt;
+    bot->tokens.completion += usage->completion;
+    bot->tokens.cached += usage->cached;
+    bot->cost += cost;
+    if (notice[0] == '\0' && bot_budget > 0 && before < bot_budget &&
+        bot->cost >= bot_budget) {
+      snprintf(notice, sizeof(notice),
+               "%s reached the $%.2f per-bot budget and is paused", bot->name,
+               bot_budget);
+    }
+  }
+  pthread_mutex_unlock(&usage_mutex);
+
+  if (notice[0] != '\0') {
+    add_chat_message("system", "system", notice);
+  }
+}
+
+// Whether the budgets let a bot make another request. Once past the
+// throttle fraction only essential requests (replies to the human) go
+// through; past the budget nothing does.
+int budget_allows(const Bot *bot, int essential) {
+  pthread_mutex_lock(&usage_mutex);
+  double session_used = session_budget > 0 ? session_cost / session_budget : 0;
+  double bot_used = bot_budget > 0 ? bot->cost / bot_budget : 0;
+  pthread_mutex_unlock(&usage_mutex);
+  double used = session_used > bot_used ? session_used : bot_used;
+  if (used >= 1.0) {
+    return 0;
+  }
+  return essential || used < BUDGET_THROTTLE_FRACTION;
+}
+
+// Append a bot's token and cost figures to a /whois report
+void bot_usage_summary(const Bot *bot, char *buffer, size_t size) {
+  pthread_mutex_lock(&usage_mutex);
+  int written = snprintf(
+      buffer, size, "Tokens: prompt %lu (cached %lu), completion %lu\nCost: $%.4f",
+      bot->tokens.prompt, bot->tokens.cached, bot->tokens.completion,
+      bot->cost);
+  if (written >= 0 && (size_t)written < size && bot_budget > 0) {
+    snprintf(buffer + written, size - written, " of $%.2f budget",
+             bot_budget);
+  }
+  pthread_mutex_unlock(&usage_mutex);
+  strncat(buffer, "\n", size - strlen(buffer) - 1);
+}
+
+// Show spend per provider/model in the chat window
+void handle_cost_stats() {
+  char info[MAX_RESPONSE_SIZE];
+  pthread_mutex_lock(&usage_mutex);
+  int len = snprintf(info, sizeof(info), "Spend: $%.4f", session_cost);
+  if (session_budget > 0) {
+    len += snprintf(info + len, sizeof(info) - len, " of $%.2f (%.0f%%)",
+                    session_budget, session_cost / session_budget * 100);
+  }
+  if (bot_budget > 0 && len < (int)sizeof(info)) {
+    len += snprintf(info + len, sizeof(info) - len, ", $%.2f per bot",
+                    bot_budget);
+  }
+  for (int i = 0; i < usage_stats_count && len < (int)sizeof(info); i++) {
+    UsageStats *stats = &usage_stats[i];
+    len += snprintf(info + len, sizeof(info) - len,
+                    "\n%s/%s: %lu requests, prompt %lu (cached %lu), "
+                    "completion %lu, $%.4f%s",
+                    stats->api_type, stats->model, stats->requests,
+                    stats->tokens.prompt, stats->tokens.cached,
+                    stats->tokens.completion, stats->cost,
+                    find_model_price(stats->model) ? "" : " (unpriced)");
+    if (stats->estimated > 0 && len < (int)sizeof(info)) {
+      len += snprintf(info + len, sizeof(info) - len, ", %lu estimated",
+                      stats->estimated);
+    }
+  }
+  pthread_mutex_unlock(&usage_mutex);
+  add_chat_message("system", "system", info);
+}
+
+// /budget #channel <requests/min>: limit how many bot requests a channel
+// may start per minute; 0 removes the limit. Replies to humans always go
+// ahead, but use up the budget.
+static void handle_channel_budget(const char *args) {
+  char name[64];
+  int budget;
+  if (sscanf(args, " %63s %d", name, &budget) != 2 || budget < 0) {
+    log_error("Invalid command format. Usage: /budget <#channel> "
+              "<requests/min>");
+    return;
+  }
+  int index = channel_find(name);
+  if (index < 0) {
+    log_error("No such channel.");
+    return;
+  }
+  pthread_mutex_lock(&chat_mutex);
+  channels[index]->request_budget = budget;
+  channels[index]->request_tokens = budget;
+  channels[index]->refill_us = monotonic_us();
+  pthread_mutex_unlock(&chat_mutex);
+  char message[128];
+  snprintf(message, sizeof(message), "%s: %d bot requests/min (0 = no limit)",
+           channels[index]->name, budget);
+  add_chat_message("system", "system", message);
+}
+
+// /budget [bot] [usd]: show the budgets, or set the session (or per-bot)
+// budget in USD; 0 removes it
+void handle_budget(const char *args) {
+  if (args[strspn(args, " ")] == '#') {
+    handle_channel_budget(args);
+    return;
+  }
+  char scope[16] = "";
+  double amount;
+  int per_bot = sscanf(args, " %15s %lf", scope, &amount) == 2 &&
+                strcmp(scope, "bot") == 0;
+  if (per_bot || sscanf(args, " %lf", &amount) == 1) {
+    if (amount < 0) {
+      log_error("Invalid command format. Usage: /budget [bot] <usd>");
+      return;
+    }
+    pthread_mutex_lock(&usage_mutex);
+    if (per_bot) {
+      bot_budget = amount;
+    } else {
+      session_budget = amount;
+    }
+    pthread_mutex_unlock(&usage_mutex);
+  } else if (args[strspn(args, " ")] != '\0') {
+    log_error("Invalid command format. Usage: /budget [bot] <usd>");
+    return;
+  }
+
+  char message[256];
+  pthread_mutex_lock(&usage_mutex);
+  snprintf(message, sizeof(message),
+           "Budget: session $%.2f (spent $%.4f), per bot $%.2f (0 = no "
+           "limit)",
+           session_budget, session_cost, bot_budget);
+  pthread_mutex_unlock(&usage_mutex);
+  add_chat_message("system", "system", message);
+}
+
+// Session snapshots (/snapshot, --restore). A snapshot holds the bots with
+// their memories and long-term stores, every channel's history and the
+// message and spend counters, so a room can be restarted without a single
+// API call. The file is a header followed by tagged, length-prefixed
+// sections in the host's byte order. Readers skip sections they don't
+// know, so SNAPSHOT_VERSION only changes when the layout of an existing
+// section does. Restoring maps the file and copies straight out of it;
+// long-term memory embeddings are copied rather than recomputed.
+#define SNAPSHOT_MAGIC "LIERCSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // SNAPSHOT_BYTE_ORDER as the saving host stores it
+  int64_t created;     // Unix time
+} SnapshotHeader;
+
+typedef enum {
+  SNAPSHOT_USAGE = 1, // Tokens and spend for one provider/model
+  SNAPSHOT_CHANNEL,   // A channel and its history
+  SNAPSHOT_BOT,       // A bot, its memory and its long-term store
+  SNAPSHOT_SESSION    // User name, channel shown and message counters
+} SnapshotTag;
+
+typedef struct {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t length; // Payload bytes following the section header
+} SnapshotSection;
+
+// Payload of the section being written
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+  int failed; // Out of memory
+} SnapshotWriter;
+
+static void snapshot_put(SnapshotWriter *w, const void *data, size_t length) {
+  if (w->failed || length == 0) {
+    return;
+  }
+  if (w->length + length > w->capacity) {
+    size_t capacity = w->capacity ? w->capacity : 4096;
+    while (capacity < w->length + length) {
+      capacity *= 2;
+    }
+    char *grown = realloc(w->data, capacity);
+    if (grown == NULL) {
+      w->failed = 1;
+      return;
+    }
+    w->data = grown;
+    w->capacity = capacity;
+  }
+  memcpy(w->data + w->length, data, length);
+  w->length += length;
+}
+
+static void snapshot_put_u32(SnapshotWriter *w, uint32_t value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+static void snapshot_put_u64(SnapshotWriter *w, uint64_t value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+static void snapshot_put_f64(SnapshotWriter *w, double value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+// Strings are stored as a length and the bytes, without the NUL
+static void snapshot_put_string(SnapshotWriter *w, const char *text) {
+  uint32_t length = strlen(text);
+  snapshot_put_u32(w, length);
+  snapshot_put(w, text, length);
+}
+
+// Write the section built up in w and empty w for the next one. Returns
+// -1 on failure, with errno set (ENOMEM if the section didn't fit in memory).
+static int snapshot_write_section(FILE *file, SnapshotTag tag,
+                                  SnapshotWriter *w) {
+  SnapshotSection section = {tag, 0, w->length};
+  int ok = 0;
+  if (w->failed) {
+    errno = ENOMEM;
+  } else {
+    ok = fwrite(&section, sizeof(section), 1, file) == 1 &&
+         (w->length == 0 || fwrite(w->data, w->length, 1, file) == 1);
+  }
+  w->length = 0;
+  w->failed = 0;
+  return ok ? 0 : -1;
+}
+
+// Payload of the section being read, in the mapped file
+typedef struct {
+  const char *data;
+  size_t length;
+  size_t offset;
+  int failed; // Ran past the end of the section
+} SnapshotReader;
+
+static const void *snapshot_get(SnapshotReader *r, size_t length) {
+  if (r->failed || length > r->length - r->offset) {
+    r->failed = 1;
+    return NULL;
+  }
+  const void *data = r->data + r->offset;
+  r->offset += length;
+  return data;
+}
+
+static uint32_t snapshot_get_u32(SnapshotReader *r) {
+  uint32_t value = 0;
+  const void *data = snapshot_get(r, sizeof(value));
+  if (data != NULL) {
+    memcpy(&value, data, sizeof(value));
+  }
+  return value;
+}
+
+static uint64_t snapshot_get_u64(SnapshotReader *r) {
+  uint64_t value = 0;
+  const void *data = snapshot_get(r, sizeof(value));
+  if (data != NULL) {
+    memcpy(&value, data, sizeof(value));
+  }
+  return value;
+}
+
+static double snapshot_get_f64(SnapshotReader *r) {
+  double value = 0;
+  const void *data = snapshot_get(r, sizeof(value));
+  if (data != NULL) {
+    memcpy(&value, data, sizeof(value));
+  }
+  return value;
+}
+
+// Read a string into a buffer of size bytes, cutting it to fit
+static void snapshot_get_string(SnapshotReader *r, char *text, size_t size) {
+  uint32_t length = snapshot_get_u32(r);
+  const char *data = snapshot_get(r, length);
+  if (data == NULL) {
+    length = 0;
+  } else if (length >= size) {
+    length = size - 1;
+  }
+  if (length > 0) {
+    memcpy(text, data, length);
+  }
+  text[length] = '\0';
+}
+
+// Add a bot to the section being written. Returns -1 if it was kicked
+// while being saved.
+static int snapshot_put_bot(SnapshotWriter *w, Bot *bot) {
+  pthread_mutex_lock(&bot_mutex);
+  if (!bot_handle_valid_locked(bot->handle)) {
+    pthread_mutex_unlock(&bot_mutex);
+    return -1;
+  }
+  uint32_t member_of = bot_registry.channels[bot->handle.index];
+  snapshot_put_string(w, bot->name);
+  snapshot_put_string(w, bot->api_type);
+  snapshot_put_string(w, bot->model);
+  snapshot_put_string(w, bot->personality);
+  snapshot_put_f64(w, bot_registry.temperature[bot->handle.index]);
+  snapshot_put_string(w, bot->summary);
+  snapshot_put_u32(w, bot->unsummarized);
+  snapshot_put_u32(w, bot->total_messages);
+  snapshot_put_u32(w, __builtin_popcount(member_of));
+  for (; member_of != 0; member_of &= member_of - 1) {
+    snapshot_put_string(w, channels[__builtin_ctz(member_of)]->name);
+  }
+  // Recent interactions, oldest first
+  snapshot_put_u32(w, bot->memory_count);
+  for (int m = 0; m < bot->memory_count; m++) {
+    int index = (bot->memory_index - bot->memory_count + m +
+                 MAX_MEMORY_ENTRIES) %
+                MAX_MEMORY_ENTRIES;
+    snapshot_put_string(w, bot->memory[index]);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+
+  pthread_mutex_lock(&usage_mutex);
+  snapshot_put_u64(w, bot->tokens.prompt);
+  snapshot_put_u64(w, bot->tokens.completion);
+  snapshot_put_u64(w, bot->tokens.cached);
+  snapshot_put_f64(w, bot->cost);
+  pthread_mutex_unlock(&usage_mutex);
+
+  // The long-term store as it sits in memory: the ring position, every
+  // embedding in one block, then the texts
+  MemoryStore *store = &bot->long_term;
+  pthread_rwlock_rdlock(&store->lock);
+  snapshot_put_u32(w, EMBEDDING_DIM);
+  snapshot_put_u32(w, store->count);
+  snapshot_put_u32(w, store->next);
+  snapshot_put_u64(w, store->total);
+  snapshot_put(w, store->vectors, store->count * sizeof(*store->vectors));
+  for (int i = 0; i < store->count; i++) {
+    snapshot_put_string(w, store->texts[i]);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+// Save the session to filename, replacing it only once the whole snapshot
+// is written. Returns the number of bots saved, or -1 on failure with errno
+// from the step that failed.
+int save_snapshot(const char *filename) {
+  char temp_name[MAX_QUERY_SIZE + 8];
+  snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+  FILE *file = fopen(temp_name, "wb");
+  if (file == NULL) {
+    return -1;
+  }
+
+  SnapshotHeader header = {0};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.created = time(NULL);
+  int status = fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+  SnapshotWriter w = {0};
+
+  pthread_mutex_lock(&usage_mutex);
+  for (int i = 0; i < usage_stats_count && status == 0; i++) {
+    const UsageStats *stats = &usage_stats[i];
+    snapshot_put_string(&w, stats->api_type);
+    snapshot_put_string(&w, stats->model);
+    snapshot_put_u64(&w, stats->requests);
+    snapshot_put_u64(&w, stats->estimated);
+    snapshot_put_u64(&w, stats->tokens.prompt);
+    snapshot_put_u64(&w, stats->tokens.completion);
+    snapshot_put_u64(&w, stats->tokens.cached);
+    snapshot_put_f64(&w, stats->cost);
+    status = snapshot_write_section(file, SNAPSHOT_USAGE, &w);
+  }
+  double cost = session_cost;
+  pthread_mutex_unlock(&usage_mutex);
+
+  // Channels go before the bots that are members of them
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count && status == 0; i++) {
+    pthread_mutex_lock(&chat_mutex);
+    const Channel *channel = channels[i];
+    unsigned long stored = channel->total < CHAT_HISTORY_LIMIT
+                               ? channel->total
+                               : CHAT_HISTORY_LIMIT;
+    snapshot_put_string(&w, channel->name);
+    snapshot_put_u32(&w, channel->joined);
+    snapshot_put_u32(&w, channel->unread);
+    snapshot_put_u32(&w, channel->request_budget);
+    snapshot_put_u64(&w, channel->requests_limited);
+    snapshot_put_u64(&w, channel->total);
+    snapshot_put_u64(&w, channel->seq);
+    snapshot_put_u32(&w, stored);
+    for (unsigned long n = channel->total - stored; n < channel->total; n++) {
+      const ChatMessage *entry = &channel->history[n % CHAT_HISTORY_LIMIT];
+      snapshot_put_string(&w, entry->timestamp);
+      snapshot_put_string(&w, entry->role);
+      snapshot_put_string(&w, entry->display_name);
+      snapshot_put_string(&w, entry->content);
+    }
+    pthread_mutex_unlock(&chat_mutex);
+    status = snapshot_write_section(file, SNAPSHOT_CHANNEL, &w);
+  }
+
+  BotHandle *handles;
+  int bot_total = bot_snapshot(&handles);
+  int saved = 0;
+  if (handles == NULL && status == 0) {
+    errno = ENOMEM;
+    status = -1;
+  }
+  for (int i = 0; i < bot_total && status == 0; i++) {
+    Bot *bot = bot_acquire(handles[i]);
+    if (bot == NULL) {
+      continue; // Kicked since the snapshot was taken
+    }
+    int kept = snapshot_put_bot(&w, bot) == 0;
+    bot_release(bot);
+    if (kept) {
+      status = snapshot_write_section(file, SNAPSHOT_BOT, &w);
+      saved++;
+    }
+  }
+  free(handles);
+
+  pthread_mutex_lock(&chat_mutex);
+  snapshot_put_string(&w, user_name);
+  snapshot_put_string(&w, channels[current_channel]->name);
+  pthread_mutex_unlock(&chat_mutex);
+  snapshot_put_u64(&w, messages_sent);
+  snapshot_put_u64(&w, messages_received);
+  snapshot_put_f64(&w, cost);
+  if (status == 0) {
+    status = snapshot_write_section(file, SNAPSHOT_SESSION, &w);
+  }
+  free(w.data);
+
+  // Keep the first error: the cleanup below may overwrite errno
+  int error = status == 0 ? 0 : errno != 0 ? errno : EIO;
+  if ((fflush(file) != 0 || fsync(fileno(file)) != 0) && error == 0) {
+    error = errno;
+  }
+  if (fclose(file) != 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 && rename(temp_name, filename) != 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    unlink(temp_name);
+    errno = error;
+    return -1;
+  }
+  return saved;
+}
+
+static void snapshot_load_usage(SnapshotReader *r) {
+  UsageStats stats = {0};
+  snapshot_get_string(r, stats.api_type, sizeof(stats.api_type));
+  snapshot_get_string(r, stats.model, sizeof(stats.model));
+  stats.requests = snapshot_get_u64(r);
+  stats.estimated = snapshot_get_u64(r);
+  stats.tokens.prompt = snapshot_get_u64(r);
+  stats.tokens.completion = snapshot_get_u64(r);
+  stats.tokens.cached = snapshot_get_u64(r);
+  stats.cost = snapshot_get_f64(r);
+  if (r->failed) {
+    return;
+  }
+  pthread_mutex_lock(&usage_mutex);
+  UsageStats *grown =
+      realloc(usage_stats, (usage_stats_count + 1) * sizeof(*grown));
+  if (grown != NULL) {
+    usage_stats = grown;
+    usage_stats[usage_stats_count++] = stats;
+  }
+  pthread_mutex_unlock(&usage_mutex);
+}
+
+// Restore a channel, replacing its history. Returns -1 if the section is
+// damaged or the channel can't be opened.
+static int snapshot_load_channel(SnapshotReader *r) {
+  char name[sizeof(channels[0]->name)];
+  snapshot_get_string(r, name, sizeof(name));
+  int joined = snapshot_get_u32(r);
+  int unread = snapshot_get_u32(r);
+  int request_budget = snapshot_get_u32(r);
+  unsigned long requests_limited = snapshot_get_u64(r);
+  unsigned long total = snapshot_get_u64(r);
+  unsigned long seq = snapshot_get_u64(r);
+  uint32_t stored = snapshot_get_u32(r);
+  if (r->failed || stored > CHAT_HISTORY_LIMIT || stored > total) {
+    return -1;
+  }
+  ChatMessage *history = calloc(stored ? stored : 1, sizeof(ChatMessage));
+  if (history == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < stored; i++) {
+    ChatMessage *entry = &history[i];
+    snapshot_get_string(r, entry->timestamp, sizeof(entry->timestamp));
+    snapshot_get_string(r, entry->role, sizeof(entry->role));
+    snapshot_get_string(r, entry->display_name, sizeof(entry->display_name));
+    snapshot_get_string(r, entry->content, sizeof(entry->content));
+  }
+  int index = r->failed ? -1 : channel_open(name);
+  if (index < 0) {
+    free(history);
+    return -1;
+  }
+
+  pthread_mutex_lock(&chat_mutex);
+  Channel *channel = channels[index];
+  memset(channel->history, 0, sizeof(channel->history));
+  for (uint32_t i = 0; i < stored; i++) {
+    channel->history[(total - stored + i) % CHAT_HISTORY_LIMIT] = history[i];
+  }
+  channel->total = total;
+  channel->seq = seq;
+  channel->scroll_position = total % CHAT_HISTORY_LIMIT;
+  channel->joined = joined;
+  channel->unread = unread;
+  channel->request_budget = request_budget;
+  channel->request_tokens = request_budget;
+  channel->requests_limited = requests_limited;
+  pthread_mutex_unlock(&chat_mutex);
+
+  // The messages are searchable again, though older ones stay forgotten
+  for (uint32_t i = 0; i < stored; i++) {
+    if (strcmp(history[i].role, "system") != 0) {
+      search_index_add(index, total - stored + i, -1, history[i].display_name,
+                       history[i].content);
+    }
+  }
+  free(history);
+  return 0;
+}
+
+// Restore a bot. Returns -1 if the section is damaged or the name is taken.
+static int snapshot_load_bot(SnapshotReader *r) {
+  Bot *bot = calloc(1, sizeof(Bot));
+  if (bot == NULL) {
+    return -1;
+  }
+  snapshot_get_string(r, bot->name, sizeof(bot->name));
+  snapshot_get_string(r, bot->api_type, sizeof(bot->api_type));
+  snapshot_get_string(r, bot->model, sizeof(bot->model));
+  snapshot_get_string(r, bot->personality, sizeof(bot->personality));
+  float temperature = (float)snapshot_get_f64(r);
+  snapshot_get_string(r, bot->summary, sizeof(bot->summary));
+  bot->unsummarized = snapshot_get_u32(r);
+  bot->total_messages = snapshot_get_u32(r);
+
+  uint32_t member_count = snapshot_get_u32(r);
+  char member_of[MAX_CHANNELS][sizeof(channels[0]->name)];
+  for (uint32_t c = 0; c < member_count && !r->failed; c++) {
+    char name[sizeof(channels[0]->name)];
+    snapshot_get_string(r, name, sizeof(name));
+    if (c < MAX_CHANNELS) {
+      strcpy(member_of[c], name);
+    }
+  }
+
+  uint32_t memory_count = snapshot_get_u32(r);
+  for (uint32_t m = 0; m < memory_count && !r->failed; m++) {
+    char entry[MAX_MEMORY_ENTRY_LENGTH];
+    snapshot_get_string(r, entry, sizeof(entry));
+    // Only the newest MAX_MEMORY_ENTRIES fit in the ring
+    strcpy(bot->memory[m % MAX_MEMORY_ENTRIES], entry);
+  }
+  bot->memory_count =
+      memory_count < MAX_MEMORY_ENTRIES ? memory_count : MAX_MEMORY_ENTRIES;
+  bot->memory_index = memory_count % MAX_MEMORY_ENTRIES;
+
+  bot->tokens.prompt = snapshot_get_u64(r);
+  bot->tokens.completion = snapshot_get_u64(r);
+  bot->tokens.cached = snapshot_get_u64(r);
+  bot->cost = snapshot_get_f64(r);
+
+  // Embeddings made with another dimension are recomputed from the texts
+  uint32_t dimension = snapshot_get_u32(r);
+  uint32_t stored = snapshot_get_u32(r);
+  uint32_t next = snapshot_get_u32(r);
+  unsigned long total = snapshot_get_u64(r);
+  if (stored > LONG_TERM_MEMORY_LIMIT || next >= LONG_TERM_MEMORY_LIMIT) {
+    r->failed = 1;
+  }
+  const int8_t *saved_vectors =
+      r->failed ? NULL : snapshot_get(r, (size_t)stored * dimension);
+  int capacity = 64;
+  while (capacity < (int)stored) {
+    capacity *= 2;
+  }
+  int8_t(*vectors)[EMBEDDING_DIM] =
+      malloc(capacity * sizeof(*vectors));
+  char(*texts)[LONG_TERM_ENTRY_LENGTH] = malloc(capacity * sizeof(*texts));
+  for (uint32_t i = 0; i < stored && !r->failed && texts != NULL; i++) {
+    snapshot_get_string(r, texts[i], LONG_TERM_ENTRY_LENGTH);
+  }
+  if (r->failed || bot->name[0] == '\0' || vectors == NULL || texts == NULL ||
+      bot_register(bot, temperature) != 0) {
+    free(vectors);
+    free(texts);
+    free(bot);
+    return -1;
+  }
+
+  MemoryStore *store = &bot->long_term;
+  if (dimension == EMBEDDING_DIM) {
+    if (stored > 0) {
+      memcpy(vectors, saved_vectors, stored * sizeof(*vectors));
+    }
+    pthread_rwlock_wrlock(&store->lock);
+    store->vectors = vectors;
+    store->texts = texts;
+    store->count = stored;
+    store->capacity = capacity;
+    store->next = next;
+    store->total = total;
+    pthread_rwlock_unlock(&store->lock);
+  } else {
+    // Oldest first, so the ring ends up in the same order
+    for (uint32_t i = 0; i < stored; i++) {
+      uint32_t slot = stored == LONG_TERM_MEMORY_LIMIT
+                          ? (next + i) % LONG_TERM_MEMORY_LIMIT
+                          : i;
+      memory_store_add(store, texts[slot]);
+    }
+    free(vectors);
+    free(texts);
+  }
+
+  for (uint32_t c = 0; c < member_count && c < MAX_CHANNELS; c++) {
+    int index = channel_open(member_of[c]);
+    if (index >= 0) {
+      bot_join_channel(bot->handle, index);
+    }
+  }
+  return 0;
+}
+
+static void snapshot_load_session(SnapshotReader *r) {
+  char name[sizeof(user_name)], shown[sizeof(channels[0]->name)];
+  snapshot_get_string(r, name, sizeof(name));
+  snapshot_get_string(r, shown, sizeof(shown));
+  unsigned long sent = snapshot_get_u64(r);
+  unsigned long received = snapshot_get_u64(r);
+  double cost = snapshot_get_f64(r);
+  if (r->failed) {
+    return;
+  }
+  snprintf(user_name, sizeof(user_name), "%s", name);
+  messages_sent = sent;
+  messages_received = received;
+  pthread_mutex_lock(&usage_mutex);
+  session_cost = cost;
+  pthread_mutex_unlock(&usage_mutex);
+  int index = channel_find(shown);
+  if (index >= 0) {
+    switch_channel(index);
+  }
+}
+
+// Restore a session saved by save_snapshot: its channels, bots and
+// counters. Bots whose names are already taken are skipped. Returns the
+// number of bots restored, or -1 if the file can't be read or was written
+// by a newer version or another byte order.
+int load_snapshot(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+    close(fd);
+    return -1;
+  }
+  size_t size = st.st_size;
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise((void *)data, size, MADV_SEQUENTIAL); // Read once, front to back
+
+  SnapshotHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version == 0 || header.version > SNAPSHOT_VERSION ||
+      header.byte_order != SNAPSHOT_BYTE_ORDER) {
+    munmap((void *)data, size);
+    return -1;
+  }
+
+  int restored = 0;
+  size_t offset = sizeof(header);
+  while (size - offset >= sizeof(SnapshotSection)) {
+    SnapshotSection section;
+    memcpy(&section, data + offset, sizeof(section));
+    offset += sizeof(section);
+    if (section.length > size - offset) {
+      break; // Cut short; keep what was complete
+    }
+    SnapshotReader r = {data + offset, section.length, 0, 0};
+    switch (section.tag) {
+    case SNAPSHOT_USAGE:
+      snapshot_load_usage(&r);
+      break;
+    case SNAPSHOT_CHANNEL:
+      snapshot_load_channel(&r);
+      break;
+    case SNAPSHOT_BOT:
+      restored += snapshot_load_bot(&r) == 0;
+      break;
+    case SNAPSHOT_SESSION:
+      snapshot_load_session(&r);
+      break;
+    default:
+      break; // Added by a later version
+    }
+    offset += section.length;
+  }
+  munmap((void *)data, size);
+  return restored;
+}
+
+// Function to handle /snapshot: save the session for --restore
+void handle_snapshot(const char *filename) {
+  uint64_t start = monotonic_us();
+  int saved = save_snapshot(filename);
+  char message[MAX_QUERY_SIZE * 2 + 128];
+  if (saved < 0) {
+    snprintf(message, sizeof(message), "Failed to write snapshot %.200s: %s",
+             filename, errno == ENOMEM ? "out of memory" : strerror(errno));
+    log_error(message);
+    return;
+  }
+  snprintf(message, sizeof(message),
+           "Saved %d bot(s) and %d channel(s) to %.200s in %.1f ms; restart "
+           "with --restore %.200s",
+           saved, __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE), filename,
+           (monotonic_us() - start) / 1000.0, filename);
+  add_chat_message("system", "system", message);
+}
+
+// Finished API requests by provider, kind ("reply" or "classify") and
+// status: the HTTP status code, "cancelled" or "error" for transport failures
+typedef struct {
+  char provider[20];
+  const char *kind;
+  char status[16];
+  unsigned long count;
+} RequestCounter;
+
+RequestCounter *request_counters = NULL;
+int request_counter_count = 0;
+pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void record_request_status(CURL *curl, CURLcode res, const char *provider,
+                           const char *kind) {
+  char status[16];
+  if (res == CURLE_ABORTED_BY_CALLBACK) {
+    strcpy(status, "cancelled");
+  } else if (res != CURLE_OK) {
+    strcpy(status, "error");
+  } else {
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    snprintf(status, sizeof(status), "%ld", code);
+  }
+
+  pthread_mutex_lock(&metrics_mutex);
+  RequestCounter *counter = NULL;
+  for (int i = 0; i < request_counter_count; i++) {
+    if (request_counters[i].kind == kind &&
+        strcmp(request_counters[i].provider, provider) == 0 &&
+        strcmp(request_counters[i].status, status) == 0) {
+      counter = &request_counters[i];
+      break;
+    }
+  }
+  if (counter == NULL) {
+    RequestCounter *grown = realloc(
+        request_counters, (request_counter_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&metrics_mutex);
+      return;
+    }
+    request_counters = grown;
+    counter = &request_counters[request_counter_count++];
+    snprintf(counter->provider, sizeof(counter->provider), "%s", provider);
+    counter->kind = kind;
+    strcpy(counter->status, status);
+    counter->count = 0;
+  }
+  counter->count++;
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+// Requests that take no explicit length still need one for the Messages API
+#define ANTHROPIC_MAX_TOKENS 1024
+
+static struct curl_slist *openai_auth(struct curl_slist *headers,
+                                      const char *api_key) {
+  if (api_key != NULL && api_key[0] != '\0') {
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
+             api_key);
+    headers = curl_slist_append(headers, auth_header);
+  }
+  return headers;
+}
+
+static int openai_build(const char *model, const char *system,
+                        const char *user, int max_tokens, float temperature,
+                        int stream, char *json, size_t size) {
+  char escaped_model[100];
+  json_escape_string(model, escaped_model, sizeof(escaped_model));
+  char limit[32] = "";
+  if (max_tokens > 0) {
+    snprintf(limit, sizeof(limit), "\"max_tokens\": %d, ", max_tokens);
+  }
+  // Usage only comes with a stream if it's asked for
+  int written = snprintf(
+      json, size,
+      "{\"model\": \"%s\", \"messages\": ["
+      "{\"role\": \"system\", \"content\": \"%s\"}, "
+      "{\"role\": \"user\", \"content\": \"%s\"}], "
+      "%s\"temperature\": %.2f, \"stream\": %s%s}",
+      escaped_model, system, user, limit, temperature,
+      stream ? "true" : "false",
+      stream ? ", \"stream_options\": {\"include_usage\": true}" : "");
+  return (written < 0 || (size_t)written >= size) ? -1 : written;
+}
+
+static const char *openai_reply(struct json_object *response) {
+  struct json_object *choices, *choice, *message, *content;
+  if (json_object_object_get_ex(response, "choices", &choices) &&
+      json_object_get_type(choices) == json_type_array &&
+      (choice = json_object_array_get_idx(choices, 0)) != NULL &&
+      json_object_object_get_ex(choice, "message", &message) &&
+      json_object_object_get_ex(message, "content", &content)) {
+    return json_object_get_string(content);
+  }
+  return NULL;
+}
+
+static const char *openai_stream_event(struct json_object *event,
+                                       TokenUsage *usage) {
+  // Only the last chunk carries usage; the others have "usage": null
+  TokenUsage counted;
+  if (parse_usage(event, &counted) &&
+      (counted.prompt > 0 || counted.completion > 0)) {
+    *usage = counted;
+  }
+  struct json_object *choices, *choice, *delta, *content;
+  if (json_object_object_get_ex(event, "choices", &choices) &&
+      json_object_get_type(choices) == json_type_array &&
+      (choice = json_object_array_get_idx(choices, 0)) != NULL &&
+      json_object_object_get_ex(choice, "delta", &delta) &&
+      json_object_object_get_ex(delta, "content", &content)) {
+    return json_object_get_string(content);
+  }
+  return NULL;
+}
+
+static struct curl_slist *anthropic_auth(struct curl_slist *headers,
+                                         const char *api_key) {
+  if (api_key != NULL && api_key[0] != '\0') {
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "x-api-key: %s", api_key);
+    headers = curl_slist_append(headers, auth_header);
+  }
+  return curl_slist_append(headers, "anthropic-version: 2023-06-01");
+}
+
+static int anthropic_build(const char *model, const char *system,
+                           const char *user, int max_tokens,
+                           float temperature, int stream, char *json,
+                           size_t size) {
+  char escaped_model[100];
+  json_escape_string(model, escaped_model, sizeof(escaped_model));
+  // The system prompt is a top-level field, the length is required and the
+  // temperature only goes up to 1
+  int written = snprintf(
+      json, size,
+      "{\"model\": \"%s\", \"system\": \"%s\", \"messages\": ["
+      "{\"role\": \"user\", \"content\": \"%s\"}], "
+      "\"max_tokens\": %d, \"temperature\": %.2f, \"stream\": %s}",
+      escaped_model, system, user,
+      max_tokens > 0 ? max_tokens : ANTHROPIC_MAX_TOKENS,
+      temperature < 1.0f ? temperature : 1.0f, stream ? "true" : "false");
+  return (written < 0 || (size_t)written >= size) ? -1 : written;
+}
+
+static const char *anthropic_reply(struct json_object *response) {
+  struct json_object *content, *block, *type, *text;
+  if (!json_object_object_get_ex(response, "content", &content) ||
+      json_object_get_type(content) != json_type_array) {
+    return NULL;
+  }
+  for (size_t i = 0; i < json_object_array_length(content); i++) {
+    block = json_object_array_get_idx(content, i);
+    if (json_object_object_get_ex(block, "type", &type) &&
+        strcmp(json_object_get_string(type), "text") == 0 &&
+        json_object_object_get_ex(block, "text", &text)) {
+      return json_object_get_string(text);
+    }
+  }
+  return NULL;
+}
+
+static const char *anthropic_stream_event(struct json_object *event,
+                                          TokenUsage *usage) {
+  struct json_object *type, *message, *delta, *text;
+  if (!json_object_object_get_ex(event, "type", &type)) {
+    return NULL;
+  }
+  const char *name = json_object_get_string(type);
+  TokenUsage counted;
+  if (strcmp(name, "message_start") == 0) {
+    // Input tokens come first, with the message
+    if (json_object_object_get_ex(event, "message", &message) &&
+        parse_usage(message, &counted)) {
+      usage->prompt = counted.prompt;
+      usage->cached = counted.cached;
+    }
+  } else if (strcmp(name, "message_delta") == 0) {
+    if (parse_usage(event, &counted)) {
+      usage->completion = counted.completion;
+    }
+  } else if (strcmp(name, "content_block_delta") == 0 &&
+             json_object_object_get_ex(event, "delta", &delta) &&
+             json_object_object_get_ex(delta, "text", &text)) {
+    return json_object_get_string(text);
+  }
+  return NULL;
+}
+
+const ProviderApi openai_api = {"/v1/chat/completions", openai_auth,
+                                openai_build, openai_reply,
+                                openai_stream_event};
+const ProviderApi anthropic_api = {"/v1/messages", anthropic_auth,
+                                   anthropic_build, anthropic_reply,
+                                   anthropic_stream_event};
+
+Provider providers[] = {
+    {"openai", &openai_api, DEFAULT_OPENAI_BASE_URL, NULL, "OPENAI_API_KEY",
+     DEFAULT_OPENAI_BASE_URL, DEFAULT_MODEL},
+    {"anthropic", &anthropic_api, DEFAULT_ANTHROPIC_BASE_URL, NULL,
+     "ANTHROPIC_API_KEY", DEFAULT_ANTHROPIC_BASE_URL, DEFAULT_ANTHROPIC_MODEL},
+    {"local", &openai_api, DEFAULT_LOCAL_BASE_URL, NULL, "LOCAL_API_KEY",
+     NULL, DEFAULT_LOCAL_MODEL},
+};
+#define PROVIDER_COUNT (int)(sizeof(providers) / sizeof(providers[0]))
+
+// Find a provider by name. Returns NULL if there is none.
+Provider *provider_find(const char *name) {
+  for (int i = 0; i < PROVIDER_COUNT; i++) {
+    if (strcmp(providers[i].name, name) == 0) {
+      return &providers[i];
+    }
+  }
+  return NULL;
+}
+
+// The environment variable to set if provider can't be used without a key,
+// or NULL if it can. Only the public endpoints need one.
+const char *provider_missing_key(const Provider *provider) {
+  if (provider->api_key == NULL && provider->public_url != NULL &&
+      strcmp(provider->base_url, provider->public_url) == 0) {
+    return provider->key_variable;
+  }
+  return NULL;
+}
+
+// Start a request to provider: returns a curl handle with the URL and
+// headers set, and the headers in *headers to free after the transfer
+static CURL *provider_request(const Provider *provider,
+                              struct curl_slist **headers) {
+  CURL *curl = curl_easy_init();
+  if (curl == NULL) {
+    return NULL;
+  }
+  char url[512];
+  snprintf(url, sizeof(url), "%s%s", provider->base_url, provider->api->path);
+  *headers = curl_slist_append(NULL, "Content-Type: application/json");
+  *headers = provider->api->auth(*headers, provider->api_key);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+  return curl;
+}
+
+// A one-off request for the classifier, a summary or a personality, split
+// so that it can be performed on the calling thread or by the reactor
+typedef struct {
+  const Provider *provider;
+  const char *kind; // Label in the request counters
+  CURL *curl;
+  struct curl_slist *headers;
+  char *json_data;
+  struct memory chunk;
+} ProviderCall;
+
+// Prepare a request to provider. Returns 0, or -1 if it can't be made.
+int provider_call_start(ProviderCall *call, const Provider *provider,
+                        const char *model, const char *system,
+                        const char *user, int max_tokens, float temperature,
+                        const char *kind) {
+  memset(call, 0, sizeof(*call));
+  call->provider = provider;
+  call->kind = kind;
+  const char *missing = provider_missing_key(provider);
+  if (missing != NULL) {
+    char message[128];
+    snprintf(message, sizeof(message), "No API key for %s: set %s",
+             provider->name, missing);
+    log_error(message);
+    return -1;
+  }
+
+  size_t system_size = strlen(system) * 6 + 1;
+  size_t user_size = strlen(user) * 6 + 1;
+  size_t json_size = system_size + user_size + 512;
+  char *escaped_system = malloc(system_size);
+  char *escaped_user = malloc(user_size);
+  call->json_data = malloc(json_size);
+  call->chunk.response = malloc(1);
+  int status = -1;
+  if (escaped_system != NULL && escaped_user != NULL &&
+      call->json_data != NULL && call->chunk.response != NULL) {
+    json_escape_string(system, escaped_system, system_size);
+    json_escape_string(user, escaped_user, user_size);
+    if (provider->api->build(model, escaped_system, escaped_user, max_tokens,
+                             temperature, 0, call->json_data,
+                             json_size) < 0) {
+      log_error("JSON data truncated in provider_call_start");
+    } else if ((call->curl = provider_request(provider, &call->headers)) ==
+               NULL) {
+      log_error("CURL initialization failed.");
+    } else {
+      curl_easy_setopt(call->curl, CURLOPT_POSTFIELDS, call->json_data);
+      curl_easy_setopt(call->curl, CURLOPT_WRITEFUNCTION, write_callback);
+      curl_easy_setopt(call->curl, CURLOPT_WRITEDATA, (void *)&call->chunk);
+      status = 0;
+    }
+  }
+  free(escaped_user);
+  free(escaped_system);
+  if (status != 0) {
+    curl_slist_free_all(call->headers);
+    free(call->chunk.response);
+    free(call->json_data);
+  }
+  return status;
+}
+
+// Free a call without looking at its response, as when it is abandoned
+void provider_call_free(ProviderCall *call) {
+  curl_easy_cleanup(call->curl);
+  curl_slist_free_all(call->headers);
+  free(call->chunk.response);
+  free(call->json_data);
+}
+
+// Finish a call whose transfer ended with res and free it. Returns the reply
+// text, malloc'd, or NULL. usage receives the tokens used, estimated from
+// the sizes when the response has no usage block, in which case *estimated
+// is set.
+char *provider_call_finish(ProviderCall *call, CURLcode res,
+                           TokenUsage *usage, int *estimated) {
+  memset(usage, 0, sizeof(*usage));
+  if (estimated != NULL) {
+    *estimated = 0;
+  }
+  char *text = NULL;
+  record_request_status(call->curl, res, call->provider->name, call->kind);
+  if (res != CURLE_OK) {
+    log_error(curl_easy_strerror(res));
+  } else {
+    struct json_object *parsed_json = json_tokener_parse(call->chunk.response);
+    const char *reply = call->provider->api->reply(parsed_json);
+    if (reply != NULL) {
+      text = strdup(reply);
+    }
+    if (!parse_usage(parsed_json, usage) ||
+        (usage->prompt == 0 && usage->completion == 0)) {
+      usage->prompt = strlen(call->json_data) / 4;
+      usage->completion = text ? strlen(text) / 4 + 1 : 0;
+      if (estimated != NULL) {
+        *estimated = 1;
+      }
+    }
+    json_object_put(parsed_json);
+  }
+
+  provider_call_free(call);
+  return text;
+}
+
+// Make a one-off request for the classifier, a summary or a personality;
+// kind labels it in the request counters. Returns the reply text, malloc'd,
+// or NULL; usage and estimated are as for provider_call_finish.
+char *provider_complete(const Provider *provider, const char *model,
+                        const char *system, const char *user, int max_tokens,
+                        float temperature, const char *kind,
+                        TokenUsage *usage, int *estimated) {
+  memset(usage, 0, sizeof(*usage));
+  if (estimated != NULL) {
+    *estimated = 0;
+  }
+  ProviderCall call;
+  if (provider_call_start(&call, provider, model, system, user, max_tokens,
+                          temperature, kind) != 0) {
+    return NULL;
+  }
+  return provider_call_finish(&call, curl_easy_perform(call.curl), usage,
+                              estimated);
+}
+
+// A streamed reply being received. Server-sent events are split into lines
+// as they arrive, and the text of each event is appended to the reply.
+typedef struct {
+  const ProviderApi *api;
+  struct memory line; // Partial line left over from the last write
+  struct memory text; // Reply text so far
+  TokenUsage usage;
+} ReplyStream;
+
+static void reply_stream_line(ReplyStream *stream, char *line) {
+  if (strncmp(line, "data:", 5) != 0) {
+    return; // Event names, comments and blank separators
+  }
+  line += 5;
+  while (*line == ' ') {
+    line++;
+  }
+  if (strcmp(line, "[DONE]") == 0) {
+    return;
+  }
+  struct json_object *event = json_tokener_parse(line);
+  if (event == NULL) {
+    return;
+  }
+  const char *delta = stream->api->stream_event(event, &stream->usage);
+  if (delta != NULL && delta[0] != '\0') {
+    write_callback((void *)delta, 1, strlen(delta), &stream->text);
+  }
+  json_object_put(event);
+}
+
+static size_t reply_stream_callback(void *data, size_t size, size_t nmemb,
+                                    void *userp) {
+  ReplyStream *stream = (ReplyStream *)userp;
+  size_t realsize = write_callback(data, size, nmemb, &stream->line);
+  if (realsize == 0) {
+    return 0;
+  }
+  char *start = stream->line.response;
+  char *end = stream->line.response + stream->line.size;
+  char *newline;
+  while ((newline = memchr(start, '\n', end - start)) != NULL) {
+    *newline = '\0';
+    if (newline > start && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+    reply_stream_line(stream, start);
+    start = newline + 1;
+  }
+  stream->line.size -= start - stream->line.response;
+  memmove(stream->line.response, start, stream->line.size + 1);
+  return realsize;
+}
+
+// Decide by chance whether a bot responds: 1 or 0, or -1 if the classifier
+// should be asked
+int classify_by_chance(int is_mentioned) {
+  // If the bot is mentioned, it should respond with very high probability
+  if (is_mentioned) {
+    return random_below(100) < 95; // 95% chance to respond when mentioned
+  }
+
+  // Random chance to respond even when not mentioned
+  if (random_below(100) < 30) { // 30% chance to consider responding
+    return 1;
+  }
+  return -1;
+}
+
+// Prepare the classifier request asking whether a bot should respond
+int classifier_call_start(ProviderCall *call, const char *message,
+                          const char *bot_personality, const char *bot_memory,
+                          const char *bot_name) {
+  char system[MAX_QUERY_SIZE + MEMORY_PROMPT_SIZE + 1024];
+  snprintf(system, sizeof(system),
+           "You are an AI assistant that determines if a bot with a given "
+           "personality should respond to a message. The bot's name is %s. "
+           "The bot's personality is: %s. The bot's recent memory is: %s. "
+           "Consider the context and the bot's personality. Respond with only "
+           "'yes' if the bot should respond, "
+           "or 'no' if it shouldn't. Aim for natural conversation flow and "
+           "avoid having the bot respond to every message.",
+           bot_name, bot_personality, bot_memory);
+  char user[MAX_QUERY_SIZE * 2];
+  snprintf(user, sizeof(user), "Should the bot respond to this message: %s",
+           message);
+  return provider_call_start(call, classifier_provider, classifier_model,
+                             system, user, 1, 0.7f, "classify");
+}
+
+// Read the classifier's answer, freeing it. Returns 1 for yes.
+int classifier_answer(char *answer) {
+  if (answer == NULL) {
+    return 0;
+  }
+  // Small local models tend to add punctuation or leading space
+  const char *start = answer;
+  while (isspace((unsigned char)*start)) {
+    start++;
+  }
+  int should_respond = strncasecmp(start, "yes", 3) == 0;
+  free(answer);
+  return should_respond;
+}
+
+// Function to determine if a bot should respond. Unless chance decides,
+// the classifier provider is asked.
+int should_bot_respond(const char *message, const char *bot_personality,
+                       const char *bot_memory, const char *bot_name,
+                       int is_mentioned, TokenUsage *usage) {
+  memset(usage, 0, sizeof(*usage));
+  int decided = classify_by_chance(is_mentioned);
+  if (decided >= 0) {
+    return decided;
+  }
+
+  ProviderCall call;
+  if (classifier_call_start(&call, message, bot_personality, bot_memory,
+                            bot_name) != 0) {
+    return 0;
+  }
+  return classifier_answer(
+      provider_call_finish(&call, curl_easy_perform(call.curl), usage, NULL));
+}
+
+// Record an interaction in the bot's memory. The raw reply goes into the
+// ring of recent interactions; every SUMMARY_REFRESH_INTERACTIONS of them a
+// summary refresh is queued at the lowest priority, so it runs on a worker
+// when no replies are waiting instead of on the response consumer. The
+// whole exchange, prompt included when known, goes into long-term memory.
+void update_bot_memory(Bot *bot, const char *prompt, const char *reply) {
+  char exchange[LONG_TERM_ENTRY_LENGTH];
+  if (prompt != NULL) {
+    snprintf(exchange, sizeof(exchange), "%.120s -> you: %s", prompt, reply);
+  } else {
+    snprintf(exchange, sizeof(exchange), "you: %s", reply);
+  }
+  memory_store_add(&bot->long_term, exchange);
+
+  pthread_mutex_lock(&bot_mutex);
+  snprintf(bot->memory[bot->memory_index], MAX_MEMORY_ENTRY_LENGTH, "%s",
+           reply);
+  bot->memory_index = (bot->memory_index + 1) % MAX_MEMORY_ENTRIES;
+  if (bot->memory_count < MAX_MEMORY_ENTRIES) {
+    bot->memory_count++;
+  }
+  bot->total_messages++;
+  int refresh = ++bot->unsummarized % SUMMARY_REFRESH_INTERACTIONS == 0;
+  BotHandle handle = bot->handle;
+  pthread_mutex_unlock(&bot_mutex);
+
+  if (refresh) {
+    schedule_memory_summary(handle);
+  }
+}
+
+// Render a bot's memory for a prompt: the summary of older interactions,
+// then the recent ones newest first
+void format_bot_memory(const Bot *bot, char *output, size_t output_size) {
+  pthread_mutex_lock(&bot_mutex);
+  int len = snprintf(output, output_size, "%s%s", bot->summary,
+                     bot->summary[0] ? " " : "");
+  if (bot->memory_count == 0 && bot->summary[0] == '\0') {
+    snprintf(output, output_size, "nothing yet");
+  }
+  for (int i = 0; i < bot->memory_count && len < (int)output_size; i++) {
+    int index = (bot->memory_index - 1 - i + MAX_MEMORY_ENTRIES) %
+                MAX_MEMORY_ENTRIES;
+    len += snprintf(output + len, output_size - len, "%s%.150s",
+                    i == 0 ? "Recently said: " : " | ", bot->memory[index]);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+}
+
+// Function to check if a message mentions a specific user as a whole word:
+// "@bob" doesn't count in "@bobby" or "x@bob"
+int is_mentioned(const char *message, const char *username) {
+  char mention[52]; // @username
+  int length = snprintf(mention, sizeof(mention), "@%s", username);
+  for (const char *found = strstr(message, mention); found != NULL;
+       found = strstr(found + 1, mention)) {
+    if ((found == message || !is_nick_char(found[-1])) &&
+        !is_nick_char(found[length])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Structure to pass data to the bot response thread
+typedef struct {
+  char *query;
+  char *sender;
+  BotHandle bot;       // Resolved through the registry; stale once kicked
+  int channel;         // Channel of the conversation, -1 for none
+  int priority;        // RequestPriority class of the request
+  int fanout;          // Relay the query to the other bots instead of replying
+  int summarize;       // Refresh the bot's memory summary instead of replying
+  uint64_t enqueue_us; // When the request entered the scheduler
+  unsigned long context_seq; // The channel's seq when the request was made
+  uint64_t reply_us;         // When the reply was queued for display
+  uint64_t stage_us[LATENCY_STAGES]; // Time spent in each stage so far
+  char *prompt; // For replies, "sender: message" that was replied to
+} BotThreadData;
+
+// Free a BotThreadData and the strings it owns
+void free_bot_thread_data(BotThreadData *data) {
+  free(data->query);
+  free(data->sender);
+  free(data->prompt);
+  free(data);
+}
+
+// Stale request cancellation. A request is dropped once its bot is kicked or
+// leaves the channel, or more than stale_message_limit messages were posted
+// in the channel after it was made.
+int stale_message_limit = 20; // 0 disables message-based cancellation
+unsigned long cancelled_requests = 0;
+unsigned long tokens_saved = 0;
+unsigned long request_bytes_total = 0; // Request bodies sent, for estimates
+unsigned long requests_sent = 0;
+unsigned long reply_bytes_total = 0; // Reply texts received, for estimates
+unsigned long replies_received = 0;
+pthread_mutex_t cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether a request's bot is gone or the conversation has moved on
+int request_is_stale(const BotThreadData *data) {
+  if (data->channel < 0) {
+    return !bot_handle_valid(data->bot); // Not part of any conversation
+  }
+  if (!(bot_channels(data->bot) & (1u << data->channel))) {
+    return 1;
+  }
+  return stale_message_limit > 0 &&
+         channel_seq(data->channel) - data->context_seq >
+             (unsigned long)stale_message_limit;
+}
+
+// Token estimates at roughly four bytes per token, from the averages seen
+// so far (with a floor for the first requests). Must hold cancel_mutex.
+static unsigned long estimated_prompt_tokens_locked() {
+  return requests_sent ? request_bytes_total / requests_sent / 4 : 500;
+}
+
+static unsigned long estimated_reply_tokens_locked() {
+  return replies_received ? reply_bytes_total / replies_received / 4 : 50;
+}
+
+// Record the size of a request body sent or a reply received
+void record_request_sent(size_t body_bytes) {
+  pthread_mutex_lock(&cancel_mutex);
+  request_bytes_total += body_bytes;
+  requests_sent++;
+  pthread_mutex_unlock(&cancel_mutex);
+}
+
+void record_reply_received(size_t reply_bytes) {
+  pthread_mutex_lock(&cancel_mutex);
+  reply_bytes_total += reply_bytes;
+  replies_received++;
+  pthread_mutex_unlock(&cancel_mutex);
+}
+
+// Count a cancelled request. Tokens are saved for whatever part of the
+// exchange had not happened yet: the prompt if it was never (fully) sent,
+// and the part of the reply not yet received.
+void record_cancellation(int prompt_sent, size_t reply_bytes_received) {
+  pthread_mutex_lock(&cancel_mutex);
+  unsigned long saved = prompt_sent ? 0 : estimated_prompt_tokens_locked();
+  unsigned long reply_tokens = estimated_reply_tokens_locked();
+  unsigned long received_tokens = reply_bytes_received / 4;
+  if (received_tokens < reply_tokens) {
+    saved += reply_tokens - received_tokens;
+  }
+  cancelled_requests++;
+  tokens_saved += saved;
+  pthread_mutex_unlock(&cancel_mutex);
+}
+
+// State for aborting a transfer from curl's progress callback
+typedef struct {
+  const BotThreadData *data;
+  curl_off_t uploaded;
+  curl_off_t upload_total;
+  curl_off_t downloaded;
+} TransferProgress;
+
+// curl progress callback: a nonzero return aborts a request gone stale
+static int transfer_progress_callback(void *clientp, curl_off_t dltotal,
+                                      curl_off_t dlnow, curl_off_t ultotal,
+                                      curl_off_t ulnow) {
+  (void)dltotal;
+  TransferProgress *progress = (TransferProgress *)clientp;
+  progress->uploaded = ulnow;
+  progress->upload_total = ultotal;
+  progress->downloaded = dlnow;
+  return request_is_stale(progress->data);
+}
+
+// Channel messages sent as context at the current load level
+int load_context_messages();
+
+// Write the last few messages of a channel into context, one "name: text"
+// line each, leaving out system messages, which go to whichever channel the
+// user is looking at
+void format_channel_context(int channel_index, char *context,
+                            size_t context_size) {
+  context[0] = '\0';
+  int context_messages = load_context_messages(); // Fewer under load
+  pthread_mutex_lock(&chat_mutex);
+  const Channel *channel = channels[channel_index];
+  unsigned long oldest = channel->total > CHAT_HISTORY_LIMIT
+                             ? channel->total - CHAT_HISTORY_LIMIT
+                             : 0;
+  unsigned long start = channel->total;
+  for (int found = 0; start > oldest && found < context_messages; start--) {
+    found += strcmp(channel->history[(start - 1) % CHAT_HISTORY_LIMIT].role,
+                    "system") != 0;
+  }
+  for (unsigned long j = start; j < channel->total; j++) {
+    const ChatMessage *entry = &channel->history[j % CHAT_HISTORY_LIMIT];
+    if (strcmp(entry->role, "system") == 0) {
+      continue;
+    }
+    // Long messages are deliberately clipped to keep the prompt bounded
+    char temp[MAX_QUERY_SIZE * 5];
+    snprintf(temp, sizeof(temp), "%.50s: %.1000s\n", entry->display_name,
+             entry->content);
+    strncat(context, temp, context_size - strlen(context) - 1);
+  }
+  pthread_mutex_unlock(&chat_mutex);
+}
+
+// Build the JSON request body for a bot's reply to query, including the
+// recent conversation in the channel and the bot's most related earlier
+// exchanges as context, in the format of the bot's provider. Returns the
+// body length, or -1 if the body was truncated to fit json_data_size or the
+// provider is unknown.
+int build_bot_request(Bot *bot, float temperature, int channel_index,
+                      const char *query, const char *sender, char *json_data,
+                      size_t json_data_size) {
+  char context[MAX_QUERY_SIZE * 5];
+  format_channel_context(channel_index, context, sizeof(context));
+
+  char memory[MEMORY_PROMPT_SIZE];
+  format_bot_memory(bot, memory, sizeof(memory));
+
+  // Recall older exchanges similar to the message, skipping the recent
+  // ones already in memory
+  uint64_t recall_start = trace_begin();
+  MemoryMatch matches[LONG_TERM_RECALL];
+  int match_count = memory_store_search(&bot->long_term, query,
+                                        MAX_MEMORY_ENTRIES, matches,
+                                        LONG_TERM_RECALL);
+  char recalled[RECALL_PROMPT_SIZE] = "";
+  int recalled_len = 0;
+  for (int i = 0; i < match_count && recalled_len < (int)sizeof(recalled);
+       i++) {
+    recalled_len += snprintf(recalled + recalled_len,
+                             sizeof(recalled) - recalled_len, "%s%s",
+                             i == 0 ? "Earlier exchanges that may be related: "
+                                    : " | ",
+                             matches[i].text);
+  }
+  if (match_count > 0 && recalled_len < (int)sizeof(recalled)) {
+    snprintf(recalled + recalled_len, sizeof(recalled) - recalled_len, ". ");
+  }
+  trace_end("memory recall", recall_start, bot->name);
+
+  int is_bot_mentioned = is_mentioned(query, bot->name);
+
+  char system[MAX_QUERY_SIZE * 5 + MEMORY_PROMPT_SIZE + RECALL_PROMPT_SIZE +
+              1024];
+  snprintf(system, sizeof(system),
+           "You are a chatbot named %.50s "
+           "with the following personality: %.200s. Respond in a way that "
+           "reflects this personality. Be sarcastic, make jokes, and poke fun "
+           "at the user or other bots when appropriate. Don't be overly "
+           "helpful or polite. "
+           "Your responses should be reminiscent of IRC, Discord, or Reddit "
+           "conversations. "
+           "Occasionally, initiate new topics or ask questions to keep the "
+           "conversation going. "
+           "The message you're responding to was sent by %.50s. "
+           "Your memory: %.1000s. %.1000s"
+           "Here's the recent conversation context:\n%.1000s "
+           "You %s directly mentioned in this message. "
+           "If the conversation seems to be dying down, introduce a new topic "
+           "or ask a question.",
+           bot->name, bot->personality, sender, memory, recalled, context,
+           is_bot_mentioned ? "were" : "were not");
+
+  // Escape special characters in strings
+  char escaped_system[sizeof(system) * 2];
+  char escaped_query[MAX_QUERY_SIZE * 2];
+  json_escape_string(system, escaped_system, sizeof(escaped_system));
+  json_escape_string(query, escaped_query, sizeof(escaped_query));
+
+  const Provider *provider = provider_find(bot->api_type);
+  if (provider == NULL) {
+    return -1;
+  }
+  return provider->api->build(bot->model, escaped_system, escaped_query, 0,
+                              temperature, stream_replies, json_data,
+                              json_data_size);
+}
+
+// Split a finished transfer's time into the connect, TLS, first byte and
+// last byte stages using curl's cumulative timers
+static void record_transfer_times(CURL *curl, uint64_t stage_us[]) {
+  curl_off_t connect = 0, appconnect = 0, starttransfer = 0, total = 0;
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+  curl_off_t connected = appconnect > connect ? appconnect : connect;
+  stage_us[STAGE_CONNECT] = connect;
+  stage_us[STAGE_TLS] = connected - connect; // 0 for plain HTTP
+  stage_us[STAGE_FIRST_BYTE] =
+      starttransfer > connected ? starttransfer - connected : 0;
+  stage_us[STAGE_LAST_BYTE] = total > starttransfer ? total - starttransfer : 0;
+}
+
+// Extract the reply text from an API response body. Returns a malloc'd
+// string, or NULL if the body isn't a valid response for api_type. usage,
+// if not NULL, receives the response's usage block (zeroed if it has none).
+char *parse_bot_response(const char *api_type, const char *body,
+                         TokenUsage *usage) {
+  const Provider *provider = provider_find(api_type);
+  if (provider == NULL) {
+    return NULL;
+  }
+  struct json_object *parsed_json = json_tokener_parse(body);
+  if (parsed_json == NULL) {
+    return NULL;
+  }
+  if (usage != NULL) {
+    parse_usage(parsed_json, usage);
+  }
+  const char *reply = provider->api->reply(parsed_json);
+  char *response_text = reply != NULL ? strdup(reply) : NULL;
+  json_object_put(parsed_json); // Free the parsed JSON object
+  return response_text;
+}
+
+// A bot's reply request, split so that it can be performed on a worker or
+// by the reactor. The bot is held from start to finish.
+typedef struct {
+  BotThreadData *data;
+  Bot *bot;
+  CURL *curl;
+  struct curl_slist *headers;
+  struct memory chunk;
+  ReplyStream stream;
+  TransferProgress progress;
+  uint64_t trace_start_us;
+  uint64_t perform_start;
+  char json_data[MAX_QUERY_SIZE * 20];
+} ReplyCall;
+
+// Prepare the reply request for data, taking ownership of it. Returns NULL
+// if the request was dropped or can't be made.
+ReplyCall *reply_call_start(BotThreadData *data) {
+  uint64_t trace_start_us = trace_begin();
+
+  // Hold a reference so a concurrent /kick can't free the bot under us
+  Bot *bot = bot_acquire(data->bot);
+  if (bot == NULL || request_is_stale(data)) {
+    record_cancellation(0, 0);
+    if (bot != NULL) {
+      bot_release(bot);
+    }
+    free_bot_thread_data(data);
+    return NULL;
+  }
+  float temperature = bot_temperature(bot->handle);
+
+  // Set typing status
+  bot_set_typing(bot->handle, 1);
+  update_sidebar();
+
+  const Provider *provider = provider_find(bot->api_type);
+  const char *missing = provider ? provider_missing_key(provider) : NULL;
+  ReplyCall *call = NULL;
+  if (provider == NULL || missing != NULL) {
+    char message[128];
+    if (provider == NULL) {
+      snprintf(message, sizeof(message), "Unknown bot API type: %s",
+               bot->api_type);
+    } else {
+      snprintf(message, sizeof(message), "No API key for %s: set %s",
+               provider->name, missing);
+    }
+    log_error(message);
+  } else if ((call = calloc(1, sizeof(ReplyCall))) == NULL ||
+             (call->chunk.response = malloc(1)) == NULL ||
+             (call->curl = provider_request(provider, &call->headers)) ==
+                 NULL) {
+    log_error("CURL initialization failed in bot thread.");
+    if (call != NULL) {
+      curl_slist_free_all(call->headers);
+      free(call->chunk.response);
+      free(call);
+      call = NULL;
+    }
+  }
+  if (call == NULL) {
+    bot_set_typing(bot->handle, 0);
+    update_sidebar();
+    bot_release(bot);
+    free_bot_thread_data(data);
+    return NULL;
+  }
+  call->data = data;
+  call->bot = bot;
+  call->trace_start_us = trace_start_us;
+  call->stream.api = provider->api;
+
+  // Create the JSON request body
+  if (build_bot_request(bot, temperature, data->channel, data->query,
+                        data->sender, call->json_data,
+                        sizeof(call->json_data)) < 0) {
+    log_error("JSON data truncated in bot_response_thread");
+  }
+
+  // Set up CURL options. Streamed replies are assembled from their events
+  // as they arrive.
+  CURL *curl = call->curl;
+  call->progress.data = data;
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, call->json_data);
+  if (stream_replies) {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, reply_stream_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&call->stream);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&call->chunk);
+  }
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, transfer_progress_callback);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)&call->progress);
+  call->perform_start = trace_begin();
+  return call;
+}
+
+// Queue bot's reply to the request data for posting. Takes ownership of
+// response_text. Returns -1 if it couldn't be queued.
+int queue_bot_reply(const BotThreadData *data, const Bot *bot,
+                    char *response_text) {
+  BotThreadData *response_data = calloc(1, sizeof(BotThreadData));
+  if (response_data == NULL) {
+    free(response_text);
+    return -1;
+  }
+  response_data->query = response_text;
+  response_data->sender = strdup(bot->name);
+  size_t prompt_size = strlen(data->sender) + strlen(data->query) + 3;
+  response_data->prompt = malloc(prompt_size);
+  if (response_data->prompt != NULL) {
+    snprintf(response_data->prompt, prompt_size, "%s: %s", data->sender,
+             data->query);
+  }
+  response_data->bot = bot->handle;
+  response_data->channel = data->channel;
+  response_data->context_seq = data->context_seq;
+  response_data->enqueue_us = data->enqueue_us;
+  response_data->reply_us = monotonic_us();
+  memcpy(response_data->stage_us, data->stage_us,
+         sizeof(response_data->stage_us));
+  record_reply_received(strlen(response_text));
+
+  pthread_mutex_lock(&queue_mutex);
+  queue_push(response_queue, response_data);
+  outstanding_responses++;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+  reactor_wake();
+  return 0;
+}
+
+// Handle the end of a reply transfer, queueing the reply for posting, and
+// free the call. Returns 1 if a reply was queued.
+int reply_call_finish(ReplyCall *call, CURLcode res) {
+  int queued = 0;
+  BotThreadData *data = call->data;
+  Bot *bot = call->bot;
+  CURL *curl = call->curl;
+  const char *json_data = call->json_data;
+  trace_end("curl_easy_perform", call->perform_start, bot->name);
+  record_request_status(curl, res, bot->api_type, "reply");
+  if (res == CURLE_ABORTED_BY_CALLBACK) {
+    // The request went stale while in flight
+    record_cancellation(call->progress.upload_total > 0 &&
+                            call->progress.uploaded >=
+                                call->progress.upload_total,
+                        (size_t)call->progress.downloaded);
+  } else if (res != CURLE_OK) {
+    record_request_sent(strlen(json_data));
+    log_error(curl_easy_strerror(res));
+  } else {
+    record_request_sent(strlen(json_data));
+    record_transfer_times(curl, data->stage_us);
+
+    // Parse the JSON response and extract the bot's response
+    uint64_t parse_start = monotonic_us();
+    TokenUsage usage = {0};
+    char *response_text;
+    if (stream_replies) {
+      response_text = call->stream.text.response; // NULL if no text arrived
+      call->stream.text.response = NULL;
+      usage = call->stream.usage;
+    } else {
+      response_text =
+          parse_bot_response(bot->api_type, call->chunk.response, &usage);
+    }
+    data->stage_us[STAGE_PARSE] = monotonic_us() - parse_start;
+    trace_end("parse_bot_response", parse_start, bot->name);
+
+    // Responses without a usage block are billed at the estimated size
+    int estimated = usage.prompt == 0 && usage.completion == 0;
+    if (estimated) {
+      usage.prompt = strlen(json_data) / 4;
+      usage.completion = response_text ? strlen(response_text) / 4 + 1 : 0;
+    }
+    record_usage(bot, bot->api_type, bot->model, &usage, estimated);
+    if (response_text != NULL) {
+      queued = queue_bot_reply(data, bot, response_text) == 0;
+    } else {
+      char error_message[1024];
+      snprintf(error_message, sizeof(error_message),
+               "Failed to extract response from JSON. Raw response: %.900s",
+               stream_replies ? "(streamed)" : call->chunk.response);
+      log_error(error_message);
+    }
+  }
+
+  // Cleanup CURL resources
+  curl_easy_cleanup(curl);
+  curl_slist_free_all(call->headers);
+  free(call->chunk.response);
+  free(call->stream.line.response);
+  free(call->stream.text.response);
+  free_bot_thread_data(data);
+  bot_set_typing(bot->handle, 0);
+  trace_end("bot_response_thread", call->trace_start_us, bot->name);
+  bot_release(bot);
+  free(call);
+  update_sidebar();
+  return queued;
+}
+
+// Make a reply request on the calling thread. Returns 1 if a reply was
+// queued.
+int bot_response_thread(BotThreadData *data) {
+  ReplyCall *call = reply_call_start(data);
+  if (call == NULL) {
+    return 0;
+  }
+  return reply_call_finish(call, curl_easy_perform(call->curl));
+}
+
+// Request scheduler. Reply requests wait in one FIFO per priority class and
+// a fixed pool of workers always takes the highest class first. When the
+// backlog is full, a new request evicts the oldest request of the lowest
+// class below its own, so chatter never delays a reply to the human.
+typedef enum {
+  PRIORITY_MENTION,    // The bot was @mentioned directly
+  PRIORITY_USER_REPLY, // Reply to a message from the human
+  PRIORITY_BOT_REPLY,  // Reply to another bot
+  PRIORITY_AUTONOMOUS, // Unprompted chatter
+  PRIORITY_CLASSES
+} RequestPriority;
+
+const char *priority_names[PRIORITY_CLASSES] = {"mention", "user", "bot",
+                                                "autonomous"};
+
+// Per-class scheduler metrics
+typedef struct {
+  unsigned long enqueued;  // Requests accepted into the queue
+  unsigned long preempted; // Queued requests evicted by higher classes
+  unsigned long rejected;  // Requests refused because the queue was full
+  unsigned long started;   // Requests picked up by a worker
+  unsigned long declined;  // Requests the bot chose not to answer
+  unsigned long over_budget; // Requests skipped to stay within budget
+  unsigned long shed;      // Requests refused or dropped under load
+  unsigned long completed; // Requests that produced a reply
+  uint64_t wait_ms_total;  // Sum of enqueue-to-start times
+  uint64_t wait_ms_max;
+  uint64_t reply_ms_total; // Sum of enqueue-to-reply times (completed only)
+  uint64_t reply_ms_max;
+} PriorityStats;
+
+queue_t *request_queues[PRIORITY_CLASSES];
+int pending_requests = 0;
+int active_requests = 0; // Requests currently being run by a worker
+int scheduler_running = 0;
+PriorityStats priority_stats[PRIORITY_CLASSES];
+pthread_t request_workers[MAX_THREADS];
+pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+// Admission control. The scheduler watches for signs that the providers (or
+// the workers) are falling behind: the queue depth, every request slot being
+// in use with more waiting, and how long the oldest queued reply to the
+// human has waited. Rather than letting that wait grow, the room degrades a
+// step at a time: when busy, bots chatter less and send shorter context;
+// when overloaded, replies to other bots and unprompted chatter are refused
+// and dropped from the queue, so only work for the human runs. The level
+// rises as soon as a signal crosses its threshold and falls one step once
+// the signals have stayed below it for LOAD_COOLDOWN_MS.
+#define LOAD_CHECK_MS 1000
+#define LOAD_COOLDOWN_MS 5000
+#define LOAD_BUSY_DEPTH 16       // Queued requests
+#define LOAD_OVERLOADED_DEPTH 48 // Below MAX_PENDING_REQUESTS
+#define LOAD_BUSY_WAIT_MS 2000   // Wait of the oldest queued user reply
+#define LOAD_OVERLOADED_WAIT_MS 8000
+
+typedef enum { LOAD_NORMAL, LOAD_BUSY, LOAD_OVERLOADED, LOAD_LEVELS } LoadLevel;
+
+typedef struct {
+  const char *name;
+  int autonomous_percent; // Chance a bot speaks when its timer fires
+  int context_messages;   // Channel messages included in a reply's prompt
+  RequestPriority lowest; // Lowest priority class admitted
+} LoadPolicy;
+
+const LoadPolicy load_policies[LOAD_LEVELS] = {
+    {"normal", 30, 5, PRIORITY_AUTONOMOUS},
+    {"busy", 10, 3, PRIORITY_AUTONOMOUS},
+    {"overloaded", 0, 1, PRIORITY_USER_REPLY},
+};
+
+LoadLevel load_level = LOAD_NORMAL; // Written under sched_mutex
+uint64_t load_calm_since_us = 0;    // Since when the signals are lower
+unsigned long load_changes = 0;
+TimerEvent load_timer;
+
+const char *load_level_name() {
+  return load_policies[__atomic_load_n(&load_level, __ATOMIC_RELAXED)].name;
+}
+
+int load_context_messages() {
+  return load_policies[__atomic_load_n(&load_level, __ATOMIC_RELAXED)]
+      .context_messages;
+}
+
+int load_autonomous_percent() {
+  return load_policies[__atomic_load_n(&load_level, __ATOMIC_RELAXED)]
+      .autonomous_percent;
+}
+
+// The level the current backlog calls for. Called with sched_mutex held.
+static LoadLevel load_signal_locked(uint64_t now_us) {
+  uint64_t oldest_us = now_us;
+  for (int p = PRIORITY_MENTION; p <= PRIORITY_USER_REPLY; p++) {
+    QueueNode *head = request_queues[p]->front;
+    if (head != NULL && ((BotThreadData *)head->data)->enqueue_us < oldest_us) {
+      oldest_us = ((BotThreadData *)head->data)->enqueue_us;
+    }
+  }
+  uint64_t wait_ms = (now_us - oldest_us) / 1000;
+  int slots = reactor_mode ? REACTOR_MAX_REQUESTS : MAX_THREADS;
+  if (pending_requests >= LOAD_OVERLOADED_DEPTH ||
+      wait_ms >= LOAD_OVERLOADED_WAIT_MS) {
+    return LOAD_OVERLOADED;
+  }
+  if (pending_requests >= LOAD_BUSY_DEPTH || wait_ms >= LOAD_BUSY_WAIT_MS ||
+      (active_requests >= slots && pending_requests > 0)) {
+    return LOAD_BUSY;
+  }
+  return LOAD_NORMAL;
+}
+
+// Re-evaluate the load level. Queued requests the new level no longer
+// admits are moved to shed (room for MAX_PENDING_REQUESTS) for the caller
+// to free once sched_mutex is released. Returns how many were moved.
+static int load_update_locked(BotThreadData **shed) {
+  uint64_t now_us = monotonic_us();
+  LoadLevel signal = load_signal_locked(now_us);
+  LoadLevel level = load_level;
+  if (signal > level) {
+    level = signal;
+    load_calm_since_us = now_us;
+  } else if (signal == level) {
+    load_calm_since_us = now_us;
+  } else if (now_us - load_calm_since_us >= LOAD_COOLDOWN_MS * 1000ULL) {
+    level--;
+    load_calm_since_us = now_us;
+  }
+  if (level == load_level) {
+    return 0;
+  }
+  __atomic_store_n(&load_level, level, __ATOMIC_RELAXED);
+  load_changes++;
+
+  int count = 0;
+  for (int p = load_policies[level].lowest + 1; p < PRIORITY_CLASSES; p++) {
+    BotThreadData *data;
+    while ((data = queue_pop(request_queues[p])) != NULL) {
+      priority_stats[p].shed++;
+      pending_requests--;
+      shed[count++] = data;
+    }
+  }
+  return count;
+}
+
+// Timer callback: keeps the load level current while nothing is being
+// queued, so it can fall back once the backlog has cleared
+static unsigned load_check(void *arg) {
+  static LoadLevel shown = LOAD_NORMAL; // Level on the status bar
+  (void)arg;
+  BotThreadData *shed[MAX_PENDING_REQUESTS];
+  pthread_mutex_lock(&sched_mutex);
+  int count = load_update_locked(shed);
+  LoadLevel level = load_level;
+  pthread_mutex_unlock(&sched_mutex);
+  for (int i = 0; i < count; i++) {
+    free_bot_thread_data(shed[i]);
+  }
+  if (level != shown) {
+    // The status bar is redrawn by the thread posting replies, which owns the
+    // screen; this callback runs with timer_mutex held and must not draw.
+    shown = level;
+    pthread_mutex_lock(&queue_mutex);
+    status_bar_stale = 1;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+  }
+  return LOAD_CHECK_MS;
+}
+
+// Start checking the load level. Call after timer_start().
+void admission_start() {
+  load_timer.callback = load_check;
+  timer_schedule(&load_timer, LOAD_CHECK_MS);
+}
+
+// Queue a request for a worker. Takes ownership of data.
+void schedule_request(BotThreadData *data) {
+  int priority = data->priority;
+  BotThreadData *evicted = NULL;
+  BotThreadData *shed[MAX_PENDING_REQUESTS];
+  data->enqueue_us = monotonic_us();
+
+  pthread_mutex_lock(&sched_mutex);
+  int shed_count = load_update_locked(shed);
+  if (priority > (int)load_policies[load_level].lowest) {
+    priority_stats[priority].shed++;
+    pthread_mutex_unlock(&sched_mutex);
+    for (int i = 0; i < shed_count; i++) {
+      free_bot_thread_data(shed[i]);
+    }
+    free_bot_thread_data(data);
+    return;
+  }
+  if (pending_requests >= MAX_PENDING_REQUESTS) {
+    for (int p = PRIORITY_CLASSES - 1; p > priority && evicted == NULL; p--) {
+      evicted = queue_pop(request_queues[p]);
+      if (evicted != NULL) {
+        priority_stats[p].preempted++;
+        pending_requests--;
+      }
+    }
+    if (evicted == NULL) {
+      priority_stats[priority].rejected++;
+      pthread_mutex_unlock(&sched_mutex);
+      for (int i = 0; i < shed_count; i++) {
+        free_bot_thread_data(shed[i]);
+      }
+      free_bot_thread_data(data);
+      return;
+    }
+  }
+  if (queue_push(request_queues[priority], data) == 0) {
+    priority_stats[priority].enqueued++;
+    pending_requests++;
+    pthread_cond_signal(&sched_cond);
+    data = NULL;
+  }
+  pthread_mutex_unlock(&sched_mutex);
+  reactor_wake();
+
+  for (int i = 0; i < shed_count; i++) {
+    free_bot_thread_data(shed[i]);
+  }
+  if (evicted != NULL) {
+    free_bot_thread_data(evicted);
+  }
+  if (data != NULL) {
+    free_bot_thread_data(data); // Out of memory
+  }
+}
+
+int scheduler_queue_depth() {
+  pthread_mutex_lock(&sched_mutex);
+  int depth = pending_requests;
+  pthread_mutex_unlock(&sched_mutex);
+  return depth;
+}
+
+// Queue a refresh of a bot's memory summary at the lowest priority
+void schedule_memory_summary(BotHandle bot) {
+  BotThreadData *data = calloc(1, sizeof(BotThreadData));
+  if (data == NULL) {
+    return;
+  }
+  data->query = strdup("");
+  data->sender = strdup("system");
+  data->bot = bot;
+  data->priority = PRIORITY_AUTONOMOUS;
+  data->summarize = 1;
+  data->channel = -1;
+  schedule_request(data);
+}
+
+// Fold a bot's recent interactions into its summary with a short completion
+// request. A dropped or failed refresh is retried after the next batch of
+// interactions. The bot is held from start to finish.
+typedef struct {
+  Bot *bot;
+  int consumed; // Interactions the new summary covers
+  uint64_t trace_start_us;
+  ProviderCall call;
+} SummaryCall;
+
+// Prepare a summary refresh for data, freeing it. Returns 0 if there is a
+// request to make.
+static int summary_call_start(SummaryCall *summary, BotThreadData *data) {
+  Bot *bot = bot_acquire(data->bot);
+  free_bot_thread_data(data);
+  if (bot == NULL) {
+    return -1;
+  }
+  if (!budget_allows(bot, 0)) {
+    bot_release(bot);
+    return -1;
+  }
+
+  // Snapshot the memory, oldest interaction first
+  char previous[MAX_SUMMARY_LENGTH];
+  char interactions[MAX_MEMORY_ENTRIES * (MAX_MEMORY_ENTRY_LENGTH + 4)];
+  size_t len = 0;
+  interactions[0] = '\0';
+  pthread_mutex_lock(&bot_mutex);
+  int consumed = bot->unsummarized;
+  strcpy(previous, bot->summary);
+  for (int i = 0; i < bot->memory_count; i++) {
+    int index = (bot->memory_index - bot->memory_count + i +
+                 MAX_MEMORY_ENTRIES) %
+                MAX_MEMORY_ENTRIES;
+    len += snprintf(interactions + len, sizeof(interactions) - len, "- %s\n",
+                    bot->memory[index]);
+  }
+  pthread_mutex_unlock(&bot_mutex);
+  if (consumed == 0) {
+    bot_release(bot); // Already refreshed by an earlier request
+    return -1;
+  }
+
+  char system[512];
+  snprintf(system, sizeof(system),
+           "Summarize what the chat bot %s should remember about its "
+           "conversations in at most 50 words: topics, running jokes, who it "
+           "argued with, what it claimed. Merge the previous summary with the "
+           "new lines and drop stale details. Reply with the summary only.",
+           bot->name);
+  char *user = malloc(sizeof(previous) + sizeof(interactions) + 64);
+  if (user == NULL) {
+    bot_release(bot);
+    return -1;
+  }
+  snprintf(user, sizeof(previous) + sizeof(interactions) + 64,
+           "Previous summary: %s\nRecent things the bot said:\n%s",
+           previous[0] ? previous : "(none)", interactions);
+
+  summary->bot = bot;
+  summary->consumed = consumed;
+  summary->trace_start_us = trace_begin();
+  int status = provider_call_start(&summary->call, classifier_provider,
+                                   classifier_model, system, user, 100, 0.3f,
+                                   "summary");
+  free(user);
+  if (status != 0) {
+    bot_release(bot);
+  }
+  return status;
+}
+
+// Store the summary from a finished refresh
+static void summary_call_finish(SummaryCall *summary, CURLcode res) {
+  Bot *bot = summary->bot;
+  TokenUsage usage;
+  int estimated;
+  char *text = provider_call_finish(&summary->call, res, &usage, &estimated);
+  trace_end("summarize_bot_memory", summary->trace_start_us, bot->name);
+  record_usage(bot, classifier_provider->name, classifier_model, &usage,
+               estimated);
+  if (text != NULL && text[0] != '\0') {
+    pthread_mutex_lock(&bot_mutex);
+    snprintf(bot->summary, sizeof(bot->summary), "%s", text);
+    bot->unsummarized = bot->unsummarized > summary->consumed
+                            ? bot->unsummarized - summary->consumed
+                            : 0;
+    pthread_mutex_unlock(&bot_mutex);
+  }
+  free(text);
+  bot_release(bot);
+}
+
+// Checks before a reply request runs. Returns the bot, held, or NULL if the
+// request was dropped.
+static Bot *request_admit(BotThreadData *data) {
+  Bot *bot = bot_acquire(data->bot);
+  if (bot == NULL || request_is_stale(data)) {
+    // Kicked or overtaken by the conversation while queued
+    if (!data->fanout) {
+      record_cancellation(0, 0);
+    }
+    if (bot != NULL) {
+      bot_release(bot);
+    }
+    free_bot_thread_data(data);
+    return NULL;
+  }
+  // Past the budget, skip the request before the classifier costs anything
+  if (!budget_allows(bot, data->priority <= PRIORITY_USER_REPLY)) {
+    bot_release(bot);
+    pthread_mutex_lock(&sched_mutex);
+    priority_stats[data->priority].over_budget++;
+    pthread_mutex_unlock(&sched_mutex);
+    free_bot_thread_data(data);
+    return NULL;
+  }
+  return bot;
+}
+
+// Act on the decision whether bot_name responds, made since classify_start.
+// Returns 1 if the reply should be sent after the delay; otherwise the
+// request is done and freed.
+static int request_decided(BotThreadData *data, const char *bot_name,
+                           int respond, uint64_t classify_start) {
+  data->stage_us[STAGE_CLASSIFY] = monotonic_us() - classify_start;
+  trace_end("should_bot_respond", classify_start, bot_name);
+  if (!respond) {
+    pthread_mutex_lock(&sched_mutex);
+    priority_stats[data->priority].declined++;
+    pthread_mutex_unlock(&sched_mutex);
+    free_bot_thread_data(data);
+    return 0;
+  }
+
+  if (data->fanout) {
+    // The bot picked up the message; let the others react to it as well
+    send_chat_query(data->channel, data->query, bot_name, PRIORITY_BOT_REPLY);
+    free_bot_thread_data(data);
+    return 0;
+  }
+  return 1;
+}
+
+// Random delay between 1 and 3 seconds before a bot responds
+static unsigned reply_delay_ms() { return 1000 * (1 + random_below(3)); }
+
+// Count a request whose reply was queued for posting
+static void request_completed(int priority, uint64_t enqueue_us) {
+  uint64_t reply_ms = (monotonic_us() - enqueue_us) / 1000;
+  pthread_mutex_lock(&sched_mutex);
+  priority_stats[priority].completed++;
+  priority_stats[priority].reply_ms_total += reply_ms;
+  if (reply_ms > priority_stats[priority].reply_ms_max) {
+    priority_stats[priority].reply_ms_max = reply_ms;
+  }
+  pthread_mutex_unlock(&sched_mutex);
+}
+
+// Group replies (--group-replies). When a message gets several bots to
+// answer, each would send its own request repeating the same instructions
+// and conversation. Instead, bots deciding to answer the same message
+// through the same provider and model within the coalescing window join a
+// group; when the window closes, one request asks the model for all their
+// replies as JSON, and the replies are posted one by one with short pauses,
+// as if typed. A bot alone in its group sends its usual request, and so does
+// a bot the answer has no usable reply for.
+#define GROUP_MAX_BOTS 16
+#define GROUP_TOKENS_PER_BOT 150 // Completion budget per reply
+
+typedef struct ReplyGroup {
+  int channel;
+  unsigned long context_seq;
+  const Provider *provider;
+  char model[50];
+  uint64_t closes_ms; // End of the coalescing window
+  int open;           // Linked into open_groups, taking members
+  int timed;          // Closed by close_timer, without --reactor
+  int count;
+  BotThreadData *members[GROUP_MAX_BOTS]; // Requests of the bots answering
+  uint64_t joined_us[GROUP_MAX_BOTS];
+  char names[GROUP_MAX_BOTS][50];
+  char *replies[GROUP_MAX_BOTS]; // Parsed from the group's response
+  int next;                      // Next member to post
+  uint64_t trace_start_us;
+  ProviderCall call;
+  TimerEvent close_timer; // Ends the window, without --reactor
+  TimerEvent post_timer;  // Posts the replies, without --reactor
+  LIST_ENTRY(ReplyGroup) entries; // In open, closed or posting_groups
+} ReplyGroup;
+
+LIST_HEAD(ReplyGroupList, ReplyGroup);
+struct ReplyGroupList open_groups = LIST_HEAD_INITIALIZER(open_groups);
+struct ReplyGroupList posting_groups = LIST_HEAD_INITIALIZER(posting_groups);
+// Groups whose window closed, for a worker to send; under sched_mutex
+struct ReplyGroupList closed_groups = LIST_HEAD_INITIALIZER(closed_groups);
+int groups_waiting = 0; // Timed groups not yet taken by a worker, ditto
+int groups_posting = 0; // Length of posting_groups
+unsigned group_window_ms = 0;     // 0 disables group replies
+unsigned long group_requests = 0; // Requests sent for groups
+unsigned long group_members = 0;  // Replies asked for by those requests
+pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Add a request whose bot decided to answer to the open group for its
+// message, provider and model, opening one if there is none. Takes
+// ownership of data. Returns the group if the request opened it, to see
+// that it is closed and sent; NULL if it joined another group or was
+// dropped.
+ReplyGroup *group_join(BotThreadData *data) {
+  Bot *bot = bot_acquire(data->bot);
+  if (bot == NULL) {
+    record_cancellation(0, 0);
+    free_bot_thread_data(data);
+    return NULL;
+  }
+  const Provider *provider = provider_find(bot->api_type);
+  char model[sizeof(bot->model)];
+  snprintf(model, sizeof(model), "%s", bot->model);
+  bot_release(bot);
+
+  pthread_mutex_lock(&group_mutex);
+  ReplyGroup *group;
+  LIST_FOREACH(group, &open_groups, entries) {
+    if (group->channel == data->channel &&
+        group->context_seq == data->context_seq &&
+        group->provider == provider && strcmp(group->model, model) == 0 &&
+        group->count < GROUP_MAX_BOTS &&
+        strcmp(group->members[0]->query, data->query) == 0) {
+      break;
+    }
+  }
+  for (int i = 0; group != NULL && i < group->count; i++) {
+    if (group->members[i]->bot.index == data->bot.index &&
+        group->members[i]->bot.generation == data->bot.generation) {
+      // Relayed to the bot again by another bot; one reply will do
+      pthread_mutex_unlock(&group_mutex);
+      pthread_mutex_lock(&sched_mutex);
+      priority_stats[data->priority].declined++;
+      pthread_mutex_unlock(&sched_mutex);
+      free_bot_thread_data(data);
+      return NULL;
+    }
+  }
+  ReplyGroup *opened = NULL;
+  if (group == NULL && (group = calloc(1, sizeof(ReplyGroup))) != NULL) {
+    group->channel = data->channel;
+    group->context_seq = data->context_seq;
+    group->provider = provider;
+    snprintf(group->model, sizeof(group->model), "%s", model);
+    group->closes_ms = monotonic_ms() + group_window_ms;
+    group->open = 1;
+    LIST_INSERT_HEAD(&open_groups, group, entries);
+    opened = group;
+  }
+  if (group != NULL) {
+    group->joined_us[group->count] = monotonic_us();
+    group->members[group->count++] = data;
+  }
+  pthread_mutex_unlock(&group_mutex);
+  if (group == NULL) {
+    free_bot_thread_data(data); // Out of memory
+  }
+  return opened;
+}
+
+// Close the group to new members, if its close_timer hasn't already. A
+// group of one is dissolved and its request returned, to be sent as a
+// normal reply; otherwise returns NULL and the group's request is next.
+BotThreadData *group_close(ReplyGroup *group) {
+  pthread_mutex_lock(&group_mutex);
+  if (group->open) {
+    LIST_REMOVE(group, entries);
+    group->open = 0;
+  }
+  pthread_mutex_unlock(&group_mutex);
+  uint64_t now = monotonic_us();
+  for (int i = 0; i < group->count; i++) {
+    group->members[i]->stage_us[STAGE_DELAY] = now - group->joined_us[i];
+  }
+  if (group->count > 1) {
+    return NULL;
+  }
+  BotThreadData *data = group->members[0];
+  free(group);
+  return data;
+}
+
+// Prepare one request for the replies of every bot in a closed group.
+// Returns 0 if it is ready to perform; otherwise the group gets no replies.
+int group_call_start(ReplyGroup *group) {
+  const BotThreadData *first = group->members[0];
+  char context[MAX_QUERY_SIZE * 5];
+  format_channel_context(first->channel, context, sizeof(context));
+
+  // Each bot's line is clipped, so the prompt's size is bounded
+  size_t size = sizeof(context) + GROUP_MAX_BOTS * (MEMORY_PROMPT_SIZE + 512) +
+                MAX_RESPONSE_SIZE + 256;
+  char *user = malloc(size);
+  if (user == NULL) {
+    return -1;
+  }
+  int length = snprintf(user, size, "Recent conversation:\n%sThe bots:\n",
+                        context);
+  float temperature = 0.8f;
+  for (int i = 0; i < group->count; i++) {
+    Bot *bot = bot_acquire(group->members[i]->bot);
+    if (bot == NULL) {
+      continue; // Kicked meanwhile; the bot gets no reply
+    }
+    char memory[MEMORY_PROMPT_SIZE];
+    format_bot_memory(bot, memory, sizeof(memory));
+    length += snprintf(user + length, size - length,
+                       "- %.50s%s: %.200s. Remembers: %s\n", bot->name,
+                       is_mentioned(first->query, bot->name) ? " (mentioned)"
+                                                              : "",
+                       bot->personality, memory);
+    snprintf(group->names[i], sizeof(group->names[i]), "%s", bot->name);
+    if (i == 0) {
+      temperature = bot_temperature(bot->handle);
+    }
+    bot_release(bot);
+  }
+  snprintf(user + length, size - length,
+           "The message to answer, from %.50s: %.2000s", first->sender,
+           first->query);
+
+  const char *system =
+      "You write the next messages of several bots in an IRC-style chat "
+      "room. Each bot answers the message in its own voice and personality: "
+      "sarcastic, joking, poking fun at the user or the other bots, never "
+      "overly helpful or polite, one or two sentences, no name prefix. "
+      "Reply with JSON only, no other text, in the form "
+      "{\"replies\": [{\"bot\": \"<name>\", \"reply\": \"<message>\"}]}, "
+      "with one entry for each bot listed.";
+  int status = -1;
+  if (group->provider == NULL) {
+    log_error("Unknown bot API type for a group reply");
+  } else {
+    group->trace_start_us = trace_begin();
+    status = provider_call_start(&group->call, group->provider, group->model,
+                                 system, user,
+                                 GROUP_TOKENS_PER_BOT * group->count,
+                                 temperature, "group");
+  }
+  free(user);
+  if (status == 0) {
+    pthread_mutex_lock(&group_mutex);
+    group_requests++;
+    group_members += group->count;
+    pthread_mutex_unlock(&group_mutex);
+    for (int i = 0; i < group->count; i++) {
+      bot_set_typing(group->members[i]->bot, 1);
+    }
+    update_sidebar();
+  }
+  return status;
+}
+
+// Match the replies in the model's answer to the bots of the group
+static void group_parse_replies(ReplyGroup *group, const char *text) {
+  // Models like to wrap the JSON in prose or a code block
+  const char *start = text != NULL ? strchr(text, '{') : NULL;
+  const char *end = text != NULL ? strrchr(text, '}') : NULL;
+  char *json = start != NULL && end > start
+                   ? strndup(start, end - start + 1)
+                   : NULL;
+  struct json_object *parsed = json != NULL ? json_tokener_parse(json) : NULL;
+  struct json_object *replies;
+  free(json);
+  if (parsed == NULL ||
+      !json_object_object_get_ex(parsed, "replies", &replies) ||
+      !json_object_is_type(replies, json_type_array)) {
+    char message[MAX_QUERY_SIZE + 64];
+    snprintf(message, sizeof(message), "Unusable group reply: %.200s",
+             text != NULL ? text : "(none)");
+    log_error(message);
+    json_object_put(parsed);
+    return;
+  }
+
+  size_t count = json_object_array_length(replies);
+  for (size_t r = 0; r < count; r++) {
+    struct json_object *entry = json_object_array_get_idx(replies, r);
+    struct json_object *name, *reply;
+    if (!json_object_object_get_ex(entry, "bot", &name) ||
+        !json_object_object_get_ex(entry, "reply", &reply) ||
+        !json_object_is_type(name, json_type_string) ||
+        !json_object_is_type(reply, json_type_string)) {
+      continue; // Not an entry for a bot, e.g. null for one with no answer
+    }
+    const char *bot_name = json_object_get_string(name);
+    const char *reply_text = json_object_get_string(reply);
+    bot_name += bot_name[0] == '@';
+    for (int i = 0; i < group->count; i++) {
+      if (group->replies[i] == NULL && reply_text[0] != '\0' &&
+          strcmp(group->names[i], bot_name) == 0) {
+        group->replies[i] = strdup(reply_text);
+        break;
+      }
+    }
+  }
+  json_object_put(parsed);
+}
+
+// Handle the end of a group's request, splitting the tokens used evenly
+// between its bots
+void group_call_finish(ReplyGroup *group, CURLcode res) {
+  if (res == CURLE_OK) {
+    for (int i = 0; i < group->count; i++) {
+      record_transfer_times(group->call.curl, group->members[i]->stage_us);
+    }
+  }
+  TokenUsage usage;
+  int estimated;
+  char *text = provider_call_finish(&group->call, res, &usage, &estimated);
+  trace_end("group reply", group->trace_start_us, group->model);
+  uint64_t parse_start = monotonic_us();
+  group_parse_replies(group, text);
+  free(text);
+  uint64_t parse_us = monotonic_us() - parse_start;
+
+  for (int i = 0; i < group->count; i++) {
+    TokenUsage share = {usage.prompt / group->count,
+                        usage.completion / group->count,
+                        usage.cached / group->count};
+    if (i == 0) {
+      share.prompt += usage.prompt % group->count;
+      share.completion += usage.completion % group->count;
+      share.cached += usage.cached % group->count;
+    }
+    group->members[i]->stage_us[STAGE_PARSE] = parse_us;
+    Bot *bot = bot_acquire(group->members[i]->bot);
+    record_usage(bot, group->provider->name, group->model, &share, estimated);
+    if (bot != NULL) {
+      bot_release(bot);
+    }
+    bot_set_typing(group->members[i]->bot, 0);
+  }
+  update_sidebar();
+}
+
+// Take the members the group's answer has no reply for out of the group,
+// into alone, to send their own requests instead. Returns how many.
+int group_take_unanswered(ReplyGroup *group, BotThreadData **alone) {
+  int count = 0;
+  int kept = 0;
+  for (int i = 0; i < group->count; i++) {
+    if (group->replies[i] == NULL) {
+      alone[count++] = group->members[i];
+    } else {
+      group->members[kept] = group->members[i];
+      group->replies[kept] = group->replies[i];
+      kept++;
+    }
+  }
+  group->count = kept;
+  return count;
+}
+
+// Post the next reply of a group whose request is over. Returns the ms to
+// pause before the following reply, or 0 once every member is done and the
+// group can be freed.
+unsigned group_post_next(ReplyGroup *group) {
+  while (group->next < group->count) {
+    int i = group->next++;
+    BotThreadData *data = group->members[i];
+    Bot *bot = bot_acquire(data->bot);
+    if (bot != NULL && request_is_stale(data)) {
+      bot_release(bot);
+      bot = NULL;
+    }
+    if (bot != NULL) {
+      if (queue_bot_reply(data, bot, group->replies[i]) == 0) {
+        request_completed(data->priority, data->enqueue_us);
+      }
+      bot_release(bot);
+    } else {
+      // Kicked, or the conversation moved on, while earlier replies posted;
+      // the reply was already paid for
+      record_cancellation(1, SIZE_MAX);
+      free(group->replies[i]);
+    }
+    free_bot_thread_data(data);
+    if (bot != NULL && group->next < group->count) {
+      return 500 + random_below(1500);
+    }
+  }
+  return 0;
+}
+
+// Free a group whose replies won't all be posted, dropping the requests
+// still in it
+void group_discard(ReplyGroup *group) {
+  pthread_mutex_lock(&group_mutex);
+  if (group->open) {
+    LIST_REMOVE(group, entries);
+  }
+  pthread_mutex_unlock(&group_mutex);
+  for (int i = group->next; i < group->count; i++) {
+    free_bot_thread_data(group->members[i]);
+    free(group->replies[i]);
+  }
+  free(group);
+}
+
+// Timer callback: post a group's next reply, freeing it after the last
+static unsigned group_post_timer(void *arg) {
+  ReplyGroup *group = arg;
+  unsigned pause = group_post_next(group);
+  if (pause == 0) {
+    pthread_mutex_lock(&group_mutex);
+    LIST_REMOVE(group, entries);
+    groups_posting--;
+    pthread_mutex_unlock(&group_mutex);
+    timer_release(&group->post_timer, free, group);
+  }
+  return pause;
+}
+
+// Hand a group's replies to the timer wheel, which pauses between them.
+// While the timer isn't running they are posted right away.
+static void group_post(ReplyGroup *group) {
+  group->post_timer.callback = group_post_timer;
+  group->post_timer.arg = group;
+  pthread_mutex_lock(&timer_mutex);
+  int running = timer_running;
+  if (running) {
+    pthread_mutex_lock(&group_mutex);
+    LIST_INSERT_HEAD(&posting_groups, group, entries);
+    groups_posting++;
+    pthread_mutex_unlock(&group_mutex);
+    timer_schedule_locked(&group->post_timer, 0);
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  if (!running) {
+    while (group_post_next(group) > 0) {
+    }
+    free(group);
+  }
+}
+
+// Drop the groups still on the timer wheel, waiting for their window to
+// close or posting replies, after timer_stop
+void group_stop_posting() {
+  pthread_mutex_lock(&group_mutex);
+  ReplyGroup *group;
+  while ((group = LIST_FIRST(&posting_groups)) != NULL) {
+    LIST_REMOVE(group, entries);
+    groups_posting--;
+    pthread_mutex_unlock(&group_mutex);
+    timer_cancel(&group->post_timer);
+    group_discard(group);
+    pthread_mutex_lock(&group_mutex);
+  }
+  while (1) {
+    LIST_FOREACH(group, &open_groups, entries) {
+      if (group->timed) {
+        break;
+      }
+    }
+    if (group == NULL) {
+      break;
+    }
+    LIST_REMOVE(group, entries);
+    group->open = 0;
+    pthread_mutex_unlock(&group_mutex);
+    timer_cancel(&group->close_timer);
+    pthread_mutex_lock(&sched_mutex);
+    groups_waiting--;
+    pthread_mutex_unlock(&sched_mutex);
+    group_discard(group);
+    pthread_mutex_lock(&group_mutex);
+  }
+  pthread_mutex_unlock(&group_mutex);
+}
+
+// Timer callback: end a group's coalescing window and hand it to a worker
+static unsigned group_close_timer(void *arg) {
+  ReplyGroup *group = arg;
+  pthread_mutex_lock(&group_mutex);
+  LIST_REMOVE(group, entries);
+  group->open = 0;
+  pthread_mutex_unlock(&group_mutex);
+  pthread_mutex_lock(&sched_mutex);
+  LIST_INSERT_HEAD(&closed_groups, group, entries);
+  pthread_cond_signal(&sched_cond);
+  pthread_mutex_unlock(&sched_mutex);
+  return 0;
+}
+
+// Send a group whose window is over, on a worker, and answer for it: hand
+// the replies to the timer wheel, then send their own requests for the bots
+// the answer left out, or for the one bot in the group
+static void group_send(ReplyGroup *group) {
+  BotThreadData *alone[GROUP_MAX_BOTS];
+  int count = 1;
+  if ((alone[0] = group_close(group)) == NULL) {
+    if (group_call_start(group) == 0) {
+      group_call_finish(group, curl_easy_perform(group->call.curl));
+    }
+    count = group_take_unanswered(group, alone);
+    group_post(group);
+  }
+  for (int i = 0; i < count; i++) {
+    int priority = alone[i]->priority;
+    uint64_t enqueue_us = alone[i]->enqueue_us;
+    if (bot_response_thread(alone[i])) { // Frees the request
+      request_completed(priority, enqueue_us);
+    }
+  }
+}
+
+// Join the group for data's message on a worker. The request that opened
+// the group leaves it to the timer wheel, which closes it when the window
+// is over and passes it to the next free worker to send; while the timer
+// isn't running, the request waits for the window and sends it itself.
+static void run_group(BotThreadData *data) {
+  ReplyGroup *group = group_join(data);
+  if (group == NULL) {
+    return;
+  }
+  uint64_t now = monotonic_ms();
+  unsigned window_ms = group->closes_ms > now ? group->closes_ms - now : 0;
+  group->close_timer.callback = group_close_timer;
+  group->close_timer.arg = group;
+  pthread_mutex_lock(&timer_mutex);
+  int running = timer_running;
+  if (running) {
+    pthread_mutex_lock(&group_mutex);
+    group->timed = 1;
+    pthread_mutex_unlock(&group_mutex);
+    pthread_mutex_lock(&sched_mutex);
+    groups_waiting++;
+    pthread_mutex_unlock(&sched_mutex);
+    timer_schedule_locked(&group->close_timer, window_ms);
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  if (!running) {
+    usleep(window_ms * 1000);
+    group_send(group);
+  }
+}
+
+// Decide whether the target bot answers and, if so, run the request
+static void run_request(BotThreadData *data) {
+  if (data->summarize) {
+    SummaryCall summary;
+    if (summary_call_start(&summary, data) == 0) {
+      summary_call_finish(&summary, curl_easy_perform(summary.call.curl));
+    }
+    return;
+  }
+
+  Bot *bot = request_admit(data);
+  if (bot == NULL) {
+    return;
+  }
+  char bot_name[sizeof(bot->name)];
+  strcpy(bot_name, bot->name);
+  int is_bot_mentioned = is_mentioned(data->query, bot->name);
+
+  uint64_t classify_start = monotonic_us();
+  TokenUsage usage = {0};
+  char memory[MEMORY_PROMPT_SIZE];
+  format_bot_memory(bot, memory, sizeof(memory));
+  int respond = should_bot_respond(data->query, bot->personality, memory,
+                                   bot->name, is_bot_mentioned, &usage);
+  record_usage(bot, classifier_provider->name, classifier_model, &usage, 0);
+  bot_release(bot);
+  if (!request_decided(data, bot_name, respond, classify_start)) {
+    return;
+  }
+
+  if (group_window_ms > 0) {
+    // The coalescing window stands in for the delay
+    run_group(data);
+    return;
+  }
+
+  // Wait a moment before responding
+  uint64_t delay_start = monotonic_us();
+  usleep(reply_delay_ms() * 1000);
+  data->stage_us[STAGE_DELAY] = monotonic_us() - delay_start;
+  trace_end("sleep", delay_start, bot_name);
+
+  // bot_response_thread drops the request if it went stale during the delay
+  int priority = data->priority;
+  uint64_t enqueue_us = data->enqueue_us;
+  if (bot_response_thread(data)) { // Frees data
+    request_completed(priority, enqueue_us);
+  }
+}
+
+// Take the next request to run, highest priority class first, counting it
+// as started. Called with sched_mutex held and a request pending.
+static BotThreadData *scheduler_take_locked() {
+  BotThreadData *data = NULL;
+  for (int p = 0; p < PRIORITY_CLASSES && data == NULL; p++) {
+    data = queue_pop(request_queues[p]);
+  }
+  pending_requests--;
+  priority_stats[data->priority].started++;
+  data->stage_us[STAGE_QUEUE] = monotonic_us() - data->enqueue_us;
+  trace_async("queued", (uintptr_t)data, data->enqueue_us,
+              data->enqueue_us + data->stage_us[STAGE_QUEUE],
+              priority_names[data->priority]);
+  uint64_t wait_ms = data->stage_us[STAGE_QUEUE] / 1000;
+  priority_stats[data->priority].wait_ms_total += wait_ms;
+  if (wait_ms > priority_stats[data->priority].wait_ms_max) {
+    priority_stats[data->priority].wait_ms_max = wait_ms;
+  }
+  active_requests++;
+  return data;
+}
+
+// Worker thread: sends the groups whose window closed, then runs queued
+// requests, highest priority class first
+void *request_worker(void *arg) {
+  (void)arg;
+  trace_thread_name("worker");
+  while (1) {
+    pthread_mutex_lock(&sched_mutex);
+    while (pending_requests == 0 && LIST_EMPTY(&closed_groups) &&
+           scheduler_running) {
+      pthread_cond_wait(&sched_cond, &sched_mutex);
+    }
+    if (!scheduler_running) {
+      pthread_mutex_unlock(&sched_mutex);
+      break;
+    }
+
+    ReplyGroup *group = LIST_FIRST(&closed_groups);
+    BotThreadData *data = NULL;
+    if (group != NULL) {
+      LIST_REMOVE(group, entries);
+      groups_waiting--;
+      active_requests++;
+    } else {
+      data = scheduler_take_locked();
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    if (group != NULL) {
+      group_send(group);
+    } else {
+      run_request(data);
+    }
+
+    pthread_mutex_lock(&sched_mutex);
+    active_requests--;
+    pthread_mutex_unlock(&sched_mutex);
+  }
+  return NULL;
+}
+
+void scheduler_start() {
+  for (int p = 0; p < PRIORITY_CLASSES; p++) {
+    request_queues[p] = queue_create();
+  }
+  scheduler_running = 1;
+  for (int i = 0; i < MAX_THREADS && !reactor_mode; i++) {
+    pthread_create(&request_workers[i], NULL, request_worker, NULL);
+  }
+}
+
+void scheduler_stop() {
+  pthread_mutex_lock(&sched_mutex);
+  scheduler_running = 0;
+  pthread_cond_broadcast(&sched_cond);
+  pthread_mutex_unlock(&sched_mutex);
+  for (int i = 0; i < MAX_THREADS && !reactor_mode; i++) {
+    pthread_join(request_workers[i], NULL);
+  }
+  for (int p = 0; p < PRIORITY_CLASSES; p++) {
+    BotThreadData *data;
+    while ((data = queue_pop(request_queues[p])) != NULL) {
+      free_bot_thread_data(data);
+    }
+    queue_destroy(request_queues[p]);
+  }
+  ReplyGroup *group;
+  while ((group = LIST_FIRST(&closed_groups)) != NULL) {
+    LIST_REMOVE(group, entries);
+    groups_waiting--;
+    group_discard(group);
+  }
+}
+
+// Show per-stage reply latency percentiles for each provider/model
+void handle_latency_stats() {
+  // Work on a copy so the chat window isn't drawn under latency_mutex
+  pthread_mutex_lock(&latency_mutex);
+  int count = latency_stats_count;
+  LatencyStats *snapshot = malloc((count ? count : 1) * sizeof(*snapshot));
+  if (snapshot != NULL && count > 0) {
+    memcpy(snapshot, latency_stats, count * sizeof(*snapshot));
+  }
+  pthread_mutex_unlock(&latency_mutex);
+  if (snapshot == NULL) {
+    return;
+  }
+  if (count == 0) {
+    add_chat_message("system", "system", "Latency: no replies yet");
+  }
+
+  for (int i = 0; i < count; i++) {
+    LatencyStats *stats = &snapshot[i];
+    char info[1024];
+    int len = snprintf(info, sizeof(info),
+                       "Latency %s/%s (%lu replies), ms p50/p95/p99/max:\n",
+                       stats->api_type, stats->model,
+                       (unsigned long)stats->stages[STAGE_TOTAL].count);
+    for (int stage = 0; stage < LATENCY_STAGES && len < (int)sizeof(info);
+         stage++) {
+      const LatencyHistogram *hist = &stats->stages[stage];
+      len += snprintf(info + len, sizeof(info) - len,
+                      "%-10s %9.1f %9.1f %9.1f %9.1f\n",
+                      latency_stage_names[stage],
+                      histogram_percentile(hist, 50) / 1000.0,
+                      histogram_percentile(hist, 95) / 1000.0,
+                      histogram_percentile(hist, 99) / 1000.0,
+                      hist->max_us / 1000.0);
+    }
+    add_chat_message("system", "system", info);
+  }
+  free(snapshot);
+}
+
+// Show per-class scheduler metrics in the chat window
+void handle_stats() {
+  char info[1024];
+  int len =
+      snprintf(info, sizeof(info), "Scheduler (queued: %d, load: %s):\n",
+               scheduler_queue_depth(), load_level_name());
+  pthread_mutex_lock(&sched_mutex);
+  for (int p = 0; p < PRIORITY_CLASSES && len < (int)sizeof(info); p++) {
+    PriorityStats *st = &priority_stats[p];
+    len += snprintf(
+        info + len, sizeof(info) - len,
+        "%-10s queued %lu, replied %lu, declined %lu, preempted %lu, "
+        "rejected %lu, over budget %lu, shed %lu | wait avg %lu ms max %lu "
+        "ms | reply avg %lu ms max %lu ms\n",
+        priority_names[p], st->enqueued, st->completed, st->declined,
+        st->preempted, st->rejected, st->over_budget, st->shed,
+        st->started ? (unsigned long)(st->wait_ms_total / st->started) : 0,
+        (unsigned long)st->wait_ms_max,
+        st->completed ? (unsigned long)(st->reply_ms_total / st->completed)
+                      : 0,
+        (unsigned long)st->reply_ms_max);
+  }
+  pthread_mutex_unlock(&sched_mutex);
+
+  pthread_mutex_lock(&cancel_mutex);
+  if (len < (int)sizeof(info)) {
+    len += snprintf(info + len, sizeof(info) - len,
+                    "Cancelled stale requests: %lu (~%lu tokens saved)\n",
+                    cancelled_requests, tokens_saved);
+  }
+  pthread_mutex_unlock(&cancel_mutex);
+  pthread_mutex_lock(&group_mutex);
+  if (group_window_ms > 0 && len < (int)sizeof(info)) {
+    snprintf(info + len, sizeof(info) - len,
+             "Group replies: %lu requests for %lu bots (%lu requests saved)\n",
+             group_requests, group_members, group_members - group_requests);
+  }
+  pthread_mutex_unlock(&group_mutex);
+  add_chat_message("system", "system", info);
+  handle_latency_stats();
+  handle_cost_stats();
+}
+
+// Queue a reply request for every bot in the channel other than the sender.
+// Requests for bots mentioned in the query are promoted to
+// PRIORITY_MENTION. Past the channel's request budget only replies to a
+// human are queued.
+void send_chat_query(int channel, const char *query, const char *sender,
+                     int priority) {
+  BotHandle mentioned[MAX_MENTIONS];
+  int mention_count = find_mentions(query, mentioned, MAX_MENTIONS);
+  BotHandle *handles;
+  int count = channel_members(channel, &handles);
+  for (int i = 0; i < count; i++) {
+    Bot *bot = bot_acquire(handles[i]);
+    if (bot == NULL) {
+      continue; // Kicked since the snapshot was taken
+    }
+
+    // Skip if the bot is responding to its own message
+    int is_sender = strcmp(sender, bot->name) == 0;
+    bot_release(bot);
+    if (is_sender) {
+      continue;
+    }
+    int is_bot_mentioned = 0;
+    for (int m = 0; m < mention_count; m++) {
+      is_bot_mentioned |= mentioned[m].index == handles[i].index &&
+                          mentioned[m].generation == handles[i].generation;
+    }
+
+    int request_priority = is_bot_mentioned ? PRIORITY_MENTION : priority;
+    if (!channel_admit(channel, request_priority <= PRIORITY_USER_REPLY)) {
+      continue;
+    }
+
+    BotThreadData *thread_data = calloc(1, sizeof(BotThreadData));
+    thread_data->query = strdup(query);
+    thread_data->sender = strdup(sender);
+    thread_data->bot = handles[i];
+    thread_data->channel = channel;
+    thread_data->priority = request_priority;
+    thread_data->context_seq = channel_seq(channel);
+    schedule_request(thread_data);
+  }
+  free(handles);
+}
+
+// Queue requests asking each bot in the channel whether it picks up a
+// message; bots that do relay it to the others (bot-to-bot conversation)
+void send_fanout_query(int channel, const char *query, const char *sender) {
+  BotHandle *handles;
+  int count = channel_members(channel, &handles);
+  for (int i = 0; i < count; i++) {
+    if (!channel_admit(channel, 0)) {
+      break;
+    }
+    BotThreadData *thread_data = calloc(1, sizeof(BotThreadData));
+    thread_data->query = strdup(query);
+    thread_data->sender = strdup(sender);
+    thread_data->bot = handles[i];
+    thread_data->channel = channel;
+    thread_data->priority = PRIORITY_BOT_REPLY;
+    thread_data->fanout = 1;
+    thread_data->context_seq = channel_seq(channel);
+    schedule_request(thread_data);
+  }
+  free(handles);
+}
+
+// Post a chat message from a human (the local user or an IRC client) to a
+// channel and queue the replies of the bots in it
+void post_user_message(int channel, const char *sender, const char *message) {
+  add_channel_message(channel, "user", sender, message);
+  messages_sent++;
+  update_status_bar();
+
+  // Bots loaded from a roster arm their timers on first activity
+  schedule_bot_timers();
+
+  send_chat_query(channel, message, sender, PRIORITY_USER_REPLY);
+  send_fanout_query(channel, message, sender);
+}
+
+// Handle a line entered by the user: a slash command or a chat message
+void submit_user_input(const char *line) {
+  uint64_t trace_start_us = trace_begin();
+  char query[MAX_QUERY_SIZE];
+  strncpy(query, line, sizeof(query) - 1);
+  query[sizeof(query) - 1] = '\0';
+
+  if (query[0] == '/') {
+    handle_command(query);
+  } else {
+    post_user_message(current_channel, user_name, query);
+  }
+  trace_end("submit_user_input", trace_start_us, NULL);
+}
+
+// The line being typed, with the names being cycled by repeated tabs
+typedef struct {
+  char query[MAX_QUERY_SIZE];
+  int cursor_pos;
+  char completions[MAX_COMPLETIONS][sizeof(user_name)];
+  int completion_count;
+  int completion_next;
+} InputLine;
+
+static void input_draw(const InputLine *line) {
+  wmove(input_win, 0, 0);
+  wclrtoeol(input_win);
+  mvwprintw(input_win, 0, 0, "%s", line->query);
+  // cursor_pos is a byte offset; multibyte and wide characters make the
+  // column differ
+  wmove(input_win, 0, text_width(line->query, line->cursor_pos));
+  wrefresh(input_win);
+}
+
+// Apply one key to the line being typed
+static void input_key(InputLine *line, int ch) {
+  char *query = line->query;
+  int cursor_pos = line->cursor_pos;
+  if (ch != '\t') {
+    line->completion_count = 0;
+  }
+
+  if (ch == '\n') {
+    submit_user_input(query);
+    memset(query, 0, MAX_QUERY_SIZE);
+    cursor_pos = 0;
+  } else if (ch == KEY_BACKSPACE || ch == 127) {
+    if (cursor_pos > 0) {
+      int start = cursor_pos - 1;
+      while (start > 0 && (query[start] & 0xC0) == 0x80) {
+        start--; // Delete a whole UTF-8 character
+      }
+      memmove(&query[start], &query[cursor_pos],
+              strlen(query) - cursor_pos + 1);
+      cursor_pos = start;
+    }
+  } else if (ch == ('N' & 0x1f) || ch == ('P' & 0x1f)) {
+    cycle_channel(ch == ('N' & 0x1f) ? 1 : -1); // Ctrl-N / Ctrl-P
+  } else if (ch == '\t') {
+    // Complete the name after the last '@'; repeated tabs cycle through
+    // every match
+    int at_pos = cursor_pos - 1;
+    while (at_pos >= 0 && query[at_pos] != '@') {
+      at_pos--;
+    }
+    if (at_pos >= 0) {
+      if (line->completion_count == 0) {
+        char partial[MAX_QUERY_SIZE];
+        strncpy(partial, &query[at_pos + 1], cursor_pos - at_pos - 1);
+        partial[cursor_pos - at_pos - 1] = '\0';
+        line->completion_count =
+            complete_nick(partial, line->completions, MAX_COMPLETIONS);
+        line->completion_next = 0;
+      }
+      const char *match = line->completions[line->completion_next];
+      int match_len = line->completion_count > 0 ? (int)strlen(match) : 0;
+      if (line->completion_count > 0 &&
+          strlen(query) - (cursor_pos - at_pos - 1) + match_len <
+              MAX_QUERY_SIZE) {
+        line->completion_next =
+            (line->completion_next + 1) % line->completion_count;
+        memmove(&query[at_pos + match_len + 1], &query[cursor_pos],
+                strlen(query) - cursor_pos + 1);
+        memcpy(&query[at_pos + 1], match, match_len);
+        cursor_pos = at_pos + match_len + 1;
+      }
+    }
+  } else if (cursor_pos < MAX_QUERY_SIZE - 1) {
+    memmove(&query[cursor_pos + 1], &query[cursor_pos],
+            strlen(query) - cursor_pos + 1);
+    query[cursor_pos] = ch;
+    cursor_pos++;
+  }
+  line->cursor_pos = cursor_pos;
+}
+
+// Process user input and display responses
+void *process_user_input(void *arg) {
+  (void)arg;
+  trace_thread_name("input");
+  static InputLine line;
+  while (1) {
+    input_draw(&line);
+    input_key(&line, wgetch(input_win));
+  }
+}
+
+// Initialize ncurses
+void init_ncurses() {
+  setlocale(LC_CTYPE, ""); // Draw UTF-8 text in UTF-8 terminals
+  initscr();
+  start_color();
+  keypad(stdscr, TRUE); // Enable keypad input
+
+  // Define color pairs
+  init_pair(COLOR_TIME, COLOR_BLUE, COLOR_BLACK);
+  init_pair(COLOR_USERNAME_USER, COLOR_CYAN, COLOR_BLACK);
+  init_pair(COLOR_USERNAME_ASSISTANT, COLOR_GREEN, COLOR_BLACK);
+  init_pair(COLOR_BRACKETS, COLOR_YELLOW, COLOR_BLACK);
+  init_pair(COLOR_STATUS_BAR, COLOR_WHITE,
+            COLOR_BLUE); // Status bar has a blue background
+  init_pair(COLOR_TEXT, COLOR_WHITE, COLOR_BLACK);
+  init_pair(COLOR_SIDEBAR, COLOR_GREEN, COLOR_BLACK);
+  init_pair(COLOR_SYSTEM_MESSAGE, COLOR_MAGENTA, COLOR_BLACK);
+  init_pair(COLOR_LLM_MESSAGE, COLOR_GREEN, COLOR_BLACK);
+  init_pair(COLOR_TYPING, COLOR_BLACK, COLOR_YELLOW);
+
+  noecho();
+  cbreak();
+
+  int height, width;
+  getmaxyx(stdscr, height, width);
+
+  // Create windows for different sections
+  sidebar_win = newwin(height - 2, 20, 0, 0); // Sidebar for connected users
+  chat_win = newwin(height - 3, width - 20, 0, 20); // Chat window
+  status_win = newwin(1, width - 20, height - 2,
+                      20); // Status bar (one line above input)
+  input_win = newwin(1, width - 20, height - 1, 20); // Input box
+
+  update_sidebar();
+  update_chat_window();
+  update_status_bar();
+}
+
+// Function to set up logging. The log is opened for reading too, since
+// /search reads messages that scrolled out of the history back from it.
+void setup_logging(const char *log_filename) {
+  if (log_filename == NULL) {
+    // Generate default log filename
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    char default_filename[64];
+    strftime(default_filename, sizeof(default_filename), "%Y%m%d_%H%M%S.log",
+             t);
+    log_file = fopen(default_filename, "w+");
+  } else {
+    log_file = fopen(log_filename, "w+");
+  }
+
+  if (log_file == NULL) {
+    fprintf(stderr, "Error: Unable to open log file.\n");
+  }
+}
+
+// Timer callback for autonomous bot behavior. Runs on the timer thread;
+// replies are only queued here and run on the request workers.
+unsigned bot_autonomous_behavior(void *arg) {
+  Bot *bot = (Bot *)arg;
+  if (!bot_handle_valid(bot->handle) ||
+      __atomic_load_n(&chatter_stopped, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  uint64_t trace_start_us = trace_begin();
+
+  // Decide if the bot wants to speak
+  if ((int)random_below(100) < load_autonomous_percent()) { // 30% unless under load
+    // Generate a message based on the bot's personality and recent memory
+    char message[MAX_QUERY_SIZE * 2];
+    int message_size = sizeof(message);
+    int written = snprintf(
+        message, message_size,
+        "As %.50s, I want to say something based on my personality: %.200s",
+        bot->name, bot->personality);
+    if (written >= message_size) {
+      log_error("Message truncated in bot_autonomous_behavior");
+    }
+
+    // Send the generated message to one of the bot's channels
+    uint32_t mask = bot_channels(bot->handle);
+    int member_of = __builtin_popcount(mask);
+    if (member_of > 0) {
+      for (int pick = random_below(member_of); pick > 0; pick--) {
+        mask &= mask - 1;
+      }
+      send_chat_query(__builtin_ctz(mask), message, bot->name,
+                      PRIORITY_AUTONOMOUS);
+    }
+  }
+
+  trace_end("bot_autonomous_behavior", trace_start_us, bot->name);
+  return autonomous_delay_ms();
+}
+
+// Post a bot's reply taken off the response queue, dropping it if the bot
+// was kicked or the conversation moved on while it was being generated
+void post_bot_response(BotThreadData *data) {
+  Bot *bot = NULL;
+  if (request_is_stale(data)) {
+    record_cancellation(1, SIZE_MAX);
+  } else {
+    bot = bot_acquire(data->bot);
+  }
+  if (bot != NULL) {
+    uint64_t post_start = trace_begin();
+    add_channel_message(data->channel, "assistant", bot->name, data->query);
+    trace_end("post reply", post_start, bot->name);
+    uint64_t rendered_us = monotonic_us();
+    data->stage_us[STAGE_RENDER] = rendered_us - data->reply_us;
+    data->stage_us[STAGE_TOTAL] = rendered_us - data->enqueue_us;
+    latency_record(bot->api_type, bot->model, data->stage_us);
+    messages_received++;
+    update_status_bar();
+    update_bot_memory(bot, data->prompt, data->query);
+    bot_release(bot);
+  }
+
+  // Clean up
+  free_bot_thread_data(data);
+
+  pthread_mutex_lock(&queue_mutex);
+  outstanding_responses--;
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+// Function to process bot responses
+void *process_bot_responses(void *arg) {
+  (void)arg;
+  trace_thread_name("responses");
+  while (1) {
+    pthread_mutex_lock(&queue_mutex);
+    while (response_queue->front == NULL && !status_bar_stale) {
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+    }
+    int redraw = status_bar_stale;
+    status_bar_stale = 0;
+
+    // Get the response from the queue
+    BotThreadData *data = queue_pop(response_queue);
+    pthread_mutex_unlock(&queue_mutex);
+    if (redraw) {
+      update_status_bar();
+    }
+    if (data != NULL) {
+      post_bot_response(data);
+    }
+  }
+
+  return NULL;
+}
+
+// Requests queued or running plus replies not yet posted
+int requests_busy() {
+  pthread_mutex_lock(&sched_mutex);
+  int busy = pending_requests + active_requests + groups_waiting;
+  pthread_mutex_unlock(&sched_mutex);
+  pthread_mutex_lock(&queue_mutex);
+  busy += outstanding_responses;
+  pthread_mutex_unlock(&queue_mutex);
+  pthread_mutex_lock(&group_mutex);
+  busy += groups_posting;
+  pthread_mutex_unlock(&group_mutex);
+  return busy;
+}
+
+// Wait until no requests are queued or running and every reply has been
+// posted. Returns 0 once idle, -1 if timeout_ms passed first.
+int wait_for_idle(unsigned timeout_ms) {
+  uint64_t deadline = monotonic_ms() + timeout_ms;
+  while (1) {
+    if (requests_busy() == 0) {
+      return 0;
+    }
+    if (monotonic_ms() >= deadline) {
+      return -1;
+    }
+    usleep(20000);
+  }
+}
+
+// Open a headless script: the file, or stdin for NULL or "-". Returns NULL
+// if it can't be opened.
+FILE *open_script(const char *script_filename) {
+  FILE *script = stdin;
+  if (script_filename != NULL && strcmp(script_filename, "-") != 0) {
+    script = fopen(script_filename, "r");
+    if (script == NULL) {
+      fprintf(stderr, "Error: Unable to open script %s.\n", script_filename);
+    }
+  }
+  return script;
+}
+
+// Print the summary of a headless run. Returns the process exit status.
+int finish_headless(uint64_t started_ms, int drained) {
+  uint64_t elapsed_ms = monotonic_ms() - started_ms;
+  char simulated[64] = "";
+  if (virtual_time) {
+    snprintf(simulated, sizeof(simulated), " (simulated, %.2f s real)",
+             (real_monotonic_us() - virtual_start_us) / 1e6);
+  }
+  char summary[512];
+  snprintf(summary, sizeof(summary),
+           "Headless run finished in %.2f s%s%s: sent %d, received %d, "
+           "%.2f replies/s",
+           elapsed_ms / 1000.0, simulated,
+           drained ? "" : " (drain timed out)", messages_sent,
+           messages_received,
+           elapsed_ms ? messages_received * 1000.0 / elapsed_ms : 0.0);
+  add_chat_message("system", "system", summary);
+  handle_stats();
+  return drained ? 0 : 2;
+}
+
+// Drive the chat from a script instead of the keyboard. Each line is
+// handled as if typed by the user; lines starting with '#' are comments,
+// "!sleep <ms>" pauses and "!wait" blocks until all replies are posted.
+// Prints a throughput summary at the end. Returns the process exit status.
+int run_headless(const char *script_filename, unsigned drain_timeout_ms) {
+  FILE *script = open_script(script_filename);
+  if (script == NULL) {
+    return 1;
+  }
+
+  uint64_t started_ms = monotonic_ms();
+  char line[MAX_QUERY_SIZE * 4];
+  while (fgets(line, sizeof(line), script) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    if (strncmp(line, "!sleep ", 7) == 0) {
+      usleep((useconds_t)atoi(line + 7) * 1000);
+    } else if (strcmp(line, "!wait") == 0) {
+      wait_for_idle(drain_timeout_ms);
+    } else {
+      submit_user_input(line);
+    }
+  }
+  if (script != stdin) {
+    fclose(script);
+  }
+
+  // No new autonomous chatter while the remaining replies drain; the timer
+  // keeps running for the group replies still to be posted
+  __atomic_store_n(&chatter_stopped, 1, __ATOMIC_RELAXED);
+  int drained = wait_for_idle(drain_timeout_ms) == 0;
+  return finish_headless(started_ms, drained);
+}
+
+// Reactor (--reactor). The main thread runs the whole app from one epoll
+// loop: keys from the terminal or lines from the script, the timer wheel
+// through a timerfd, wakeups from other threads through the eventfd, and
+// every HTTP transfer through curl's multi socket interface. A request's
+// classifier call, delay and reply are events rather than a blocked worker,
+// so hundreds can be in flight without a thread each, and an idle room
+// sleeps until something happens. Building a reply's prompt, which searches
+// the bot's long-term memory, runs on a few helper threads. The IRC and
+// metrics listeners keep their own threads, so the locks stay, but nothing
+// else contends for them.
+#define REACTOR_HELPERS 2
+#define REACTOR_MAX_EVENTS 64
+
+// What an epoll event is for, in the low byte of its data; sockets carry
+// their descriptor above it
+enum {
+  REACTOR_WAKE,
+  REACTOR_TIMER,
+  REACTOR_INPUT,
+  REACTOR_SIGNAL,
+  REACTOR_SOCKET
+};
+
+typedef enum {
+  REQUEST_SUMMARY,  // Refreshing a memory summary
+  REQUEST_CLASSIFY, // Asking the classifier whether the bot responds
+  REQUEST_DELAY,    // Waiting before the reply, or for its group to close
+  REQUEST_REPLY,    // Prompt being built, then the reply transfer
+  REQUEST_GROUP,    // A group's request for its replies
+  REQUEST_POST      // Pausing between a group's replies
+} ReactorStage;
+
+// A request in flight on the reactor
+typedef struct ReactorRequest {
+  unsigned long sequence; // Order the reactor started requests in
+  ReactorStage stage;
+  CURLcode result; // Of the transfer that just finished
+  BotThreadData *data; // Until the reply call takes it
+  int priority;
+  uint64_t enqueue_us;
+  char bot_name[50];
+  uint64_t classify_start;
+  uint64_t delay_start;
+  uint64_t due_ms; // When the delay ends
+  ReplyGroup *group; // Opened by this request, which answers for it
+  CURL *transfer;    // Handed to curl and not yet handled, or NULL
+  union {
+    SummaryCall summary;
+    ProviderCall classify;
+    ReplyCall *reply;
+  } call;
+  TAILQ_ENTRY(ReactorRequest) entries; // In reactor_delayed or in transfer
+} ReactorRequest;
+
+TAILQ_HEAD(ReactorDelayed, ReactorRequest);
+struct ReactorDelayed reactor_delayed; // By due time
+struct ReactorDelayed reactor_in_transfer; // Until their transfer is handled
+int reactor_requests = 0;              // In flight
+unsigned long reactor_sequence = 0;
+int reactor_transfers = 0; // Transfers handed to curl and not yet handled
+ReactorRequest *reactor_finished[REACTOR_MAX_REQUESTS]; // Awaiting handling
+int reactor_finished_count = 0;
+int reactor_epoll_fd = -1;
+int reactor_timer_fd = -1;
+uint64_t reactor_timer_armed = 0; // Deadline the timerfd is set to
+CURLM *reactor_multi;
+uint64_t reactor_curl_deadline = 0; // Real ms when curl wants a timeout call
+
+// Replies whose prompts the helpers are building, and those they finished
+queue_t *helper_todo;
+queue_t *helper_done;
+pthread_t reactor_helpers[REACTOR_HELPERS];
+int helpers_started = 0; // Threads in reactor_helpers to join
+int helpers_running = 0;
+pthread_mutex_t helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t helper_cond = PTHREAD_COND_INITIALIZER;
+
+static void *reactor_helper(void *arg) {
+  (void)arg;
+  trace_thread_name("helper");
+  pthread_mutex_lock(&helper_mutex);
+  while (1) {
+    while (helper_todo->front == NULL && helpers_running) {
+      pthread_cond_wait(&helper_cond, &helper_mutex);
+    }
+    if (!helpers_running) {
+      break;
+    }
+    ReactorRequest *request = queue_pop(helper_todo);
+    pthread_mutex_unlock(&helper_mutex);
+
+    request->call.reply = reply_call_start(request->data); // Takes data
+    request->data = NULL;
+
+    pthread_mutex_lock(&helper_mutex);
+    queue_push(helper_done, request);
+    reactor_wake();
+  }
+  pthread_mutex_unlock(&helper_mutex);
+  return NULL;
+}
+
+// curl asks for a socket to be watched, or no longer watched
+static int reactor_socket_callback(CURL *easy, curl_socket_t fd, int what,
+                                   void *userp, void *socketp) {
+  (void)easy;
+  (void)userp;
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(reactor_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+  }
+  struct epoll_event event = {0};
+  event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                 ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+  event.data.u64 = REACTOR_SOCKET | ((uint64_t)fd << 8);
+  if (socketp == NULL) {
+    curl_multi_assign(reactor_multi, fd, (void *)1); // Now watched
+    if (epoll_ctl(reactor_epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0 ||
+        errno != EEXIST) {
+      return 0;
+    }
+  }
+  epoll_ctl(reactor_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  return 0;
+}
+
+static int reactor_timer_callback(CURLM *multi, long timeout_ms,
+                                  void *userp) {
+  (void)multi;
+  (void)userp;
+  reactor_curl_deadline =
+      timeout_ms < 0 ? 0 : real_monotonic_us() / 1000 + timeout_ms;
+  return 0;
+}
+
+// Hand a request's transfer to curl
+static void reactor_transfer(ReactorRequest *request, CURL *curl) {
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)request);
+  curl_multi_add_handle(reactor_multi, curl);
+  request->transfer = curl;
+  TAILQ_INSERT_TAIL(&reactor_in_transfer, request, entries);
+  reactor_transfers++;
+}
+
+// A request is over; completed says whether its reply was queued
+static void reactor_request_done(ReactorRequest *request, int completed) {
+  if (completed) {
+    request_completed(request->priority, request->enqueue_us);
+  }
+  free(request);
+  reactor_requests--;
+  pthread_mutex_lock(&sched_mutex);
+  active_requests--;
+  pthread_mutex_unlock(&sched_mutex);
+}
+
+// Wait until due_ms before the request's next step
+static void reactor_delay(ReactorRequest *request, uint64_t due_ms) {
+  request->due_ms = due_ms;
+  ReactorRequest *later = TAILQ_FIRST(&reactor_delayed);
+  while (later != NULL && later->due_ms <= due_ms) {
+    later = TAILQ_NEXT(later, entries);
+  }
+  if (later != NULL) {
+    TAILQ_INSERT_BEFORE(later, request, entries);
+  } else {
+    TAILQ_INSERT_TAIL(&reactor_delayed, request, entries);
+  }
+}
+
+// Act on the decision whether the bot responds: wait out the delay before
+// the reply, or end the request. With group replies, the request joins its
+// message's group instead, and waits for it to close if it opened it.
+static void reactor_decided(ReactorRequest *request, int respond) {
+  BotThreadData *data = request->data;
+  request->data = NULL;
+  if (!request_decided(data, request->bot_name, respond,
+                       request->classify_start)) {
+    reactor_request_done(request, 0);
+    return;
+  }
+  request->stage = REQUEST_DELAY;
+  request->delay_start = monotonic_us();
+  if (group_window_ms > 0) {
+    if ((request->group = group_join(data)) == NULL) {
+      reactor_request_done(request, 0);
+    } else {
+      reactor_delay(request, request->group->closes_ms);
+    }
+    return;
+  }
+  request->data = data;
+  reactor_delay(request, monotonic_ms() + reply_delay_ms());
+}
+
+// Start a request taken off the scheduler
+static void reactor_start(BotThreadData *data) {
+  ReactorRequest *request = calloc(1, sizeof(ReactorRequest));
+  reactor_requests++;
+  if (request == NULL) {
+    free_bot_thread_data(data);
+    pthread_mutex_lock(&sched_mutex);
+    active_requests--;
+    pthread_mutex_unlock(&sched_mutex);
+    reactor_requests--;
+    return;
+  }
+  request->sequence = reactor_sequence++;
+  request->priority = data->priority;
+  request->enqueue_us = data->enqueue_us;
+  if (data->summarize) {
+    request->stage = REQUEST_SUMMARY;
+    if (summary_call_start(&request->call.summary, data) == 0) {
+      reactor_transfer(request, request->call.summary.call.curl);
+    } else {
+      reactor_request_done(request, 0);
+    }
+    return;
+  }
+
+  Bot *bot = request_admit(data);
+  if (bot == NULL) {
+    reactor_request_done(request, 0);
+    return;
+  }
+  request->data = data;
+  snprintf(request->bot_name, sizeof(request->bot_name), "%s", bot->name);
+  request->classify_start = monotonic_us();
+  int decided = classify_by_chance(is_mentioned(data->query, bot->name));
+  if (decided < 0) {
+    char memory[MEMORY_PROMPT_SIZE];
+    format_bot_memory(bot, memory, sizeof(memory));
+    if (classifier_call_start(&request->call.classify, data->query,
+                              bot->personality, memory, bot->name) == 0) {
+      bot_release(bot);
+      request->stage = REQUEST_CLASSIFY;
+      reactor_transfer(request, request->call.classify.curl);
+      return;
+    }
+    decided = 0;
+  }
+  bot_release(bot);
+  reactor_decided(request, decided);
+}
+
+// Send a reply whose prompt is built, unless it was dropped meanwhile
+static void reactor_reply_ready(ReactorRequest *request) {
+  if (request->call.reply == NULL) {
+    reactor_request_done(request, 0); // Dropped before it was sent
+  } else {
+    reactor_transfer(request, request->call.reply->curl);
+  }
+}
+
+// Have a reply's prompt built, by the helpers or, in simulated runs, on
+// the reactor in order
+static void reactor_build_reply(ReactorRequest *request) {
+  request->stage = REQUEST_REPLY;
+  if (virtual_time) {
+    request->call.reply = reply_call_start(request->data);
+    request->data = NULL;
+    reactor_reply_ready(request);
+    return;
   }
+  pthread_mutex_lock(&helper_mutex);
+  queue_push(helper_todo, request);
+  pthread_cond_signal(&helper_cond);
+  pthread_mutex_unlock(&helper_mutex);
+}
 
-  // Set up the request to OpenAI
-  const char *url = "https://api.openai.com/v1/chat/completions";
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  char auth_header[256];
-  snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-           openai_api_key);
-  headers = curl_slist_append(headers, auth_header);
+// Send their own requests for the bots a group's answer left out
+static void reactor_reply_unanswered(ReplyGroup *group) {
+  BotThreadData *alone[GROUP_MAX_BOTS];
+  int count = group_take_unanswered(group, alone);
+  for (int i = 0; i < count; i++) {
+    ReactorRequest *request = calloc(1, sizeof(ReactorRequest));
+    if (request == NULL) {
+      free_bot_thread_data(alone[i]);
+      continue;
+    }
+    reactor_requests++;
+    pthread_mutex_lock(&sched_mutex);
+    active_requests++;
+    pthread_mutex_unlock(&sched_mutex);
+    request->sequence = reactor_sequence++;
+    request->priority = alone[i]->priority;
+    request->enqueue_us = alone[i]->enqueue_us;
+    request->data = alone[i];
+    Bot *bot = bot_acquire(alone[i]->bot);
+    if (bot != NULL) {
+      snprintf(request->bot_name, sizeof(request->bot_name), "%s", bot->name);
+      bot_release(bot);
+    }
+    reactor_build_reply(request);
+  }
+}
 
-  // Create the JSON request body
-  char json_data[1024];
-  snprintf(
-      json_data, sizeof(json_data),
-      "{\"model\": \"gpt-3.5-turbo\", \"messages\": [{\"role\": \"system\", "
-      "\"content\": \"Generate a short, one-sentence personality description "
-      "for a chatbot inspired by various online communities. Include a mix of "
-      "traits such as helpful, sarcastic, meme-loving, intellectual, "
-      "optimistic, "
-      "cynical, or quirky. Aim for diversity in personalities.\"}], "
-      "\"max_tokens\": 50}");
-
-  // Set up CURL options
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+static int compare_sequence(const void *a, const void *b) {
+  const ReactorRequest *x = *(ReactorRequest *const *)a;
+  const ReactorRequest *y = *(ReactorRequest *const *)b;
+  return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+}
 
-  // Perform the request
-  res = curl_easy_perform(curl);
-  if (res != CURLE_OK) {
-    log_error(curl_easy_strerror(res));
-    free(chunk.response);
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    return NULL;
+// Handle the transfers curl has finished. Under simulated time the clock
+// stands still until every transfer is back, and they are handled in the
+// order their requests started, so network timing can't change the run.
+static void reactor_finish_transfers() {
+  CURLMsg *message;
+  int left;
+  while ((message = curl_multi_info_read(reactor_multi, &left)) != NULL) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    ReactorRequest *request = NULL;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE,
+                      (char **)&request);
+    request->result = message->data.result;
+    curl_multi_remove_handle(reactor_multi, message->easy_handle);
+    reactor_finished[reactor_finished_count++] = request;
+  }
+  if (virtual_time) {
+    if (reactor_finished_count < reactor_transfers) {
+      return;
+    }
+    qsort(reactor_finished, reactor_finished_count, sizeof(ReactorRequest *),
+          compare_sequence);
+  }
+
+  int count = reactor_finished_count;
+  reactor_finished_count = 0;
+  reactor_transfers -= count;
+  for (int i = 0; i < count; i++) {
+    ReactorRequest *request = reactor_finished[i];
+    TAILQ_REMOVE(&reactor_in_transfer, request, entries);
+    request->transfer = NULL;
+    if (request->stage == REQUEST_SUMMARY) {
+      summary_call_finish(&request->call.summary, request->result);
+      reactor_request_done(request, 0);
+    } else if (request->stage == REQUEST_CLASSIFY) {
+      TokenUsage usage;
+      int respond = classifier_answer(provider_call_finish(
+          &request->call.classify, request->result, &usage, NULL));
+      Bot *bot = bot_acquire(request->data->bot);
+      record_usage(bot, classifier_provider->name, classifier_model, &usage,
+                   0);
+      if (bot != NULL) {
+        bot_release(bot);
+      }
+      reactor_decided(request, respond);
+    } else if (request->stage == REQUEST_GROUP) {
+      group_call_finish(request->group, request->result);
+      reactor_reply_unanswered(request->group);
+      request->stage = REQUEST_POST;
+      reactor_delay(request, monotonic_ms());
+    } else {
+      int queued = reply_call_finish(request->call.reply, request->result);
+      reactor_request_done(request, queued);
+    }
+  }
+}
+
+// A group is due: post its next reply, or close it and send its request
+static void reactor_run_group(ReactorRequest *request) {
+  if (request->stage == REQUEST_POST) {
+    unsigned pause = group_post_next(request->group);
+    if (pause == 0) {
+      free(request->group);
+      reactor_request_done(request, 0); // Each member counted as posted
+    } else {
+      reactor_delay(request, monotonic_ms() + pause);
+    }
+    return;
+  }
+  if (group_call_start(request->group) == 0) {
+    request->stage = REQUEST_GROUP;
+    reactor_transfer(request, request->group->call.curl);
+  } else {
+    reactor_reply_unanswered(request->group);
+    request->stage = REQUEST_POST;
+    reactor_delay(request, monotonic_ms());
+  }
+}
+
+// Pass the replies whose delay is over to the helpers, and send the ones
+// whose prompts are ready. Simulated runs build prompts on the reactor, in
+// order.
+static void reactor_run_replies() {
+  uint64_t now = monotonic_ms();
+  ReactorRequest *request;
+  while ((request = TAILQ_FIRST(&reactor_delayed)) != NULL &&
+         request->due_ms <= now) {
+    TAILQ_REMOVE(&reactor_delayed, request, entries);
+    if (request->group != NULL) {
+      if (request->stage == REQUEST_DELAY) {
+        trace_end("group wait", request->delay_start, request->bot_name);
+        request->data = group_close(request->group);
+      }
+      if (request->data == NULL) {
+        reactor_run_group(request);
+        continue;
+      }
+      request->group = NULL; // Alone; replies as usual
+    } else {
+      request->data->stage_us[STAGE_DELAY] =
+          monotonic_us() - request->delay_start;
+      trace_end("sleep", request->delay_start, request->bot_name);
+    }
+    reactor_build_reply(request);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&helper_mutex);
+    request = queue_pop(helper_done);
+    pthread_mutex_unlock(&helper_mutex);
+    if (request == NULL) {
+      break;
+    }
+    reactor_reply_ready(request);
+  }
+}
+
+// Take requests off the scheduler while there is room for them
+static void reactor_take_requests() {
+  while (reactor_requests < REACTOR_MAX_REQUESTS) {
+    pthread_mutex_lock(&sched_mutex);
+    if (pending_requests == 0 || !scheduler_running) {
+      pthread_mutex_unlock(&sched_mutex);
+      break;
+    }
+    BotThreadData *data = scheduler_take_locked();
+    pthread_mutex_unlock(&sched_mutex);
+    reactor_start(data);
+  }
+}
+
+// Whether the reactor has work it can do right away: requests it has room
+// to start, or replies to post. Simulated time must not move on past them.
+static int reactor_work_waiting() {
+  pthread_mutex_lock(&sched_mutex);
+  int waiting = pending_requests > 0 && scheduler_running &&
+                reactor_requests < REACTOR_MAX_REQUESTS;
+  pthread_mutex_unlock(&sched_mutex);
+  pthread_mutex_lock(&queue_mutex);
+  waiting |= response_queue->front != NULL;
+  pthread_mutex_unlock(&queue_mutex);
+  return waiting;
+}
+
+static void reactor_post_responses() {
+  pthread_mutex_lock(&queue_mutex);
+  int redraw = status_bar_stale;
+  status_bar_stale = 0;
+  pthread_mutex_unlock(&queue_mutex);
+  if (redraw) {
+    update_status_bar();
+  }
+  while (1) {
+    pthread_mutex_lock(&queue_mutex);
+    BotThreadData *data = queue_pop(response_queue);
+    pthread_mutex_unlock(&queue_mutex);
+    if (data == NULL) {
+      break;
+    }
+    post_bot_response(data);
   }
+}
+
+// Point the timerfd at the timer wheel's next deadline
+static void reactor_arm_timer() {
+  uint64_t next = virtual_time ? 0 : timer_next_ms();
+  if (next == reactor_timer_armed) {
+    return;
+  }
+  struct itimerspec spec = {0}; // Disarmed if nothing is due
+  if (next != 0) {
+    spec.it_value.tv_sec = next / 1000;
+    spec.it_value.tv_nsec = (next % 1000) * 1000000L;
+  }
+  timerfd_settime(reactor_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  reactor_timer_armed = next;
+}
+
+// A headless script being fed to the reactor
+typedef struct {
+  FILE *script;
+  unsigned drain_timeout_ms;
+  uint64_t started_ms;
+  uint64_t resume_ms;  // End of a !sleep, or 0
+  uint64_t wait_until; // Deadline of a !wait or the final drain, or 0
+  int draining;        // The script is over; the last replies are awaited
+} ReactorScript;
+
+// Feed script lines until one has to wait. Returns the exit status once
+// the run is over, or -1 while it goes on.
+static int reactor_script_step(ReactorScript *run) {
+  uint64_t now = monotonic_ms();
+  if (run->resume_ms > now) {
+    return -1;
+  }
+  run->resume_ms = 0;
+  if (run->wait_until != 0) {
+    int idle = requests_busy() == 0;
+    if (!idle && now < run->wait_until) {
+      return -1;
+    }
+    run->wait_until = 0;
+    if (run->draining) {
+      return finish_headless(run->started_ms, idle);
+    }
+  }
+
+  char line[MAX_QUERY_SIZE * 4];
+  while (fgets(line, sizeof(line), run->script) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    if (strncmp(line, "!sleep ", 7) == 0) {
+      run->resume_ms = now + atoi(line + 7);
+      return -1;
+    } else if (strcmp(line, "!wait") == 0) {
+      run->wait_until = now + run->drain_timeout_ms;
+      return reactor_script_step(run); // The room may already be idle
+    }
+    submit_user_input(line);
+  }
+
+  // No new autonomous chatter while the remaining replies drain
+  timer_stop();
+  run->draining = 1;
+  run->wait_until = now + run->drain_timeout_ms;
+  return reactor_script_step(run);
+}
+
+// Abandon a request whose transfer is still with curl
+static void reactor_abandon(ReactorRequest *request) {
+  curl_multi_remove_handle(reactor_multi, request->transfer);
+  switch (request->stage) {
+  case REQUEST_SUMMARY:
+    provider_call_free(&request->call.summary.call);
+    bot_release(request->call.summary.bot);
+    break;
+  case REQUEST_CLASSIFY:
+    provider_call_free(&request->call.classify);
+    free_bot_thread_data(request->data);
+    break;
+  case REQUEST_GROUP:
+    provider_call_free(&request->group->call);
+    group_discard(request->group);
+    break;
+  default:
+    reply_call_finish(request->call.reply, CURLE_ABORTED_BY_CALLBACK);
+    break;
+  }
+  reactor_request_done(request, 0);
+}
+
+// Close what reactor_run opened
+static void reactor_release(int signal_fd) {
+  int fd = __atomic_exchange_n(&reactor_wake_fd, -1, __ATOMIC_ACQ_REL);
+  int fds[] = {fd, reactor_timer_fd, reactor_epoll_fd, signal_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  reactor_timer_fd = reactor_epoll_fd = -1;
+  reactor_timer_armed = 0;
+  if (reactor_multi != NULL) {
+    curl_multi_cleanup(reactor_multi);
+    reactor_multi = NULL;
+  }
+  queue_destroy(helper_todo);
+  queue_destroy(helper_done);
+  helper_todo = helper_done = NULL;
+}
+
+// Stop the helper threads that were started and wait for them
+static void reactor_stop_helpers() {
+  pthread_mutex_lock(&helper_mutex);
+  helpers_running = 0;
+  pthread_cond_broadcast(&helper_cond);
+  pthread_mutex_unlock(&helper_mutex);
+  for (int i = 0; i < helpers_started; i++) {
+    pthread_join(reactor_helpers[i], NULL);
+  }
+  helpers_started = 0;
+}
+
+static int reactor_watch(int fd, uint64_t kind) {
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u64 = kind | ((uint64_t)fd << 8);
+  return epoll_ctl(reactor_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Run the app on the reactor until the script ends (headless), a stop
+// signal arrives (serving IRC only) or /quit. Returns the exit status.
+int reactor_run(const char *script_filename, unsigned drain_timeout_ms,
+                int serve_irc_only, const sigset_t *stop_signals) {
+  trace_thread_name("reactor");
+  ReactorScript run = {0};
+  run.drain_timeout_ms = drain_timeout_ms;
+  run.started_ms = monotonic_ms();
+  if (headless && !serve_irc_only &&
+      (run.script = open_script(script_filename)) == NULL) {
+    return 1;
+  }
+
+  TAILQ_INIT(&reactor_delayed);
+  TAILQ_INIT(&reactor_in_transfer);
+  helper_todo = queue_create();
+  helper_done = queue_create();
+  reactor_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  reactor_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  reactor_timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int signal_fd = serve_irc_only ? signalfd(-1, stop_signals, SFD_CLOEXEC) : -1;
+  reactor_multi = curl_multi_init();
+  if (reactor_epoll_fd < 0 || reactor_wake_fd < 0 || reactor_timer_fd < 0 ||
+      (serve_irc_only && signal_fd < 0) || reactor_multi == NULL ||
+      reactor_watch(reactor_wake_fd, REACTOR_WAKE) < 0 ||
+      reactor_watch(reactor_timer_fd, REACTOR_TIMER) < 0 ||
+      (signal_fd >= 0 && reactor_watch(signal_fd, REACTOR_SIGNAL) < 0) ||
+      (!headless && reactor_watch(STDIN_FILENO, REACTOR_INPUT) < 0)) {
+    fprintf(stderr, "Error: Unable to start the reactor: %s\n",
+            strerror(errno));
+    reactor_release(signal_fd);
+    if (run.script != NULL && run.script != stdin) {
+      fclose(run.script);
+    }
+    return 1;
+  }
+  curl_multi_setopt(reactor_multi, CURLMOPT_SOCKETFUNCTION,
+                    reactor_socket_callback);
+  curl_multi_setopt(reactor_multi, CURLMOPT_TIMERFUNCTION,
+                    reactor_timer_callback);
+  helpers_running = 1;
+  while (helpers_started < REACTOR_HELPERS &&
+         pthread_create(&reactor_helpers[helpers_started], NULL,
+                        reactor_helper, NULL) == 0) {
+    helpers_started++;
+  }
+  if (helpers_started < REACTOR_HELPERS) {
+    fprintf(stderr, "Error: Unable to start the reactor's helper threads\n");
+    reactor_stop_helpers();
+    reactor_release(signal_fd);
+    if (run.script != NULL && run.script != stdin) {
+      fclose(run.script);
+    }
+    return 1;
+  }
+
+  static InputLine line;
+  if (!headless) {
+    nodelay(input_win, TRUE);
+    input_draw(&line);
+  }
+
+  int status = -1;
+  while (1) {
+    if (reactor_curl_deadline != 0 &&
+        real_monotonic_us() / 1000 >= reactor_curl_deadline) {
+      int running;
+      reactor_curl_deadline = 0;
+      curl_multi_socket_action(reactor_multi, CURL_SOCKET_TIMEOUT, 0,
+                               &running);
+    }
+    reactor_finish_transfers();
+    timer_run_due();
+    reactor_run_replies();
+    reactor_post_responses();
+    reactor_take_requests();
+    if (run.script != NULL && status < 0) {
+      status = reactor_script_step(&run);
+    }
+    if (status >= 0) {
+      break;
+    }
+    reactor_arm_timer();
+
+    // Sleep until the earliest of curl's timeout, the next reply delay and
+    // the script's next step; the timer wheel has the timerfd. A !wait also
+    // ends when the room goes idle, which posting the last reply wakes the
+    // loop for. Simulated time jumps to the next of these instead, once
+    // nothing is in flight and nothing the script just sent is waiting.
+    uint64_t deadlines[] = {
+        TAILQ_EMPTY(&reactor_delayed) ? 0
+                                      : TAILQ_FIRST(&reactor_delayed)->due_ms,
+        run.resume_ms, run.wait_until, virtual_time ? timer_next_ms() : 0};
+    uint64_t next = 0;
+    for (size_t i = 0; i < sizeof(deadlines) / sizeof(deadlines[0]); i++) {
+      if (deadlines[i] != 0 && (next == 0 || deadlines[i] < next)) {
+        next = deadlines[i];
+      }
+    }
+    int timeout = -1;
+    if (virtual_time) {
+      if (reactor_work_waiting()) {
+        timeout = 0;
+      } else if (reactor_transfers == 0 && next != 0) {
+        virtual_time_advance(next * 1000);
+        timeout = 0;
+      }
+    } else if (next != 0) {
+      uint64_t now = monotonic_ms();
+      timeout = next > now ? (int)(next - now) : 0;
+    }
+    if (reactor_curl_deadline != 0) {
+      uint64_t now = real_monotonic_us() / 1000;
+      int wait = reactor_curl_deadline > now
+                     ? (int)(reactor_curl_deadline - now)
+                     : 0;
+      timeout = timeout < 0 || wait < timeout ? wait : timeout;
+    }
 
-  // Parse the JSON response
-  struct json_object *parsed_json;
-  struct json_object *choices_array;
-  struct json_object *message_object;
-  struct json_object *message_content;
-
-  parsed_json = json_tokener_parse(chunk.response);
-  char *personality = NULL;
-
-  if (json_object_object_get_ex(parsed_json, "choices", &choices_array)) {
-    if (json_object_get_type(choices_array) == json_type_array) {
-      message_object = json_object_array_get_idx(choices_array, 0);
-      if (json_object_object_get_ex(message_object, "message",
-                                    &message_object)) {
-        if (json_object_object_get_ex(message_object, "content",
-                                      &message_content)) {
-          const char *response_text = json_object_get_string(message_content);
-          personality = strdup(response_text);
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int count = epoll_wait(reactor_epoll_fd, events, REACTOR_MAX_EVENTS,
+                           timeout);
+    for (int i = 0; i < count; i++) {
+      int fd = (int)(events[i].data.u64 >> 8);
+      uint64_t value;
+      switch (events[i].data.u64 & 0xff) {
+      case REACTOR_WAKE:
+      case REACTOR_TIMER:
+        if (read(fd, &value, sizeof(value)) < 0) {
+          // Spurious wakeup; nothing was pending
+        }
+        break;
+      case REACTOR_INPUT: {
+        int ch;
+        while ((ch = wgetch(input_win)) != ERR) {
+          input_key(&line, ch);
         }
+        input_draw(&line);
+        break;
+      }
+      case REACTOR_SIGNAL:
+        status = 0;
+        break;
+      case REACTOR_SOCKET: {
+        int flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                    ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                    ((events[i].events & (EPOLLERR | EPOLLHUP))
+                         ? CURL_CSELECT_ERR
+                         : 0);
+        int running;
+        curl_multi_socket_action(reactor_multi, fd, flags, &running);
+        break;
+      }
       }
     }
   }
 
-  // Generate a random temperature between 0.5 and 1.0 for more varied responses
-  *temperature = ((float)rand() / RAND_MAX) * 0.5 + 0.5;
+  // Every request still in flight is dropped: those waiting out their
+  // delay, those with the helpers and those whose transfer is with curl
+  reactor_stop_helpers();
+  ReactorRequest *request;
+  while ((request = TAILQ_FIRST(&reactor_delayed)) != NULL) {
+    TAILQ_REMOVE(&reactor_delayed, request, entries);
+    if (request->group != NULL) {
+      group_discard(request->group);
+    } else {
+      free_bot_thread_data(request->data);
+    }
+    reactor_request_done(request, 0);
+  }
+  while ((request = queue_pop(helper_todo)) != NULL) {
+    free_bot_thread_data(request->data);
+    reactor_request_done(request, 0);
+  }
+  while ((request = queue_pop(helper_done)) != NULL) {
+    if (request->call.reply != NULL) {
+      reply_call_finish(request->call.reply, CURLE_ABORTED_BY_CALLBACK);
+    }
+    reactor_request_done(request, 0);
+  }
+  while ((request = TAILQ_FIRST(&reactor_in_transfer)) != NULL) {
+    TAILQ_REMOVE(&reactor_in_transfer, request, entries);
+    reactor_abandon(request);
+  }
+  reactor_finished_count = reactor_transfers = 0;
+  if (run.script != NULL && run.script != stdin) {
+    fclose(run.script);
+  }
+  reactor_release(signal_fd);
+  return status;
+}
 
-  // Clean up
-  json_object_put(parsed_json);
-  free(chunk.response);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
+// IRC server frontend (--irc). Real IRC clients can share the room's
+// channels: what they say reaches the bots like the local user's own
+// messages, and every user and bot message is relayed to the clients in
+// that channel, with the bots appearing as users. A JOIN opens a channel
+// the room doesn't have yet. One thread runs an epoll loop over all the
+// connections; other threads hand it room events through a queue and an
+// eventfd. Each client has its own output buffer. While a client's backlog
+// is above IRC_PAUSE_OUTPUT its input isn't read, and a client that falls
+// IRC_SENDQ_LIMIT behind is disconnected, so a slow reader never blocks
+// the chat or anyone else.
+#define IRC_SERVER_NAME "lierc"
+#define IRC_LINE_LIMIT 512          // Longest line, CR LF included
+#define IRC_TEXT_CHUNK 400          // Most message text sent per line
+#define IRC_PAUSE_OUTPUT 65536      // Backlog at which input stops being read
+#define IRC_SENDQ_LIMIT (1 << 20)   // Backlog at which a client is dropped
+#define IRC_READ_BUDGET 16384       // Most bytes read from a client per wakeup
+#define IRC_MAX_CLIENTS 1024
+#define IRC_EVENT_LIMIT 65536       // Pending room events before dropping
+#define IRC_MAX_PARAMS 15
 
-  return personality;
+typedef struct {
+  IrcEventType type;
+  uint32_t channels; // Channels the event happened in
+  char nick[50];
+  char *text; // Message, reason or new nick, or NULL
+} IrcEvent;
+
+typedef struct {
+  int fd;
+  int slot;           // Index in irc_clients
+  char nick[50];      // "*" until a NICK is accepted
+  char user[50];
+  char host[64];      // Peer address
+  int registered;     // Got both NICK and USER
+  uint32_t channels;  // Channels joined, a bitmask of channel indices
+  int closing;        // Close once the output is flushed
+  int dead;           // Closed at the end of the loop iteration
+  int dirty;          // Listed in irc_dirty
+  uint32_t events;    // Current epoll interest
+  char quit_reason[128];
+  char input[IRC_LINE_LIMIT];
+  size_t input_length;
+  int overlong;       // Skipping the rest of a line that didn't fit
+  char *output;       // Pending output is output[output_start..output_length)
+  size_t output_start;
+  size_t output_length;
+  size_t output_capacity;
+} IrcClient;
+
+int irc_running = 0;
+int irc_listen_fd = -1;
+int irc_wake_fd = -1; // eventfd: room events are pending or irc_stop ran
+int irc_epoll_fd = -1;
+pthread_t irc_thread_id;
+
+// Room events from other threads; irc_mutex is taken last, under chat_mutex
+// or bot_mutex
+pthread_mutex_t irc_mutex = PTHREAD_MUTEX_INITIALIZER;
+IrcEvent *irc_events = NULL;
+int irc_event_count = 0;
+int irc_event_capacity = 0;
+unsigned long irc_events_dropped = 0;
+
+// Only the IRC thread touches the clients
+IrcClient **irc_clients = NULL;
+int irc_client_count = 0; // Read atomically by the metrics listener
+IrcClient *irc_dirty[IRC_MAX_CLIENTS]; // Clients with output or to close
+int irc_dirty_count = 0;
+
+// Queue a room event for the IRC clients. Cheap no-op unless --irc is on.
+void irc_post_event(IrcEventType type, uint32_t channels, const char *nick,
+                    const char *text) {
+  if (channels == 0 || !__atomic_load_n(&irc_running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&irc_mutex);
+  if (!irc_running) { // Stopped since the check; irc_wake_fd may be closed
+    pthread_mutex_unlock(&irc_mutex);
+    return;
+  }
+  if (irc_event_count == irc_event_capacity) {
+    int capacity = irc_event_capacity ? irc_event_capacity * 2 : 64;
+    IrcEvent *grown = capacity <= IRC_EVENT_LIMIT
+                          ? realloc(irc_events, capacity * sizeof(IrcEvent))
+                          : NULL;
+    if (grown == NULL) {
+      irc_events_dropped++;
+      pthread_mutex_unlock(&irc_mutex);
+      return;
+    }
+    irc_events = grown;
+    irc_event_capacity = capacity;
+  }
+  IrcEvent *event = &irc_events[irc_event_count++];
+  event->type = type;
+  event->channels = channels;
+  snprintf(event->nick, sizeof(event->nick), "%s", nick);
+  event->text = text != NULL ? strdup(text) : NULL;
+  uint64_t one = 1;
+  if (write(irc_wake_fd, &one, sizeof(one)) < 0) {
+    // The counter is already non-zero; the IRC thread will wake anyway
+  }
+  pthread_mutex_unlock(&irc_mutex);
+}
+
+static void irc_mark_dirty(IrcClient *client) {
+  if (!client->dirty) {
+    client->dirty = 1;
+    irc_dirty[irc_dirty_count++] = client;
+  }
+}
+
+// Close a client at the end of the loop iteration, telling the channel why
+static void irc_drop(IrcClient *client, const char *reason) {
+  if (!client->dead) {
+    client->dead = 1;
+    snprintf(client->quit_reason, sizeof(client->quit_reason), "%s", reason);
+    irc_mark_dirty(client);
+  }
+}
+
+// Queue bytes for a client, dropping it if its backlog gets too long
+static void irc_append(IrcClient *client, const char *data, size_t length) {
+  if (client->dead) {
+    return;
+  }
+  size_t pending = client->output_length - client->output_start;
+  if (pending + length > IRC_SENDQ_LIMIT) {
+    irc_drop(client, "SendQ exceeded");
+    return;
+  }
+  if (client->output_length + length > client->output_capacity) {
+    // Slide the pending bytes to the front before growing
+    if (pending > 0) {
+      memmove(client->output, client->output + client->output_start, pending);
+    }
+    client->output_start = 0;
+    client->output_length = pending;
+    if (pending + length > client->output_capacity) {
+      size_t capacity = client->output_capacity ? client->output_capacity : 4096;
+      while (capacity < pending + length) {
+        capacity *= 2;
+      }
+      char *grown = realloc(client->output, capacity);
+      if (grown == NULL) {
+        irc_drop(client, "Out of memory");
+        return;
+      }
+      client->output = grown;
+      client->output_capacity = capacity;
+    }
+  }
+  memcpy(client->output + client->output_length, data, length);
+  client->output_length += length;
+  irc_mark_dirty(client);
+}
+
+// Format one protocol line, cut to IRC_LINE_LIMIT, with its CR LF.
+// Returns its length.
+static size_t irc_format(char line[IRC_LINE_LIMIT], const char *format,
+                         va_list args) {
+  int length = vsnprintf(line, IRC_LINE_LIMIT - 2, format, args);
+  if (length < 0) {
+    length = 0;
+  } else if (length > IRC_LINE_LIMIT - 3) {
+    length = IRC_LINE_LIMIT - 3;
+  }
+  line[length++] = '\r';
+  line[length++] = '\n';
+  return length;
+}
+
+static void irc_send(IrcClient *client, const char *format, ...) {
+  char line[IRC_LINE_LIMIT];
+  va_list args;
+  va_start(args, format);
+  size_t length = irc_format(line, format, args);
+  va_end(args);
+  irc_append(client, line, length);
+}
+
+// Send a numeric reply, addressed to the client's nick
+static void irc_numeric(IrcClient *client, int code, const char *format, ...) {
+  char text[IRC_LINE_LIMIT];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  irc_send(client, ":%s %03d %s %s", IRC_SERVER_NAME, code, client->nick,
+           text);
+}
+
+// Send a line to every client in any of the channels but the one named
+// except (if any), formatting it once
+static void irc_broadcast(uint32_t channels, const char *except,
+                          const char *format, ...) {
+  char line[IRC_LINE_LIMIT];
+  va_list args;
+  va_start(args, format);
+  size_t length = irc_format(line, format, args);
+  va_end(args);
+  for (int i = 0; i < irc_client_count; i++) {
+    IrcClient *client = irc_clients[i];
+    if ((client->channels & channels) &&
+        (except == NULL || strcmp(client->nick, except) != 0)) {
+      irc_append(client, line, length);
+    }
+  }
+}
+
+static IrcClient *irc_find_client(const char *nick) {
+  for (int i = 0; i < irc_client_count; i++) {
+    if (irc_clients[i]->registered &&
+        strcasecmp(irc_clients[i]->nick, nick) == 0) {
+      return irc_clients[i];
+    }
+  }
+  return NULL;
+}
+
+// The nick!user@host prefix messages from nick carry: bots are at "bot"
+// and the local user at "local"
+static void irc_prefix(const char *nick, char *prefix, size_t size) {
+  IrcClient *client = irc_find_client(nick);
+  if (client != NULL) {
+    snprintf(prefix, size, "%s!%s@%s", client->nick, client->user,
+             client->host);
+  } else {
+    snprintf(prefix, size, "%s!%s@%s", nick, nick,
+             strcmp(nick, user_name) == 0 ? "local" : "bot");
+  }
+}
+
+// Length of the next line's worth of message text: up to a newline, or at
+// most IRC_TEXT_CHUNK bytes broken after a space if there is one and never
+// inside a UTF-8 sequence
+static size_t irc_chunk(const char *text, size_t length) {
+  const char *newline = memchr(text, '\n', length);
+  size_t limit = newline != NULL ? (size_t)(newline - text) : length;
+  if (limit <= IRC_TEXT_CHUNK) {
+    return limit;
+  }
+  size_t end = IRC_TEXT_CHUNK;
+  while (end > 0 && text[end] != ' ') {
+    end--;
+  }
+  if (end == 0) {
+    end = IRC_TEXT_CHUNK;
+    while (end > 0 && ((unsigned char)text[end] & 0xC0) == 0x80) {
+      end--;
+    }
+  }
+  return end;
+}
+
+// Relay a room message to a channel, split over as many lines as needed
+static void irc_relay_message(int channel, const char *nick,
+                              const char *text) {
+  char prefix[180];
+  irc_prefix(nick, prefix, sizeof(prefix));
+  size_t length = strlen(text);
+  size_t offset = 0;
+  while (offset < length) {
+    size_t chunk = irc_chunk(text + offset, length - offset);
+    size_t end = chunk;
+    while (end > 0 && text[offset + end - 1] == '\r') {
+      end--;
+    }
+    if (end > 0) {
+      irc_broadcast(1u << channel, nick, ":%s PRIVMSG %s :%.*s", prefix,
+                    channels[channel]->name, (int)end, text + offset);
+    }
+    offset += chunk;
+    if (offset < length && (text[offset] == '\n' || text[offset] == ' ')) {
+      offset++;
+    }
+  }
+}
+
+// Deliver the room events queued by other threads
+static void irc_deliver_events() {
+  uint64_t wakeups;
+  if (read(irc_wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+    // Nothing pending
+  }
+  pthread_mutex_lock(&irc_mutex);
+  IrcEvent *events = irc_events;
+  int count = irc_event_count;
+  irc_events = NULL;
+  irc_event_count = irc_event_capacity = 0;
+  pthread_mutex_unlock(&irc_mutex);
+
+  for (int i = 0; i < count; i++) {
+    IrcEvent *event = &events[i];
+    char prefix[180];
+    irc_prefix(event->nick, prefix, sizeof(prefix));
+    switch (event->type) {
+    case IRC_EVENT_MESSAGE:
+      if (event->text != NULL) {
+        irc_relay_message(__builtin_ctz(event->channels), event->nick,
+                          event->text);
+      }
+      break;
+    case IRC_EVENT_JOIN:
+    case IRC_EVENT_PART:
+      for (uint32_t mask = event->channels; mask != 0; mask &= mask - 1) {
+        int channel = __builtin_ctz(mask);
+        irc_broadcast(1u << channel, NULL, ":%s %s %s", prefix,
+                      event->type == IRC_EVENT_JOIN ? "JOIN" : "PART",
+                      channels[channel]->name);
+      }
+      break;
+    case IRC_EVENT_QUIT:
+      irc_broadcast(event->channels, NULL, ":%s QUIT :%s", prefix,
+                    event->text != NULL ? event->text : "");
+      break;
+    case IRC_EVENT_NICK:
+      // user_name already holds the new nick, so irc_prefix can't tell
+      snprintf(prefix, sizeof(prefix), "%s!%s@local", event->nick,
+               event->nick);
+      irc_broadcast(event->channels, NULL, ":%s NICK :%s", prefix,
+                    event->text != NULL ? event->text : event->nick);
+      break;
+    }
+    free(event->text);
+  }
+  free(events);
+}
+
+// Whether nick is free: not a bot, the local user or another client
+static int irc_nick_available(const IrcClient *self, const char *nick) {
+  IrcClient *client = irc_find_client(nick);
+  if ((client != NULL && client != self) || strcasecmp(nick, user_name) == 0 ||
+      strcasecmp(nick, "system") == 0) {
+    return 0;
+  }
+  Bot *bot = bot_acquire_by_name(nick);
+  if (bot != NULL) {
+    bot_release(bot);
+    return 0;
+  }
+  return 1;
+}
+
+static int irc_valid_nick(const char *nick) {
+  size_t length = strlen(nick);
+  if (length == 0 || length >= sizeof(((IrcClient *)0)->nick) ||
+      isdigit((unsigned char)nick[0]) || nick[0] == '-') {
+    return 0;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (!is_nick_char((unsigned char)nick[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Channel names in a bitmask, space separated
+static void irc_channel_list(uint32_t mask, char *list, size_t size) {
+  size_t length = 0;
+  list[0] = '\0';
+  for (; mask != 0 && length < size; mask &= mask - 1) {
+    length += snprintf(list + length, size - length, "%s%s",
+                       length > 0 ? " " : "",
+                       channels[__builtin_ctz(mask)]->name);
+  }
+}
+
+// Send RPL_NAMREPLY lines for a channel: the local user if they're in it,
+// its bots and the clients that joined it
+static void irc_send_names(IrcClient *client, int channel) {
+  const char *channel_name = channels[channel]->name;
+  char names[IRC_TEXT_CHUNK + 64] = "";
+  size_t length = 0;
+  pthread_mutex_lock(&chat_mutex);
+  int user_here = channels[channel]->joined && !headless;
+  pthread_mutex_unlock(&chat_mutex);
+  BotHandle *handles;
+  int bot_total = channel_members(channel, &handles);
+  int total = bot_total + irc_client_count + 1;
+  for (int i = 0; i < total; i++) {
+    char name[sizeof(user_name)];
+    if (i == 0) {
+      if (!user_here) {
+        continue; // No one at the keyboard, or they're elsewhere
+      }
+      snprintf(name, sizeof(name), "%s", user_name);
+    } else if (i <= bot_total) {
+      Bot *bot = bot_acquire(handles[i - 1]);
+      if (bot == NULL) {
+        continue;
+      }
+      snprintf(name, sizeof(name), "%s", bot->name);
+      bot_release(bot);
+    } else {
+      IrcClient *member = irc_clients[i - bot_total - 1];
+      if (!(member->channels & (1u << channel))) {
+        continue;
+      }
+      snprintf(name, sizeof(name), "%s", member->nick);
+    }
+    size_t name_length = strlen(name);
+    if (length > 0 && length + 1 + name_length > IRC_TEXT_CHUNK) {
+      irc_numeric(client, 353, "= %s :%s", channel_name, names);
+      length = 0;
+    }
+    length += snprintf(names + length, sizeof(names) - length, "%s%s",
+                       length > 0 ? " " : "", name);
+  }
+  free(handles);
+  if (length > 0) {
+    irc_numeric(client, 353, "= %s :%s", channel_name, names);
+  }
+  irc_numeric(client, 366, "%s :End of NAMES list", channel_name);
+}
+
+static void irc_send_whois(IrcClient *client, const char *nick) {
+  IrcClient *target = irc_find_client(nick);
+  Bot *bot = target == NULL ? bot_acquire_by_name(nick) : NULL;
+  char list[IRC_TEXT_CHUNK];
+  if (target != NULL) {
+    irc_numeric(client, 311, "%s %s %s * :%s", target->nick, target->user,
+                target->host, target->nick);
+    irc_numeric(client, 312, "%s %s :IRC client", target->nick,
+                IRC_SERVER_NAME);
+    irc_channel_list(target->channels, list, sizeof(list));
+    if (list[0] != '\0') {
+      irc_numeric(client, 319, "%s :%s", target->nick, list);
+    }
+  } else if (bot != NULL) {
+    // The personality, on one line, stands in for the real name
+    char personality[sizeof(bot->personality)];
+    snprintf(personality, sizeof(personality), "%s", bot->personality);
+    for (char *c = personality; *c != '\0'; c++) {
+      if ((unsigned char)*c < 0x20) {
+        *c = ' ';
+      }
+    }
+    irc_numeric(client, 311, "%s %s bot * :%s", bot->name, bot->name,
+                personality);
+    irc_numeric(client, 312, "%s %s :%s %s", bot->name, IRC_SERVER_NAME,
+                bot->api_type, bot->model);
+    irc_channel_list(bot_channels(bot->handle), list, sizeof(list));
+    if (list[0] != '\0') {
+      irc_numeric(client, 319, "%s :%s", bot->name, list);
+    }
+    nick = bot->name;
+  } else if (!headless && strcasecmp(nick, user_name) == 0) {
+    irc_numeric(client, 311, "%s %s local * :%s", user_name, user_name,
+                user_name);
+    irc_numeric(client, 312, "%s %s :terminal", user_name, IRC_SERVER_NAME);
+    irc_channel_list(user_channels(), list, sizeof(list));
+    if (list[0] != '\0') {
+      irc_numeric(client, 319, "%s :%s", user_name, list);
+    }
+  } else {
+    irc_numeric(client, 401, "%s :No such nick/channel", nick);
+  }
+  irc_numeric(client, 318, "%s :End of WHOIS list", nick);
+  if (bot != NULL) {
+    bot_release(bot);
+  }
+}
+
+// Finish registration once both NICK and USER have arrived
+static void irc_try_register(IrcClient *client) {
+  if (client->registered || strcmp(client->nick, "*") == 0 ||
+      client->user[0] == '\0') {
+    return;
+  }
+  client->registered = 1;
+  char created[64];
+  strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S",
+           localtime(&start_time));
+  irc_numeric(client, 1, ":Welcome to the lierc IRC network %s!%s@%s",
+              client->nick, client->user, client->host);
+  irc_numeric(client, 2, ":Your host is %s, running lierc", IRC_SERVER_NAME);
+  irc_numeric(client, 3, ":This server was created %s", created);
+  irc_numeric(client, 4, "%s lierc o nt", IRC_SERVER_NAME);
+  irc_numeric(client, 375, ":- %s Message of the day -", IRC_SERVER_NAME);
+  irc_numeric(client, 372, ":- The bots talk in %s; /join it and mention one "
+                           "with @name. Joining any other #channel opens it.",
+              DEFAULT_CHANNEL);
+  irc_numeric(client, 376, ":End of MOTD command");
+}
+
+static void irc_join(IrcClient *client, int channel) {
+  uint32_t bit = 1u << channel;
+  if (client->channels & bit) {
+    return;
+  }
+  client->channels |= bit;
+  char prefix[180];
+  irc_prefix(client->nick, prefix, sizeof(prefix));
+  irc_broadcast(bit, NULL, ":%s JOIN %s", prefix, channels[channel]->name);
+  irc_numeric(client, 332, "%s :AI bots chatting. Mention one with @name.",
+              channels[channel]->name);
+  irc_send_names(client, channel);
+}
+
+static void irc_part(IrcClient *client, int channel, const char *reason) {
+  char prefix[180];
+  irc_prefix(client->nick, prefix, sizeof(prefix));
+  irc_broadcast(1u << channel, NULL, ":%s PART %s :%s", prefix,
+                channels[channel]->name, reason);
+  client->channels &= ~(1u << channel);
+}
+
+// Split a line into its command and parameters, the last of which may be
+// a ":"-prefixed trailing one with spaces. Returns the parameter count.
+static int irc_parse(char *line, char **command, char *params[]) {
+  int count = 0;
+  *command = NULL;
+  if (*line == ':') {
+    line += strcspn(line, " "); // Prefix, ignored from clients
+  }
+  while (*line != '\0') {
+    while (*line == ' ') {
+      line++;
+    }
+    if (*line == '\0') {
+      break;
+    }
+    if (*command != NULL && (*line == ':' || count == IRC_MAX_PARAMS - 1)) {
+      params[count++] = *line == ':' ? line + 1 : line;
+      break;
+    }
+    char *word = line;
+    line += strcspn(line, " ");
+    if (*line != '\0') {
+      *line++ = '\0';
+    }
+    if (*command == NULL) {
+      *command = word;
+    } else {
+      params[count++] = word;
+    }
+  }
+  return count;
 }
 
-// Function prototype for bot_autonomous_behavior
-void *bot_autonomous_behavior(void *arg);
-
-// Function to display the sidebar with connected bots
-char *find_matching_username(const char *partial) {
-  if (strncmp(partial, user_name, strlen(partial)) == 0) {
-    return user_name;
-  }
-  for (int i = 0; i < bot_count; i++) {
-    if (strncmp(partial, bots[i].name, strlen(partial)) == 0) {
-      return bots[i].name;
+static void irc_handle_nick(IrcClient *client, const char *nick) {
+  if (!irc_valid_nick(nick)) {
+    irc_numeric(client, 432, "%s :Erroneous nickname", nick);
+  } else if (!irc_nick_available(client, nick)) {
+    irc_numeric(client, 433, "%s :Nickname is already in use", nick);
+  } else if (client->registered) {
+    char prefix[180];
+    irc_prefix(client->nick, prefix, sizeof(prefix));
+    if (client->channels != 0) {
+      irc_broadcast(client->channels, NULL, ":%s NICK :%s", prefix, nick);
+    } else {
+      irc_send(client, ":%s NICK :%s", prefix, nick);
     }
+    snprintf(client->nick, sizeof(client->nick), "%s", nick);
+  } else {
+    snprintf(client->nick, sizeof(client->nick), "%s", nick);
+    irc_try_register(client);
   }
-  return NULL;
 }
 
-void update_sidebar() {
-  werase(sidebar_win);
-  mvwprintw(sidebar_win, 1, 2, "Users:");
-  mvwprintw(sidebar_win, 2, 2, "@%s", user_name);
-  for (int i = 0; i < bot_count; i++) {
-    if (bots[i].is_typing) {
-      wattron(sidebar_win, COLOR_PAIR(COLOR_TYPING));
+static void irc_handle_privmsg(IrcClient *client, const char *command,
+                               char *params[], int count) {
+  int notice = strcasecmp(command, "NOTICE") == 0;
+  if (count < 1) {
+    irc_numeric(client, 411, ":No recipient given (%s)", command);
+    return;
+  }
+  if (count < 2 || params[1][0] == '\0') {
+    irc_numeric(client, 412, ":No text to send");
+    return;
+  }
+  const char *target = params[0];
+  const char *text = params[1];
+  char prefix[180];
+  irc_prefix(client->nick, prefix, sizeof(prefix));
+  int channel = target[0] == '#' ? channel_find(target) : -1;
+  if (channel >= 0) {
+    if (!(client->channels & (1u << channel))) {
+      irc_numeric(client, 404, "%s :Cannot send to channel",
+                  channels[channel]->name);
+    } else if (notice) {
+      // Notices never get automatic replies, so the bots don't see them
+      irc_broadcast(1u << channel, client->nick, ":%s NOTICE %s :%s", prefix,
+                    channels[channel]->name, text);
     } else {
-      wattron(sidebar_win, COLOR_PAIR(COLOR_SIDEBAR));
+      // Relayed to the other clients when it comes back as a room event
+      post_user_message(channel, client->nick, text);
     }
-    mvwprintw(sidebar_win, i + 3, 2, "+%s [%s]", bots[i].name,
-              bots[i].api_type);
-    if (bots[i].is_typing) {
-      wattroff(sidebar_win, COLOR_PAIR(COLOR_TYPING));
-    } else {
-      wattroff(sidebar_win, COLOR_PAIR(COLOR_SIDEBAR));
+    return;
+  }
+  IrcClient *recipient = irc_find_client(target);
+  if (recipient != NULL) {
+    irc_send(recipient, ":%s %s %s :%s", prefix, notice ? "NOTICE" : "PRIVMSG",
+             recipient->nick, text);
+  } else if (target[0] == '#') {
+    irc_numeric(client, 403, "%s :No such channel", target);
+  } else if (!irc_nick_available(NULL, target)) {
+    if (!notice) {
+      irc_send(client,
+               ":%s NOTICE %s :%s only talks in channels; mention them in one",
+               IRC_SERVER_NAME, client->nick, target);
     }
+  } else if (!notice) {
+    irc_numeric(client, 401, "%s :No such nick/channel", target);
   }
-  wrefresh(sidebar_win);
 }
 
-// Parse and handle slash commands like adding or removing a bot
-void handle_command(char *input) {
-  char command[MAX_QUERY_SIZE];
-  sscanf(input, "%s", command);
-
-  if (strcmp(command, "/addbot") == 0) {
-    char api_type[20], name[50];
-    if (sscanf(input, "/addbot %s %s", api_type, name) == 2) {
-      if (bot_count < MAX_BOTS) {
-        Bot *new_bot = &bots[bot_count];
-        strncpy(new_bot->api_type, api_type, sizeof(new_bot->api_type));
-        strncpy(new_bot->name, name, sizeof(new_bot->name));
+// Handle one line from a client
+static void irc_handle_line(IrcClient *client, char *line) {
+  char *command;
+  char *params[IRC_MAX_PARAMS];
+  int count = irc_parse(line, &command, params);
+  if (command == NULL) {
+    return;
+  }
 
-        // Generate unique personality and temperature
-        float temperature;
-        char existing_personalities[MAX_BOTS][256];
-        for (int i = 0; i < bot_count; i++) {
-          strncpy(existing_personalities[i], bots[i].personality, 256);
-        }
-        char *personality = generate_unique_bot_personality(
-            &temperature, existing_personalities, bot_count);
-        if (personality) {
-          strncpy(new_bot->personality, personality,
-                  sizeof(new_bot->personality));
-          free(personality);
-        } else {
-          strncpy(new_bot->personality, "Default personality",
-                  sizeof(new_bot->personality));
+  if (strcasecmp(command, "CAP") == 0) {
+    // No capabilities; this just lets clients that negotiate carry on
+    if (count > 0 && strcasecmp(params[0], "LS") == 0) {
+      irc_send(client, ":%s CAP * LS :", IRC_SERVER_NAME);
+    }
+  } else if (strcasecmp(command, "PASS") == 0 ||
+             strcasecmp(command, "PONG") == 0) {
+    // Not needed
+  } else if (strcasecmp(command, "NICK") == 0) {
+    if (count < 1) {
+      irc_numeric(client, 431, ":No nickname given");
+    } else {
+      irc_handle_nick(client, params[0]);
+    }
+  } else if (strcasecmp(command, "USER") == 0) {
+    if (client->registered) {
+      irc_numeric(client, 462, ":Unauthorized command (already registered)");
+    } else if (count < 4) {
+      irc_numeric(client, 461, "USER :Not enough parameters");
+    } else {
+      snprintf(client->user, sizeof(client->user), "%.*s",
+               (int)strcspn(params[0], "@"), params[0]);
+      if (client->user[0] == '\0') {
+        strcpy(client->user, "user");
+      }
+      irc_try_register(client);
+    }
+  } else if (strcasecmp(command, "PING") == 0) {
+    irc_send(client, ":%s PONG %s :%s", IRC_SERVER_NAME, IRC_SERVER_NAME,
+             count > 0 ? params[0] : IRC_SERVER_NAME);
+  } else if (strcasecmp(command, "QUIT") == 0) {
+    snprintf(client->quit_reason, sizeof(client->quit_reason), "Quit: %s",
+             count > 0 ? params[0] : "Client Quit");
+    irc_send(client, "ERROR :Closing Link: %s (%s)", client->host,
+             client->quit_reason);
+    client->closing = 1;
+    irc_mark_dirty(client);
+  } else if (!client->registered) {
+    irc_numeric(client, 451, ":You have not registered");
+  } else if (strcasecmp(command, "JOIN") == 0) {
+    if (count < 1) {
+      irc_numeric(client, 461, "JOIN :Not enough parameters");
+      return;
+    }
+    char *save;
+    for (char *channel = strtok_r(params[0], ",", &save); channel != NULL;
+         channel = strtok_r(NULL, ",", &save)) {
+      if (strcmp(channel, "0") == 0) {
+        while (client->channels != 0) {
+          irc_part(client, __builtin_ctz(client->channels), client->nick);
         }
-        new_bot->temperature = temperature;
-
-        // Initialize memory and counters
-        memset(new_bot->memory, 0, sizeof(new_bot->memory));
-        new_bot->memory_index = 0;
-        new_bot->memory_count = 0;
-        new_bot->total_messages = 0;
-
-        bot_count++;
-        new_bot->is_active = 1;
-        pthread_create(&new_bot->thread_id, NULL, bot_autonomous_behavior,
-                       new_bot);
-        update_sidebar();
-        char success_message[256];
-        snprintf(success_message, sizeof(success_message), "Added %s bot '%s'",
-                 api_type, name);
-        add_chat_message("system", "system", success_message);
+        continue;
+      }
+      int index = channel_open(channel);
+      if (index >= 0) {
+        irc_join(client, index);
+      } else if (channel_name_valid(channel)) {
+        irc_numeric(client, 405, "%s :Too many channels", channel);
       } else {
-        log_error("Bot limit reached.");
+        irc_numeric(client, 403, "%s :No such channel", channel);
       }
-    } else {
-      log_error(
-          "Invalid command format. Usage: /addbot <openai|anthropic> <name>");
     }
-  } else if (strcmp(command, "/kick") == 0) {
-    char botname[50];
-    if (sscanf(input, "/kick %s", botname) == 1) {
-      if (strcmp(botname, "all") == 0) {
-        bot_count = 0;
-        update_sidebar();
-        add_chat_message("system", "system", "All bots kicked.");
+  } else if (strcasecmp(command, "PART") == 0) {
+    if (count < 1) {
+      irc_numeric(client, 461, "PART :Not enough parameters");
+      return;
+    }
+    char *save;
+    for (char *channel = strtok_r(params[0], ",", &save); channel != NULL;
+         channel = strtok_r(NULL, ",", &save)) {
+      int index = channel_find(channel);
+      if (index < 0) {
+        irc_numeric(client, 403, "%s :No such channel", channel);
+      } else if (!(client->channels & (1u << index))) {
+        irc_numeric(client, 442, "%s :You're not on that channel",
+                    channels[index]->name);
       } else {
-        int found = 0;
-        for (int i = 0; i < bot_count; i++) {
-          if (strcmp(bots[i].name, botname) == 0) {
-            found = 1;
-            bots[i].is_active = 0;
-            pthread_join(bots[i].thread_id, NULL);
-            for (int j = i; j < bot_count - 1; j++) {
-              bots[j] = bots[j + 1]; // Shift all bots left
-            }
-            bot_count--;
-            update_sidebar();
-            add_chat_message("system", "system", "Bot kicked.");
-            break;
-          }
-        }
-        if (!found) {
-          log_error("Bot not found.");
-        }
+        irc_part(client, index, count > 1 ? params[1] : client->nick);
       }
-    } else {
-      log_error("Invalid command format. Usage: /kick <botname|all>");
     }
-  } else if (strcmp(command, "/nick") == 0) {
-    char new_nick[50];
-    if (sscanf(input, "/nick %s", new_nick) == 1) {
-      strncpy(user_name, new_nick, sizeof(user_name));
-      update_sidebar();
-      add_chat_message("system", "system", "User name changed.");
-    } else {
-      log_error("Invalid command format. Usage: /nick <newname>");
+  } else if (strcasecmp(command, "NAMES") == 0) {
+    if (count == 0) {
+      for (uint32_t mask = client->channels; mask != 0; mask &= mask - 1) {
+        irc_send_names(client, __builtin_ctz(mask));
+      }
+      return;
     }
-  } else if (strcmp(command, "/quit") == 0) {
-    endwin();
-    exit(0);
-  } else if (strcmp(command, "/whois") == 0) {
-    char botname[50];
-    if (sscanf(input, "/whois %s", botname) == 1) {
-      handle_whois(botname);
+    char *save;
+    for (char *channel = strtok_r(params[0], ",", &save); channel != NULL;
+         channel = strtok_r(NULL, ",", &save)) {
+      int index = channel_find(channel);
+      if (index >= 0) {
+        irc_send_names(client, index);
+      } else {
+        irc_numeric(client, 366, "%s :End of NAMES list", channel);
+      }
+    }
+  } else if (strcasecmp(command, "WHOIS") == 0) {
+    if (count < 1) {
+      irc_numeric(client, 431, ":No nickname given");
     } else {
-      log_error("Invalid command format. Usage: /whois <botname>");
+      // "WHOIS server nick" names the server first
+      irc_send_whois(client, params[count - 1]);
     }
+  } else if (strcasecmp(command, "PRIVMSG") == 0 ||
+             strcasecmp(command, "NOTICE") == 0) {
+    irc_handle_privmsg(client, command, params, count);
   } else {
-    log_error("Unknown command.");
+    irc_numeric(client, 421, "%s :Unknown command", command);
   }
 }
 
-// Function to determine if a bot should respond
-int should_bot_respond(const char *message, const char *bot_personality,
-                       const char *bot_memory, const char *bot_name,
-                       int is_mentioned) {
-  CURL *curl;
-  CURLcode res;
-  struct memory chunk = {0};
-  chunk.response = malloc(1);
-  chunk.size = 0;
-
-  // If the bot is mentioned, it should respond with very high probability
-  if (is_mentioned) {
-    free(chunk.response);
-    return (rand() % 100) < 95; // 95% chance to respond when mentioned
+// Read what a client sent and handle each complete line. Stops early once
+// the client's output backs up, leaving the rest in the socket.
+static void irc_read(IrcClient *client) {
+  char buffer[4096];
+  size_t budget = IRC_READ_BUDGET;
+  while (budget > 0 && !client->dead && !client->closing &&
+         client->output_length - client->output_start < IRC_PAUSE_OUTPUT) {
+    ssize_t n = recv(client->fd, buffer,
+                     budget < sizeof(buffer) ? budget : sizeof(buffer), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      char reason[64] = "Connection closed";
+      if (n < 0) {
+        snprintf(reason, sizeof(reason), "Read error: %s", strerror(errno));
+      }
+      irc_drop(client, reason);
+      return;
+    }
+    if (n < 0) {
+      return;
+    }
+    budget -= n;
+    for (ssize_t i = 0; i < n && !client->dead && !client->closing; i++) {
+      char c = buffer[i];
+      if (c == '\n' || c == '\r') {
+        if (!client->overlong && client->input_length > 0) {
+          client->input[client->input_length] = '\0';
+          irc_handle_line(client, client->input);
+        }
+        client->input_length = 0;
+        client->overlong = 0;
+      } else if (client->input_length < sizeof(client->input) - 3) {
+        client->input[client->input_length++] = c;
+      } else if (!client->overlong) {
+        // Too long for the protocol: handle what fit, skip the rest
+        client->input[client->input_length] = '\0';
+        irc_handle_line(client, client->input);
+        client->input_length = 0;
+        client->overlong = 1;
+      }
+    }
   }
+}
 
-  // Random chance to respond even when not mentioned
-  if ((rand() % 100) < 30) { // 30% chance to consider responding
-    free(chunk.response);
-    return 1;
+// Write as much pending output as the socket takes
+static void irc_flush(IrcClient *client) {
+  while (client->output_start < client->output_length) {
+    ssize_t n = send(client->fd, client->output + client->output_start,
+                     client->output_length - client->output_start,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "Write error: %s", strerror(errno));
+        irc_drop(client, reason);
+      }
+      if (errno != EINTR) {
+        return;
+      }
+      continue;
+    }
+    client->output_start += n;
   }
+  client->output_start = client->output_length = 0;
+}
 
-  curl = curl_easy_init();
-  if (!curl) {
-    log_error("CURL initialization failed in should_bot_respond.");
-    return 0;
+// Watch for input unless the client's output is backed up, and for
+// writability while there is output pending
+static void irc_update_interest(IrcClient *client) {
+  size_t pending = client->output_length - client->output_start;
+  uint32_t events = 0;
+  if (!client->closing && pending < IRC_PAUSE_OUTPUT) {
+    events |= EPOLLIN;
   }
+  if (pending > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events != client->events) {
+    struct epoll_event event = {.events = events, .data.ptr = client};
+    epoll_ctl(irc_epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->events = events;
+  }
+}
 
-  // Set up the request to OpenAI
-  const char *url = "https://api.openai.com/v1/chat/completions";
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  char auth_header[256];
-  snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-           openai_api_key);
-  headers = curl_slist_append(headers, auth_header);
-
-  // Create the JSON request body
-  char json_data[4096];
-  snprintf(json_data, sizeof(json_data),
-           "{\"model\": \"gpt-3.5-turbo\", \"messages\": ["
-           "{\"role\": \"system\", \"content\": \"You are an AI assistant that "
-           "determines if a bot with a given personality should respond to a "
-           "message. The bot's name is %s. "
-           "The bot's personality is: %s. The bot's recent memory is: %s. "
-           "Consider the context and the bot's personality. Respond with only "
-           "'yes' if the bot should respond, "
-           "or 'no' if it shouldn't. Aim for natural conversation flow and "
-           "avoid having the bot respond to every message.\"}, "
-           "{\"role\": \"user\", \"content\": \"Should the bot respond to this "
-           "message: %s\"}], "
-           "\"max_tokens\": 1, \"temperature\": 0.7}",
-           bot_name, bot_personality, bot_memory, message);
-
-  // Set up CURL options
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+static void irc_close(IrcClient *client) {
+  epoll_ctl(irc_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  IrcClient *last = irc_clients[--irc_client_count];
+  irc_clients[client->slot] = last;
+  last->slot = client->slot;
+  __atomic_store_n(&irc_client_count, irc_client_count, __ATOMIC_RELAXED);
+  if (client->registered && client->channels != 0) {
+    char prefix[180];
+    snprintf(prefix, sizeof(prefix), "%s!%s@%s", client->nick, client->user,
+             client->host);
+    irc_broadcast(client->channels, NULL, ":%s QUIT :%s", prefix,
+                  client->quit_reason);
+  }
+  free(client->output);
+  free(client);
+}
 
-  // Perform the request
-  res = curl_easy_perform(curl);
-  int should_respond = 0;
+static void irc_accept() {
+  while (1) {
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof(addr);
+    int fd = accept(irc_listen_fd, (struct sockaddr *)&addr, &addr_length);
+    if (fd < 0) {
+      return; // EAGAIN once the backlog is empty
+    }
+    if (irc_client_count >= IRC_MAX_CLIENTS) {
+      const char *full = "ERROR :Server full\r\n";
+      send(fd, full, strlen(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    IrcClient *client = calloc(1, sizeof(IrcClient));
+    if (client == NULL) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    strcpy(client->nick, "*");
+    if (addr.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr,
+                client->host, sizeof(client->host));
+    } else {
+      inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr,
+                client->host, sizeof(client->host));
+    }
+    client->events = EPOLLIN;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    if (epoll_ctl(irc_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      free(client);
+      continue;
+    }
+    client->slot = irc_client_count;
+    irc_clients[irc_client_count] = client;
+    __atomic_store_n(&irc_client_count, irc_client_count + 1,
+                     __ATOMIC_RELAXED);
+  }
+}
 
-  if (res != CURLE_OK) {
-    log_error(curl_easy_strerror(res));
-  } else {
-    // Parse the JSON response
-    struct json_object *parsed_json;
-    struct json_object *choices_array;
-    struct json_object *message_object;
-    struct json_object *message_content;
-
-    parsed_json = json_tokener_parse(chunk.response);
-
-    if (json_object_object_get_ex(parsed_json, "choices", &choices_array)) {
-      if (json_object_get_type(choices_array) == json_type_array) {
-        message_object = json_object_array_get_idx(choices_array, 0);
-        if (json_object_object_get_ex(message_object, "message",
-                                      &message_object)) {
-          if (json_object_object_get_ex(message_object, "content",
-                                        &message_content)) {
-            const char *response_text = json_object_get_string(message_content);
-            should_respond = (strcasecmp(response_text, "yes") == 0);
-          }
+void *irc_thread(void *arg) {
+  (void)arg;
+  trace_thread_name("irc");
+  struct epoll_event events[64];
+  while (__atomic_load_n(&irc_running, __ATOMIC_ACQUIRE)) {
+    int ready = epoll_wait(irc_epoll_fd, events, 64, -1);
+    for (int i = 0; i < ready; i++) {
+      void *source = events[i].data.ptr;
+      if (source == &irc_listen_fd) {
+        irc_accept();
+      } else if (source == &irc_wake_fd) {
+        irc_deliver_events();
+      } else {
+        IrcClient *client = source;
+        if (client->dead) {
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          irc_read(client);
+        }
+        if (events[i].events & EPOLLOUT) {
+          irc_mark_dirty(client);
         }
       }
     }
 
-    json_object_put(parsed_json);
+    // Write out what the events produced and close finished clients.
+    // Closing one can queue a QUIT for the others, which lands here too.
+    while (irc_dirty_count > 0) {
+      // Still marked dirty, so a write error can't list it a second time
+      IrcClient *client = irc_dirty[--irc_dirty_count];
+      if (!client->dead) {
+        irc_flush(client);
+      }
+      if (client->dead || (client->closing &&
+                           client->output_start == client->output_length)) {
+        irc_close(client);
+      } else {
+        client->dirty = 0;
+        irc_update_interest(client);
+      }
+    }
   }
 
-  // Clean up
-  free(chunk.response);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
-
-  return should_respond;
+  while (irc_client_count > 0) {
+    IrcClient *client = irc_clients[irc_client_count - 1];
+    client->registered = 0; // No QUITs for the others on the way out
+    irc_close(client);
+  }
+  return NULL;
 }
 
-// Function to update bot's memory
-void update_bot_memory(Bot *bot, const char *new_interaction) {
-  pthread_mutex_lock(&bot_mutex);
-
-  // Create a summary of the new interaction
-  char summary[MAX_MEMORY_ENTRY_LENGTH];
-  snprintf(summary, sizeof(summary), "Last interaction: %.100s...",
-           new_interaction);
+// Close the server's descriptors and free the client table
+static void irc_release() {
+  int *fds[] = {&irc_listen_fd, &irc_wake_fd, &irc_epoll_fd};
+  for (int i = 0; i < 3; i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+  free(irc_clients);
+  irc_clients = NULL;
+}
 
-  // Add summary to the circular buffer
-  strncpy(bot->memory[bot->memory_index], summary, MAX_MEMORY_ENTRY_LENGTH - 1);
-  bot->memory[bot->memory_index][MAX_MEMORY_ENTRY_LENGTH - 1] = '\0';
+// Start the IRC server on "[host:]port", by default on 127.0.0.1 (use
+// 0.0.0.0 to share the room over the network). Returns -1 on failure.
+int irc_start(const char *target) {
+  char host[64] = "127.0.0.1";
+  const char *port = strrchr(target, ':');
+  if (port != NULL) {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - target), target);
+    port++;
+  } else {
+    port = target;
+  }
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(port));
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    return -1;
+  }
 
-  // Update index and count
-  bot->memory_index = (bot->memory_index + 1) % MAX_MEMORY_ENTRIES;
-  if (bot->memory_count < MAX_MEMORY_ENTRIES) {
-    bot->memory_count++;
+  irc_clients = calloc(IRC_MAX_CLIENTS, sizeof(IrcClient *));
+  irc_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  irc_wake_fd = eventfd(0, EFD_NONBLOCK);
+  irc_epoll_fd = epoll_create1(0);
+  int reuse = 1;
+  struct epoll_event listen_event = {.events = EPOLLIN,
+                                     .data.ptr = &irc_listen_fd};
+  struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = &irc_wake_fd};
+  if (irc_clients == NULL || irc_listen_fd < 0 || irc_wake_fd < 0 ||
+      irc_epoll_fd < 0 ||
+      setsockopt(irc_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) < 0 ||
+      bind(irc_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(irc_listen_fd, 128) < 0 ||
+      fcntl(irc_listen_fd, F_SETFL,
+            fcntl(irc_listen_fd, F_GETFL) | O_NONBLOCK) < 0 ||
+      epoll_ctl(irc_epoll_fd, EPOLL_CTL_ADD, irc_listen_fd, &listen_event) < 0 ||
+      epoll_ctl(irc_epoll_fd, EPOLL_CTL_ADD, irc_wake_fd, &wake_event) < 0) {
+    irc_release();
+    return -1;
   }
 
-  // Increment total messages
-  bot->total_messages++;
+  // Under irc_mutex, so no event is queued if the thread fails to start
+  pthread_mutex_lock(&irc_mutex);
+  irc_running = 1;
+  if (pthread_create(&irc_thread_id, NULL, irc_thread, NULL) != 0) {
+    irc_running = 0;
+    pthread_mutex_unlock(&irc_mutex);
+    irc_release();
+    return -1;
+  }
+  pthread_mutex_unlock(&irc_mutex);
+  return 0;
+}
 
-  // Create a consolidated memory string
-  char consolidated_memory[MAX_MEMORY_ENTRIES * MAX_MEMORY_ENTRY_LENGTH];
-  consolidated_memory[0] = '\0';
-  for (int i = 0; i < bot->memory_count; i++) {
-    strcat(consolidated_memory, bot->memory[i]);
-    strcat(consolidated_memory, " ");
+void irc_stop() {
+  if (!irc_running) {
+    return;
   }
+  pthread_mutex_lock(&irc_mutex);
+  __atomic_store_n(&irc_running, 0, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(irc_wake_fd, &one, sizeof(one)) < 0) {
+    // Already signalled
+  }
+  pthread_mutex_unlock(&irc_mutex);
+  pthread_join(irc_thread_id, NULL);
+  irc_release();
+  for (int i = 0; i < irc_event_count; i++) {
+    free(irc_events[i].text);
+  }
+  free(irc_events);
+  irc_events = NULL;
+  irc_event_count = irc_event_capacity = 0;
+}
 
-  // Update the first memory entry with the consolidated memory
-  strncpy(bot->memory[0], consolidated_memory, MAX_MEMORY_ENTRY_LENGTH - 1);
-  bot->memory[0][MAX_MEMORY_ENTRY_LENGTH - 1] = '\0';
+// Tail API (--tail). Dashboards and archivers connect to a Unix socket and
+// get every chat message and bot state change (added, removed, join, part,
+// typing, idle) as a line of JSON, from the moment they connect. Events are
+// formatted once, into a ring shared by all readers; each reader only has
+// a position in it, and one thread sends each reader its share straight
+// from the ring. Publishing never waits for readers: a reader that falls a
+// whole ring behind is disconnected, and can reconnect to carry on.
+#define TAIL_RING_SIZE (1 << 20) // Bytes of events kept; a power of two
+#define TAIL_MAX_READERS 256
+#define TAIL_LINE_LIMIT (MAX_RESPONSE_SIZE * 2 + 512)
 
-  pthread_mutex_unlock(&bot_mutex);
+typedef struct {
+  int fd;
+  uint64_t position; // Offset in the event stream of the next byte to send
+  int blocked;       // Waiting for the socket to drain
+} TailReader;
+
+int tail_running = 0;
+int tail_listen_fd = -1;
+int tail_wake_fd = -1; // eventfd: events are pending or tail_stop ran
+int tail_epoll_fd = -1;
+char tail_socket_path[108] = "";
+pthread_t tail_thread_id;
+
+// The ring holds the last TAIL_RING_SIZE bytes of the stream. Publishers
+// write under tail_mutex, taken last, under chat_mutex or bot_mutex; the
+// tail thread reads without it. tail_reserved runs ahead of tail_head
+// while an event is being copied in, so the thread can tell whether what
+// it just sent was overwritten.
+pthread_mutex_t tail_mutex = PTHREAD_MUTEX_INITIALIZER;
+char *tail_ring = NULL;
+uint64_t tail_head = 0;     // Bytes of events published
+uint64_t tail_reserved = 0; // Bytes published or being copied in
+int tail_wake_pending = 0;  // tail_wake_fd was signalled (under tail_mutex)
+
+// Only the tail thread touches the readers
+TailReader tail_readers[TAIL_MAX_READERS];
+int tail_reader_count = 0; // Read atomically by publishers and metrics
+unsigned long tail_readers_dropped = 0;
+
+// Append one line to the ring and wake the tail thread
+static void tail_publish(const char *line, size_t length) {
+  pthread_mutex_lock(&tail_mutex);
+  if (!tail_running) { // Stopped since the check; tail_wake_fd may be closed
+    pthread_mutex_unlock(&tail_mutex);
+    return;
+  }
+  uint64_t start = tail_head;
+  __atomic_store_n(&tail_reserved, start + length, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  size_t offset = start & (TAIL_RING_SIZE - 1);
+  size_t first = length < TAIL_RING_SIZE - offset ? length
+                                                  : TAIL_RING_SIZE - offset;
+  memcpy(tail_ring + offset, line, first);
+  memcpy(tail_ring, line + first, length - first);
+  __atomic_store_n(&tail_head, start + length, __ATOMIC_RELEASE);
+  if (!tail_wake_pending) {
+    tail_wake_pending = 1;
+    uint64_t one = 1;
+    if (write(tail_wake_fd, &one, sizeof(one)) < 0) {
+      // The counter is already non-zero; the tail thread will wake anyway
+    }
+  }
+  pthread_mutex_unlock(&tail_mutex);
 }
 
-// Function to check if a message mentions a specific user
-int is_mentioned(const char *message, const char *username) {
-  char mention[52]; // @username
-  snprintf(mention, sizeof(mention), "@%s", username);
-  return strstr(message, mention) != NULL;
+// Publish a chat message. Cheap no-op unless someone is subscribed.
+void tail_post_message(int channel, unsigned long number, const char *role,
+                       const char *nick, const char *text) {
+  if (__atomic_load_n(&tail_reader_count, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  char escaped_nick[128];
+  char escaped_text[MAX_RESPONSE_SIZE * 2];
+  json_escape_string(nick, escaped_nick, sizeof(escaped_nick));
+  json_escape_string(text, escaped_text, sizeof(escaped_text));
+  char line[TAIL_LINE_LIMIT];
+  int length = snprintf(line, sizeof(line),
+                        "{\"type\": \"message\", \"time\": %ld, "
+                        "\"channel\": \"%s\", \"number\": %lu, "
+                        "\"role\": \"%s\", \"nick\": \"%s\", "
+                        "\"text\": \"%s\"}\n",
+                        (long)wall_time(), channels[channel]->name, number,
+                        role, escaped_nick, escaped_text);
+  tail_publish(line, (size_t)length < sizeof(line) ? (size_t)length
+                                                    : sizeof(line) - 1);
 }
 
-// Structure to pass data to the bot response thread
-typedef struct {
-  char *query;
-  char *sender;
-  Bot *bot;
-} BotThreadData;
-
-// Function for the bot response thread
-void *bot_response_thread(void *arg) {
-  BotThreadData *data = (BotThreadData *)arg;
-  const char *query = data->query;
-  const char *sender = data->sender;
-  Bot *bot = data->bot;
+// Publish a change to a bot: type is "bot_added", "bot_removed", "join",
+// "part", "typing" or "idle"
+void tail_post_bot(const char *type, const char *bot, int channel) {
+  if (__atomic_load_n(&tail_reader_count, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  char escaped_bot[128];
+  json_escape_string(bot, escaped_bot, sizeof(escaped_bot));
+  char line[512];
+  int length = snprintf(line, sizeof(line),
+                        "{\"type\": \"%s\", \"time\": %ld, \"bot\": \"%s\"",
+                        type, (long)wall_time(), escaped_bot);
+  if (channel >= 0) {
+    length += snprintf(line + length, sizeof(line) - length,
+                       ", \"channel\": \"%s\"", channels[channel]->name);
+  }
+  length += snprintf(line + length, sizeof(line) - length, "}\n");
+  tail_publish(line, length);
+}
 
-  // Set typing status
-  bot->is_typing = 1;
-  update_sidebar();
+static void tail_close(int index) {
+  close(tail_readers[index].fd); // Also takes it out of the epoll set
+  tail_readers[index] = tail_readers[--tail_reader_count];
+  __atomic_store_n(&tail_reader_count, tail_reader_count, __ATOMIC_RELEASE);
+}
 
-  CURL *curl;
-  CURLcode res;
-  struct memory chunk = {0};
-  chunk.response = malloc(1);
-  chunk.size = 0;
+// Send a reader what it hasn't had yet, straight from the ring. Returns -1
+// if it is to be dropped: it fell a ring behind or the connection failed.
+static int tail_send(TailReader *reader) {
+  while (1) {
+    uint64_t head = __atomic_load_n(&tail_head, __ATOMIC_ACQUIRE);
+    if (reader->position == head) {
+      return 0;
+    }
+    if (head - reader->position > TAIL_RING_SIZE) {
+      return -1;
+    }
+    size_t offset = reader->position & (TAIL_RING_SIZE - 1);
+    size_t length = head - reader->position;
+    if (length > TAIL_RING_SIZE - offset) {
+      length = TAIL_RING_SIZE - offset; // The rest is at the ring's start
+    }
+    ssize_t n = send(reader->fd, tail_ring + offset, length,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? 0 : -1;
+    }
 
-  curl = curl_easy_init();
-  if (!curl) {
-    log_error("CURL initialization failed in bot thread.");
-    bot->is_typing = 0;
-    update_sidebar();
-    free(data);
-    return NULL;
+    // Unless a publisher got to these bytes while they were being sent,
+    // they went out intact
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&tail_reserved, __ATOMIC_RELAXED) >
+        reader->position + TAIL_RING_SIZE) {
+      return -1;
+    }
+    reader->position += n;
   }
+}
 
-  // Create the correct URL and headers for each bot type
-  char url[256];
-  struct curl_slist *headers = NULL;
-
-  if (strcmp(bot->api_type, "openai") == 0) {
-    // OpenAI URL and headers
-    strcpy(url, "https://api.openai.com/v1/chat/completions");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-             openai_api_key);
-    headers = curl_slist_append(headers, auth_header);
-  } else if (strcmp(bot->api_type, "anthropic") == 0) {
-    // Anthropic URL and headers
-    strcpy(url, "https://api.anthropic.com/v1/complete");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s",
-             anthropic_api_key);
-    headers = curl_slist_append(headers, auth_header);
-  } else {
-    log_error("Unknown bot API type.");
-    curl_easy_cleanup(curl);
-    free(data);
-    return NULL;
+// Bring every reader up to date, and watch the ones whose sockets are full
+// for writability
+static void tail_deliver() {
+  for (int i = 0; i < tail_reader_count;) {
+    TailReader *reader = &tail_readers[i];
+    if (tail_send(reader) < 0) {
+      tail_readers_dropped++;
+      tail_close(i);
+      continue;
+    }
+    int blocked =
+        reader->position != __atomic_load_n(&tail_head, __ATOMIC_ACQUIRE);
+    if (blocked != reader->blocked) {
+      struct epoll_event event = {
+          .events = EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0),
+          .data.fd = reader->fd};
+      epoll_ctl(tail_epoll_fd, EPOLL_CTL_MOD, reader->fd, &event);
+      reader->blocked = blocked;
+    }
+    i++;
   }
+}
 
-  // Create a string with the last few messages for context
-  char context[MAX_QUERY_SIZE * 5] = "";
-  int context_messages = 5; // Number of previous messages to include
-  int start_index =
-      (chat_index - context_messages < 0) ? 0 : chat_index - context_messages;
-  for (int j = start_index; j < chat_index; j++) {
-    char temp[MAX_QUERY_SIZE * 2];
-    int temp_size = sizeof(temp);
-    int written =
-        snprintf(temp, temp_size, "%.50s: %.1000s\n",
-                 chat_history[j].display_name, chat_history[j].content);
-    if (written >= temp_size) {
-      log_error("Message truncated in update_chat_window");
+static void tail_accept() {
+  while (1) {
+    int fd = accept(tail_listen_fd, NULL, NULL);
+    if (fd < 0) {
+      return; // EAGAIN once the backlog is empty
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP,
+                                .data.fd = fd};
+    if (tail_reader_count >= TAIL_MAX_READERS ||
+        epoll_ctl(tail_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      continue;
     }
-    strncat(context, temp, sizeof(context) - strlen(context) - 1);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    TailReader *reader = &tail_readers[tail_reader_count];
+    reader->fd = fd;
+    reader->position = __atomic_load_n(&tail_head, __ATOMIC_ACQUIRE);
+    reader->blocked = 0;
+    __atomic_store_n(&tail_reader_count, tail_reader_count + 1,
+                     __ATOMIC_RELEASE);
   }
+}
 
-  // Create the JSON request body
-  char
-      json_data[MAX_QUERY_SIZE * 20]; // Further increased size for more context
-  char escaped_personality[MAX_QUERY_SIZE * 2];
-  char escaped_memory[MAX_QUERY_SIZE * 2];
-  char escaped_context[MAX_QUERY_SIZE * 5];
-  char escaped_query[MAX_QUERY_SIZE * 2];
-
-  // Escape special characters in strings
-  json_escape_string(bot->personality, escaped_personality,
-                     sizeof(escaped_personality));
-  json_escape_string(bot->memory[0], escaped_memory, sizeof(escaped_memory));
-  json_escape_string(context, escaped_context, sizeof(escaped_context));
-  json_escape_string(query, escaped_query, sizeof(escaped_query));
-
-  int is_bot_mentioned = is_mentioned(query, bot->name);
-
-  int json_data_size = sizeof(json_data);
-  int written = snprintf(
-      json_data, json_data_size,
-      "{\"model\": \"%.50s\", \"messages\": ["
-      "{\"role\": \"system\", \"content\": \"You are a chatbot named %.50s "
-      "with the following personality: %.200s. Respond in a way that "
-      "reflects this personality. Be sarcastic, make jokes, and poke fun at "
-      "the user or other bots when appropriate. Don't be overly helpful or "
-      "polite. "
-      "Your responses should be reminiscent of IRC, Discord, or Reddit "
-      "conversations. "
-      "Occasionally, initiate new topics or ask questions to keep the "
-      "conversation going. "
-      "The message you're responding to was sent by %.50s. "
-      "Your recent memory is: %.200s. "
-      "Here's the recent conversation context:\\n%.1000s "
-      "You %s directly mentioned in this message. "
-      "If the conversation seems to be dying down, introduce a new topic or "
-      "ask a question.\"},"
-      "{\"role\": \"user\", \"content\": \"%.200s\"}"
-      "], \"temperature\": %.2f, \"stream\": false}",
-      model, bot->name, escaped_personality, sender, escaped_memory,
-      escaped_context, is_bot_mentioned ? "were" : "were not", escaped_query,
-      bot->temperature);
-
-  if (written >= json_data_size) {
-    log_error("JSON data truncated in bot_response_thread");
+// Readers have nothing to say; reading only tells when they hang up
+static void tail_read(int fd) {
+  for (int i = 0; i < tail_reader_count; i++) {
+    if (tail_readers[i].fd != fd) {
+      continue;
+    }
+    char discard[512];
+    ssize_t n;
+    while ((n = recv(fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      tail_close(i);
+    }
+    return;
   }
+}
 
-  // Set up CURL options
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-  // Perform the request and handle response
-  res = curl_easy_perform(curl);
-  if (res != CURLE_OK) {
-    log_error(curl_easy_strerror(res));
-  } else {
-    // Parse the JSON response and extract the bot's response
-    struct json_object *parsed_json;
-    struct json_object *choices_array;
-    struct json_object *message_object;
-    struct json_object *message_content;
-
-    parsed_json = json_tokener_parse(chunk.response);
-
-    if (parsed_json == NULL) {
-      log_error("Failed to parse JSON response");
-      add_chat_message("system", "system", "Failed to parse JSON response");
-    } else {
-      const char *response_text = NULL;
-
-      if (strcmp(bot->api_type, "openai") == 0) {
-        // OpenAI API response parsing
-        if (json_object_object_get_ex(parsed_json, "choices", &choices_array)) {
-          if (json_object_get_type(choices_array) == json_type_array) {
-            message_object = json_object_array_get_idx(choices_array, 0);
-            if (json_object_object_get_ex(message_object, "message",
-                                          &message_object)) {
-              if (json_object_object_get_ex(message_object, "content",
-                                            &message_content)) {
-                response_text = json_object_get_string(message_content);
-              }
-            }
-          }
-        }
-      } else if (strcmp(bot->api_type, "anthropic") == 0) {
-        // Anthropic API response parsing
-        if (json_object_object_get_ex(parsed_json, "completion",
-                                      &message_content)) {
-          response_text = json_object_get_string(message_content);
+void *tail_thread(void *arg) {
+  (void)arg;
+  trace_thread_name("tail");
+  struct epoll_event events[64];
+  while (__atomic_load_n(&tail_running, __ATOMIC_ACQUIRE)) {
+    int ready = epoll_wait(tail_epoll_fd, events, 64, -1);
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == tail_listen_fd) {
+        tail_accept();
+      } else if (fd == tail_wake_fd) {
+        uint64_t value;
+        pthread_mutex_lock(&tail_mutex);
+        tail_wake_pending = 0;
+        if (read(tail_wake_fd, &value, sizeof(value)) < 0) {
+          // Nothing was pending
         }
+        pthread_mutex_unlock(&tail_mutex);
+      } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                                     EPOLLERR)) {
+        tail_read(fd);
       }
+    }
+    tail_deliver();
+  }
 
-      if (response_text != NULL) {
-        // Add the bot's response to the queue
-        pthread_mutex_lock(&queue_mutex);
-        QueueNode *new_node = malloc(sizeof(QueueNode));
-        BotThreadData *response_data = malloc(sizeof(BotThreadData));
-        response_data->query = strdup(response_text);
-        response_data->sender = strdup(bot->name);
-        response_data->bot = bot;
-        new_node->data = response_data;
-        new_node->next = NULL;
-
-        if (response_queue->rear == NULL) {
-          response_queue->front = response_queue->rear = new_node;
-        } else {
-          response_queue->rear->next = new_node;
-          response_queue->rear = new_node;
-        }
-
-        pthread_cond_signal(&queue_cond);
-        pthread_mutex_unlock(&queue_mutex);
-      } else {
-        char error_message[1024];
-        snprintf(error_message, sizeof(error_message),
-                 "Failed to extract response from JSON. Raw response: %.900s",
-                 chunk.response);
-        log_error(error_message);
-        add_chat_message("system", "system", error_message);
-      }
+  while (tail_reader_count > 0) {
+    tail_close(tail_reader_count - 1);
+  }
+  return NULL;
+}
 
-      json_object_put(parsed_json); // Free the parsed JSON object
+// Close the tail sockets, remove the socket file and drop the ring, on
+// shutdown or after a failed tail_start
+static void tail_release() {
+  int *fds[] = {&tail_listen_fd, &tail_wake_fd, &tail_epoll_fd};
+  for (int i = 0; i < 3; i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
     }
   }
+  if (tail_socket_path[0] != '\0') {
+    unlink(tail_socket_path);
+    tail_socket_path[0] = '\0';
+  }
+  free(tail_ring);
+  tail_ring = NULL;
+}
 
-  // Cleanup CURL resources
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
-  free(chunk.response);
-  free(data);
-  bot->is_typing = 0;
-  update_sidebar();
-  return NULL;
+// Start serving the event stream on a Unix socket. Returns -1 on failure.
+int tail_start(const char *path) {
+  struct sockaddr_un addr = {0};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  tail_ring = malloc(TAIL_RING_SIZE);
+  tail_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (tail_ring == NULL || tail_listen_fd < 0) {
+    tail_release();
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path); // Left over from an earlier run
+  if (bind(tail_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    tail_release();
+    return -1;
+  }
+  strcpy(tail_socket_path, path);
+  fcntl(tail_listen_fd, F_SETFL, fcntl(tail_listen_fd, F_GETFL) | O_NONBLOCK);
+
+  tail_wake_fd = eventfd(0, EFD_NONBLOCK);
+  tail_epoll_fd = epoll_create1(0);
+  struct epoll_event listen_event = {.events = EPOLLIN,
+                                     .data.fd = tail_listen_fd};
+  struct epoll_event wake_event = {.events = EPOLLIN, .data.fd = tail_wake_fd};
+  if (listen(tail_listen_fd, 64) < 0 || tail_wake_fd < 0 ||
+      tail_epoll_fd < 0 ||
+      epoll_ctl(tail_epoll_fd, EPOLL_CTL_ADD, tail_listen_fd, &listen_event) <
+          0 ||
+      epoll_ctl(tail_epoll_fd, EPOLL_CTL_ADD, tail_wake_fd, &wake_event) < 0) {
+    tail_release();
+    return -1;
+  }
+
+  tail_running = 1;
+  if (pthread_create(&tail_thread_id, NULL, tail_thread, NULL) != 0) {
+    pthread_mutex_lock(&tail_mutex);
+    __atomic_store_n(&tail_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tail_mutex);
+    tail_release();
+    return -1;
+  }
+  return 0;
 }
 
-// Function to send a query to the OpenAI or Anthropic API based on bot type
-void send_chat_query(const char *query, const char *sender) {
-  for (int i = 0; i < bot_count; i++) {
-    // Skip if the bot is responding to its own message
-    if (strcmp(sender, bots[i].name) == 0) {
-      continue;
-    }
+void tail_stop() {
+  if (!tail_running) {
+    return;
+  }
+  pthread_mutex_lock(&tail_mutex);
+  __atomic_store_n(&tail_running, 0, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(tail_wake_fd, &one, sizeof(one)) < 0) {
+    // Already signalled
+  }
+  pthread_mutex_unlock(&tail_mutex);
+  pthread_join(tail_thread_id, NULL);
+  tail_release();
+}
 
-    int is_bot_mentioned = is_mentioned(query, bots[i].name);
-    if (!should_bot_respond(query, bots[i].personality, bots[i].memory[0],
-                            bots[i].name, is_bot_mentioned)) {
-      continue; // Skip this bot if it shouldn't respond
-    }
+// Prometheus text-format metrics, served over HTTP on a Unix socket or a
+// localhost TCP port (--metrics) so long-running rooms can be scraped
+// without touching the TUI
+int metrics_fd = -1;
+int metrics_running = 0;
+char metrics_socket_path[108] = ""; // Set when listening on a Unix socket
+pthread_t metrics_thread_id;
 
-    // Add a random delay between 1 and 3 seconds before responding
-    sleep(1 + (rand() % 3));
+// Upper bounds of the exported latency histogram buckets, in seconds
+const double metrics_latency_buckets[] = {0.001, 0.005, 0.025, 0.1, 0.25, 0.5,
+                                          1,     2.5,   5,     10,  30,   60};
+#define METRICS_LATENCY_BUCKETS                                                \
+  (int)(sizeof(metrics_latency_buckets) / sizeof(metrics_latency_buckets[0]))
 
-    // Prepare thread data
-    BotThreadData *thread_data = malloc(sizeof(BotThreadData));
-    thread_data->query = strdup(query);
-    thread_data->sender = strdup(sender);
-    thread_data->bot = &bots[i];
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} MetricsBuffer;
 
-    // Add task to thread pool
-    pthread_mutex_lock(&thread_pool_mutex);
-    while (thread_pool_size >= MAX_THREADS) {
-      pthread_cond_wait(&thread_pool_cond, &thread_pool_mutex);
+static void metrics_printf(MetricsBuffer *buffer, const char *format, ...) {
+  while (1) {
+    va_list args;
+    va_start(args, format);
+    size_t available = buffer->capacity - buffer->length;
+    int written =
+        vsnprintf(buffer->data + buffer->length, available, format, args);
+    va_end(args);
+    if (written < 0) {
+      return;
+    }
+    if ((size_t)written < available) {
+      buffer->length += written;
+      return;
     }
+    size_t capacity = buffer->capacity * 2 + written;
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      return;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+}
 
-    if (pthread_create(&thread_pool[thread_pool_size], NULL,
-                       bot_response_thread, thread_data) != 0) {
-      log_error("Failed to create thread for bot response");
-      free(thread_data->query);
-      free(thread_data->sender);
-      free(thread_data);
+// Escape a label value (backslash, double quote and newline)
+static void metrics_escape(const char *input, char *output, size_t size) {
+  size_t j = 0;
+  for (size_t i = 0; input[i] != '\0' && j + 2 < size; i++) {
+    if (input[i] == '\\' || input[i] == '"') {
+      output[j++] = '\\';
+      output[j++] = input[i];
+    } else if (input[i] == '\n') {
+      output[j++] = '\\';
+      output[j++] = 'n';
     } else {
-      thread_pool_size++;
+      output[j++] = input[i];
     }
-    pthread_mutex_unlock(&thread_pool_mutex);
   }
+  output[j] = '\0';
 }
 
-// Process user input and display responses
-void *process_user_input(void *arg) {
-  (void)arg;
-  char query[MAX_QUERY_SIZE];
-  int ch, cursor_pos = 0;
-
-  while (1) {
-    wmove(input_win, 0, 0);
-    wclrtoeol(input_win);
-    mvwprintw(input_win, 0, 0, "%s", query);
-    wmove(input_win, 0, cursor_pos);
-    wrefresh(input_win);
-
-    ch = wgetch(input_win);
+static void metrics_header(MetricsBuffer *buffer, const char *name,
+                           const char *type, const char *help) {
+  metrics_printf(buffer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+                 type);
+}
 
-    if (ch == '\n') {
-      if (query[0] == '/') {
-        handle_command(query);
-      } else {
-        add_chat_message("user", user_name, query);
-        messages_sent++;
-        update_status_bar();
+// Render every metric in the Prometheus text exposition format
+void metrics_render(MetricsBuffer *buffer) {
+  metrics_header(buffer, "lierc_uptime_seconds", "gauge",
+                 "Seconds since the client started.");
+  metrics_printf(buffer, "lierc_uptime_seconds %ld\n",
+                 (long)difftime(wall_time(), start_time));
+
+  metrics_header(buffer, "lierc_messages_total", "counter",
+                 "Chat messages sent by the user and received from bots.");
+  metrics_printf(buffer, "lierc_messages_total{direction=\"sent\"} %d\n",
+                 messages_sent);
+  metrics_printf(buffer, "lierc_messages_total{direction=\"received\"} %d\n",
+                 messages_received);
+
+  metrics_header(buffer, "lierc_requests_total", "counter",
+                 "Finished API requests by provider, kind and status.");
+  pthread_mutex_lock(&metrics_mutex);
+  for (int i = 0; i < request_counter_count; i++) {
+    RequestCounter *counter = &request_counters[i];
+    char provider[sizeof(counter->provider) * 2];
+    metrics_escape(counter->provider, provider, sizeof(provider));
+    metrics_printf(buffer,
+                   "lierc_requests_total{provider=\"%s\",kind=\"%s\","
+                   "status=\"%s\"} %lu\n",
+                   provider, counter->kind, counter->status, counter->count);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+
+  pthread_mutex_lock(&cancel_mutex);
+  unsigned long request_bytes = request_bytes_total;
+  unsigned long reply_bytes = reply_bytes_total;
+  unsigned long cancelled = cancelled_requests;
+  unsigned long saved = tokens_saved;
+  pthread_mutex_unlock(&cancel_mutex);
+  metrics_header(buffer, "lierc_api_bytes_total", "counter",
+                 "Request bodies sent and reply texts received.");
+  metrics_printf(buffer, "lierc_api_bytes_total{direction=\"out\"} %lu\n",
+                 request_bytes);
+  metrics_printf(buffer, "lierc_api_bytes_total{direction=\"in\"} %lu\n",
+                 reply_bytes);
+  metrics_header(buffer, "lierc_tokens_estimated_total", "counter",
+                 "Tokens sent and received, estimated at four bytes each.");
+  metrics_printf(buffer,
+                 "lierc_tokens_estimated_total{direction=\"out\"} %lu\n",
+                 request_bytes / 4);
+  metrics_printf(buffer, "lierc_tokens_estimated_total{direction=\"in\"} %lu\n",
+                 reply_bytes / 4);
+  metrics_header(buffer, "lierc_cancelled_requests_total", "counter",
+                 "Requests dropped because they went stale.");
+  metrics_printf(buffer, "lierc_cancelled_requests_total %lu\n", cancelled);
+  metrics_header(buffer, "lierc_tokens_saved_total", "counter",
+                 "Estimated tokens saved by cancelling stale requests.");
+  metrics_printf(buffer, "lierc_tokens_saved_total %lu\n", saved);
+  pthread_mutex_lock(&group_mutex);
+  unsigned long grouped = group_members;
+  pthread_mutex_unlock(&group_mutex);
+  metrics_header(buffer, "lierc_group_replies_total", "counter",
+                 "Replies asked for through group reply requests.");
+  metrics_printf(buffer, "lierc_group_replies_total %lu\n", grouped);
+
+  metrics_header(buffer, "lierc_tokens_total", "counter",
+                 "Tokens billed by provider, model and type.");
+  metrics_header(buffer, "lierc_cost_usd_total", "counter",
+                 "Spend in USD by provider and model.");
+  pthread_mutex_lock(&usage_mutex);
+  for (int i = 0; i < usage_stats_count; i++) {
+    UsageStats *stats = &usage_stats[i];
+    char provider[sizeof(stats->api_type) * 2];
+    char model[sizeof(stats->model) * 2];
+    metrics_escape(stats->api_type, provider, sizeof(provider));
+    metrics_escape(stats->model, model, sizeof(model));
+    const char *types[] = {"prompt", "completion", "cached"};
+    unsigned long counts[] = {stats->tokens.prompt, stats->tokens.completion,
+                              stats->tokens.cached};
+    for (int t = 0; t < 3; t++) {
+      metrics_printf(buffer,
+                     "lierc_tokens_total{provider=\"%s\",model=\"%s\","
+                     "type=\"%s\"} %lu\n",
+                     provider, model, types[t], counts[t]);
+    }
+    metrics_printf(buffer,
+                   "lierc_cost_usd_total{provider=\"%s\",model=\"%s\"} %.6f\n",
+                   provider, model, stats->cost);
+  }
+  double budget = session_budget;
+  pthread_mutex_unlock(&usage_mutex);
+  metrics_header(buffer, "lierc_budget_usd", "gauge",
+                 "Session budget in USD, 0 for no limit.");
+  metrics_printf(buffer, "lierc_budget_usd %.2f\n", budget);
+
+  metrics_header(buffer, "lierc_scheduler_requests_total", "counter",
+                 "Scheduler events by priority class.");
+  pthread_mutex_lock(&sched_mutex);
+  int queued = pending_requests;
+  int active = active_requests;
+  LoadLevel level = load_level;
+  unsigned long level_changes = load_changes;
+  for (int p = 0; p < PRIORITY_CLASSES; p++) {
+    PriorityStats *st = &priority_stats[p];
+    const char *events[] = {"enqueued", "preempted", "rejected", "started",
+                            "declined", "completed", "over_budget", "shed"};
+    unsigned long counts[] = {st->enqueued, st->preempted, st->rejected,
+                              st->started,  st->declined,  st->completed,
+                              st->over_budget, st->shed};
+    for (int e = 0; e < 8; e++) {
+      metrics_printf(buffer,
+                     "lierc_scheduler_requests_total{priority=\"%s\","
+                     "event=\"%s\"} %lu\n",
+                     priority_names[p], events[e], counts[e]);
+    }
+  }
+  pthread_mutex_unlock(&sched_mutex);
+  metrics_header(buffer, "lierc_queue_depth", "gauge",
+                 "Requests waiting for a worker.");
+  metrics_printf(buffer, "lierc_queue_depth %d\n", queued);
+  metrics_header(buffer, "lierc_active_requests", "gauge",
+                 "Requests being run by a worker.");
+  metrics_printf(buffer, "lierc_active_requests %d\n", active);
+  metrics_header(buffer, "lierc_load_level", "gauge",
+                 "Admission control level: 0 normal, 1 busy, 2 overloaded.");
+  metrics_printf(buffer, "lierc_load_level %d\n", level);
+  metrics_header(buffer, "lierc_load_level_changes_total", "counter",
+                 "Times the admission control level changed.");
+  metrics_printf(buffer, "lierc_load_level_changes_total %lu\n",
+                 level_changes);
+  metrics_header(buffer, "lierc_active_bots", "gauge", "Bots in the room.");
+  metrics_printf(buffer, "lierc_active_bots %d\n", bot_count());
+  metrics_header(buffer, "lierc_irc_clients", "gauge",
+                 "Connections to the IRC server.");
+  metrics_printf(buffer, "lierc_irc_clients %d\n",
+                 __atomic_load_n(&irc_client_count, __ATOMIC_RELAXED));
+  metrics_header(buffer, "lierc_tail_readers", "gauge",
+                 "Subscribers to the tail API.");
+  metrics_printf(buffer, "lierc_tail_readers %d\n",
+                 __atomic_load_n(&tail_reader_count, __ATOMIC_RELAXED));
+  metrics_header(buffer, "lierc_tail_readers_dropped_total", "counter",
+                 "Tail API subscribers disconnected for falling behind.");
+  metrics_printf(buffer, "lierc_tail_readers_dropped_total %lu\n",
+                 __atomic_load_n(&tail_readers_dropped, __ATOMIC_RELAXED));
+
+  // Each family's samples are kept together, as the text format requires
+  unsigned long posted[MAX_CHANNELS], limited[MAX_CHANNELS];
+  int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&chat_mutex);
+  for (int i = 0; i < count; i++) {
+    posted[i] = channels[i]->seq;
+    limited[i] = channels[i]->requests_limited;
+  }
+  pthread_mutex_unlock(&chat_mutex);
+  for (int family = 0; family < 2; family++) {
+    const char *metric = family == 0 ? "lierc_channel_messages_total"
+                                     : "lierc_channel_requests_limited_total";
+    metrics_header(buffer, metric, "counter",
+                   family == 0
+                       ? "User and bot messages by channel."
+                       : "Bot requests skipped for a channel's request budget.");
+    for (int i = 0; i < count; i++) {
+      char name[sizeof(channels[i]->name) * 2];
+      metrics_escape(channels[i]->name, name, sizeof(name));
+      metrics_printf(buffer, "%s{channel=\"%s\"} %lu\n", metric, name,
+                     family == 0 ? posted[i] : limited[i]);
+    }
+  }
 
-        send_chat_query(query, user_name);
+  pthread_mutex_lock(&chat_mutex);
+  unsigned long logged = log_bytes_written;
+  pthread_mutex_unlock(&chat_mutex);
+  metrics_header(buffer, "lierc_log_bytes_total", "counter",
+                 "Bytes written to the chat log file.");
+  metrics_printf(buffer, "lierc_log_bytes_total %lu\n", logged);
+
+  metrics_header(buffer, "lierc_render_frames_total", "counter",
+                 "Redraws of each TUI window.");
+  for (int w = 0; w < WINDOW_COUNT; w++) {
+    metrics_printf(
+        buffer, "lierc_render_frames_total{window=\"%s\"} %lu\n",
+        window_names[w],
+        __atomic_load_n(&render_frames[w], __ATOMIC_RELAXED));
+  }
 
-        for (int i = 0; i < bot_count; i++) {
-          int is_bot_mentioned = is_mentioned(query, bots[i].name);
-          if (should_bot_respond(query, bots[i].personality, bots[i].memory[0],
-                                 bots[i].name, is_bot_mentioned)) {
-            send_chat_query(chat_history[chat_index - 1].content, bots[i].name);
-          }
-        }
-      }
-      memset(query, 0, MAX_QUERY_SIZE);
-      cursor_pos = 0;
-    } else if (ch == KEY_BACKSPACE || ch == 127) {
-      if (cursor_pos > 0) {
-        memmove(&query[cursor_pos - 1], &query[cursor_pos],
-                strlen(query) - cursor_pos + 1);
-        cursor_pos--;
-      }
-    } else if (ch == '\t') {
-      // Handle autocomplete
-      int at_pos = cursor_pos - 1;
-      while (at_pos >= 0 && query[at_pos] != '@') {
-        at_pos--;
-      }
-      if (at_pos >= 0) {
-        char partial[MAX_QUERY_SIZE];
-        strncpy(partial, &query[at_pos + 1], cursor_pos - at_pos - 1);
-        partial[cursor_pos - at_pos - 1] = '\0';
-        char *match = find_matching_username(partial);
-        if (match) {
-          int match_len = strlen(match);
-          memmove(&query[at_pos + match_len + 1], &query[cursor_pos],
-                  strlen(query) - cursor_pos + 1);
-          memcpy(&query[at_pos + 1], match, match_len);
-          cursor_pos = at_pos + match_len + 1;
+  // The latency histograms are re-bucketed from their finer HDR buckets; a
+  // sample counts towards the first bound its HDR bucket fits under
+  metrics_header(buffer, "lierc_reply_latency_seconds", "histogram",
+                 "Reply latency by provider, model and pipeline stage.");
+  pthread_mutex_lock(&latency_mutex);
+  for (int i = 0; i < latency_stats_count; i++) {
+    LatencyStats *stats = &latency_stats[i];
+    char provider[sizeof(stats->api_type) * 2];
+    char model[sizeof(stats->model) * 2];
+    metrics_escape(stats->api_type, provider, sizeof(provider));
+    metrics_escape(stats->model, model, sizeof(model));
+    for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+      const LatencyHistogram *hist = &stats->stages[stage];
+      char labels[256];
+      snprintf(labels, sizeof(labels),
+               "provider=\"%s\",model=\"%s\",stage=\"%s\"", provider, model,
+               latency_stage_names[stage]);
+      uint64_t cumulative = 0;
+      int b = 0;
+      for (int le = 0; le < METRICS_LATENCY_BUCKETS; le++) {
+        uint64_t bound_us = (uint64_t)(metrics_latency_buckets[le] * 1e6);
+        while (b < HISTOGRAM_BUCKETS &&
+               histogram_bucket_limit(b) <= bound_us) {
+          cumulative += hist->counts[b++];
         }
+        metrics_printf(buffer,
+                       "lierc_reply_latency_seconds_bucket{%s,le=\"%g\"} "
+                       "%lu\n",
+                       labels, metrics_latency_buckets[le],
+                       (unsigned long)cumulative);
       }
-    } else if (cursor_pos < MAX_QUERY_SIZE - 1) {
-      memmove(&query[cursor_pos + 1], &query[cursor_pos],
-              strlen(query) - cursor_pos + 1);
-      query[cursor_pos] = ch;
-      cursor_pos++;
+      metrics_printf(buffer,
+                     "lierc_reply_latency_seconds_bucket{%s,le=\"+Inf\"} "
+                     "%lu\n",
+                     labels, (unsigned long)hist->count);
+      metrics_printf(buffer, "lierc_reply_latency_seconds_sum{%s} %.6f\n",
+                     labels, hist->sum_us / 1e6);
+      metrics_printf(buffer, "lierc_reply_latency_seconds_count{%s} %lu\n",
+                     labels, (unsigned long)hist->count);
     }
   }
+  pthread_mutex_unlock(&latency_mutex);
 }
 
-// Initialize ncurses
-void init_ncurses() {
-  initscr();
-  start_color();
-  keypad(stdscr, TRUE); // Enable keypad input
-
-  // Define color pairs
-  init_pair(COLOR_TIME, COLOR_BLUE, COLOR_BLACK);
-  init_pair(COLOR_USERNAME_USER, COLOR_CYAN, COLOR_BLACK);
-  init_pair(COLOR_USERNAME_ASSISTANT, COLOR_GREEN, COLOR_BLACK);
-  init_pair(COLOR_BRACKETS, COLOR_YELLOW, COLOR_BLACK);
-  init_pair(COLOR_STATUS_BAR, COLOR_WHITE,
-            COLOR_BLUE); // Status bar has a blue background
-  init_pair(COLOR_TEXT, COLOR_WHITE, COLOR_BLACK);
-  init_pair(COLOR_SIDEBAR, COLOR_GREEN, COLOR_BLACK);
-  init_pair(COLOR_SYSTEM_MESSAGE, COLOR_MAGENTA, COLOR_BLACK);
-  init_pair(COLOR_LLM_MESSAGE, COLOR_GREEN, COLOR_BLACK);
-  init_pair(COLOR_TYPING, COLOR_BLACK, COLOR_YELLOW);
-
-  noecho();
-  cbreak();
-
-  int height, width;
-  getmaxyx(stdscr, height, width);
-
-  // Create windows for different sections
-  sidebar_win = newwin(height - 2, 20, 0, 0); // Sidebar for connected users
-  chat_win = newwin(height - 3, width - 20, 0, 20); // Chat window
-  status_win = newwin(1, width - 20, height - 2,
-                      20); // Status bar (one line above input)
-  input_win = newwin(1, width - 20, height - 1, 20); // Input box
-
-  update_sidebar();
-  update_chat_window();
-  update_status_bar();
-}
-
-// Function to set up logging
-void setup_logging(const char *log_filename) {
-  if (log_filename == NULL) {
-    // Generate default log filename
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char default_filename[64];
-    strftime(default_filename, sizeof(default_filename), "%Y%m%d_%H%M%S.log",
-             t);
-    log_file = fopen(default_filename, "w");
-  } else {
-    log_file = fopen(log_filename, "w");
+// Answer one scrape. Any request path gets the metrics.
+static void metrics_serve(int client) {
+  struct timeval timeout = {1, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Read the request headers; their contents don't matter
+  char request[4096];
+  size_t received = 0;
+  while (received < sizeof(request) - 1) {
+    ssize_t n = recv(client, request + received, sizeof(request) - 1 - received,
+                     0);
+    if (n <= 0) {
+      break;
+    }
+    received += n;
+    request[received] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
   }
 
-  if (log_file == NULL) {
-    fprintf(stderr, "Error: Unable to open log file.\n");
+  MetricsBuffer body = {malloc(16384), 0, 16384};
+  if (body.data == NULL) {
+    return;
   }
-}
-
-// Function for autonomous bot behavior
-void *bot_autonomous_behavior(void *arg) {
-  Bot *bot = (Bot *)arg;
-  while (bot->is_active) {
-    // Sleep for a random interval between 5 and 30 seconds
-    sleep(5 + (rand() % 26));
-
-    // Decide if the bot wants to speak
-    if (rand() % 100 < 30) { // 30% chance to speak
-      // Generate a message based on the bot's personality and recent memory
-      char message[MAX_QUERY_SIZE * 2];
-      int message_size = sizeof(message);
-      int written = snprintf(
-          message, message_size,
-          "As %.50s, I want to say something based on my personality: %.200s",
-          bot->name, bot->personality);
-      if (written >= message_size) {
-        log_error("Message truncated in bot_autonomous_behavior");
+  metrics_render(&body);
+
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Connection: close\r\n\r\n",
+                               body.length);
+  const char *parts[] = {header, body.data};
+  size_t lengths[] = {(size_t)header_length, body.length};
+  for (int i = 0; i < 2; i++) {
+    size_t sent = 0;
+    while (sent < lengths[i]) {
+      ssize_t n = send(client, parts[i] + sent, lengths[i] - sent,
+                       MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
       }
-
-      // Send the generated message to the chat
-      send_chat_query(message, bot->name);
+      sent += n;
     }
   }
-  return NULL;
+  free(body.data);
 }
 
-// Function to process bot responses
-void *process_bot_responses(void *arg) {
+void *metrics_thread(void *arg) {
   (void)arg;
+  trace_thread_name("metrics");
   while (1) {
-    pthread_mutex_lock(&queue_mutex);
-    while (response_queue->front == NULL) {
-      pthread_cond_wait(&queue_cond, &queue_mutex);
+    int client = accept(metrics_fd, NULL, NULL);
+    if (client < 0) {
+      if (!__atomic_load_n(&metrics_running, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      continue;
     }
+    metrics_serve(client);
+    close(client);
+  }
+  return NULL;
+}
 
-    // Get the response from the queue
-    QueueNode *node = response_queue->front;
-    BotThreadData *data = (BotThreadData *)node->data;
-    response_queue->front = node->next;
-    if (response_queue->front == NULL) {
-      response_queue->rear = NULL;
-    }
-    pthread_mutex_unlock(&queue_mutex);
+// Close the metrics socket and remove its file, on shutdown or after a
+// failed metrics_start
+static void metrics_release() {
+  if (metrics_fd >= 0) {
+    close(metrics_fd);
+    metrics_fd = -1;
+  }
+  if (metrics_socket_path[0] != '\0') {
+    unlink(metrics_socket_path);
+    metrics_socket_path[0] = '\0';
+  }
+}
 
-    // Process the response
-    add_chat_message("assistant", data->bot->name, data->query);
-    messages_received++;
-    update_status_bar();
-    update_bot_memory(data->bot, data->query);
+// Start serving metrics. A numeric target is a TCP port on 127.0.0.1,
+// anything else a Unix socket path. Returns -1 on failure.
+int metrics_start(const char *target) {
+  int is_port = target[0] != '\0' && strspn(target, "0123456789") ==
+                                         strlen(target);
+  if (is_port) {
+    metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_fd < 0) {
+      return -1;
+    }
+    int reuse = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(target));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      metrics_release();
+      return -1;
+    }
+  } else {
+    struct sockaddr_un addr = {0};
+    if (strlen(target) >= sizeof(addr.sun_path)) {
+      return -1;
+    }
+    metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (metrics_fd < 0) {
+      return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, target);
+    unlink(target); // Left over from an earlier run
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      metrics_release();
+      return -1;
+    }
+    strcpy(metrics_socket_path, target);
+  }
 
-    // Clean up
-    free(data->query);
-    free(data->sender);
-    free(data);
-    free(node);
+  if (listen(metrics_fd, 8) < 0) {
+    metrics_release();
+    return -1;
+  }
+  metrics_running = 1;
+  if (pthread_create(&metrics_thread_id, NULL, metrics_thread, NULL) != 0) {
+    metrics_running = 0;
+    metrics_release();
+    return -1;
   }
+  return 0;
+}
 
-  return NULL;
+void metrics_stop() {
+  if (!metrics_running) {
+    return;
+  }
+  __atomic_store_n(&metrics_running, 0, __ATOMIC_RELEASE);
+  shutdown(metrics_fd, SHUT_RDWR); // Wakes the blocked accept()
+  pthread_join(metrics_thread_id, NULL);
+  metrics_release();
 }
 
+#ifndef LIERC_NO_MAIN
 int main(int argc, char *argv[]) {
   strcpy(model, DEFAULT_MODEL);
   const char *log_filename = NULL;
+  const char *roster_filename = NULL;
+  const char *restore_filename = NULL;
+  const char *script_filename = NULL;
+  const char *trace_filename = NULL;
+  const char *metrics_target = NULL;
+  const char *irc_target = NULL;
+  const char *tail_path = NULL;
+  const char *prices_filename = NULL;
+  const char *openai_url = getenv("OPENAI_BASE_URL");
+  const char *anthropic_url = getenv("ANTHROPIC_BASE_URL");
+  const char *local_url = getenv("LOCAL_BASE_URL");
+  const char *classifier = DEFAULT_CLASSIFIER_PROVIDER;
+  unsigned drain_timeout_ms = 60000;
+  int seeded = 0;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--model") == 0 || strcmp(argv[i], "-m") == 0) {
       if (i + 1 < argc) {
-        strncpy(model, argv[i + 1], 50);
+        snprintf(model, sizeof(model), "%s", argv[i + 1]);
         i++;
       }
     } else if (strcmp(argv[i], "--log") == 0 || strcmp(argv[i], "-l") == 0) {
@@ -1317,44 +9814,316 @@ int main(int argc, char *argv[]) {
         log_filename = argv[i + 1];
         i++;
       }
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = 1;
+    } else if (strcmp(argv[i], "--script") == 0) {
+      if (i + 1 < argc) {
+        script_filename = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--drain-timeout") == 0) {
+      if (i + 1 < argc) {
+        drain_timeout_ms = (unsigned)atoi(argv[i + 1]) * 1000;
+        i++;
+      }
+    } else if (strcmp(argv[i], "--openai-url") == 0) {
+      if (i + 1 < argc) {
+        openai_url = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--anthropic-url") == 0) {
+      if (i + 1 < argc) {
+        anthropic_url = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--local-url") == 0) {
+      if (i + 1 < argc) {
+        local_url = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--classifier") == 0) {
+      if (i + 1 < argc) {
+        classifier = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream_replies = 1;
+    } else if (strcmp(argv[i], "--group-replies") == 0) {
+      if (i + 1 < argc) {
+        group_window_ms = (unsigned)atoi(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--reactor") == 0) {
+      reactor_mode = 1;
+    } else if (strcmp(argv[i], "--virtual-time") == 0) {
+      virtual_time_start();
+      reactor_mode = 1; // Only the reactor can drive simulated time
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      if (i + 1 < argc) {
+        random_seed = strtoull(argv[i + 1], NULL, 10);
+        seeded = 1;
+        i++;
+      }
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      if (i + 1 < argc) {
+        trace_filename = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      if (i + 1 < argc) {
+        metrics_target = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--tail") == 0) {
+      if (i + 1 < argc) {
+        tail_path = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--irc") == 0) {
+      if (i + 1 < argc) {
+        irc_target = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--prices") == 0) {
+      if (i + 1 < argc) {
+        prices_filename = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--budget") == 0) {
+      if (i + 1 < argc) {
+        session_budget = atof(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--bot-budget") == 0) {
+      if (i + 1 < argc) {
+        bot_budget = atof(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--channel-budget") == 0) {
+      if (i + 1 < argc) {
+        channel_request_budget = atoi(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--stale-after") == 0) {
+      if (i + 1 < argc) {
+        stale_message_limit = atoi(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--restore") == 0) {
+      if (i + 1 < argc) {
+        restore_filename = argv[i + 1];
+        i++;
+      }
+    } else if (strcmp(argv[i], "--roster") == 0 || strcmp(argv[i], "-r") == 0) {
+      if (i + 1 < argc) {
+        roster_filename = argv[i + 1];
+        i++;
+      }
     }
   }
 
-  setup_logging(log_filename);
+  if (virtual_time && (!headless || script_filename == NULL)) {
+    fprintf(stderr, "Error: --virtual-time needs --headless and --script.\n");
+    return 1;
+  }
+  if (!seeded) {
+    random_seed = real_monotonic_us() ^ ((uint64_t)getpid() << 32);
+  }
 
-  openai_api_key = getenv("OPENAI_API_KEY");
-  anthropic_api_key = getenv("ANTHROPIC_API_KEY");
+  channels_init();
+
+  const char *base_urls[PROVIDER_COUNT] = {openai_url, anthropic_url,
+                                           local_url};
+  for (int i = 0; i < PROVIDER_COUNT; i++) {
+    if (base_urls[i] != NULL) {
+      snprintf(providers[i].base_url, sizeof(providers[i].base_url), "%s",
+               base_urls[i]);
+    }
+    providers[i].api_key = getenv(providers[i].key_variable);
+  }
+  snprintf(providers[0].default_model, sizeof(providers[0].default_model),
+           "%s", model);
+
+  // The classifier is given as provider[:model]
+  char classifier_name[20];
+  const char *colon = strchr(classifier, ':');
+  snprintf(classifier_name, sizeof(classifier_name), "%.*s",
+           colon ? (int)(colon - classifier) : (int)strlen(classifier),
+           classifier);
+  classifier_provider = provider_find(classifier_name);
+  if (classifier_provider == NULL) {
+    fprintf(stderr, "Error: unknown classifier provider '%s'.\n",
+            classifier_name);
+    return 1;
+  }
+  if (colon != NULL) {
+    snprintf(classifier_model, sizeof(classifier_model), "%s", colon + 1);
+  } else if (strcmp(classifier_provider->name, "openai") != 0) {
+    // Others use their default model; OpenAI keeps a cheaper one
+    snprintf(classifier_model, sizeof(classifier_model), "%s",
+             classifier_provider->default_model);
+  }
 
-  if (openai_api_key == NULL || anthropic_api_key == NULL) {
-    fprintf(stderr, "Error: API keys not set in environment variables.\n");
+  // Keys are only required for the public endpoints; local servers such as
+  // mock_llm and llama.cpp need none. Bots on a provider without its key
+  // are refused when added, but the classifier is needed from the start.
+  const char *missing = provider_missing_key(classifier_provider);
+  if (missing != NULL) {
+    fprintf(stderr,
+            "Error: %s not set. Set it, or use --classifier to pick another "
+            "provider.\n",
+            missing);
     return 1;
   }
 
-  init_ncurses();
-  start_time = time(NULL);
+  // Headless with an IRC server and no script, serve clients until
+  // interrupted. The signals are blocked before any thread starts so that
+  // only sigwait() sees them.
+  int serve_irc_only = headless && irc_target != NULL && script_filename == NULL;
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  if (serve_irc_only) {
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  }
+
+  setup_logging(log_filename);
+
+  if (trace_filename != NULL) {
+    if (trace_start(trace_filename) < 0) {
+      fprintf(stderr, "Error: can't open trace file %s\n", trace_filename);
+      return 1;
+    }
+    trace_thread_name("main");
+  }
+
+  if (!headless) {
+    init_ncurses();
+  }
+  start_time = wall_time();
+
+  if (prices_filename != NULL && load_prices(prices_filename) < 0) {
+    char message[MAX_QUERY_SIZE + 64];
+    snprintf(message, sizeof(message), "Failed to load prices from %.200s",
+             prices_filename);
+    log_error(message);
+  }
+
+  // Restore a snapshot, then add the bots of a roster, if given
+  if (restore_filename != NULL) {
+    char message[MAX_QUERY_SIZE + 64];
+    uint64_t restore_start = monotonic_us();
+    int restored = load_snapshot(restore_filename);
+    if (restored < 0) {
+      snprintf(message, sizeof(message), "Failed to restore snapshot %.200s",
+               restore_filename);
+      log_error(message);
+    } else {
+      snprintf(message, sizeof(message),
+               "Restored %d bot(s) and %d channel(s) from %.200s in %.1f ms",
+               restored, channel_count, restore_filename,
+               (monotonic_us() - restore_start) / 1000.0);
+      add_chat_message("system", "system", message);
+      update_sidebar();
+    }
+  }
+  if (roster_filename != NULL) {
+    char message[MAX_QUERY_SIZE + 64];
+    int loaded = load_roster(roster_filename);
+    if (loaded < 0) {
+      snprintf(message, sizeof(message), "Failed to load roster %.200s",
+               roster_filename);
+      log_error(message);
+    } else {
+      snprintf(message, sizeof(message), "Loaded %d bot(s) from %.200s",
+               loaded, roster_filename);
+      add_chat_message("system", "system", message);
+      update_sidebar();
+    }
+  }
 
-  // Initialize the response queue
+  // Initialize the response queue, request scheduler, timer wheel and
+  // admission control
   response_queue = queue_create();
+  scheduler_start();
+  if (timer_start() < 0) {
+    log_error("Failed to start the timer thread; bots won't chat on their own");
+  }
+  admission_start();
+
+  if (metrics_target != NULL && metrics_start(metrics_target) < 0) {
+    char message[MAX_QUERY_SIZE + 64];
+    snprintf(message, sizeof(message), "Failed to serve metrics on %.200s",
+             metrics_target);
+    log_error(message);
+  }
+
+  if (tail_path != NULL && tail_start(tail_path) < 0) {
+    char message[MAX_QUERY_SIZE + 64];
+    snprintf(message, sizeof(message), "Failed to serve the tail API on %.200s",
+             tail_path);
+    log_error(message);
+  }
+
+  if (irc_target != NULL) {
+    char message[MAX_QUERY_SIZE + 64];
+    if (irc_start(irc_target) < 0) {
+      snprintf(message, sizeof(message), "Failed to serve IRC on %.200s",
+               irc_target);
+      log_error(message);
+      serve_irc_only = 0;
+    } else {
+      snprintf(message, sizeof(message), "IRC clients can join %s on %.200s",
+               DEFAULT_CHANNEL, irc_target);
+      add_chat_message("system", "system", message);
+    }
+  }
 
   // Create threads for user input and bot responses
   pthread_t user_input_thread, bot_response_thread;
-  pthread_create(&user_input_thread, NULL, process_user_input, NULL);
-  pthread_create(&bot_response_thread, NULL, process_bot_responses, NULL);
-
-  // Wait for user input thread to finish (which it never will in this case)
-  pthread_join(user_input_thread, NULL);
+  int status = 0;
+  if (reactor_mode) {
+    // One loop runs input, timers, transfers and responses
+    status = reactor_run(script_filename, drain_timeout_ms, serve_irc_only,
+                         &stop_signals);
+  } else {
+    pthread_create(&bot_response_thread, NULL, process_bot_responses, NULL);
+    if (serve_irc_only) {
+      int signal_number;
+      sigwait(&stop_signals, &signal_number);
+    } else if (headless) {
+      status = run_headless(script_filename, drain_timeout_ms);
+    } else {
+      pthread_create(&user_input_thread, NULL, process_user_input, NULL);
 
-  // Clean up bot threads
-  for (int i = 0; i < bot_count; i++) {
-    bots[i].is_active = 0;
-    pthread_join(bots[i].thread_id, NULL);
+      // Wait for user input thread to finish (which it never will in this
+      // case)
+      pthread_join(user_input_thread, NULL);
+    }
   }
 
+  // Stop the IRC server, autonomous bot behavior, the request workers and
+  // the metrics and tail listeners
+  irc_stop();
+  timer_stop();
+  group_stop_posting();
+  scheduler_stop();
+  metrics_stop();
+  tail_stop();
+
   // Clean up bot response thread
-  pthread_cancel(bot_response_thread);
-  pthread_join(bot_response_thread, NULL);
+  if (!reactor_mode) {
+    pthread_cancel(bot_response_thread);
+    pthread_join(bot_response_thread, NULL);
+  }
 
   // Clean up resources
   queue_destroy(response_queue);
-  endwin();
+  trace_stop();
+  if (!headless) {
+    endwin();
+  }
+  return status;
 }
+#endif // LIERC_NO_MAIN
@@ -0,0 +1,512 @@
+// mock_llm - a local stand-in for the OpenAI and Anthropic HTTP APIs, used to
+// load test lierc offline. Point lierc at it with
+//   ./lierc --headless --script load.txt
+//           --openai-url http://127.0.0.1:8080
+//           --anthropic-url http://127.0.0.1:8080
+//
+// Endpoints:
+//   POST /v1/chat/completions  OpenAI chat completions (optionally streamed)
+//   POST /v1/messages          Anthropic Messages (optionally streamed)
+//   POST /v1/complete          Legacy Anthropic text completions
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_HEADER_SIZE 8192
+#define MAX_BODY_SIZE (1024 * 1024)
+
+// Latency distributions for time to first byte
+typedef enum {
+  LATENCY_FIXED,     // a
+  LATENCY_UNIFORM,   // a..b
+  LATENCY_EXP,       // mean a
+  LATENCY_LOGNORMAL, // median a, sigma b
+} LatencyKind;
+
+typedef struct {
+  LatencyKind kind;
+  double a;
+  double b;
+} Latency;
+
+// Server configuration
+int port = 8080;
+Latency latency = {LATENCY_FIXED, 200, 0};
+double token_ms = 20;    // Delay between streamed tokens
+double rate_429 = 0;     // Probability of answering 429 Too Many Requests
+double yes_rate = 0.5;   // Probability the classifier answers "yes"
+int report_interval = 0; // Seconds between stats lines, 0 for none
+int seeded = 0;          // Draw each answer from the request body and seed
+unsigned int seed_value = 0;
+
+// Stats
+unsigned long requests_total = 0;
+unsigned long requests_429 = 0;
+unsigned long requests_streamed = 0;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *replies[] = {
+    "lol that's the most IRC thing I've read all day",
+    "Counterpoint: no.",
+    "I was told there would be memes in this channel.",
+    "Has anyone tried turning the conversation off and on again?",
+    "Ok but what if we talked about something interesting instead",
+    "Strong opinions, loosely held, badly typed.",
+    "This is fine. Everything is fine.",
+    "Sure, and I'm a toaster with a philosophy degree.",
+};
+
+// Uniform random number in [0, 1)
+static double rand_unit(unsigned int *seed) {
+  return rand_r(seed) / ((double)RAND_MAX + 1.0);
+}
+
+// Sample the configured latency distribution, in milliseconds
+static double sample_latency(unsigned int *seed) {
+  switch (latency.kind) {
+  case LATENCY_UNIFORM:
+    return latency.a + rand_unit(seed) * (latency.b - latency.a);
+  case LATENCY_EXP:
+    return -latency.a * log(1.0 - rand_unit(seed));
+  case LATENCY_LOGNORMAL: {
+    // Box-Muller transform for a standard normal sample
+    double u1 = 1.0 - rand_unit(seed);
+    double u2 = rand_unit(seed);
+    double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+    return latency.a * exp(latency.b * z);
+  }
+  case LATENCY_FIXED:
+  default:
+    return latency.a;
+  }
+}
+
+static void sleep_ms(double ms) {
+  if (ms <= 0) {
+    return;
+  }
+  struct timespec ts;
+  ts.tv_sec = (time_t)(ms / 1000);
+  ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000);
+  nanosleep(&ts, NULL);
+}
+
+// Parse a latency spec: fixed:MS, uniform:MIN:MAX, exp:MEAN or
+// lognormal:MEDIAN:SIGMA. Returns 0 on success.
+static int parse_latency(const char *spec, Latency *out) {
+  char kind[16];
+  double a = 0, b = 0;
+  int n = sscanf(spec, "%15[^:]:%lf:%lf", kind, &a, &b);
+  if (n < 2) {
+    return -1;
+  }
+  if (strcmp(kind, "fixed") == 0) {
+    out->kind = LATENCY_FIXED;
+  } else if (strcmp(kind, "uniform") == 0 && n == 3) {
+    out->kind = LATENCY_UNIFORM;
+  } else if (strcmp(kind, "exp") == 0) {
+    out->kind = LATENCY_EXP;
+  } else if (strcmp(kind, "lognormal") == 0 && n == 3) {
+    out->kind = LATENCY_LOGNORMAL;
+  } else {
+    return -1;
+  }
+  out->a = a;
+  out->b = b;
+  return 0;
+}
+
+// Write a whole buffer to a socket. Returns 0 on success.
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int send_response(int fd, int status, const char *reason,
+                         const char *extra_headers, const char *body) {
+  char header[512];
+  size_t body_len = strlen(body);
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s\r\n",
+                     status, reason, body_len, extra_headers);
+  if (write_all(fd, header, len) != 0) {
+    return -1;
+  }
+  return write_all(fd, body, body_len);
+}
+
+// Send one chunk of a chunked-encoding response
+static int send_chunk(int fd, const char *data) {
+  char size_line[32];
+  size_t len = strlen(data);
+  int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+  if (write_all(fd, size_line, n) != 0 || write_all(fd, data, len) != 0) {
+    return -1;
+  }
+  return write_all(fd, "\r\n", 2);
+}
+
+// Stream the reply word by word as server-sent events
+static int stream_reply(int fd, int messages_api, const char *text,
+                        int prompt_tokens) {
+  const char *header = "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/event-stream\r\n"
+                       "Transfer-Encoding: chunked\r\n\r\n";
+  if (write_all(fd, header, strlen(header)) != 0) {
+    return -1;
+  }
+
+  char event[512];
+  if (messages_api) {
+    snprintf(event, sizeof(event),
+             "event: message_start\ndata: {\"type\": \"message_start\", "
+             "\"message\": {\"id\": \"msg_mock\", \"role\": \"assistant\", "
+             "\"usage\": {\"input_tokens\": %d, \"output_tokens\": 0}}}\n\n",
+             prompt_tokens);
+    if (send_chunk(fd, event) != 0) {
+      return -1;
+    }
+  }
+
+  int tokens = 0;
+  const char *p = text;
+  while (*p) {
+    const char *end = strchr(p + 1, ' ');
+    int len = end ? (int)(end - p) : (int)strlen(p);
+    if (messages_api) {
+      snprintf(event, sizeof(event),
+               "event: content_block_delta\ndata: {\"type\": "
+               "\"content_block_delta\", \"index\": 0, \"delta\": {\"type\": "
+               "\"text_delta\", \"text\": \"%.*s\"}}\n\n",
+               len, p);
+    } else {
+      snprintf(event, sizeof(event),
+               "data: {\"object\": \"chat.completion.chunk\", \"choices\": "
+               "[{\"index\": 0, \"delta\": {\"content\": \"%.*s\"}}]}\n\n",
+               len, p);
+    }
+    if (send_chunk(fd, event) != 0) {
+      return -1;
+    }
+    tokens++;
+    p += len;
+    sleep_ms(token_ms);
+  }
+
+  if (messages_api) {
+    snprintf(event, sizeof(event),
+             "event: message_delta\ndata: {\"type\": \"message_delta\", "
+             "\"delta\": {\"stop_reason\": \"end_turn\"}, \"usage\": "
+             "{\"output_tokens\": %d}}\n\n"
+             "event: message_stop\ndata: {\"type\": \"message_stop\"}\n\n",
+             tokens);
+  } else {
+    snprintf(event, sizeof(event),
+             "data: {\"object\": \"chat.completion.chunk\", \"choices\": "
+             "[{\"index\": 0, \"delta\": {}, \"finish_reason\": \"stop\"}], "
+             "\"usage\": {\"prompt_tokens\": %d, \"completion_tokens\": %d}}"
+             "\n\ndata: [DONE]\n\n",
+             prompt_tokens, tokens);
+  }
+  if (send_chunk(fd, event) != 0) {
+    return -1;
+  }
+  return write_all(fd, "0\r\n\r\n", 5);
+}
+
+// Write the answer to a group reply request: a JSON object with a reply
+// for each bot listed in the prompt, escaped to sit in a JSON string. The
+// body carries the prompt escaped too, so each bot's line starts "\\n- ".
+static void group_reply(const char *body, unsigned int *seed, char *text,
+                        size_t size) {
+  const char *p = strstr(body, "The bots:");
+  const char *end = strstr(body, "The message to answer");
+  size_t len = snprintf(text, size, "{\\\"replies\\\": [");
+  int count = 0;
+  while (p != NULL && (p = strstr(p, "\\n- ")) != NULL &&
+         (end == NULL || p < end) && len < size) {
+    p += 4;
+    int name_len = (int)strcspn(p, ": ");
+    len += snprintf(
+        text + len, size - len,
+        "%s{\\\"bot\\\": \\\"%.*s\\\", \\\"reply\\\": \\\"%s\\\"}",
+        count++ ? ", " : "", name_len, p,
+        replies[rand_r(seed) % (sizeof(replies) / sizeof(replies[0]))]);
+  }
+  if (len < size) {
+    snprintf(text + len, size - len, "]}");
+  }
+}
+
+// Answer one request. Returns 0 to keep the connection open.
+static int handle_request(int fd, const char *path, const char *body,
+                          unsigned int *seed) {
+  int chat_api = strcmp(path, "/v1/chat/completions") == 0;
+  int messages_api = strcmp(path, "/v1/messages") == 0;
+  int complete_api = strcmp(path, "/v1/complete") == 0;
+  if (!chat_api && !messages_api && !complete_api) {
+    return send_response(fd, 404, "Not Found", "",
+                         "{\"error\": {\"message\": \"unknown endpoint\"}}");
+  }
+
+  pthread_mutex_lock(&stats_mutex);
+  requests_total++;
+  pthread_mutex_unlock(&stats_mutex);
+
+  // With --seed the same request always gets the same answer, whichever
+  // connection it arrives on
+  unsigned int request_seed = 2166136261u ^ seed_value;
+  if (seeded) {
+    for (const char *p = body; *p; p++) {
+      request_seed = (request_seed ^ (unsigned char)*p) * 16777619u;
+    }
+    seed = &request_seed;
+  }
+
+  sleep_ms(sample_latency(seed));
+
+  if (rate_429 > 0 && rand_unit(seed) < rate_429) {
+    pthread_mutex_lock(&stats_mutex);
+    requests_429++;
+    pthread_mutex_unlock(&stats_mutex);
+    return send_response(
+        fd, 429, "Too Many Requests", "Retry-After: 1\r\n",
+        "{\"error\": {\"type\": \"rate_limit_error\", \"message\": "
+        "\"mock rate limit\"}}");
+  }
+
+  // Classifier requests ask for a single token: answer yes or no. Group
+  // reply requests get a reply for each bot they list.
+  const char *text;
+  char group_text[4096];
+  if (strstr(body, "\"max_tokens\": 1,") != NULL ||
+      strstr(body, "\"max_tokens\":1,") != NULL) {
+    text = rand_unit(seed) < yes_rate ? "yes" : "no";
+  } else if (strstr(body, "{\\\"replies\\\":") != NULL) {
+    group_reply(body, seed, group_text, sizeof(group_text));
+    text = group_text;
+  } else {
+    text = replies[rand_r(seed) % (sizeof(replies) / sizeof(replies[0]))];
+  }
+  int prompt_tokens = (int)(strlen(body) / 4);
+  int completion_tokens = 1;
+  for (const char *p = text; *p; p++) {
+    completion_tokens += *p == ' ';
+  }
+
+  if (!complete_api && (strstr(body, "\"stream\": true") != NULL ||
+                        strstr(body, "\"stream\":true") != NULL)) {
+    pthread_mutex_lock(&stats_mutex);
+    requests_streamed++;
+    pthread_mutex_unlock(&stats_mutex);
+    return stream_reply(fd, messages_api, text, prompt_tokens);
+  }
+
+  char response[8192];
+  if (chat_api) {
+    snprintf(response, sizeof(response),
+             "{\"id\": \"chatcmpl-mock\", \"object\": \"chat.completion\", "
+             "\"choices\": [{\"index\": 0, \"message\": {\"role\": "
+             "\"assistant\", \"content\": \"%s\"}, \"finish_reason\": "
+             "\"stop\"}], \"usage\": {\"prompt_tokens\": %d, "
+             "\"completion_tokens\": %d, \"total_tokens\": %d}}",
+             text, prompt_tokens, completion_tokens,
+             prompt_tokens + completion_tokens);
+  } else if (messages_api) {
+    snprintf(response, sizeof(response),
+             "{\"id\": \"msg_mock\", \"type\": \"message\", \"role\": "
+             "\"assistant\", \"content\": [{\"type\": \"text\", \"text\": "
+             "\"%s\"}], \"stop_reason\": \"end_turn\", \"usage\": "
+             "{\"input_tokens\": %d, \"output_tokens\": %d}}",
+             text, prompt_tokens, completion_tokens);
+  } else {
+    snprintf(response, sizeof(response),
+             "{\"completion\": \"%s\", \"stop_reason\": \"stop_sequence\"}",
+             text);
+  }
+  return send_response(fd, 200, "OK", "", response);
+}
+
+// Serve HTTP/1.1 requests on one keep-alive connection
+void *connection_thread(void *arg) {
+  int fd = (int)(long)arg;
+  unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)fd ^
+                      (unsigned int)(unsigned long)pthread_self();
+  char *buffer = malloc(MAX_HEADER_SIZE + MAX_BODY_SIZE + 1);
+  size_t used = 0;
+  if (buffer != NULL) {
+    buffer[0] = '\0';
+  }
+
+  while (buffer != NULL) {
+    // Read until the end of the headers
+    char *header_end = NULL;
+    while ((header_end = strstr(buffer, "\r\n\r\n")) == NULL) {
+      if (used >= MAX_HEADER_SIZE) {
+        goto done;
+      }
+      ssize_t n = recv(fd, buffer + used, MAX_HEADER_SIZE - used, 0);
+      if (n <= 0) {
+        goto done;
+      }
+      used += n;
+      buffer[used] = '\0';
+    }
+
+    char method[16], path[256];
+    if (sscanf(buffer, "%15s %255s", method, path) != 2) {
+      goto done;
+    }
+    size_t content_length = 0;
+    for (char *line = strstr(buffer, "\r\n"); line && line < header_end;
+         line = strstr(line + 2, "\r\n")) {
+      if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+        content_length = strtoul(line + 17, NULL, 10);
+      }
+    }
+    if (content_length > MAX_BODY_SIZE) {
+      goto done;
+    }
+
+    // Read the rest of the body
+    size_t header_len = header_end + 4 - buffer;
+    while (used < header_len + content_length) {
+      ssize_t n = recv(fd, buffer + used, header_len + content_length - used,
+                       0);
+      if (n <= 0) {
+        goto done;
+      }
+      used += n;
+    }
+    char saved = buffer[header_len + content_length];
+    buffer[header_len + content_length] = '\0';
+
+    if (handle_request(fd, path, buffer + header_len, &seed) != 0) {
+      goto done;
+    }
+
+    // Keep any pipelined bytes for the next request
+    buffer[header_len + content_length] = saved;
+    used -= header_len + content_length;
+    memmove(buffer, buffer + header_len + content_length, used);
+    buffer[used] = '\0';
+  }
+
+done:
+  free(buffer);
+  close(fd);
+  return NULL;
+}
+
+// Print request counters every report_interval seconds
+void *report_thread(void *arg) {
+  (void)arg;
+  unsigned long last_total = 0;
+  while (1) {
+    sleep(report_interval);
+    pthread_mutex_lock(&stats_mutex);
+    unsigned long total = requests_total;
+    fprintf(stderr, "mock_llm: %lu requests (%.1f/s), %lu streamed, %lu 429s\n",
+            total, (double)(total - last_total) / report_interval,
+            requests_streamed, requests_429);
+    pthread_mutex_unlock(&stats_mutex);
+    last_total = total;
+  }
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--port N] [--latency SPEC] [--token-ms MS]\n"
+          "          [--rate-429 P] [--yes-rate P] [--report SECONDS]\n"
+          "          [--seed N]\n"
+          "SPEC is fixed:MS, uniform:MIN:MAX, exp:MEAN or "
+          "lognormal:MEDIAN:SIGMA\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (strcmp(argv[i], "--port") == 0) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      if (parse_latency(argv[++i], &latency) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--token-ms") == 0) {
+      token_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--rate-429") == 0) {
+      rate_429 = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--yes-rate") == 0) {
+      yes_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--report") == 0) {
+      report_interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      seed_value = (unsigned int)strtoul(argv[++i], NULL, 10);
+      seeded = 1;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server, 512) != 0) {
+    perror("mock_llm: bind");
+    return 1;
+  }
+  fprintf(stderr, "mock_llm: listening on http://127.0.0.1:%d\n", port);
+
+  if (report_interval > 0) {
+    pthread_t reporter;
+    pthread_create(&reporter, NULL, report_thread, NULL);
+    pthread_detach(reporter);
+  }
+
+  while (1) {
+    int fd = accept(server, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_thread, (void *)(long)fd) ==
+        0) {
+      pthread_detach(thread);
+    } else {
+      close(fd);
+    }
+  }
+}